@@ -0,0 +1,68 @@
+#version 110
+
+// Nearest depth (r) and negated farthest depth (g) of the fragments left after the previous pass
+uniform sampler2D minMaxTexSampler;
+uniform float invDepthTexWidth;
+uniform float invDepthTexHeight;
+
+// 0 for the draw that finds the depths, 1 for the draw that writes the normals of the same layers
+uniform int normalPass;
+
+// Normal interpolated from vertex shader
+varying vec3 fragNormal;
+
+void main( void )
+{
+	// Compute texel coords
+	vec2 texelCoord;
+	texelCoord.x = gl_FragCoord.x * invDepthTexWidth;
+	texelCoord.y = gl_FragCoord.y * invDepthTexHeight;
+
+	vec2 minMax = texture2D( minMaxTexSampler, texelCoord ).rg;
+	float nearest = minMax.r;
+	float farthest = -minMax.g;
+	float depth = gl_FragCoord.z;
+
+	// Outside the previous range, we were peeled in an earlier pass.
+	// Fragments on the far plane never pass the depth test of front to back peeling, drop them as well.
+	if( ( depth < nearest ) || ( depth > farthest ) || ( depth >= 1.0 ) )
+		discard;
+
+	// Every target is blended with GL_MIN and cleared to 1.0, so 1.0 leaves a target as it is.
+	// Targets: 0 = next nearest and farthest depths, 1 = front layer, 2 = back layer.
+	gl_FragData[0] = vec4( 1.0 );
+	gl_FragData[1] = vec4( 1.0 );
+	gl_FragData[2] = vec4( 1.0 );
+	gl_FragDepth = depth;
+
+	bool front = ( depth == nearest );
+	bool back = ( depth == farthest );
+	if( normalPass != 0 )
+	{
+		// Blending would mix the normals of fragments sharing a depth, so only the first fragment drawn
+		// at the nearest and at the farthest depth writes its layer, as the depth test of front to back
+		// peeling keeps. Each kind gets its own depth so that GL_NOTEQUAL stops a second one of a kind,
+		// the stencil stops everything once a front and a back were written.
+		// A single fragment left is both the front and the back layer, it is kept once when layers are merged.
+		if( !front && !back )
+			discard;
+
+		vec4 layer = vec4( depth, normalize( fragNormal ) );
+		if( front )
+			gl_FragData[1] = layer;
+		if( back )
+			gl_FragData[2] = layer;
+		gl_FragDepth = front ? ( back ? 0.75 : 0.25 ) : 0.5;
+		return;
+	}
+
+	// Layers hold depth in r, their normals (gba) come from the normal draw when they are read
+	if( front )
+		gl_FragData[1].r = depth;
+	if( back )
+		gl_FragData[2].r = depth;
+
+	// Fragments in between are peeled in the next passes
+	if( ( depth > nearest ) && ( depth < farthest ) )
+		gl_FragData[0] = vec4( depth, -depth, 1.0, 1.0 );
+}
@@ -0,0 +1,54 @@
+#version 430 compatibility
+
+// Every fragment of the pass is appended to the list of its pixel, nothing is drawn.
+// Lists are sorted and written as layers by sortFragmentLists_CS and writeLayers_CS.
+
+struct Fragment
+{
+	float depth;
+	float nx;
+	float ny;
+	float nz;
+	uint next;
+};
+
+// Fragments stored so far, it goes on counting past the capacity so that the caller can grow the buffer
+layout( binding = 0, offset = 0 ) uniform atomic_uint fragmentCount;
+
+// Last fragment of each pixel, 0xffffffff for none
+layout( std430, binding = 0 ) buffer Heads
+{
+	uint heads[];
+};
+
+layout( std430, binding = 1 ) buffer Fragments
+{
+	Fragment fragments[];
+};
+
+uniform int u_width;
+uniform int u_maxFragments;
+
+// Normal interpolated from vertex shader
+in vec3 fragNormal;
+
+void main( void )
+{
+	// Front to back peeling never keeps fragments on the far plane
+	float depth = gl_FragCoord.z;
+	if( depth >= 1.0 )
+		discard;
+
+	uint index = atomicCounterIncrement( fragmentCount );
+	if( index >= uint( u_maxFragments ) )
+		discard;
+
+	vec3 normal = normalize( fragNormal );
+	fragments[index].depth = depth;
+	fragments[index].nx = normal.x;
+	fragments[index].ny = normal.y;
+	fragments[index].nz = normal.z;
+
+	uint pixel = uint( gl_FragCoord.y ) * uint( u_width ) + uint( gl_FragCoord.x );
+	fragments[index].next = atomicExchange( heads[pixel], index );
+}
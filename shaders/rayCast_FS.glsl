@@ -1,5 +1,5 @@
 #version 110
-//#define testa_layer
+#extension GL_EXT_texture_array : enable
 
 /************************************************************************/
 /* Varying                                                              */
@@ -16,20 +16,48 @@ varying vec3 v_rayOrigin;
 /************************************************************************/
 /* Uniforms                                                             */
 /************************************************************************/
-// Heightmap texture
-uniform sampler2D u_hm1;
-uniform sampler2D u_hm2;
-uniform sampler2D u_hm3;
-uniform sampler2D u_hm4;
-uniform sampler2D u_hm5;
-uniform sampler2D u_hm6;
-
-uniform sampler2D u_normal1;
-uniform sampler2D u_normal2;
-uniform sampler2D u_normal3;
-uniform sampler2D u_normal4;
-uniform sampler2D u_normal5;
-uniform sampler2D u_normal6;
+// Heightmaps and normal maps of every layer, one array layer each (see LayerTextures)
+uniform sampler2DArray u_heights;
+uniform sampler2DArray u_normals;
+uniform int u_layerCount;
+
+// 1 when normal maps are not loaded and normals come from the heightmaps
+uniform int u_computeNormals;
+// Neighbor distance for computed normals (one texel)
+uniform float u_texelSize;
+
+// 1 when normal maps hold octahedral codes in luminance and alpha (see LayerEncoding)
+uniform int u_octNormals;
+// Maps texel values to [0,1] codes: 65535/65534 for 16 bits, 255/254 for 8 bits
+uniform float u_octScale;
+
+// 1 when layers are streamed in bricks (see BrickTextureCache): the layer textures are
+// atlases of resident bricks, and the page table gives the atlas slot of each brick
+uniform int u_bricked;
+uniform sampler2D u_pageTable;
+// Page table size in bricks, layer and brick size in texels, atlas size in texels
+uniform vec2 u_pageTableSize;
+uniform vec2 u_layerSize;
+uniform float u_brickSize;
+uniform float u_atlasSize;
+// Coarse level size in texels, at the lower left corner of the atlas
+uniform vec2 u_coarseSize;
+
+// Min (r) and max (a) height pyramids of every layer (see HeightBounds), levels side by side
+// from level 1. No skipping with 0 levels, as for bricked layers.
+uniform sampler2DArray u_heightBounds;
+uniform int u_boundsLevels;
+uniform float u_boundsPaddedWidth;
+uniform vec2 u_boundsAtlasSize;
+
+// 1 to walk the layers texel by texel with exact intersections (texelCast) instead of linear casts
+uniform int u_texelTraversal;
+
+// Cone maps of every layer (see ConeMaps), codes / 255 in luminance, relative to the larger
+// layer side in texels. No cone steps with u_coneMaps 0, as for bricked or progressive layers.
+uniform sampler2DArray u_cones;
+uniform int u_coneMaps;
+uniform float u_coneScale;
 
 
 /************************************************************************/
@@ -38,7 +66,32 @@ uniform sampler2D u_normal6;
 #define END    0
 #define EXIT   1
 #define ENTER  2
-float dbg = 0.0;
+
+// Layer texture coordinates of uv. Bricks that are not resident fall back to the coarse level.
+// Texels are clamped inside their slot, so that rounding never reads a neighboring slot.
+vec2 layerCoord( vec2 uv )
+{
+	if( u_bricked == 0 )
+		return uv;
+
+	vec2 texel = clamp( uv * u_layerSize, vec2( 0.5 ), u_layerSize - 0.5 );
+	vec2 brick = floor( texel / u_brickSize );
+	vec4 page = texture2D( u_pageTable, ( brick + 0.5 ) / u_pageTableSize );
+	if( page.z == 0.0 )
+		return clamp( uv * u_coarseSize, vec2( 0.5 ), u_coarseSize - 0.5 ) / u_atlasSize;
+
+	texel = clamp( texel - brick * u_brickSize, vec2( 0.5 ), vec2( u_brickSize - 0.5 ) );
+	return ( page.xy * u_brickSize + texel ) / u_atlasSize;
+}
+
+// Height of layer at layer texture coordinates. There is nothing below the last layer,
+// layers past it are empty (height 0) as texels without a surface.
+float layerHeight( int layer, vec2 coord )
+{
+	if( layer >= u_layerCount )
+		return 0.0;
+	return texture2DArray( u_heights, vec3( coord, float( layer ) ) ).r;
+}
 
 // Compute limit to quickly terminate linear casting when ray exits box
 void computeBoxExitInW( inout vec4 current, inout vec4 step_vec )
@@ -72,16 +125,152 @@ void computeBoxExitInW( inout vec4 current, inout vec4 step_vec )
 }
 
 
+// Min and max heights of layer over cell of level, nothing above the last layer
+vec2 cellBounds( int layer, int level, vec2 cell )
+{
+	if( layer >= u_layerCount )
+		return vec2( 0.0 );
+	float offset = u_boundsPaddedWidth - u_boundsPaddedWidth / exp2( float( level - 1 ) );
+	vec2 coord = ( vec2( offset + cell.x, cell.y ) + 0.5 ) / u_boundsAtlasSize;
+	return texture2DArray( u_heightBounds, vec3( coord, float( layer ) ) ).ra;
+}
+
+// Moves current ahead by whole steps over cells of the pyramids where the next samples
+// cannot be below layerIn nor above layerOut (-1 for none), so that the samples left are
+// those of the linear cast, up to the rounding of one jump against that of single steps
+// (texel casts are unaffected). Goes up a level after each cell skipped and down when one
+// cannot be, and stops at level 1, where level is kept for the next step of the cast.
+// Samples past the box exit are never skipped, the cast ends on them.
+void skipEmptySpace( inout vec4 current, vec4 step, int layerIn, int layerOut, inout int level )
+{
+	// Samples within a 64th of a texel of a cell side may be rounded to the next cell
+	float margin = 1.0 / 64.0;
+	vec2 stepTexels = step.xy * u_layerSize;
+	for( int i = 0; i < 64; ++i )
+	{
+		vec4 next = current + step;
+		if( ( level == 0 ) || ( next.w <= 0.0 ) )
+			return;
+
+		// Cell of the next sample, unbounded past the layer sides as textures are clamped
+		float cellSize = exp2( float( level ) );
+		vec2 texel = next.xy * u_layerSize;
+		vec2 cell = floor( clamp( texel, vec2( 0.0 ), u_layerSize - 1.0 ) / cellSize );
+		vec2 low = cell * cellSize + margin;
+		vec2 high = low + cellSize - 2.0 * margin;
+		if( cell.x == 0.0 )
+			low.x = -1e9;
+		if( cell.y == 0.0 )
+			low.y = -1e9;
+		if( ( cell.x + 1.0 ) * cellSize >= u_layerSize.x )
+			high.x = 1e9;
+		if( ( cell.y + 1.0 ) * cellSize >= u_layerSize.y )
+			high.y = 1e9;
+
+		// Samples in the cell and before the box exit (w stays above 0)
+		float last = -next.w / step.w - 0.001;
+		if( stepTexels.x > 0.0 )
+			last = min( last, ( high.x - texel.x ) / stepTexels.x );
+		else if( stepTexels.x < 0.0 )
+			last = min( last, ( low.x - texel.x ) / stepTexels.x );
+		if( stepTexels.y > 0.0 )
+			last = min( last, ( high.y - texel.y ) / stepTexels.y );
+		else if( stepTexels.y < 0.0 )
+			last = min( last, ( low.y - texel.y ) / stepTexels.y );
+
+		bool inside = all( greaterThanEqual( texel, low ) ) && all( lessThan( texel, high ) ) && ( last >= 0.0 );
+		float count = floor( last ) + 1.0;
+		float lastZ = next.z + ( count - 1.0 ) * step.z;
+		float minZ = min( next.z, lastZ );
+		float maxZ = max( next.z, lastZ );
+		if( inside && ( layerIn >= 0 ) )
+			inside = ( minZ > cellBounds( layerIn, level, cell ).y );
+		if( inside && ( layerOut >= 0 ) )
+			inside = ( maxZ <= cellBounds( layerOut, level, cell ).x );
+
+		if( inside )
+		{
+			current += step * count;
+			if( level < u_boundsLevels )
+				++level;
+		}
+		else if( level > 1 )
+			--level;
+		else
+			return;
+	}
+}
+
+// Slope of the cone of layer at layer texture coordinates, in height per texel.
+// Layers past the last one are flat.
+float coneSlope( int layer, vec2 coord )
+{
+	if( layer >= u_layerCount )
+		return 0.0;
+	float t = texture2DArray( u_cones, vec3( coord, float( layer ) ) ).r;
+	return ( t > 0.0 ) ? ( 1.0 - t ) / ( t * u_coneScale ) : 1e30;
+}
+
+// Steps from current that the ray stays above layerIn and below layerOut (-1 for none), from
+// the cones of its texel. Texel centers are at most one texel farther apart than the ray moves,
+// so the height left above the cone, less the slope over one texel, is used up at that speed.
+float coneSteps( vec4 current, vec4 step, int layerIn, int layerOut )
+{
+	// Kept between rays and cones, above the rounding of 16-bit height textures
+	float margin = 1.0 / 16384.0;
+	float texels = max( abs( step.x ) * u_layerSize.x, abs( step.y ) * u_layerSize.y );
+	vec2 coord = layerCoord( current.xy );
+	float steps = 1e30;
+	if( layerIn >= 0 )
+	{
+		float slope = coneSlope( layerIn, coord );
+		float rise = current.z - layerHeight( layerIn, coord ) - margin - slope;
+		if( rise <= 0.0 )
+			return 0.0;
+		float speed = -step.z + slope * texels;
+		if( speed > 0.0 )
+			steps = min( steps, rise / speed );
+	}
+	if( layerOut >= 0 )
+	{
+		float slope = coneSlope( layerOut, coord );
+		float rise = layerHeight( layerOut, coord ) - current.z - margin - slope;
+		if( rise <= 0.0 )
+			return 0.0;
+		float speed = step.z + slope * texels;
+		if( speed > 0.0 )
+			steps = min( steps, rise / speed );
+	}
+	return steps;
+}
+
+// Moves current ahead by the whole steps whose samples are all inside the cones and
+// before the box exit, so that the samples left are those of the linear cast, up to rounding
+void coneSkip( inout vec4 current, vec4 step, int layerIn, int layerOut )
+{
+	if( u_coneMaps == 0 )
+		return;
+	float steps = ceil( min( coneSteps( current, step, layerIn, layerOut ), -current.w / step.w - 0.001 ) ) - 1.0;
+	if( steps > 0.0 )
+		current += step * steps;
+}
+
 // Linear ray intersection
-int inCastLinear( inout vec4 current, in vec4 step, sampler2D heightmap )
+int inCastLinear( inout vec4 current, in vec4 step, int layer )
 {
 	float height;
 	bool detail_search = false;
+	int level = u_boundsLevels;
 
     for( int i = 0; i < 1024; ++i )
 	{
+		if( !detail_search )
+		{
+			coneSkip( current, step, layer, -1 );
+			skipEmptySpace( current, step, layer, -1, level );
+		}
 		current += step;
-		height = texture2D( heightmap, current.xy ).r;
+		height = layerHeight( layer, layerCoord( current.xy ) );
 		if( current.z <= height )
 		{
 			if (detail_search)
@@ -95,18 +284,24 @@ int inCastLinear( inout vec4 current, in vec4 step, sampler2D heightmap )
 		if( current.w <= 0.0 )
 			return END;
 	}
+	return END;
 }
 
-int outCastLinear( inout vec4 current, in vec4 step, sampler2D heightmap )
+int outCastLinear( inout vec4 current, in vec4 step, int layer )
 {
 	float height;
-	vec4 s = step;
 	bool detail_search = false;
+	int level = u_boundsLevels;
 
     for( int i = 0; i < 1024; ++i )
 	{
+		if( !detail_search )
+		{
+			coneSkip( current, step, -1, layer );
+			skipEmptySpace( current, step, -1, layer, level );
+		}
 		current += step;
-		height = texture2D( heightmap, current.xy ).r;
+		height = layerHeight( layer, layerCoord( current.xy ) );
 		if( current.z > height )
 		{
 			if (detail_search)
@@ -120,19 +315,26 @@ int outCastLinear( inout vec4 current, in vec4 step, sampler2D heightmap )
 		if( current.w <= 0.0 )
 			return END;
 	}
+	return END;
 }
 
-int inOutCastLinear( inout vec4 current, in vec4 step, sampler2D heightmapIn, sampler2D heightmapOut )
+int inOutCastLinear( inout vec4 current, in vec4 step, int layerIn, int layerOut )
 {
 	float heightIn;
 	float heightOut;
-	vec4 s = step;
 	bool detail_search = false;
+	int level = u_boundsLevels;
 
     for( int i = 0; i < 1024; ++i )
 	{
+		if( !detail_search )
+		{
+			coneSkip( current, step, layerIn, layerOut );
+			skipEmptySpace( current, step, layerIn, layerOut, level );
+		}
 		current += step;
-		heightIn = texture2D( heightmapIn, current.xy ).r;
+		vec2 coord = layerCoord( current.xy );
+		heightIn = layerHeight( layerIn, coord );
 		if( current.z <= heightIn )
 		{
 			if (detail_search)
@@ -143,7 +345,7 @@ int inOutCastLinear( inout vec4 current, in vec4 step, sampler2D heightmapIn, sa
 			continue;
 		}
 
-		heightOut = texture2D( heightmapOut, current.xy ).r;
+		heightOut = layerHeight( layerOut, coord );
 		if( current.z > heightOut )
 		{
 			if (detail_search)
@@ -156,43 +358,157 @@ int inOutCastLinear( inout vec4 current, in vec4 step, sampler2D heightmapIn, sa
 		if( current.w <= 0.0 )
 			return END;
 	}
+	return END;
+}
+
+// Walks the texels the ray crosses from current to the box exit, as a 2D DDA, and stops in the
+// first one where the ray goes below layerIn or above layerOut (-1 for none). Layers are sampled
+// nearest, so within a texel they are flat at the height of its center and the ray is tested
+// against them exactly: from the texel side when it is already past the height there, otherwise
+// from where it crosses it. As in the linear casts, current itself is not tested. Current is left just past the hit, inside the texel.
+// Work is one iteration per texel crossed, thin features are never stepped over, or one per cone the ray goes through.
+int texelCast( inout vec4 current, vec4 step, int layerIn, int layerOut )
+{
+	// Ray in texels, as origin + s * dir with s in steps from current
+	vec2 origin = current.xy * u_layerSize;
+	vec2 dir = step.xy * u_layerSize;
+	// Up to just before the box exit, where rays along the bottom face would hit empty texels
+	float end = -current.w / step.w - 0.001;
+	vec2 cell = floor( clamp( origin, vec2( 0.0 ), u_layerSize - 1.0 ) );
+	float start = 0.0;
+	for( int i = 0; i < 16384; ++i )
+	{
+		// Where the ray leaves the texel, never through the layer sides as textures are clamped
+		vec2 side = vec2( 1e30 );
+		if( ( dir.x > 0.0 ) && ( cell.x + 1.0 < u_layerSize.x ) )
+			side.x = ( cell.x + 1.0 - origin.x ) / dir.x;
+		else if( ( dir.x < 0.0 ) && ( cell.x > 0.0 ) )
+			side.x = ( cell.x - origin.x ) / dir.x;
+		if( ( dir.y > 0.0 ) && ( cell.y + 1.0 < u_layerSize.y ) )
+			side.y = ( cell.y + 1.0 - origin.y ) / dir.y;
+		else if( ( dir.y < 0.0 ) && ( cell.y > 0.0 ) )
+			side.y = ( cell.y - origin.y ) / dir.y;
+		float stop = min( end, min( side.x, side.y ) );
+
+		// Past the texel when cones clear the ray beyond it, the walk goes on from where they stop
+		if( u_coneMaps != 0 )
+		{
+			float ahead = coneSteps( current + step * start, step, layerIn, layerOut );
+			if( ahead > stop - start )
+			{
+				start += ahead;
+				if( start >= end )
+					return END;
+				cell = floor( clamp( origin + dir * start, vec2( 0.0 ), u_layerSize - 1.0 ) );
+				continue;
+			}
+		}
+
+		vec2 coord = layerCoord( ( cell + 0.5 ) / u_layerSize );
+		float startZ = current.z + start * step.z;
+		float hitIn = 1e30;
+		float hitOut = 1e30;
+		if( layerIn >= 0 )
+		{
+			float height = layerHeight( layerIn, coord );
+			if( startZ < height )
+				hitIn = start;
+			else if( step.z < 0.0 )
+				hitIn = ( height - current.z ) / step.z;
+		}
+		if( layerOut >= 0 )
+		{
+			float height = layerHeight( layerOut, coord );
+			if( startZ > height )
+				hitOut = start;
+			else if( step.z > 0.0 )
+				hitOut = ( height - current.z ) / step.z;
+		}
+
+		float hit = min( hitIn, hitOut );
+		if( hit <= stop )
+		{
+			// A hundredth of a step further, without leaving the texel
+			current += step * min( hit + 0.01, ( hit + stop ) * 0.5 );
+			return ( hitIn <= hitOut ) ? ENTER : EXIT;
+		}
+		if( stop >= end )
+			return END;
+
+		if( side.x < side.y )
+			cell.x += sign( dir.x );
+		else
+			cell.y += sign( dir.y );
+		start = stop;
+	}
+	return END;
 }
 
-vec3 neighborsDiff( vec3 current_pos, vec3 shift, sampler2D heightMap )
+vec3 neighborsDiff( vec3 current_pos, vec3 shift, int layer )
 {
   vec3 v1 = current_pos.xyz + shift;
-  v1.z = texture2D(heightMap, v1.xy).r;
+  v1.z = layerHeight(layer, layerCoord(v1.xy));
   vec3 v2 = current_pos.xyz - shift;
-  v2.z = texture2D(heightMap, v2.xy).r;
+  v2.z = layerHeight(layer, layerCoord(v2.xy));
   return vec3(v1-v2);
 }
 
-vec3 computeNormal( float neigb_dist, vec3 current_pos, sampler2D heightMap )
+vec3 computeNormal( float neigb_dist, vec3 current_pos, int layer )
 {
   vec3 shift, v1, v2;
   shift.x = neigb_dist;
   shift.yz = vec2(0.0,0.0);
-  v1 = neighborsDiff(current_pos, shift, heightMap);
+  v1 = neighborsDiff(current_pos, shift, layer);
   shift.x = 0.0;
   shift.y = neigb_dist;
-  v2 = neighborsDiff(current_pos, shift, heightMap);
+  v2 = neighborsDiff(current_pos, shift, layer);
   v1 = cross(v1,v2);
   v1.z *= 2.0;
   return normalize(v1);
 }
 
-vec3 computeHalfInterpolation( vec4 current, vec3 currNormal, sampler2D otherNormalMap, float otherHeight )
+// Empty texels hold the all-ones code and decode to (1,1,1), as float normal maps store them
+vec3 decodeOctNormal( vec4 texel )
+{
+	if( texel.r == 1.0 )
+		return vec3(1.0,1.0,1.0);
+
+	vec2 p = texel.ra * u_octScale * 2.0 - 1.0;
+	vec3 n = vec3( p, 1.0 - abs( p.x ) - abs( p.y ) );
+	if( n.z < 0.0 )
+	{
+		// Lower hemisphere is folded over the diagonals
+		vec2 signs = vec2( n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0 );
+		n.xy = ( 1.0 - abs( p.yx ) ) * signs;
+	}
+	return normalize( n );
+}
+
+// Normal of layer at current position. Layers alternate between surfaces facing the
+// viewer (even) and facing away (odd), as the stored normals do.
+vec3 layerNormal( int layer, vec3 current_pos, float facing )
+{
+	if( u_computeNormals != 0 )
+		return computeNormal( u_texelSize, current_pos, layer ) * facing;
+	if( layer >= u_layerCount )
+		return vec3(0.0,0.0,0.0);
+	vec4 texel = texture2DArray( u_normals, vec3( layerCoord( current_pos.xy ), float( layer ) ) );
+	if( u_octNormals != 0 )
+		return decodeOctNormal( texel );
+	return texel.rgb;
+}
+
+vec3 computeHalfInterpolation( vec4 current, vec3 currNormal, int otherLayer, float otherHeight, float otherFacing )
 {
 	float threshold = 0.075;//0.005;
 	float diff = abs( current.z - otherHeight );
-	//vec3 currNormal = texture2D( currNormalMap, current.xy ).rgb;
 
 	if( diff > threshold )
 		return currNormal;
 
 	float factor = (diff / threshold)*0.5 + 0.5;
 	//float factor = smoothstep (0.0,threshold,diff)*0.5 + 0.5;
-	return mix( texture2D( otherNormalMap, current.xy ).rgb, currNormal, factor );
+	return mix( layerNormal( otherLayer, current.xyz, otherFacing ), currNormal, factor );
 }
 
 /************************************************************************/
@@ -217,211 +533,89 @@ void main( void )
 	// Compute limit to quickly terminate linear casting when ray exits box
 	computeBoxExitInW( current, step );
 
-	int condition;
+	// Along z, layers alternate between entering (even) and exiting (odd) the model, from the top.
+	// Gap g is the empty space between the pair of layers 2g-2, 2g-1 above and 2g, 2g+1 below,
+	// rays start in gap 0 above every layer. Casts only test the layers around the gap the ray
+	// is in, so that work grows with the layers a ray crosses and not with the layer count.
+	int gap = 0;
+	bool hit = false;
  	vec3 normal = vec3(1,1,1);
-	float height;
-    float count;
-	float diff2;
-	float diff3;
-
-	do
+	for( int i = 0; ( i < 1024 ) && !hit; ++i )
 	{
-		// even == 0
-		// odd  == 1
-		condition = inCastLinear( current, step, u_hm1 );
+		int enterLayer = 2*gap;
+		int exitLayer = 2*gap - 1;
+		int condition;
+		if( u_texelTraversal != 0 )
+			condition = texelCast( current, step, ( enterLayer < u_layerCount ) ? enterLayer : -1, exitLayer );
+		else if( gap == 0 )
+			condition = inCastLinear( current, step, enterLayer );
+		else if( enterLayer < u_layerCount )
+			condition = inOutCastLinear( current, step, enterLayer, exitLayer );
+		else
+			condition = outCastLinear( current, step, exitLayer ); // nothing below
 
 		if( condition == END )
 			discard;
 
-		// If not enter even + 2
-		height = texture2D( u_hm2, current.xy ).r;
-		if( current.z > height )
+		vec2 coord = layerCoord( current.xy );
+		if( condition == ENTER )
 		{
-			// Draw odd
-#ifdef testa_layer
-			normal.xyz = vec3(1,0,0);
-			//normal.xyz = vec3(0,0,0);
-#else
-			//normal = texture2D( u_normal1, current.xy ).rgb;
-			vec3 normal1 = texture2D( u_normal1, current.xy ).rgb;
-			normal = computeHalfInterpolation( current, normal1, u_normal2, height );
-#endif
-			break;
+			// Below the exit layer of the pair as well, go down a gap
+			float heightBelow = layerHeight( enterLayer + 1, coord );
+			float limit = ( gap > 0 ) ? heightBelow * 1.1 : heightBelow; // TODO: 1.1 fixes bunny head
+			if( current.z <= limit )
+			{
+				++gap;
+				continue;
+			}
+
+			// Draw enter layer
+			vec3 enterNormal = layerNormal( enterLayer, current.xyz, 1.0 );
+			float heightAbove = ( gap > 0 ) ? layerHeight( exitLayer, coord ) : heightBelow;
+			if( ( gap > 0 ) && ( abs( current.z - heightAbove ) < abs( current.z - heightBelow ) ) )
+				normal = computeHalfInterpolation( current, enterNormal, exitLayer, heightAbove, -1.0 );
+			else
+				normal = computeHalfInterpolation( current, enterNormal, enterLayer + 1, heightBelow, -1.0 );
+			hit = true;
+			continue;
 		}
 
-		do
+		// Above the enter layer of the pair as well, go up a gap
+		float heightAbove = layerHeight( exitLayer - 1, coord );
+		if( current.z > heightAbove )
 		{
+			--gap;
+			continue;
+		}
 
-			// even == 2
-			// odd  == 3
-			condition = inOutCastLinear( current, step, u_hm3, u_hm2 );
-
-			if( condition == END )
-				discard;
-
-			if( condition == EXIT )
-			{
-				// If exit even - 1
-				height = texture2D( u_hm1, current.xy ).r;
-				if( current.z > height )
-					break; // go back to outer loop -> even -= 2
-
-				// Draw even
-				// At this point current is just outside hm2, 
-				// so we bring it back to just inside hm2 to access correct normal
-				current -= step*0.1;
-				float diff2 = ( texture2D( u_hm2, current.xy ).r - current.z );
-				if ( abs(diff2) > 0.2 ) 
-					current -= step*0.1;
-
-#ifdef testa_layer
-				normal.xyz = vec3(0,1,0);
-				//normal.xyz = vec3(0,0,0);
-#else
-				//normal = texture2D( u_normal2, current.xy ).rgb;
-				float height1 = texture2D( u_hm1, current.xy ).r;
-				float height3 = texture2D( u_hm3, current.xy ).r;
-				float diff1 = abs( current.z - height1 );
-				float diff3 = abs( current.z - height3 );
-				vec3 normal2 = texture2D( u_normal2, current.xy ).rgb;
-				if( diff1 < diff3 )
-					normal = computeHalfInterpolation( current, normal2, u_normal1, height1 );
-				else
-					normal = computeHalfInterpolation( current, normal2, u_normal3, height3 );
-#endif
-				// exit all loops because at this point height <= current.z (see if above)
-				height = 2.0;
-				break;
-			}
-dbg += 0.25;
-
-			// If not enter even + 2
-			height = texture2D( u_hm4, current.xy ).r;
-			if( current.z > height * 1.1 ) // TODO: fixes bunny head
-			{
-				// Draw odd
-#ifdef testa_layer
-				normal.xyz = vec3(0,0,1);
-				//normal.xyz = vec3(0,0,0);
-#else
-				//normal = texture2D( u_normal3, current.xy ).rgb;
-				float height2 = texture2D( u_hm2, current.xy ).r;
-				float height4 = texture2D( u_hm4, current.xy ).r;
-				float diff2 = abs( current.z - height2 );
-				float diff4 = abs( current.z - height4 );
-				vec3 normal3 = texture2D( u_normal3, current.xy ).rgb;
-				if( diff2 < diff4 )
-					normal = computeHalfInterpolation( current, normal3, u_normal2, height2 );
-				else
-					normal = computeHalfInterpolation( current, normal3, u_normal4, height4 );
-#endif
-				height = 2.0;
-				break;
-			}
+		// Draw exit layer
+		if( enterLayer >= u_layerCount )
+		{
+			normal = computeHalfInterpolation( current, layerNormal( exitLayer, current.xyz, -1.0 ), exitLayer - 1, heightAbove, 1.0 );
+			hit = true;
+			continue;
+		}
 
-			do
-			{
+		// At this point current is just outside the exit layer,
+		// so we bring it back to just inside to access correct normal
+		current -= step*0.1;
+		float diff = layerHeight( exitLayer, layerCoord( current.xy ) ) - current.z;
+		if ( abs(diff) > 0.2 ) 
+			current -= step*0.1;
+
+		coord = layerCoord( current.xy );
+		heightAbove = layerHeight( exitLayer - 1, coord );
+		float heightBelow = layerHeight( enterLayer, coord );
+		vec3 exitNormal = layerNormal( exitLayer, current.xyz, -1.0 );
+		if( abs( current.z - heightAbove ) < abs( current.z - heightBelow ) )
+			normal = computeHalfInterpolation( current, exitNormal, exitLayer - 1, heightAbove, 1.0 );
+		else
+			normal = computeHalfInterpolation( current, exitNormal, enterLayer, heightBelow, 1.0 );
+		hit = true;
+	}
+	if( !hit )
+		discard;
 
-				// even == 4
-				// odd  == 5
-				condition = inOutCastLinear( current, step, u_hm5, u_hm4 );
-
-				if( condition == END )
-					discard;
-
-				if( condition == EXIT )
-				{
-					// If exit even - 1
-					height = texture2D( u_hm3, current.xy ).r;
-					if( current.z > height )
-						break; // go back to outer loop -> even -= 2
-
-					// Draw even
-					// At this point current is just outside hm2, 
-					// so we bring it back to just inside hm4 to access correct normal
-					current -= step*0.1;
-					float diff2 = ( texture2D( u_hm4, current.xy ).r - current.z );
-					if ( abs(diff2) > 0.2 ) 
-						current -= step*0.1;
-
-	#ifdef testa_layer
-					normal.xyz = vec3(1,1,0);
-					//normal.xyz = vec3(0,0,0);
-	#else
-					//normal = texture2D( u_normal2, current.xy ).rgb;
-					float height3 = texture2D( u_hm3, current.xy ).r;
-					float height5 = texture2D( u_hm5, current.xy ).r;
-					float diff3 = abs( current.z - height3 );
-					float diff5 = abs( current.z - height5 );
-					vec3 normal4 = texture2D( u_normal4, current.xy ).rgb;
-					if( diff3 < diff5 )
-						normal = computeHalfInterpolation( current, normal4, u_normal3, height3 );
-					else
-						normal = computeHalfInterpolation( current, normal4, u_normal5, height5 );
-	#endif
-					// exit all loops because at this point height <= current.z (see if above)
-					height = 2.0;
-					break;
-				}
-	dbg += 0.25;
-
-				// If not enter even + 2
-				height = texture2D( u_hm6, current.xy ).r;
-				if( current.z > height * 1.1 ) // TODO: fixes bunny head
-				{
-					// Draw odd
-	#ifdef testa_layer
-					normal.xyz = vec3(0,1,1);
-					//normal.xyz = vec3(0,0,0);
-	#else
-					//normal = texture2D( u_normal3, current.xy ).rgb;
-					float height4 = texture2D( u_hm4, current.xy ).r;
-					float height6 = texture2D( u_hm6, current.xy ).r;
-					float diff4 = abs( current.z - height4 );
-					float diff6 = abs( current.z - height6 );
-					vec3 normal5 = texture2D( u_normal5, current.xy ).rgb;
-					if( diff4 < diff6 )
-						normal = computeHalfInterpolation( current, normal5, u_normal4, height4 );
-					else
-						normal = computeHalfInterpolation( current, normal5, u_normal6, height6 );
-	#endif
-					height = 2.0;
-					break;
-				}
-
-				// TODO: testing with only 6 layers
-				// even == 6
-				// odd  == 7
-				condition = outCastLinear( current, step, u_hm6 );
-				if( condition == END )
-					discard;
-
-				// If exit even - 1
-				height = texture2D( u_hm5, current.xy ).r;
-				if( current.z > height )
-					continue; // go back to outer loop -> even -= 2
-
-				// Draw even
-	#ifdef testa_layer
-				normal.xyz = vec3(1,0,1);
-				//normal.xyz = vec3(0,0,0);
-	#else
-				//normal = texture2D( u_normal4, current.xy ).rgb;
-				vec3 normal6 = texture2D( u_normal6, current.xy ).rgb;
-				normal = computeHalfInterpolation( current, normal6, u_normal5, height );
-	#endif
-				// exit all loops because at this point height <= current.z (see if above)
-				break;
-
-			} while( current.z > height );
-
-		} while( current.z > height );
-
-	} while( current.z > height );
-
-	//if( diff2 < diff3 )
-	//	normal.xyz = vec3(1.0);
-	
 	vec3 lightDir;
 
 	lightDir = normalize (vec3(1,1,0));
@@ -431,14 +625,6 @@ dbg += 0.25;
 	//lightDir.z = dot( gl_ModelViewMatrix[2].xyz, gl_LightSource[0].position.xyz );
 	//lightDir = normalize( lightDir );   //todo: do we need this?
 
-
-#ifdef testa_layer
-	gl_FragColor.rgb = normal.xyz;
-	//gl_FragColor.rgb = vec3(0.6);
-	//gl_FragColor.rgb = current.xyz;
-	//gl_FragColor.rgb = vec3(1.0-dbg);
-	//gl_FragColor.rgb = vec3(dbg);
-#else
 	//gl_FragColor.r = length(normal.xyz) * 0.5;
 	//return;
 	normal = normalize(normal);
@@ -448,7 +634,6 @@ dbg += 0.25;
 	gl_FragColor.rgb = ( vec3(dot( -viewDir, normal )) )*0.8 + vec3(0.2);
 	//gl_FragColor.rgb = normal.xyz;
 	//gl_FragColor.rgb = current.zzz;
-#endif
 
 	return;
 
@@ -458,4 +643,3 @@ dbg += 0.25;
 	// TODO: remove
 	gl_FragColor = gl_Color;
 }
-
@@ -0,0 +1,92 @@
+#version 430
+
+// Sorts the fragment list of each pixel nearest first, in place, keeping the nearest MAX_LAYERS
+// fragments like front to back peeling. Coincident fragments are kept once.
+
+#define MAX_LAYERS 100
+
+layout( local_size_x = 8, local_size_y = 8 ) in;
+
+struct Fragment
+{
+	float depth;
+	float nx;
+	float ny;
+	float nz;
+	uint next;
+};
+
+const uint END = 0xffffffffu;
+
+layout( std430, binding = 0 ) buffer Heads
+{
+	uint heads[];
+};
+
+layout( std430, binding = 1 ) buffer Fragments
+{
+	Fragment fragments[];
+};
+
+// Most layers of a pixel
+layout( std430, binding = 2 ) buffer ListInfo
+{
+	uint maxLayers;
+};
+
+uniform int u_width;
+uniform int u_height;
+
+void main( void )
+{
+	uvec2 texel = gl_GlobalInvocationID.xy;
+	if( ( texel.x >= uint( u_width ) ) || ( texel.y >= uint( u_height ) ) )
+		return;
+	uint pixel = texel.y * uint( u_width ) + texel.x;
+
+	// Insertion sort while walking the list, the farthest fragment drops out when full
+	float depths[MAX_LAYERS];
+	vec3 normals[MAX_LAYERS];
+	int count = 0;
+	for( uint node = heads[pixel]; node != END; node = fragments[node].next )
+	{
+		float depth = fragments[node].depth;
+		int i = count;
+		while( ( i > 0 ) && ( depths[i-1] > depth ) )
+			--i;
+
+		// Lists run from the last drawn fragment, a later one at the same depth was drawn first and wins
+		if( ( i > 0 ) && ( depths[i-1] == depth ) )
+		{
+			normals[i-1] = vec3( fragments[node].nx, fragments[node].ny, fragments[node].nz );
+			continue;
+		}
+		if( i == MAX_LAYERS )
+			continue;
+
+		for( int j = min( count, MAX_LAYERS - 1 ); j > i; --j )
+		{
+			depths[j] = depths[j-1];
+			normals[j] = normals[j-1];
+		}
+		depths[i] = depth;
+		normals[i] = vec3( fragments[node].nx, fragments[node].ny, fragments[node].nz );
+		count = min( count + 1, MAX_LAYERS );
+	}
+
+	// Back into the first nodes of the list, which ends after them
+	uint node = heads[pixel];
+	for( int i = 0; i < count; ++i )
+	{
+		fragments[node].depth = depths[i];
+		fragments[node].nx = normals[i].x;
+		fragments[node].ny = normals[i].y;
+		fragments[node].nz = normals[i].z;
+		uint next = fragments[node].next;
+		if( i == count - 1 )
+			fragments[node].next = END;
+		node = next;
+	}
+
+	atomicMax( maxLayers, uint( count ) );
+}
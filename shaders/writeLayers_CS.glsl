@@ -0,0 +1,72 @@
+#version 430
+
+// Writes layers u_firstLayer to u_firstLayer + u_layerCount - 1 from the sorted fragment lists,
+// as front to back peeling reads them back: depth, then the normal with 4 channels.
+// Texels without that layer hold 1.0, the clear value of peeling.
+
+layout( local_size_x = 8, local_size_y = 8 ) in;
+
+struct Fragment
+{
+	float depth;
+	float nx;
+	float ny;
+	float nz;
+	uint next;
+};
+
+const uint END = 0xffffffffu;
+
+layout( std430, binding = 0 ) buffer Heads
+{
+	uint heads[];
+};
+
+layout( std430, binding = 1 ) buffer Fragments
+{
+	Fragment fragments[];
+};
+
+// Layer after layer of u_width x u_height texels
+layout( std430, binding = 3 ) buffer Layers
+{
+	float layers[];
+};
+
+uniform int u_width;
+uniform int u_height;
+uniform int u_firstLayer;
+uniform int u_layerCount;
+uniform int u_channels;
+
+void main( void )
+{
+	uvec2 texel = gl_GlobalInvocationID.xy;
+	if( ( texel.x >= uint( u_width ) ) || ( texel.y >= uint( u_height ) ) )
+		return;
+	uint pixel = texel.y * uint( u_width ) + texel.x;
+	uint count = uint( u_width * u_height );
+
+	uint node = heads[pixel];
+	for( int i = 0; ( i < u_firstLayer ) && ( node != END ); ++i )
+		node = fragments[node].next;
+
+	for( int i = 0; i < u_layerCount; ++i )
+	{
+		uint k = ( uint( i ) * count + pixel ) * uint( u_channels );
+		vec4 layer = vec4( 1.0 );
+		if( node != END )
+		{
+			layer = vec4( fragments[node].depth, fragments[node].nx, fragments[node].ny, fragments[node].nz );
+			node = fragments[node].next;
+		}
+
+		layers[k] = layer.x;
+		if( u_channels == 4 )
+		{
+			layers[k+1] = layer.y;
+			layers[k+2] = layer.z;
+			layers[k+3] = layer.w;
+		}
+	}
+}
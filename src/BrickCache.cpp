@@ -0,0 +1,303 @@
+#include "BrickCache.h"
+#include <vr/math.h>
+#include <cstring>
+
+BrickCache::BrickCache()
+: _memoryBudget( 0 ), _coarseStep( 1 ), _quit( false ), _loader( NULL )
+{
+	memset( &_stats, 0, sizeof(_stats) );
+}
+
+BrickCache::~BrickCache()
+{
+	close();
+}
+
+bool BrickCache::open( const std::string& filename, vr::uint64 memoryBudget, int coarseSize )
+{
+	close();
+
+	if( !_file.open( filename ) )
+		return false;
+	if( !_file.isBricked() )
+	{
+		printf( "%s is not bricked, it cannot be streamed\n", filename.c_str() );
+		_file.close();
+		return false;
+	}
+
+	_memoryBudget = memoryBudget;
+	if( !readCoarseLevel( filename, coarseSize ) && !buildCoarseLevel( coarseSize ) )
+	{
+		_file.close();
+		return false;
+	}
+
+	_quit = false;
+	memset( &_stats, 0, sizeof(_stats) );
+	_loader = new Loader( this );
+	_loader->start( QThread::LowPriority );
+	return true;
+}
+
+void BrickCache::close()
+{
+	if( _loader != NULL )
+	{
+		_mutex.lock();
+		_quit = true;
+		_queue.clear();
+		_wake.wakeAll();
+		_mutex.unlock();
+
+		_loader->wait();
+		delete _loader;
+		_loader = NULL;
+	}
+
+	for( std::map<int, Entry*>::iterator it = _entries.begin(); it != _entries.end(); ++it )
+		delete it->second;
+	_entries.clear();
+	_lru.clear();
+	_failed.clear();
+	_coarse.clear();
+	_file.close();
+}
+
+bool BrickCache::isOpen() const
+{
+	return _loader != NULL;
+}
+
+const ShsFile& BrickCache::file() const
+{
+	return _file;
+}
+
+int BrickCache::brickCount() const
+{
+	return _file.bricksX() * _file.bricksY();
+}
+
+int BrickCache::brickIndex( int bx, int by ) const
+{
+	return by * _file.bricksX() + bx;
+}
+
+const LayerSet& BrickCache::coarseLevel() const
+{
+	return _coarse;
+}
+
+int BrickCache::coarseStep() const
+{
+	return _coarseStep;
+}
+
+const LayerSet* BrickCache::acquire( int bx, int by )
+{
+	QMutexLocker locker( &_mutex );
+
+	std::map<int, Entry*>::iterator it = _entries.find( brickIndex( bx, by ) );
+	if( it == _entries.end() )
+	{
+		++_stats.misses;
+		return NULL;
+	}
+
+	++_stats.hits;
+	Entry* entry = it->second;
+	++entry->pins;
+	_lru.splice( _lru.begin(), _lru, entry->lru );
+	return &entry->layers;
+}
+
+void BrickCache::release( int bx, int by )
+{
+	QMutexLocker locker( &_mutex );
+
+	std::map<int, Entry*>::iterator it = _entries.find( brickIndex( bx, by ) );
+	if( ( it != _entries.end() ) && ( it->second->pins > 0 ) )
+		--it->second->pins;
+	evict();
+}
+
+bool BrickCache::isResident( int bx, int by )
+{
+	QMutexLocker locker( &_mutex );
+	return _entries.find( brickIndex( bx, by ) ) != _entries.end();
+}
+
+void BrickCache::prefetch( const std::vector<int>& bricks )
+{
+	QMutexLocker locker( &_mutex );
+
+	_queue.clear();
+	for( unsigned int i = 0; i < bricks.size(); ++i )
+	{
+		if( ( _entries.find( bricks[i] ) == _entries.end() ) && ( _failed.find( bricks[i] ) == _failed.end() ) )
+			_queue.push_back( bricks[i] );
+	}
+	if( !_queue.empty() )
+		_wake.wakeOne();
+}
+
+BrickCache::Stats BrickCache::stats()
+{
+	QMutexLocker locker( &_mutex );
+	return _stats;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+BrickCache::Loader::Loader( BrickCache* cache )
+: _cache( cache )
+{
+}
+
+void BrickCache::Loader::run()
+{
+	_cache->loadBricks();
+}
+
+bool BrickCache::readCoarseLevel( const std::string& filename, int coarseSize )
+{
+	// The finest stored level that fits, its texels are 2^level texels of the file apart
+	int width = _file.width();
+	int height = _file.height();
+	coarseSize = vr::max( coarseSize, 1 );
+	int level = ShsFile::pyramidLevels( width, height, coarseSize );
+	if( ( level == 0 ) || ( level > _file.levelCount() ) )
+		return false;
+
+	ShsFile coarse;
+	if( !coarse.open( filename, level ) || !coarse.readLayers( _coarse ) )
+	{
+		_coarse.clear();
+		return false;
+	}
+	_coarseStep = 1 << level;
+	return true;
+}
+
+bool BrickCache::buildCoarseLevel( int coarseSize )
+{
+	// Streams every brick once and keeps one texel out of step along each axis.
+	// The coarse level is what the renderer falls back to, so every layer is kept.
+	int width = _file.width();
+	int height = _file.height();
+	coarseSize = vr::max( coarseSize, 1 );
+	_coarseStep = ( vr::max( width, height ) + coarseSize - 1 ) / coarseSize;
+	int coarseWidth = ( width + _coarseStep - 1 ) / _coarseStep;
+	int coarseHeight = ( height + _coarseStep - 1 ) / _coarseStep;
+	_coarse.resize( coarseWidth, coarseHeight, _file.layerCount() );
+
+	LayerSet brick;
+	for( int by = 0; by < _file.bricksY(); ++by )
+	{
+		for( int bx = 0; bx < _file.bricksX(); ++bx )
+		{
+			int x0, y0, w, h;
+			_file.brickRegion( bx, by, x0, y0, w, h );
+			if( !_file.readBrick( bx, by, brick ) )
+				return false;
+
+			// Coarse texels whose sample falls in this brick
+			int cx0 = ( x0 + _coarseStep - 1 ) / _coarseStep;
+			int cy0 = ( y0 + _coarseStep - 1 ) / _coarseStep;
+			for( int l = 0; l < _coarse.layerCount(); ++l )
+			{
+				for( int cy = cy0; cy * _coarseStep < y0 + h; ++cy )
+				{
+					for( int cx = cx0; cx * _coarseStep < x0 + w; ++cx )
+					{
+						int src = ( cy * _coarseStep - y0 ) * w + ( cx * _coarseStep - x0 );
+						int dst = cy * coarseWidth + cx;
+						_coarse.heights( l )[dst] = brick.heights( l )[src];
+						memcpy( _coarse.normals( l ) + dst*3, brick.normals( l ) + src*3, sizeof(float)*3 );
+					}
+				}
+			}
+		}
+	}
+	return true;
+}
+
+vr::uint64 BrickCache::layerBytes( const LayerSet& layers )
+{
+	return (vr::uint64)layers.width() * layers.height() * layers.layerCount() * sizeof(float) * 4;
+}
+
+void BrickCache::loadBricks()
+{
+	while( true )
+	{
+		_mutex.lock();
+		while( !_quit && _queue.empty() )
+			_wake.wait( &_mutex );
+		if( _quit )
+		{
+			_mutex.unlock();
+			return;
+		}
+		int index = _queue.front();
+		_queue.pop_front();
+		bool resident = ( _entries.find( index ) != _entries.end() );
+		_mutex.unlock();
+
+		if( resident )
+			continue;
+
+		// Only this thread reads the file, the brick is decoded without holding the lock
+		int bx = index % _file.bricksX();
+		int by = index / _file.bricksX();
+		Entry* entry = new Entry;
+		bool ok = _file.readBrick( bx, by, entry->layers );
+
+		QMutexLocker locker( &_mutex );
+		if( !ok )
+		{
+			// Reported once by ShsFile, not requested again
+			_failed.insert( index );
+			delete entry;
+			continue;
+		}
+
+		entry->bytes = layerBytes( entry->layers );
+		entry->pins = 0;
+		_lru.push_front( index );
+		entry->lru = _lru.begin();
+		_entries[index] = entry;
+
+		++_stats.loads;
+		++_stats.residentBricks;
+		_stats.bytesRead += _file.brick( bx, by ).size;
+		_stats.bytesResident += entry->bytes;
+		evict();
+	}
+}
+
+void BrickCache::evict()
+{
+	// The most recent brick always stays, even when it alone exceeds the budget
+	std::list<int>::iterator it = _lru.end();
+	while( ( _stats.bytesResident > _memoryBudget ) && ( it != _lru.begin() ) )
+	{
+		--it;
+		if( it == _lru.begin() )
+			break;
+
+		Entry* entry = _entries[*it];
+		if( entry->pins > 0 )
+			continue;
+
+		_stats.bytesResident -= entry->bytes;
+		--_stats.residentBricks;
+		++_stats.evictions;
+		_entries.erase( *it );
+		delete entry;
+		it = _lru.erase( it );
+	}
+}
@@ -0,0 +1,117 @@
+#ifndef _BRICKCACHE_H_
+#define _BRICKCACHE_H_
+
+#include <vr/platform.h>
+#include "ShsFile.h"
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <set>
+
+/*!
+	Decoded bricks of a bricked layer file (see ShsFile) within a memory budget.
+	Bricks are read by a background thread, in the order of the last prefetch list,
+	and the least recently used ones are evicted once the budget is exceeded.
+	The renderer pins a resident brick while it uploads it, pinned bricks are never evicted.
+	A coarse level of the whole file is read from its pyramid, or built once on open,
+	for what is not resident yet.
+ */
+class BrickCache
+{
+public:
+	struct Stats
+	{
+		vr::uint64 hits;        // acquire found the brick resident
+		vr::uint64 misses;      // acquire did not
+		vr::uint64 loads;       // bricks read by the loader thread
+		vr::uint64 evictions;
+		vr::uint64 bytesRead;   // from the file, as stored
+		vr::uint64 bytesResident; // decoded bricks in memory
+		int residentBricks;
+	};
+
+public:
+	BrickCache();
+	~BrickCache();
+
+	// Fails unless filename is a bricked layer file. Reads or builds the coarse level, at most
+	// coarseSize texels along the longest side, then starts the loader thread.
+	bool open( const std::string& filename, vr::uint64 memoryBudget, int coarseSize );
+	void close();
+
+	bool isOpen() const;
+	const ShsFile& file() const;
+	int brickCount() const;
+	int brickIndex( int bx, int by ) const;
+
+	// Every layer downsampled by taking one texel out of each coarseStep()^2 block
+	const LayerSet& coarseLevel() const;
+	int coarseStep() const;
+
+	// Resident brick, pinned until release, or NULL (a miss) when it is not loaded yet
+	const LayerSet* acquire( int bx, int by );
+	void release( int bx, int by );
+	bool isResident( int bx, int by );
+
+	// Replaces the bricks waiting to be read, most wanted first. Resident ones are skipped.
+	void prefetch( const std::vector<int>& bricks );
+
+	Stats stats();
+
+private:
+	struct Entry
+	{
+		LayerSet layers;
+		vr::uint64 bytes;
+		int pins;
+		std::list<int>::iterator lru;
+	};
+
+	class Loader : public QThread
+	{
+	public:
+		Loader( BrickCache* cache );
+
+	protected:
+		virtual void run();
+
+	private:
+		BrickCache* _cache;
+	};
+
+private:
+	// From the pyramid of the file when it has a level small enough, false otherwise
+	bool readCoarseLevel( const std::string& filename, int coarseSize );
+	bool buildCoarseLevel( int coarseSize );
+	static vr::uint64 layerBytes( const LayerSet& layers );
+
+	// Loader thread body, reads queued bricks until close
+	void loadBricks();
+
+	// Least recently used unpinned bricks go until the budget holds, with _mutex held
+	void evict();
+
+private:
+	ShsFile _file;
+	vr::uint64 _memoryBudget;
+	LayerSet _coarse;
+	int _coarseStep;
+
+	// Everything below is shared with the loader thread and guarded by _mutex.
+	// The file itself is only read by the loader once open returns.
+	QMutex _mutex;
+	QWaitCondition _wake;
+	bool _quit;
+	std::map<int, Entry*> _entries;
+	std::list<int> _lru;   // most recently used first
+	std::deque<int> _queue;
+	std::set<int> _failed; // bricks that could not be read, not queued again
+	Stats _stats;
+	Loader* _loader;
+};
+
+#endif // _BRICKCACHE_H_
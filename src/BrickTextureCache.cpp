@@ -0,0 +1,398 @@
+#include "BrickTextureCache.h"
+#include <vr/math.h>
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <set>
+
+BrickTextureCache::BrickTextureCache()
+: _layerCount( 0 ), _shaderNormals( false ), _brickSize( 0 ), _slotsPerSide( 0 ), _coarseSlots( 0 ),
+  _maxUploads( 16 ), _frame( 0 ), _pageTable( 0 )
+{
+	memset( &_stats, 0, sizeof(_stats) );
+	memset( &_printedStats, 0, sizeof(_printedStats) );
+}
+
+BrickTextureCache::~BrickTextureCache()
+{
+	close();
+}
+
+bool BrickTextureCache::open( const std::string& filename, int maxLayers, vr::uint64 memoryBudget, vr::uint64 textureBudget,
+							  bool shaderNormals, ShaderManager& shaderManager )
+{
+	close();
+
+	// Atlas size first, the coarse level fills its lower left slots
+	ShsFile header;
+	if( !header.open( filename ) )
+		return false;
+	if( !header.isBricked() )
+	{
+		printf( "%s is not bricked, it cannot be streamed\n", filename.c_str() );
+		return false;
+	}
+
+	_layerCount = vr::min( header.layerCount(), maxLayers );
+	if( header.layerCount() > maxLayers )
+		printf( "Warning: only the first %d of %d layers are loaded\n", maxLayers, header.layerCount() );
+	_shaderNormals = shaderNormals;
+	_brickSize = header.brickSize();
+	header.close();
+
+	GLint maxTextureSize;
+	glGetIntegerv( GL_MAX_TEXTURE_SIZE, &maxTextureSize );
+	vr::uint64 slotBytes = (vr::uint64)_brickSize * _brickSize * ( shaderNormals ? 4 : 16 ) * vr::max( _layerCount, 1 );
+	_slotsPerSide = vr::min( (int)sqrt( (double)( textureBudget / slotBytes ) ), maxTextureSize / _brickSize );
+	if( _slotsPerSide < 2 )
+	{
+		printf( "Texture budget of %.1f MB is too small for bricks of %d texels\n", textureBudget / ( 1024.0 * 1024.0 ), _brickSize );
+		return false;
+	}
+	_coarseSlots = vr::max( 1, _slotsPerSide / 4 );
+
+	if( !_cache.open( filename, memoryBudget, _coarseSlots * _brickSize ) )
+		return false;
+
+	// Atlases start empty, every page points to the coarse level
+	const ShsFile& file = _cache.file();
+	int atlasSize = _slotsPerSide * _brickSize;
+	LayerTextures::Format heightFormat = { GL_LUMINANCE32F_ARB, GL_LUMINANCE, GL_FLOAT };
+	LayerTextures::Format normalFormat = { GL_RGB32F_ARB, GL_RGB, GL_FLOAT };
+	_textures.create( atlasSize, atlasSize, _layerCount, heightFormat, shaderNormals ? NULL : &normalFormat, shaderManager );
+	std::vector<float> pages( file.bricksX() * file.bricksY() * 4, 0.0f );
+	_pageTable = createTexture( LayerTextures::PAGE_TABLE_UNIT, GL_RGBA32F_ARB, file.bricksX(), file.bricksY(), GL_RGBA, &pages[0] );
+	uploadCoarseLevel();
+
+	int slotCount = _slotsPerSide * _slotsPerSide;
+	_brickSlot.assign( file.bricksX() * file.bricksY(), -1 );
+	_slotBrick.assign( slotCount, -1 );
+	_slotFrame.assign( slotCount, 0 );
+	_slotLruPos.resize( slotCount );
+	for( int s = 0; s < slotCount; ++s )
+	{
+		if( ( s % _slotsPerSide < _coarseSlots ) && ( s / _slotsPerSide < _coarseSlots ) )
+			continue;
+		_slotLru.push_back( s );
+		_slotLruPos[s] = --_slotLru.end();
+	}
+	_frame = 0;
+	memset( &_stats, 0, sizeof(_stats) );
+	memset( &_printedStats, 0, sizeof(_printedStats) );
+	_stats.slotCount = (int)_slotLru.size();
+
+	shaderManager.addUniformi( "u_octNormals", 0 );
+	shaderManager.addUniformi( "u_bricked", 1 );
+	shaderManager.addUniformi( "u_pageTable", LayerTextures::PAGE_TABLE_UNIT );
+	shaderManager.addUniform2f( "u_pageTableSize", (float)file.bricksX(), (float)file.bricksY() );
+	// The layers, not the atlas the textures were created at
+	shaderManager.setUniform2f( "u_layerSize", (float)file.width(), (float)file.height() );
+	shaderManager.addUniformf( "u_brickSize", (float)_brickSize );
+	shaderManager.addUniformf( "u_atlasSize", (float)atlasSize );
+	shaderManager.addUniform2f( "u_coarseSize", (float)_cache.coarseLevel().width(), (float)_cache.coarseLevel().height() );
+
+	double textureBytes = (double)atlasSize * atlasSize * ( shaderNormals ? 4 : 16 ) * _layerCount;
+	printf( "Streaming %d layers of %dx%d from %s: %d brick slots of %d texels (%.1f MB of textures), coarse level of %dx%d\n",
+		    _layerCount, file.width(), file.height(), filename.c_str(), _stats.slotCount, _brickSize, textureBytes / ( 1024.0 * 1024.0 ),
+		    _cache.coarseLevel().width(), _cache.coarseLevel().height() );
+	return true;
+}
+
+void BrickTextureCache::close()
+{
+	_textures.destroy();
+	if( _pageTable != 0 )
+		glDeleteTextures( 1, &_pageTable );
+	_pageTable = 0;
+
+	_brickSlot.clear();
+	_slotBrick.clear();
+	_slotFrame.clear();
+	_slotLru.clear();
+	_slotLruPos.clear();
+	_cache.close();
+}
+
+bool BrickTextureCache::isOpen() const
+{
+	return _cache.isOpen();
+}
+
+const ShsFile& BrickTextureCache::file() const
+{
+	return _cache.file();
+}
+
+void BrickTextureCache::setMaxUploads( int count )
+{
+	_maxUploads = count;
+}
+
+bool BrickTextureCache::update( const double* modelview, const double* predictedModelview, const double* projection, const int* viewport )
+{
+	if( !isOpen() )
+		return false;
+
+	++_frame;
+	const ShsFile& file = _cache.file();
+	std::vector<int> wanted;
+	wantedBricks( modelview, projection, viewport, wanted );
+
+	// Slots of wanted bricks are kept this frame, missing ones are uploaded when in memory
+	std::vector<int> requests;
+	int uploads = 0;
+	for( unsigned int i = 0; i < wanted.size(); ++i )
+	{
+		int brick = wanted[i];
+		int slot = _brickSlot[brick];
+		if( slot >= 0 )
+		{
+			++_stats.hits;
+			_slotFrame[slot] = _frame;
+			_slotLru.splice( _slotLru.begin(), _slotLru, _slotLruPos[slot] );
+			continue;
+		}
+
+		++_stats.misses;
+		int bx = brick % file.bricksX();
+		int by = brick / file.bricksX();
+		const LayerSet* layers = ( uploads < _maxUploads ) ? _cache.acquire( bx, by ) : NULL;
+		if( layers == NULL )
+		{
+			requests.push_back( brick );
+			continue;
+		}
+
+		slot = freeSlot();
+		if( slot >= 0 )
+		{
+			upload( brick, slot, *layers );
+			_slotFrame[slot] = _frame;
+			++uploads;
+		}
+		_cache.release( bx, by );
+	}
+	bool missing = ( uploads > 0 ) || !requests.empty();
+
+	// Then whatever the predicted view needs, and does not already have a slot
+	std::vector<int> predicted;
+	wantedBricks( predictedModelview, projection, viewport, predicted );
+	std::set<int> requested( requests.begin(), requests.end() );
+	for( unsigned int i = 0; i < predicted.size(); ++i )
+	{
+		if( ( _brickSlot[predicted[i]] < 0 ) && requested.insert( predicted[i] ).second )
+			requests.push_back( predicted[i] );
+	}
+	_cache.prefetch( requests );
+	return missing;
+}
+
+BrickTextureCache::Stats BrickTextureCache::stats() const
+{
+	return _stats;
+}
+
+BrickCache::Stats BrickTextureCache::memoryStats()
+{
+	return _cache.stats();
+}
+
+void BrickTextureCache::printStats()
+{
+	if( !isOpen() || ( ( _stats.uploads == _printedStats.uploads ) && ( _stats.misses == _printedStats.misses ) ) )
+		return;
+	_printedStats = _stats;
+
+	BrickCache::Stats memory = _cache.stats();
+	printf( "Texture bricks: %d of %d slots, %.0f hits, %.0f misses, %.0f uploads (%.1f MB), %.0f evictions\n",
+		    _stats.residentBricks, _stats.slotCount, (double)_stats.hits, (double)_stats.misses, (double)_stats.uploads,
+		    _stats.bytesUploaded / ( 1024.0 * 1024.0 ), (double)_stats.evictions );
+	printf( "Memory bricks: %d (%.1f MB), %.0f hits, %.0f misses, %.0f loads (%.1f MB read), %.0f evictions\n",
+		    memory.residentBricks, memory.bytesResident / ( 1024.0 * 1024.0 ), (double)memory.hits, (double)memory.misses,
+		    (double)memory.loads, memory.bytesRead / ( 1024.0 * 1024.0 ), (double)memory.evictions );
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void BrickTextureCache::wantedBricks( const double* modelview, const double* projection, const int* viewport, std::vector<int>& bricks ) const
+{
+	// Column-major product, clip = projection * modelview * cube position
+	View view;
+	for( int c = 0; c < 4; ++c )
+	{
+		for( int r = 0; r < 4; ++r )
+		{
+			double sum = 0.0;
+			for( int k = 0; k < 4; ++k )
+				sum += projection[k*4 + r] * modelview[c*4 + k];
+			view.mvp[c*4 + r] = sum;
+		}
+	}
+	view.viewport[0] = viewport[2];
+	view.viewport[1] = viewport[3];
+
+	std::vector< std::pair<double, int> > found;
+	collectBricks( view, 0, 0, _cache.file().bricksX(), _cache.file().bricksY(), found );
+
+	// Nearest first, and no more than fit in the atlas
+	std::sort( found.begin(), found.end() );
+	size_t count = vr::min( found.size(), (size_t)_stats.slotCount );
+	bricks.resize( count );
+	for( size_t i = 0; i < count; ++i )
+		bricks[i] = found[i].second;
+}
+
+void BrickTextureCache::collectBricks( const View& view, int bx0, int by0, int bx1, int by1,
+									   std::vector< std::pair<double, int> >& bricks ) const
+{
+	// Column of the bricks through the whole height range, in cube space
+	const ShsFile& file = _cache.file();
+	int x0 = bx0 * _brickSize;
+	int y0 = by0 * _brickSize;
+	int x1 = vr::min( bx1 * _brickSize, file.width() );
+	int y1 = vr::min( by1 * _brickSize, file.height() );
+	double xs[2] = { (double)x0 / file.width(), (double)x1 / file.width() };
+	double ys[2] = { (double)y0 / file.height(), (double)y1 / file.height() };
+
+	int outside = 0x3F;
+	bool behindEye = false;
+	double nearest = 1e30;
+	double minX = 1e30, minY = 1e30, maxX = -1e30, maxY = -1e30;
+	for( int i = 0; i < 8; ++i )
+	{
+		double p[3] = { xs[i & 1], ys[( i >> 1 ) & 1], (double)( i >> 2 ) };
+		double clip[4];
+		for( int r = 0; r < 4; ++r )
+			clip[r] = view.mvp[r] * p[0] + view.mvp[4 + r] * p[1] + view.mvp[8 + r] * p[2] + view.mvp[12 + r];
+
+		// Outside of a frustum plane for every corner means out of view
+		int code = 0;
+		for( int axis = 0; axis < 3; ++axis )
+		{
+			if( clip[axis] < -clip[3] )
+				code |= 1 << ( axis*2 );
+			if( clip[axis] > clip[3] )
+				code |= 2 << ( axis*2 );
+		}
+		outside &= code;
+
+		nearest = vr::min( nearest, clip[3] );
+		if( clip[3] <= 1e-6 )
+		{
+			behindEye = true;
+			continue;
+		}
+		double px = clip[0] / clip[3] * view.viewport[0] * 0.5;
+		double py = clip[1] / clip[3] * view.viewport[1] * 0.5;
+		minX = vr::min( minX, px );
+		maxX = vr::max( maxX, px );
+		minY = vr::min( minY, py );
+		maxY = vr::max( maxY, py );
+	}
+	if( outside != 0 )
+		return;
+
+	// Where the coarse level already has a texel per pixel, full resolution adds nothing
+	double coarseTexels = vr::max( x1 - x0, y1 - y0 ) / (double)_cache.coarseStep();
+	if( !behindEye && ( vr::max( maxX - minX, maxY - minY ) <= coarseTexels ) )
+		return;
+
+	if( ( bx1 - bx0 == 1 ) && ( by1 - by0 == 1 ) )
+	{
+		bricks.push_back( std::make_pair( vr::max( nearest, 0.0 ), _cache.brickIndex( bx0, by0 ) ) );
+		return;
+	}
+
+	int mx = ( bx1 - bx0 > 1 ) ? ( bx0 + bx1 ) / 2 : bx1;
+	int my = ( by1 - by0 > 1 ) ? ( by0 + by1 ) / 2 : by1;
+	collectBricks( view, bx0, by0, mx, my, bricks );
+	if( mx < bx1 )
+		collectBricks( view, mx, by0, bx1, my, bricks );
+	if( my < by1 )
+		collectBricks( view, bx0, my, mx, by1, bricks );
+	if( ( mx < bx1 ) && ( my < by1 ) )
+		collectBricks( view, mx, my, bx1, by1, bricks );
+}
+
+int BrickTextureCache::freeSlot()
+{
+	int slot = _slotLru.back();
+	if( _slotFrame[slot] == _frame )
+		return -1;
+
+	int brick = _slotBrick[slot];
+	if( brick >= 0 )
+	{
+		_brickSlot[brick] = -1;
+		setPage( brick, -1 );
+		--_stats.residentBricks;
+		++_stats.evictions;
+	}
+	_slotBrick[slot] = -1;
+	_slotLru.splice( _slotLru.begin(), _slotLru, _slotLruPos[slot] );
+	return slot;
+}
+
+void BrickTextureCache::upload( int brick, int slot, const LayerSet& layers )
+{
+	int x = ( slot % _slotsPerSide ) * _brickSize;
+	int y = ( slot / _slotsPerSide ) * _brickSize;
+
+	for( int i = 0; i < _layerCount; ++i )
+	{
+		_textures.uploadHeights( i, x, y, layers.width(), layers.height(), layers.heights( i ) );
+		_textures.uploadNormals( i, x, y, layers.width(), layers.height(), layers.normals( i ) );
+	}
+
+	_brickSlot[brick] = slot;
+	_slotBrick[slot] = brick;
+	setPage( brick, slot );
+	++_stats.uploads;
+	++_stats.residentBricks;
+	_stats.bytesUploaded += (vr::uint64)layers.width() * layers.height() * ( _shaderNormals ? 4 : 16 ) * _layerCount;
+}
+
+void BrickTextureCache::uploadCoarseLevel()
+{
+	const LayerSet& coarse = _cache.coarseLevel();
+	for( int i = 0; i < _layerCount; ++i )
+	{
+		_textures.uploadHeights( i, 0, 0, coarse.width(), coarse.height(), coarse.heights( i ) );
+		_textures.uploadNormals( i, 0, 0, coarse.width(), coarse.height(), coarse.normals( i ) );
+	}
+}
+
+void BrickTextureCache::setPage( int brick, int slot )
+{
+	// Slot coordinates and 1 for a resident brick, all zeros for the coarse level
+	float page[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+	if( slot >= 0 )
+	{
+		page[0] = (float)( slot % _slotsPerSide );
+		page[1] = (float)( slot / _slotsPerSide );
+		page[2] = 1.0f;
+	}
+
+	int bricksX = _cache.file().bricksX();
+	glActiveTexture( GL_TEXTURE0 + LayerTextures::PAGE_TABLE_UNIT );
+	glBindTexture( GL_TEXTURE_2D, _pageTable );
+	glTexSubImage2D( GL_TEXTURE_2D, 0, brick % bricksX, brick / bricksX, 1, 1, GL_RGBA, GL_FLOAT, page );
+}
+
+unsigned int BrickTextureCache::createTexture( int unit, int internalFormat, int width, int height, unsigned int format, const void* data )
+{
+	GLuint texId;
+	glActiveTexture( GL_TEXTURE0 + unit );
+	glGenTextures( 1, &texId );
+	glBindTexture( GL_TEXTURE_2D, texId );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glTexImage2D( GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, GL_FLOAT, data );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+	return texId;
+}
@@ -0,0 +1,108 @@
+#ifndef _BRICKTEXTURECACHE_H_
+#define _BRICKTEXTURECACHE_H_
+
+#include "BrickCache.h"
+#include "ShaderManager.h"
+#include "LayerTextures.h"
+#include <vector>
+#include <list>
+
+/*!
+	Streams a bricked layer file into texture memory for the ray casting shader, so that
+	layers much larger than texture memory (and, through BrickCache, than memory) are drawn.
+	Each layer of the LayerTextures arrays is an atlas of brick slots. A slot holds the same brick in every layer,
+	and the lower left slots hold the coarse level of BrickCache. A page table texture gives
+	the slot of each brick, bricks without a slot are drawn from the coarse level.
+	Every frame, update() finds the bricks the view needs at full resolution, uploads some
+	that are in memory to the least recently used slots and has BrickCache read the others,
+	then those of the predicted view.
+ */
+class BrickTextureCache
+{
+public:
+	struct Stats
+	{
+		vr::uint64 hits;    // wanted bricks already in a slot
+		vr::uint64 misses;  // wanted bricks drawn from the coarse level
+		vr::uint64 uploads;
+		vr::uint64 evictions;
+		vr::uint64 bytesUploaded;
+		int residentBricks;
+		int slotCount;
+	};
+
+public:
+	BrickTextureCache();
+	~BrickTextureCache();
+
+	// Sizes the atlases for textureBudget bytes and opens the file in BrickCache with memoryBudget.
+	// At most maxLayers layers are loaded, without normals with shaderNormals. The page table
+	// goes to LayerTextures::PAGE_TABLE_UNIT. Sets the uniforms of the ray casting shader in shaderManager.
+	bool open( const std::string& filename, int maxLayers, vr::uint64 memoryBudget, vr::uint64 textureBudget,
+		       bool shaderNormals, ShaderManager& shaderManager );
+	void close();
+
+	bool isOpen() const;
+	const ShsFile& file() const;
+
+	// Uploads at most count bricks per update, 16 by default
+	void setMaxUploads( int count );
+
+	// Matrices are column-major as in OpenGL, modelview from cube to eye space.
+	// Bricks of the predicted modelview are read ahead. Returns true while bricks the
+	// view needs are not in texture memory yet, the view should then be drawn again.
+	bool update( const double* modelview, const double* predictedModelview, const double* projection, const int* viewport );
+
+	Stats stats() const;
+	BrickCache::Stats memoryStats();
+
+	// One line with both caches, when something changed since the last one
+	void printStats();
+
+private:
+	struct View
+	{
+		double mvp[16];
+		double viewport[2];
+	};
+
+	// Bricks the view needs at full resolution, nearest first, at most the usable slots
+	void wantedBricks( const double* modelview, const double* projection, const int* viewport, std::vector<int>& bricks ) const;
+
+	// Adds the bricks of [bx0,bx1) x [by0,by1) that are in view and finer than the coarse level
+	void collectBricks( const View& view, int bx0, int by0, int bx1, int by1, std::vector< std::pair<double, int> >& bricks ) const;
+
+	// Least recently used slot not needed this frame, emptied, or -1
+	int freeSlot();
+	void upload( int brick, int slot, const LayerSet& layers );
+	void uploadCoarseLevel();
+
+	// Points the page table entry of brick to slot, or to the coarse level when slot is -1
+	void setPage( int brick, int slot );
+
+	unsigned int createTexture( int unit, int internalFormat, int width, int height, unsigned int format, const void* data );
+
+private:
+	BrickCache _cache;
+	int _layerCount;
+	bool _shaderNormals;
+	int _brickSize;
+	int _slotsPerSide;
+	int _coarseSlots;   // along each side
+	int _maxUploads;
+	unsigned int _frame;
+
+	LayerTextures _textures;
+	unsigned int _pageTable;
+
+	std::vector<int> _brickSlot;          // slot of each brick, -1 for none
+	std::vector<int> _slotBrick;          // brick in each slot, -1 for none
+	std::vector<unsigned int> _slotFrame; // last frame each slot was wanted in
+	std::list<int> _slotLru;              // usable slots, most recently used first
+	std::vector< std::list<int>::iterator > _slotLruPos;
+
+	Stats _stats;
+	Stats _printedStats;
+};
+
+#endif // _BRICKTEXTURECACHE_H_
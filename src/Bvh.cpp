@@ -0,0 +1,345 @@
+#include "Bvh.h"
+#include "SoftwareLayerGenerator.h"
+#include <algorithm>
+#include <cfloat>
+
+// Binned SAH parameters
+static const int BIN_COUNT = 16;
+static const unsigned int MAX_LEAF_SIZE = 4;
+static const float TRAVERSAL_COST = 1.0f;
+static const float INTERSECTION_COST = 1.0f;
+
+static inline float halfArea( const float* boxMin, const float* boxMax )
+{
+	float dx = boxMax[0] - boxMin[0];
+	float dy = boxMax[1] - boxMin[1];
+	float dz = boxMax[2] - boxMin[2];
+	return dx*dy + dy*dz + dz*dx;
+}
+
+static inline void expand( float* boxMin, float* boxMax, const float* otherMin, const float* otherMax )
+{
+	for( int k = 0; k < 3; ++k )
+	{
+		boxMin[k] = vr::min( boxMin[k], otherMin[k] );
+		boxMax[k] = vr::max( boxMax[k], otherMax[k] );
+	}
+}
+
+static inline void resetBox( float* boxMin, float* boxMax )
+{
+	for( int k = 0; k < 3; ++k )
+	{
+		boxMin[k] = FLT_MAX;
+		boxMax[k] = -FLT_MAX;
+	}
+}
+
+Bvh::Bvh()
+: _mesh( NULL ), _depth( 0 )
+{
+	// empty
+}
+
+void Bvh::build( const TriangleMesh* mesh )
+{
+	clear();
+	_mesh = mesh;
+
+	if( ( _mesh == NULL ) || ( _mesh->triangleCount() == 0 ) )
+		return;
+
+	unsigned int triangleCount = _mesh->triangleCount();
+
+	// Per triangle bounds and centroids
+	std::vector<BuildItem> items( triangleCount );
+	_triangles.resize( triangleCount );
+
+#pragma omp parallel for
+	for( int t = 0; t < (int)triangleCount; ++t )
+	{
+		BuildItem& item = items[t];
+		resetBox( item.boxMin, item.boxMax );
+		for( int v = 0; v < 3; ++v )
+		{
+			const float* p = _mesh->vertices[t*3+v].ptr();
+			expand( item.boxMin, item.boxMax, p, p );
+		}
+		for( int k = 0; k < 3; ++k )
+			item.centroid[k] = ( item.boxMin[k] + item.boxMax[k] ) * 0.5f;
+		_triangles[t] = t;
+	}
+
+	// Worst case is 2n-1 nodes
+	_nodes.reserve( triangleCount * 2 );
+
+	Node root;
+	root.first = 0;
+	root.count = triangleCount;
+	_nodes.push_back( root );
+
+	subdivide( 0, items, 1 );
+}
+
+void Bvh::clear()
+{
+	_mesh = NULL;
+	_nodes.clear();
+	_triangles.clear();
+	_depth = 0;
+}
+
+void Bvh::intersectAll( const vr::vec3f& origin, const vr::vec3f& dir, float tmin, float tmax, std::vector<Hit>& hits ) const
+{
+	if( _nodes.empty() )
+		return;
+
+	// Watertight ray/triangle setup (Woop et al. 2013): shear so that the ray runs along +z
+	int kz = 0;
+	if( vr::abs( dir.y ) > vr::abs( dir[kz] ) )
+		kz = 1;
+	if( vr::abs( dir.z ) > vr::abs( dir[kz] ) )
+		kz = 2;
+	int kx = ( kz + 1 ) % 3;
+	int ky = ( kx + 1 ) % 3;
+	if( dir[kz] < 0.0f )
+		std::swap( kx, ky );
+
+	double sx = (double)dir[kx] / dir[kz];
+	double sy = (double)dir[ky] / dir[kz];
+	double sz = 1.0 / dir[kz];
+
+	vr::vec3f invDir( 1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z );
+
+	unsigned int stack[64];
+	int stackSize = 0;
+	stack[stackSize++] = 0;
+
+	while( stackSize > 0 )
+	{
+		const Node& node = _nodes[stack[--stackSize]];
+
+		if( !intersectBox( node, origin, invDir, tmin, tmax ) )
+			continue;
+
+		if( node.count == 0 )
+		{
+			stack[stackSize++] = node.first;
+			stack[stackSize++] = node.first + 1;
+			continue;
+		}
+
+		for( unsigned int i = node.first; i < node.first + node.count; ++i )
+		{
+			// Edge functions are evaluated in double precision, so that slivers do not flip orientation
+			unsigned int t = _triangles[i];
+			const vr::vec3f* tri = &_mesh->vertices[t*3];
+
+			double az = (double)tri[0][kz] - origin[kz];
+			double bz = (double)tri[1][kz] - origin[kz];
+			double cz = (double)tri[2][kz] - origin[kz];
+			double ax = ( (double)tri[0][kx] - origin[kx] ) - sx*az;
+			double ay = ( (double)tri[0][ky] - origin[ky] ) - sy*az;
+			double bx = ( (double)tri[1][kx] - origin[kx] ) - sx*bz;
+			double by = ( (double)tri[1][ky] - origin[ky] ) - sy*bz;
+			double cx = ( (double)tri[2][kx] - origin[kx] ) - sx*cz;
+			double cy = ( (double)tri[2][ky] - origin[ky] ) - sy*cz;
+
+			// Edge functions: u for edge b->c, v for c->a, w for a->b
+			double u = cx*by - cy*bx;
+			double v = ax*cy - ay*cx;
+			double w = bx*ay - by*ax;
+
+			double det = u + v + w;
+			if( det == 0.0 )
+				continue;
+
+			// Consistent orientation for all triangles, then apply the fill rule of the software
+			// rasterizer, so that shared edges are hit only once
+			double s = ( det > 0.0 ) ? 1.0 : -1.0;
+			if( ( u*s < 0.0 ) || ( ( u == 0.0 ) && !SoftwareLayerGenerator::ownsEdge( s*( cx - bx ), s*( cy - by ) ) ) )
+				continue;
+			if( ( v*s < 0.0 ) || ( ( v == 0.0 ) && !SoftwareLayerGenerator::ownsEdge( s*( ax - cx ), s*( ay - cy ) ) ) )
+				continue;
+			if( ( w*s < 0.0 ) || ( ( w == 0.0 ) && !SoftwareLayerGenerator::ownsEdge( s*( bx - ax ), s*( by - ay ) ) ) )
+				continue;
+
+			double invDet = 1.0 / det;
+			float dist = (float)( ( u*az + v*bz + w*cz ) * sz * invDet );
+			if( ( dist < tmin ) || ( dist > tmax ) )
+				continue;
+
+			Hit hit;
+			hit.t = dist;
+			hit.triangle = t;
+			hit.u = (float)( v * invDet );
+			hit.v = (float)( w * invDet );
+			hits.push_back( hit );
+		}
+	}
+}
+
+unsigned int Bvh::nodeCount() const
+{
+	return _nodes.size();
+}
+
+unsigned int Bvh::depth() const
+{
+	return _depth;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void Bvh::subdivide( unsigned int nodeId, std::vector<BuildItem>& items, unsigned int depth )
+{
+	_depth = vr::max( _depth, depth );
+	computeBounds( _nodes[nodeId], items );
+
+	unsigned int first = _nodes[nodeId].first;
+	unsigned int count = _nodes[nodeId].count;
+
+	// Keep the stack in intersectAll large enough
+	if( ( count <= MAX_LEAF_SIZE ) || ( depth >= 60 ) )
+		return;
+
+	// Centroid bounds
+	float cmin[3];
+	float cmax[3];
+	resetBox( cmin, cmax );
+	for( unsigned int i = first; i < first + count; ++i )
+		expand( cmin, cmax, items[i].centroid, items[i].centroid );
+
+	// Find best binned SAH split over all axes
+	float bestCost = FLT_MAX;
+	int bestAxis = -1;
+	int bestBin = 0;
+
+	for( int axis = 0; axis < 3; ++axis )
+	{
+		float extent = cmax[axis] - cmin[axis];
+		if( extent <= 0.0f )
+			continue;
+
+		float binMin[BIN_COUNT][3];
+		float binMax[BIN_COUNT][3];
+		unsigned int binCount[BIN_COUNT];
+		for( int b = 0; b < BIN_COUNT; ++b )
+		{
+			resetBox( binMin[b], binMax[b] );
+			binCount[b] = 0;
+		}
+
+		float scale = BIN_COUNT / extent;
+		for( unsigned int i = first; i < first + count; ++i )
+		{
+			int b = vr::min( (int)( ( items[i].centroid[axis] - cmin[axis] ) * scale ), BIN_COUNT - 1 );
+			++binCount[b];
+			expand( binMin[b], binMax[b], items[i].boxMin, items[i].boxMax );
+		}
+
+		// Sweep from the right to get areas of all right partitions
+		float rightArea[BIN_COUNT];
+		unsigned int rightCount[BIN_COUNT];
+		float accMin[3];
+		float accMax[3];
+		resetBox( accMin, accMax );
+		unsigned int accCount = 0;
+		for( int b = BIN_COUNT - 1; b > 0; --b )
+		{
+			expand( accMin, accMax, binMin[b], binMax[b] );
+			accCount += binCount[b];
+			rightCount[b] = accCount;
+			rightArea[b] = ( accCount > 0 ) ? halfArea( accMin, accMax ) : 0.0f;
+		}
+
+		// Sweep from the left and evaluate each split plane
+		resetBox( accMin, accMax );
+		accCount = 0;
+		for( int b = 0; b < BIN_COUNT - 1; ++b )
+		{
+			expand( accMin, accMax, binMin[b], binMax[b] );
+			accCount += binCount[b];
+			if( ( accCount == 0 ) || ( rightCount[b+1] == 0 ) )
+				continue;
+
+			float cost = halfArea( accMin, accMax ) * accCount + rightArea[b+1] * rightCount[b+1];
+			if( cost < bestCost )
+			{
+				bestCost = cost;
+				bestAxis = axis;
+				bestBin = b;
+			}
+		}
+	}
+
+	// All centroids coincide
+	if( bestAxis < 0 )
+		return;
+
+	// Compare against not splitting at all
+	const Node& node = _nodes[nodeId];
+	float leafCost = INTERSECTION_COST * count;
+	float splitCost = TRAVERSAL_COST + INTERSECTION_COST * bestCost / halfArea( node.boxMin, node.boxMax );
+	if( ( splitCost >= leafCost ) && ( count <= MAX_LEAF_SIZE * 4 ) )
+		return;
+
+	// Partition items and triangle ids together
+	float scale = BIN_COUNT / ( cmax[bestAxis] - cmin[bestAxis] );
+	unsigned int mid = first;
+	for( unsigned int i = first; i < first + count; ++i )
+	{
+		int b = vr::min( (int)( ( items[i].centroid[bestAxis] - cmin[bestAxis] ) * scale ), BIN_COUNT - 1 );
+		if( b <= bestBin )
+		{
+			std::swap( items[i], items[mid] );
+			std::swap( _triangles[i], _triangles[mid] );
+			++mid;
+		}
+	}
+
+	// Create children, careful with reallocation of _nodes
+	unsigned int leftId = _nodes.size();
+	Node child;
+	child.first = first;
+	child.count = mid - first;
+	_nodes.push_back( child );
+	child.first = mid;
+	child.count = first + count - mid;
+	_nodes.push_back( child );
+
+	_nodes[nodeId].first = leftId;
+	_nodes[nodeId].count = 0;
+
+	subdivide( leftId, items, depth + 1 );
+	subdivide( leftId + 1, items, depth + 1 );
+}
+
+void Bvh::computeBounds( Node& node, const std::vector<BuildItem>& items ) const
+{
+	resetBox( node.boxMin, node.boxMax );
+	for( unsigned int i = node.first; i < node.first + node.count; ++i )
+		expand( node.boxMin, node.boxMax, items[i].boxMin, items[i].boxMax );
+}
+
+bool Bvh::intersectBox( const Node& node, const vr::vec3f& origin, const vr::vec3f& invDir, float tmin, float tmax ) const
+{
+	for( int k = 0; k < 3; ++k )
+	{
+		float t0 = ( node.boxMin[k] - origin[k] ) * invDir[k];
+		float t1 = ( node.boxMax[k] - origin[k] ) * invDir[k];
+		if( t0 > t1 )
+			std::swap( t0, t1 );
+
+		// NaN (origin on a slab of a parallel ray) leaves the interval untouched
+		if( t0 > tmin )
+			tmin = t0;
+		if( t1 < tmax )
+			tmax = t1;
+		if( tmin > tmax )
+			return false;
+	}
+	return true;
+}
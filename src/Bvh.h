@@ -0,0 +1,69 @@
+#ifndef _BVH_H_
+#define _BVH_H_
+
+#include <vector>
+#include <vr/vec3.h>
+#include "TriangleMesh.h"
+
+/*!
+	Bounding volume hierarchy over the triangles of a TriangleMesh.
+	Built top-down with the surface area heuristic over binned centroids,
+	which costs O(n log n). Rays report every triangle they cross, not only the closest.
+ */
+class Bvh
+{
+public:
+	struct Hit
+	{
+		float t;
+		unsigned int triangle;
+		float u; // barycentric weight of vertex 1
+		float v; // barycentric weight of vertex 2
+
+		bool operator<( const Hit& other ) const
+		{
+			return t < other.t;
+		}
+	};
+
+public:
+	Bvh();
+
+	void build( const TriangleMesh* mesh );
+	void clear();
+
+	// Appends all intersections with tmin <= t <= tmax, in no particular order.
+	// Triangle edges follow a top-left rule, so a ray through a shared edge hits only one triangle.
+	void intersectAll( const vr::vec3f& origin, const vr::vec3f& dir, float tmin, float tmax, std::vector<Hit>& hits ) const;
+
+	unsigned int nodeCount() const;
+	unsigned int depth() const;
+
+private:
+	struct Node
+	{
+		float boxMin[3];
+		float boxMax[3];
+		unsigned int first; // first child (inner) or first triangle (leaf)
+		unsigned int count; // 0 for inner nodes
+	};
+
+	struct BuildItem
+	{
+		float boxMin[3];
+		float boxMax[3];
+		float centroid[3];
+	};
+
+	void subdivide( unsigned int nodeId, std::vector<BuildItem>& items, unsigned int depth );
+	void computeBounds( Node& node, const std::vector<BuildItem>& items ) const;
+	bool intersectBox( const Node& node, const vr::vec3f& origin, const vr::vec3f& invDir, float tmin, float tmax ) const;
+
+private:
+	const TriangleMesh* _mesh;
+	std::vector<Node> _nodes;
+	std::vector<unsigned int> _triangles;
+	unsigned int _depth;
+};
+
+#endif // _BVH_H_
@@ -0,0 +1,126 @@
+#include "BvhLayerGenerator.h"
+#include "SoftwareLayerGenerator.h"
+#include <algorithm>
+#include <cstdio>
+
+BvhLayerGenerator::BvhLayerGenerator()
+: _mesh( NULL ), _width( 0 ), _height( 0 )
+{
+	// empty
+}
+
+void BvhLayerGenerator::setMesh( const TriangleMesh* mesh )
+{
+	_mesh = mesh;
+}
+
+void BvhLayerGenerator::setFrame( const LayerFrame& frame )
+{
+	_frame = frame;
+}
+
+void BvhLayerGenerator::setResolution( int width, int height )
+{
+	_width = width;
+	_height = height;
+}
+
+int BvhLayerGenerator::generateLayers( LayerSet& layers )
+{
+	layers.clear();
+
+	if( ( _mesh == NULL ) || ( _width <= 0 ) || ( _height <= 0 ) )
+		return 0;
+
+	_bvh.build( _mesh );
+	printf( "BVH: %d triangles, %d nodes, depth %d\n", _mesh->triangleCount(), _bvh.nodeCount(), _bvh.depth() );
+
+	// Cast all rows in parallel, keeping every crossing
+	std::vector<Row> rows( _height );
+
+#pragma omp parallel for schedule(dynamic)
+	for( int y = 0; y < _height; ++y )
+	{
+		castRow( y, rows[y] );
+	}
+
+	int layerCount = 0;
+	for( int y = 0; y < _height; ++y )
+		layerCount = vr::max( layerCount, rows[y].layerCount );
+
+	printf( "Layers needed: %d\n", layerCount );
+
+	layers.resize( _width, _height, layerCount );
+
+#pragma omp parallel for
+	for( int y = 0; y < _height; ++y )
+	{
+		const Row& row = rows[y];
+		for( int x = 0; x < _width; ++x )
+		{
+			unsigned int first = row.offsets[x];
+			if( row.offsets[x+1] > first )
+				SoftwareLayerGenerator::emitTexel( &row.fragments[first], row.offsets[x+1] - first, y*_width + x, layers );
+		}
+	}
+
+	_bvh.clear();
+	return layerCount;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void BvhLayerGenerator::castRow( int y, Row& row ) const
+{
+	row.offsets.resize( _width + 1 );
+	row.layerCount = 0;
+
+	std::vector<Bvh::Hit> hits;
+
+	vr::vec3f dir( _frame.forward.x, _frame.forward.y, _frame.forward.z );
+	double range = _frame.zFar - _frame.zNear;
+	double v = ( ( y + 0.5 ) / _height * 2.0 - 1.0 ) * _frame.halfHeight;
+
+	for( int x = 0; x < _width; ++x )
+	{
+		row.offsets[x] = row.fragments.size();
+
+		// Ray through the texel center, starting on the eye plane
+		double u = ( ( x + 0.5 ) / _width * 2.0 - 1.0 ) * _frame.halfWidth;
+		vr::vec3d o = _frame.eye + _frame.right * u + _frame.up * v;
+		vr::vec3f origin( o.x, o.y, o.z );
+
+		hits.clear();
+		_bvh.intersectAll( origin, dir, (float)_frame.zNear, (float)_frame.zFar, hits );
+		std::sort( hits.begin(), hits.end() );
+
+		// Keep strictly increasing depths, as depth peeling does
+		float prevDepth = -1.0f;
+		for( unsigned int i = 0; i < hits.size(); ++i )
+		{
+			const Bvh::Hit& hit = hits[i];
+			float depth = (float)( ( hit.t - _frame.zNear ) / range );
+			if( depth <= prevDepth )
+				continue;
+			prevDepth = depth;
+
+			const vr::vec3f* n = &_mesh->normals[hit.triangle*3];
+			vr::vec3f normal = n[0]*( 1.0f - hit.u - hit.v ) + n[1]*hit.u + n[2]*hit.v;
+			vr::vec3d en = _frame.toEye( vr::vec3d( normal.x, normal.y, normal.z ) );
+			en.tryNormalize();
+
+			Fragment frag;
+			frag.depth = depth;
+			frag.normal[0] = en.x;
+			frag.normal[1] = en.y;
+			frag.normal[2] = en.z;
+			row.fragments.push_back( frag );
+		}
+
+		row.layerCount = vr::max( row.layerCount, (int)( row.fragments.size() - row.offsets[x] ) );
+	}
+
+	row.offsets[_width] = row.fragments.size();
+}
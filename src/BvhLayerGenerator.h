@@ -0,0 +1,52 @@
+#ifndef _BVHLAYERGENERATOR_H_
+#define _BVHLAYERGENERATOR_H_
+
+#include <vector>
+#include "Bvh.h"
+#include "LayerFrame.h"
+#include "LayerSet.h"
+#include "TriangleMesh.h"
+
+/*!
+	CPU layer extraction by ray casting.
+	Builds a SAH BVH over the mesh and fires one orthographic ray per texel along the
+	frame direction, recording every surface crossing. All layers come out of a single
+	parallel sweep, with no limit on the number of layers.
+ */
+class BvhLayerGenerator
+{
+public:
+	BvhLayerGenerator();
+
+	void setMesh( const TriangleMesh* mesh );
+	void setFrame( const LayerFrame& frame );
+	void setResolution( int width, int height );
+
+	// Returns the number of layers generated
+	int generateLayers( LayerSet& layers );
+
+private:
+	struct Fragment
+	{
+		float depth;
+		float normal[3];
+	};
+
+	struct Row
+	{
+		std::vector<Fragment> fragments;
+		std::vector<unsigned int> offsets; // per texel, into fragments
+		int layerCount;
+	};
+
+	void castRow( int y, Row& row ) const;
+
+private:
+	const TriangleMesh* _mesh;
+	LayerFrame _frame;
+	int _width;
+	int _height;
+	Bvh _bvh;
+};
+
+#endif // _BVHLAYERGENERATOR_H_
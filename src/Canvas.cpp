@@ -1,7 +1,10 @@
 #include "Canvas.h"
+#include "BrickTextureCache.h"
+#include "ProgressiveLayerLoader.h"
 
 #include <QKeyEvent>
 #include <QMessageBox>
+#include <QTimer>
 
 #include <iostream>
 #include <fstream>
@@ -9,6 +12,11 @@
 #include <QtOpenGL/QGLFramebufferObject>
 
 static QWidget* s_parent = NULL;
+
+// Bricks are read ahead for where the camera is expected to be in this time, in seconds
+static const float BRICK_PREDICTION_TIME = 0.25f;
+// Delay between redraws while bricks the view needs or finer levels are still coming in, in milliseconds
+static const int LAYER_REDRAW_DELAY = 15;
 static Canvas* s_canvasInstance = NULL;
 
 void Canvas::setParent( QWidget* parent )
@@ -25,7 +33,8 @@ Canvas* Canvas::instance()
 }
 
 Canvas::Canvas( QWidget* parent )
-: QGLWidget( QGLFormat( QGL::StencilBuffer | QGL::AlphaChannel ), parent ), _frameCounter( 0 ), _renderMode( GEOMETRY )
+: QGLWidget( QGLFormat( QGL::StencilBuffer | QGL::AlphaChannel ), parent ), _frameCounter( 0 ), _renderMode( GEOMETRY ),
+  _hasLayerFrame( false ), _brickTextures( NULL ), _progressiveLayers( NULL ), _redrawPending( false )
 {
 	setFocusPolicy( Qt::StrongFocus );
 	_fbo = 0;
@@ -89,6 +98,31 @@ void Canvas::resetLayerShaders()
 	_layerShaderManager.initShaders();
 }
 
+void Canvas::setViewport( int x, int y, int w, int h )
+{
+	_modelRenderer.setViewport( x, y, w, h );
+	_boxRenderer.setViewport( x, y, w, h );
+	glViewport( x, y, w, h );
+}
+
+void Canvas::setLayerFrame( const LayerFrame* frame )
+{
+	_hasLayerFrame = ( frame != NULL );
+	if( _hasLayerFrame )
+		frame->layerToWorld( _layerMatrix );
+	updateGL();
+}
+
+void Canvas::setBrickTextures( BrickTextureCache* bricks )
+{
+	_brickTextures = bricks;
+}
+
+void Canvas::setProgressiveLayers( ProgressiveLayerLoader* layers )
+{
+	_progressiveLayers = layers;
+}
+
 void Canvas::setRenderMode( Canvas::RenderMode mode, bool enabled )
 {
 	unsigned int current = static_cast<unsigned int>( _renderMode );
@@ -290,6 +324,16 @@ void Canvas::paintGL()
 		}
 		if( _renderMode & HEIGHTMAP )
 		{
+			// Ray casting happens in cube space, the frame only places the cube in the scene
+			glMatrixMode( GL_MODELVIEW );
+			glPushMatrix();
+			if( _hasLayerFrame )
+				glMultMatrixd( _layerMatrix );
+			if( _brickTextures != NULL )
+				updateBricks();
+			if( ( _progressiveLayers != NULL ) && _progressiveLayers->update( _layerShaderManager ) )
+				scheduleRedraw();
+
 			glCullFace( GL_FRONT );
 			glEnable( GL_CULL_FACE );
 			_layerShaderManager.bindProgram();
@@ -317,6 +361,7 @@ void Canvas::paintGL()
 			_layerShaderManager.unbindProgram();
 			glDisable( GL_CULL_FACE );
 			glCullFace( GL_BACK );
+			glPopMatrix();
 		}
 	}
 
@@ -324,6 +369,8 @@ void Canvas::paintGL()
 	if( elapsed >= 1.0 )
 	{
 		emit updateFps( _frameCounter / elapsed );
+		if( _brickTextures != NULL )
+			_brickTextures->printStats();
 		_frameCounter = 0;
 		_timer.restart();
 	}
@@ -381,6 +428,12 @@ void Canvas::mouseMoveEvent( QMouseEvent* e )
 	}
 }
 
+void Canvas::redrawLayers()
+{
+	_redrawPending = false;
+	updateGL();
+}
+
 /************************************************************************/
 /* Private                                                              */
 /************************************************************************/
@@ -389,3 +442,35 @@ void Canvas::updateCamera()
 	glMatrixMode( GL_MODELVIEW );
 	glLoadMatrixf( _examManip.getTransform().ptr() );
 }
+
+void Canvas::updateBricks()
+{
+	double modelview[16];
+	double projection[16];
+	int viewport[4];
+	glGetDoublev( GL_MODELVIEW_MATRIX, modelview );
+	glGetDoublev( GL_PROJECTION_MATRIX, projection );
+	glGetIntegerv( GL_VIEWPORT, viewport );
+
+	mat4f predictedTransform;
+	_examManip.getPredictedTransform( BRICK_PREDICTION_TIME, predictedTransform );
+	double predicted[16];
+	glPushMatrix();
+	glLoadMatrixf( predictedTransform.ptr() );
+	if( _hasLayerFrame )
+		glMultMatrixd( _layerMatrix );
+	glGetDoublev( GL_MODELVIEW_MATRIX, predicted );
+	glPopMatrix();
+
+	// Uploads are spread over frames, keep drawing until the view has what it needs
+	if( _brickTextures->update( modelview, predicted, projection, viewport ) )
+		scheduleRedraw();
+}
+
+void Canvas::scheduleRedraw()
+{
+	if( _redrawPending )
+		return;
+	_redrawPending = true;
+	QTimer::singleShot( LAYER_REDRAW_DELAY, this, SLOT( redrawLayers() ) );
+}
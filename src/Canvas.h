@@ -10,6 +10,10 @@
 
 #include "ExamineManipulator.h"
 #include "ShaderManager.h"
+#include "LayerFrame.h"
+
+class BrickTextureCache;
+class ProgressiveLayerLoader;
 
 class Canvas : public QGLWidget
 {
@@ -40,6 +44,19 @@ public:
 	ShaderManager& layerShaderManager();
 	void resetLayerShaders();
 
+	// Viewport for OpenGL and the scene renderers, e.g. to render offscreen tiles.
+	// Does not touch the camera projection.
+	void setViewport( int x, int y, int w, int h );
+
+	// Places the layer cube in world space, NULL keeps the unit cube
+	void setLayerFrame( const LayerFrame* frame );
+
+	// Streamed layers, updated for the view before each heightmap pass. NULL when layers are loaded whole.
+	void setBrickTextures( BrickTextureCache* bricks );
+
+	// Layers loaded coarsest level first, refined before each heightmap pass. NULL once replaced.
+	void setProgressiveLayers( ProgressiveLayerLoader* layers );
+
 	void setRenderMode( RenderMode mode, bool enabled = true );
 	RenderMode renderMode() const;
 
@@ -57,12 +74,21 @@ protected slots:
 	virtual void mousePressEvent( QMouseEvent* e );
 	virtual void mouseMoveEvent( QMouseEvent* e );
 
+	void redrawLayers();
+
 private:
 	Canvas( QWidget* parent );
 	~Canvas();
 
 	void updateCamera();
 
+	// Brick textures for the current view and the one predicted by the manipulator,
+	// with the layer cube matrix on the modelview stack
+	void updateBricks();
+
+	// Draws again shortly, while layers are still coming in
+	void scheduleRedraw();
+
 private:
 	int _idleId;
 	vr::Timer _timer;
@@ -76,6 +102,13 @@ private:
 
 	RenderMode _renderMode;
 
+	bool _hasLayerFrame;
+	double _layerMatrix[16];
+
+	BrickTextureCache* _brickTextures;
+	ProgressiveLayerLoader* _progressiveLayers;
+	bool _redrawPending;
+
 	unsigned int _fbo;
 	unsigned int _renderTex;
 	ShaderManager _saveDepthShaderManager;
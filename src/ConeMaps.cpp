@@ -0,0 +1,261 @@
+#include "ConeMaps.h"
+#include <vr/math.h>
+#include <cfloat>
+#include <cmath>
+#include <cstdlib>
+#include <vector>
+
+// Columns of a window pass handled together, so that rows are read a cache line at a time
+static const int COLUMN_CHUNK = 64;
+
+// Max over [i - radius, i + radius] of count positions, stride apart, for lanes adjacent values
+// at each position (values past the ends are left out). Van Herk / Gil-Werman: prefix and suffix
+// maxima within blocks of 2 * radius + 1 positions, so that any window is the max of two of them,
+// three comparisons per value whatever the radius. Blocks start at -radius, the first one is clipped.
+static void windowMax1D( const float* src, float* dst, int count, size_t stride, int lanes, int radius, float* prefix, float* suffix )
+{
+	int size = 2 * radius + 1;
+	for( int block = 0; block * size - radius < count; ++block )
+	{
+		int first = vr::max( block * size - radius, 0 );
+		int last = vr::min( block * size - radius + size, count ) - 1;
+		float* p = prefix + (size_t)first * lanes;
+		float* q = suffix + (size_t)last * lanes;
+		for( int k = 0; k < lanes; ++k )
+		{
+			p[k] = src[first * stride + k];
+			q[k] = src[last * stride + k];
+		}
+		for( int i = first + 1; i <= last; ++i )
+		{
+			const float* s = src + i * stride;
+			p = prefix + (size_t)i * lanes;
+			for( int k = 0; k < lanes; ++k )
+				p[k] = vr::max( p[k - lanes], s[k] );
+		}
+		for( int i = last - 1; i >= first; --i )
+		{
+			const float* s = src + i * stride;
+			q = suffix + (size_t)i * lanes;
+			for( int k = 0; k < lanes; ++k )
+				q[k] = vr::max( q[k + lanes], s[k] );
+		}
+	}
+
+	for( int i = 0; i < count; ++i )
+	{
+		int a = vr::max( i - radius, 0 );
+		int b = vr::min( i + radius, count - 1 );
+		const float* p = prefix + (size_t)b * lanes;
+		const float* q = suffix + (size_t)a * lanes;
+		float* d = dst + i * stride;
+		if( ( a + radius ) / size != ( b + radius ) / size )
+		{
+			for( int k = 0; k < lanes; ++k )
+				d[k] = vr::max( q[k], p[k] );
+		}
+		else if( i - radius < 0 )
+		{
+			// Clipped by the first position, the block starts there
+			for( int k = 0; k < lanes; ++k )
+				d[k] = p[k];
+		}
+		else
+		{
+			// A whole block, or clipped by the last position
+			for( int k = 0; k < lanes; ++k )
+				d[k] = q[k];
+		}
+	}
+}
+
+// Same along a single line of contiguous values
+static void windowMaxLine( const float* src, float* dst, int count, int radius, float* prefix, float* suffix )
+{
+	int size = 2 * radius + 1;
+	for( int block = 0; block * size - radius < count; ++block )
+	{
+		int first = vr::max( block * size - radius, 0 );
+		int last = vr::min( block * size - radius + size, count ) - 1;
+		prefix[first] = src[first];
+		for( int i = first + 1; i <= last; ++i )
+			prefix[i] = vr::max( prefix[i - 1], src[i] );
+		suffix[last] = src[last];
+		for( int i = last - 1; i >= first; --i )
+			suffix[i] = vr::max( suffix[i + 1], src[i] );
+	}
+
+	for( int i = 0; i < count; ++i )
+	{
+		int a = vr::max( i - radius, 0 );
+		int b = vr::min( i + radius, count - 1 );
+		if( ( a + radius ) / size != ( b + radius ) / size )
+			dst[i] = vr::max( suffix[a], prefix[b] );
+		else
+			dst[i] = ( i - radius < 0 ) ? prefix[b] : suffix[a];
+	}
+}
+
+// Max of src over squares of (2 * radius + 1)^2 values, rows then columns
+static void windowMax( const float* src, int width, int height, int radius, float* dst, std::vector<float>& rows )
+{
+	rows.resize( (size_t)width * height );
+
+#pragma omp parallel for
+	for( int y = 0; y < height; ++y )
+	{
+		std::vector<float> prefix( width );
+		std::vector<float> suffix( width );
+		windowMaxLine( src + (size_t)y * width, &rows[(size_t)y * width], width, radius, &prefix[0], &suffix[0] );
+	}
+
+	int chunks = ( width + COLUMN_CHUNK - 1 ) / COLUMN_CHUNK;
+
+#pragma omp parallel for
+	for( int c = 0; c < chunks; ++c )
+	{
+		int x0 = c * COLUMN_CHUNK;
+		int lanes = vr::min( COLUMN_CHUNK, width - x0 );
+		std::vector<float> prefix( (size_t)height * lanes );
+		std::vector<float> suffix( (size_t)height * lanes );
+		windowMax1D( &rows[x0], dst + x0, height, width, lanes, radius, &prefix[0], &suffix[0] );
+	}
+}
+
+void ConeMaps::build( const float* heights, int width, int height, bool exitLayer, vr::uint8* codes )
+{
+	size_t count = (size_t)width * height;
+	if( count == 0 )
+		return;
+
+	// Exit layers are enter layers upside down. Levels are reserved up front, growing the
+	// outer vector would copy the inner ones and free their buffers.
+	int levelCount = 1;
+	for( int w = width, h = height; ( w > 1 ) || ( h > 1 ); w = ( w + 1 ) / 2, h = ( h + 1 ) / 2 )
+		++levelCount;
+	std::vector< std::vector<float> > levels;
+	levels.reserve( levelCount );
+	levels.push_back( std::vector<float>( count ) );
+	std::vector<int> levelWidths( 1, width );
+	std::vector<int> levelHeights( 1, height );
+	for( size_t i = 0; i < count; ++i )
+		levels[0][i] = exitLayer ? -heights[i] : heights[i];
+
+	// Max pyramid, each level halving the previous one (rounded up)
+	while( ( levelWidths.back() > 1 ) || ( levelHeights.back() > 1 ) )
+	{
+		int fw = levelWidths.back();
+		int fh = levelHeights.back();
+		int w = ( fw + 1 ) / 2;
+		int h = ( fh + 1 ) / 2;
+		levels.push_back( std::vector<float>( (size_t)w * h ) );
+		const float* finer = &levels[levels.size() - 2][0];
+		float* coarser = &levels.back()[0];
+
+#pragma omp parallel for
+		for( int y = 0; y < h; ++y )
+		{
+			int y1 = vr::min( 2*y + 1, fh - 1 );
+			for( int x = 0; x < w; ++x )
+			{
+				int x1 = vr::min( 2*x + 1, fw - 1 );
+				coarser[(size_t)y * w + x] = vr::max( vr::max( finer[(size_t)2*y * fw + 2*x], finer[(size_t)2*y * fw + x1] ),
+				                                      vr::max( finer[(size_t)y1 * fw + 2*x], finer[(size_t)y1 * fw + x1] ) );
+			}
+		}
+		levelWidths.push_back( w );
+		levelHeights.push_back( h );
+	}
+	const float* values = &levels[0][0];
+
+	// Steepest slope from each texel towards any other, in height per texel, as bands of
+	// distances [lo, hi] bounded by the window max of radius hi divided by lo. Texels in
+	// farther bands come from pyramid levels with cells of at most lo / 8 texels, whose windows
+	// cover every texel within hi, at the cost of counting a few up to two cells farther.
+	std::vector<float> slopes( count, 0.0f );
+	std::vector<float> window;
+	std::vector<float> rows;
+	int maxDistance = vr::max( width, height ) - 1;
+	for( int lo = 1; lo <= maxDistance; )
+	{
+		int hi = ( lo <= FIRST_BAND_TEXELS ) ? lo : ( lo * 6 + 4 ) / 5;
+		int level = 0;
+		while( ( level + 1 < (int)levels.size() ) && ( ( 2 << level ) * 8 <= lo ) )
+			++level;
+		int cellSize = 1 << level;
+		int lw = levelWidths[level];
+		int lh = levelHeights[level];
+		window.resize( (size_t)lw * lh );
+		windowMax( &levels[level][0], lw, lh, ( hi + cellSize - 1 ) / cellSize, &window[0], rows );
+
+		float invDistance = 1.0f / lo;
+
+#pragma omp parallel for
+		for( int y = 0; y < height; ++y )
+		{
+			const float* cells = &window[(size_t)( y >> level ) * lw];
+			const float* v = values + (size_t)y * width;
+			float* s = &slopes[(size_t)y * width];
+			for( int x = 0; x < width; ++x )
+			{
+				float rise = cells[x >> level] - v[x];
+				if( rise > 0.0f )
+					s[x] = vr::max( s[x], rise * invDistance );
+			}
+		}
+		lo = hi + 1;
+	}
+
+	// Decoded ratios round down, cones only get narrower
+	double side = vr::max( width, height );
+
+#pragma omp parallel for
+	for( int y = 0; y < height; ++y )
+	{
+		for( int x = 0; x < width; ++x )
+		{
+			size_t i = (size_t)y * width + x;
+			if( slopes[i] <= 0.0f )
+				codes[i] = UNBOUNDED;
+			else
+				codes[i] = (vr::uint8)floor( 255.0 / ( 1.0 + slopes[i] * side ) );
+		}
+	}
+}
+
+float ConeMaps::slope( vr::uint8 code, int width, int height )
+{
+	if( code == 0 )
+		return FLT_MAX;
+	float t = code / 255.0f;
+	return ( 1.0f - t ) / ( t * vr::max( width, height ) );
+}
+
+vr::int64 ConeMaps::countViolations( const float* heights, int width, int height, bool exitLayer, const vr::uint8* codes )
+{
+	int count = width * height;
+	vr::int64 violations = 0;
+
+#pragma omp parallel for reduction(+:violations)
+	for( int t = 0; t < count; ++t )
+	{
+		// Code 0 is a cone of no width, nothing enters it
+		if( codes[t] == 0 )
+			continue;
+		double s = slope( codes[t], width, height );
+		int tx = t % width;
+		int ty = t / width;
+		for( int q = 0; q < count; ++q )
+		{
+			if( q == t )
+				continue;
+			int distance = vr::max( abs( q % width - tx ), abs( q / width - ty ) );
+			double rise = exitLayer ? heights[t] - heights[q] : heights[q] - heights[t];
+
+			// Relative slack for float rounding of the decoded slope
+			if( rise > distance * s * ( 1.0 + 1e-6 ) )
+				++violations;
+		}
+	}
+	return violations;
+}
@@ -0,0 +1,48 @@
+#ifndef _CONEMAPS_H_
+#define _CONEMAPS_H_
+
+#include <vr/platform.h>
+
+/*!
+	Cone step maps of layers, so that ray casts take variable-length steps that never
+	pass a surface (see rayCast_FS.glsl). Each texel holds the ratio of the widest cone
+	standing on it that no other texel of the layer rises into: with d the Chebyshev
+	distance between texel centers, no texel q of an enter layer (even, solid below) is
+	above h(t) + d / ratio, and none of an exit layer (odd, solid above) is below
+	h(t) - d / ratio. Ratios are in texels per height unit.
+
+	Cones are not relaxed: a relaxed cone lets rays step into the surface and search back,
+	which is only safe for a single heightfield. Here the solid between an enter layer and
+	the next exit layer can be thinner than the step, and rays would leave through its bottom.
+
+	Codes are 8 bits, floor( 255 / ( 1 + side / ratio ) ) with side the larger layer size,
+	so that decoding never widens a cone. 255 is an unbounded cone (no texel rises above).
+	Casts decode them to slopes, the inverse of the ratio, which stay finite for those.
+
+	Built in O(N log N): slopes towards texels up to FIRST_BAND_TEXELS away are exact.
+	Farther texels are split into distance bands that grow by a fifth, each bounded by
+	the max of a window of a coarser max pyramid, so that cones are at most a third
+	narrower than exact, from that distance on.
+ */
+class ConeMaps
+{
+public:
+	// Code of a cone no texel rises into
+	static const vr::uint8 UNBOUNDED = 255;
+
+	// Distances with exact slopes, in texels
+	static const int FIRST_BAND_TEXELS = 8;
+
+	// Codes of one layer of width x height heights, as the shader samples them
+	static void build( const float* heights, int width, int height, bool exitLayer, vr::uint8* codes );
+
+	// Slope of the cone of a code for layers of width x height, in height units per texel,
+	// 0 when unbounded and FLT_MAX for code 0, as rayCast_FS.glsl decodes it
+	static float slope( vr::uint8 code, int width, int height );
+
+	// Brute force check of codes built for heights: counts texel pairs where the decoded cone
+	// of one is entered by the other, 0 when steps never pass a surface. O(N^2), for small layers.
+	static vr::int64 countViolations( const float* heights, int width, int height, bool exitLayer, const vr::uint8* codes );
+};
+
+#endif // _CONEMAPS_H_
@@ -0,0 +1,731 @@
+#include "CpuRayCaster.h"
+#include "ConeMaps.h"
+#include <vr/math.h>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <algorithm>
+
+// Cast results, as in the shader
+#define END    0
+#define EXIT   1
+#define ENTER  2
+
+// Iterations of a linear cast, and moves between gaps, before giving up
+static const int MAX_CAST_STEPS = 1024;
+static const int MAX_GAP_CHANGES = 1024;
+
+// Pyramid cells looked at before each step of a cast
+static const int MAX_SKIPPED_CELLS = 64;
+
+// Texels a texel cast walks through before giving up
+static const int MAX_CAST_TEXELS = 16384;
+
+// Height kept between rays and cones, above the rounding of 16-bit height textures
+static const float CONE_MARGIN = 1.0f / 16384.0f;
+
+static inline vr::vec3f mix( const vr::vec3f& a, const vr::vec3f& b, float factor )
+{
+	return a * ( 1.0f - factor ) + b * factor;
+}
+
+// Zero normals (layers that are not loaded) stay zero instead of turning into NaNs
+static inline void safeNormalize( vr::vec3f& v )
+{
+	if( v.length2() > 0.0f )
+		v.normalize();
+}
+
+CpuRayCaster::CpuRayCaster()
+: _layerCount( 0 ), _layerStride( 0 ), _width( 0 ), _height( 0 ), _computeNormals( false ), _skipEmptySpace( true ), _texelTraversal( false ), _texelSize( 0.0f ), _tileSize( 32 ), _hasFrame( false ),
+  _tanHalfFovy( 0.0 )
+{
+	setLayers( NULL );
+	setCamera( vr::vec3d( 0.5, -1.0, 2.0 ), vr::vec3d( 0.5, 0.5, 0.5 ), vr::vec3d( 0, 0, 1 ) );
+}
+
+void CpuRayCaster::setLayers( const LayerSet* layers )
+{
+	_layerCount = ( layers != NULL ) ? layers->layerCount() : 0;
+	_layerStride = ( _layerCount + 1 ) & ~1;
+	_width = ( layers != NULL ) ? layers->width() : 0;
+	_height = ( layers != NULL ) ? layers->height() : 0;
+	_texelSize = ( _layerCount > 0 ) ? 1.0f / vr::min( _width, _height ) : 0.0f;
+
+	_normals.resize( _layerCount );
+	_heights.assign( (size_t)_width * _height * _layerStride, 0.0f );
+	_coneSlopes.clear();
+	_bounds.resize( _width, _height, _layerCount );
+	for( int i = 0; i < _layerCount; ++i )
+	{
+		_normals[i] = layers->normals( i );
+		const float* heights = layers->heights( i );
+		float* dst = _heights.empty() ? NULL : &_heights[i];
+		for( int t = 0; t < _width * _height; ++t, dst += _layerStride )
+			*dst = heights[t];
+		_bounds.build( i, heights );
+	}
+}
+
+void CpuRayCaster::setFrame( const LayerFrame* frame )
+{
+	_hasFrame = ( frame != NULL );
+	if( _hasFrame )
+		_frame = *frame;
+}
+
+void CpuRayCaster::setComputeNormals( bool enabled )
+{
+	_computeNormals = enabled;
+}
+
+void CpuRayCaster::setSkipEmptySpace( bool enabled )
+{
+	_skipEmptySpace = enabled;
+}
+
+void CpuRayCaster::setTexelTraversal( bool enabled )
+{
+	_texelTraversal = enabled;
+}
+
+void CpuRayCaster::setConeMap( int layer, const vr::uint8* codes )
+{
+	if( ( layer < 0 ) || ( layer >= _layerCount ) )
+		return;
+
+	// Layers without a map stop every skip, the empty one past an odd count is flat
+	if( _coneSlopes.empty() )
+	{
+		_coneSlopes.assign( (size_t)_width * _height * _layerStride, FLT_MAX );
+		if( _layerStride > _layerCount )
+		{
+			for( size_t t = 0; t < (size_t)_width * _height; ++t )
+				_coneSlopes[t * _layerStride + _layerCount] = 0.0f;
+		}
+	}
+
+	float slopes[256];
+	for( int code = 0; code < 256; ++code )
+		slopes[code] = ConeMaps::slope( (vr::uint8)code, _width, _height );
+	float* dst = &_coneSlopes[layer];
+	for( int t = 0; t < _width * _height; ++t, dst += _layerStride )
+		*dst = slopes[codes[t]];
+}
+
+void CpuRayCaster::setCamera( const vr::vec3d& eye, const vr::vec3d& center, const vr::vec3d& up, double fovy )
+{
+	// Same axes as gluLookAt
+	_eye = eye;
+	_forward = center - eye;
+	_forward.normalize();
+	_right = _forward.cross( up );
+	_right.normalize();
+	_up = _right.cross( _forward );
+	_tanHalfFovy = tan( fovy * 0.5 * 3.14159265358979 / 180.0 );
+}
+
+void CpuRayCaster::fitCamera( const vr::vec3d& direction, const vr::vec3d& up, double fovy )
+{
+	// Sphere around the cube, in the space of the camera
+	vr::vec3d center( 0.5, 0.5, 0.5 );
+	double radius = sqrt( 3.0 ) * 0.5;
+	if( _hasFrame )
+	{
+		center = _frame.center;
+		vr::vec3d extent( _frame.halfWidth * 2.0, _frame.halfHeight * 2.0, _frame.zFar - _frame.zNear );
+		radius = extent.length() * 0.5;
+	}
+
+	vr::vec3d dir = direction;
+	dir.normalize();
+	double distance = radius / sin( fovy * 0.5 * 3.14159265358979 / 180.0 );
+	setCamera( center + dir * distance, center, up, fovy );
+}
+
+void CpuRayCaster::setTileSize( int size )
+{
+	_tileSize = vr::max( size, 1 );
+}
+
+int CpuRayCaster::render( int width, int height, std::vector<unsigned char>& rgba, std::vector<float>* depth ) const
+{
+	rgba.resize( (size_t)width * height * 4 );
+	if( depth != NULL )
+		depth->resize( (size_t)width * height );
+	if( ( width <= 0 ) || ( height <= 0 ) )
+		return 0;
+
+	int tilesX = ( width + _tileSize - 1 ) / _tileSize;
+	int tilesY = ( height + _tileSize - 1 ) / _tileSize;
+	int tileCount = tilesX * tilesY;
+	int hits = 0;
+
+	// Rays cost very different amounts, tiles are handed out as threads finish
+#pragma omp parallel for schedule(dynamic) reduction(+:hits)
+	for( int t = 0; t < tileCount; ++t )
+	{
+		int x0 = ( t % tilesX ) * _tileSize;
+		int y0 = ( t / tilesX ) * _tileSize;
+		int tileHits = 0;
+		renderTile( x0, y0, vr::min( x0 + _tileSize, width ), vr::min( y0 + _tileSize, height ), width, height,
+			        &rgba[0], ( depth != NULL ) ? &(*depth)[0] : NULL, tileHits );
+		hits += tileHits;
+	}
+	return hits;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void CpuRayCaster::renderTile( int x0, int y0, int x1, int y1, int width, int height,
+							   unsigned char* rgba, float* depth, int& hits ) const
+{
+	for( int y = y0; y < y1; ++y )
+	{
+		for( int x = x0; x < x1; ++x )
+		{
+			size_t idx = (size_t)y * width + x;
+			unsigned char* pixel = rgba + idx*4;
+
+			Ray ray;
+			vr::vec4f current;
+			vr::vec3f normal;
+			if( !setupRay( x + 0.5, y + 0.5, width, height, ray ) || !castRay( ray, current, normal ) )
+			{
+				// Canvas clears to white
+				pixel[0] = pixel[1] = pixel[2] = 255;
+				pixel[3] = 0;
+				if( depth != NULL )
+					depth[idx] = FLT_MAX;
+				continue;
+			}
+
+			safeNormalize( normal );
+			float gray = vr::clampTo( -ray.viewDir.dot( normal ) * 0.8f + 0.2f, 0.0f, 1.0f );
+			pixel[0] = pixel[1] = pixel[2] = (unsigned char)( gray * 255.0f + 0.5f );
+			pixel[3] = 255;
+			++hits;
+
+			if( depth == NULL )
+				continue;
+
+			// Back to the camera through the ray parameter, along the axis the ray moves most
+			int axis = 0;
+			for( int i = 1; i < 3; ++i )
+			{
+				if( vr::abs( ray.dir[i] ) > vr::abs( ray.dir[axis] ) )
+					axis = i;
+			}
+			depth[idx] = (float)( ( current[axis] - ray.eye[axis] ) / ray.dir[axis] );
+		}
+	}
+}
+
+bool CpuRayCaster::setupRay( double px, double py, int width, int height, Ray& ray ) const
+{
+	// Through the pixel center, one unit along the view axis
+	vr::vec3d d = _forward + _right * ( ( 2.0 * px / width - 1.0 ) * _tanHalfFovy * width / height )
+	                       + _up * ( ( 2.0 * py / height - 1.0 ) * _tanHalfFovy );
+	vr::vec3d eye = _eye;
+
+	// Cube x and y are texture coordinates and z is the height (1 - depth)
+	if( _hasFrame )
+	{
+		vr::vec3d t = _frame.toTexture( _eye );
+		vr::vec3d u = _frame.toTexture( _eye + d );
+		eye.set( t.x, t.y, 1.0 - t.z );
+		d.set( u.x - t.x, u.y - t.y, t.z - u.z );
+	}
+
+	// Slabs of the unit cube. The shader starts on the faces the camera sees,
+	// from inside the cube rays start at the eye.
+	double tNear = 0.0;
+	double tFar = DBL_MAX;
+	for( int i = 0; i < 3; ++i )
+	{
+		if( d[i] == 0.0 )
+		{
+			if( ( eye[i] < 0.0 ) || ( eye[i] > 1.0 ) )
+				return false;
+			continue;
+		}
+		double t0 = ( 0.0 - eye[i] ) / d[i];
+		double t1 = ( 1.0 - eye[i] ) / d[i];
+		if( t0 > t1 )
+			std::swap( t0, t1 );
+		tNear = vr::max( tNear, t0 );
+		tFar = vr::min( tFar, t1 );
+	}
+	if( tNear >= tFar )
+		return false;
+
+	ray.eye = eye;
+	ray.dir = d;
+	// Rounding can leave the origin a hair outside the faces, the shader interpolates it between cube corners
+	vr::vec3d origin = eye + d * tNear;
+	for( int i = 0; i < 3; ++i )
+		origin[i] = vr::clampTo( origin[i], 0.0, 1.0 );
+	d.normalize();
+	ray.origin.set( (float)origin.x, (float)origin.y, (float)origin.z );
+	ray.viewDir.set( (float)d.x, (float)d.y, (float)d.z );
+	return true;
+}
+
+bool CpuRayCaster::castRay( const Ray& ray, vr::vec4f& current, vr::vec3f& normal ) const
+{
+	if( _layerCount == 0 )
+		return false;
+
+	// Current is at ray origin (on one of the box faces)
+	vr::vec4f step( ray.viewDir.x * 0.004f, ray.viewDir.y * 0.004f, ray.viewDir.z * 0.004f, 0.0f );
+	current.set( ray.origin.x, ray.origin.y, ray.origin.z, 0.0f );
+
+	// Compute limit to quickly terminate linear casting when ray exits box
+	computeBoxExitInW( current, step );
+
+	// Along z, layers alternate between entering (even) and exiting (odd) the model, from the top.
+	// Gap g is the empty space between the pair of layers 2g-2, 2g-1 above and 2g, 2g+1 below,
+	// rays start in gap 0 above every layer. Casts only test the layers around the gap the ray is in.
+	int gap = 0;
+	for( int i = 0; i < MAX_GAP_CHANGES; ++i )
+	{
+		int enterLayer = 2*gap;
+		int exitLayer = 2*gap - 1;
+		int condition;
+		if( _texelTraversal )
+			condition = texelCast( current, step, ( enterLayer < _layerCount ) ? enterLayer : -1, exitLayer );
+		else if( gap == 0 )
+			condition = inCastLinear( current, step, enterLayer );
+		else if( enterLayer < _layerCount )
+			condition = inOutCastLinear( current, step, enterLayer, exitLayer );
+		else
+			condition = outCastLinear( current, step, exitLayer ); // nothing below
+
+		if( condition == END )
+			return false;
+
+		int t = texel( current.x, current.y );
+		if( condition == ENTER )
+		{
+			// Below the exit layer of the pair as well, go down a gap (the 1.1 fixes the bunny head in the shader)
+			float heightBelow = layerHeight( enterLayer + 1, t );
+			float limit = ( gap > 0 ) ? heightBelow * 1.1f : heightBelow;
+			if( current.z <= limit )
+			{
+				++gap;
+				continue;
+			}
+
+			// Draw enter layer
+			vr::vec3f enterNormal = layerNormal( enterLayer, current, 1.0f );
+			float heightAbove = ( gap > 0 ) ? layerHeight( exitLayer, t ) : heightBelow;
+			if( ( gap > 0 ) && ( vr::abs( current.z - heightAbove ) < vr::abs( current.z - heightBelow ) ) )
+				normal = computeHalfInterpolation( current, enterNormal, exitLayer, heightAbove, -1.0f );
+			else
+				normal = computeHalfInterpolation( current, enterNormal, enterLayer + 1, heightBelow, -1.0f );
+			return true;
+		}
+
+		// Above the enter layer of the pair as well, go up a gap
+		float heightAbove = layerHeight( exitLayer - 1, t );
+		if( current.z > heightAbove )
+		{
+			--gap;
+			continue;
+		}
+
+		// Draw exit layer
+		if( enterLayer >= _layerCount )
+		{
+			normal = computeHalfInterpolation( current, layerNormal( exitLayer, current, -1.0f ), exitLayer - 1, heightAbove, 1.0f );
+			return true;
+		}
+
+		// Back inside the exit layer for the right normal
+		current -= step * 0.1f;
+		float diff = layerHeight( exitLayer, texel( current.x, current.y ) ) - current.z;
+		if( vr::abs( diff ) > 0.2f )
+			current -= step * 0.1f;
+
+		t = texel( current.x, current.y );
+		heightAbove = layerHeight( exitLayer - 1, t );
+		float heightBelow = layerHeight( enterLayer, t );
+		vr::vec3f exitNormal = layerNormal( exitLayer, current, -1.0f );
+		if( vr::abs( current.z - heightAbove ) < vr::abs( current.z - heightBelow ) )
+			normal = computeHalfInterpolation( current, exitNormal, exitLayer - 1, heightAbove, 1.0f );
+		else
+			normal = computeHalfInterpolation( current, exitNormal, enterLayer, heightBelow, 1.0f );
+		return true;
+	}
+	return false;
+}
+
+int CpuRayCaster::texel( float u, float v ) const
+{
+	int x = vr::clampTo( (int)floorf( u * _width ), 0, _width - 1 );
+	int y = vr::clampTo( (int)floorf( v * _height ), 0, _height - 1 );
+	return y * _width + x;
+}
+
+float CpuRayCaster::layerHeight( int layer, int texel ) const
+{
+	if( layer >= _layerStride )
+		return 0.0f;
+	return _heights[(size_t)texel * _layerStride + layer];
+}
+
+int CpuRayCaster::inCastLinear( vr::vec4f& current, vr::vec4f step, int layer ) const
+{
+	bool detailSearch = false;
+	int level = _skipEmptySpace ? _bounds.levelCount() : 0;
+	for( int i = 0; i < MAX_CAST_STEPS; ++i )
+	{
+		if( !detailSearch )
+		{
+			coneSkip( current, step, layer, -1 );
+			skipEmptySpace( current, step, layer, -1, level );
+		}
+		current += step;
+		if( current.z <= layerHeight( layer, texel( current.x, current.y ) ) )
+		{
+			if( detailSearch )
+				return ENTER;
+			detailSearch = true;
+			current -= step;
+			step *= 0.1f;
+			continue;
+		}
+
+		if( current.w <= 0.0f )
+			return END;
+	}
+	return END;
+}
+
+int CpuRayCaster::outCastLinear( vr::vec4f& current, vr::vec4f step, int layer ) const
+{
+	bool detailSearch = false;
+	int level = _skipEmptySpace ? _bounds.levelCount() : 0;
+	for( int i = 0; i < MAX_CAST_STEPS; ++i )
+	{
+		if( !detailSearch )
+		{
+			coneSkip( current, step, -1, layer );
+			skipEmptySpace( current, step, -1, layer, level );
+		}
+		current += step;
+		if( current.z > layerHeight( layer, texel( current.x, current.y ) ) )
+		{
+			if( detailSearch )
+				return EXIT;
+			detailSearch = true;
+			current -= step;
+			step *= 0.1f;
+			continue;
+		}
+
+		if( current.w <= 0.0f )
+			return END;
+	}
+	return END;
+}
+
+int CpuRayCaster::inOutCastLinear( vr::vec4f& current, vr::vec4f step, int layerIn, int layerOut ) const
+{
+	bool detailSearch = false;
+	int level = _skipEmptySpace ? _bounds.levelCount() : 0;
+	for( int i = 0; i < MAX_CAST_STEPS; ++i )
+	{
+		if( !detailSearch )
+		{
+			coneSkip( current, step, layerIn, layerOut );
+			skipEmptySpace( current, step, layerIn, layerOut, level );
+		}
+		current += step;
+		int t = texel( current.x, current.y );
+		if( current.z <= layerHeight( layerIn, t ) )
+		{
+			if( detailSearch )
+				return ENTER;
+			detailSearch = true;
+			current -= step;
+			step *= 0.1f;
+			continue;
+		}
+
+		if( current.z > layerHeight( layerOut, t ) )
+		{
+			if( detailSearch )
+				return EXIT;
+			detailSearch = true;
+			current -= step;
+			step *= 0.1f;
+		}
+
+		if( current.w <= 0.0f )
+			return END;
+	}
+	return END;
+}
+
+int CpuRayCaster::texelCast( vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut ) const
+{
+	// Ray in texels, as origin + s * dir with s in steps from current
+	float layerSize[2] = { (float)_width, (float)_height };
+	float origin[2] = { current.x * _width, current.y * _height };
+	float dir[2] = { step.x * _width, step.y * _height };
+	// Up to just before the box exit, where rays along the bottom face would hit empty texels
+	float end = -current.w / step.w - 0.001f;
+	int cell[2];
+	for( int axis = 0; axis < 2; ++axis )
+		cell[axis] = (int)floorf( vr::clampTo( origin[axis], 0.0f, layerSize[axis] - 1.0f ) );
+
+	float start = 0.0f;
+	for( int i = 0; i < MAX_CAST_TEXELS; ++i )
+	{
+		// Where the ray leaves the texel, never through the layer sides as texels are clamped
+		float side[2];
+		for( int axis = 0; axis < 2; ++axis )
+		{
+			side[axis] = FLT_MAX;
+			if( ( dir[axis] > 0.0f ) && ( cell[axis] + 1.0f < layerSize[axis] ) )
+				side[axis] = ( cell[axis] + 1.0f - origin[axis] ) / dir[axis];
+			else if( ( dir[axis] < 0.0f ) && ( cell[axis] > 0 ) )
+				side[axis] = ( cell[axis] - origin[axis] ) / dir[axis];
+		}
+		float stop = vr::min( end, vr::min( side[0], side[1] ) );
+
+		// Past the texel when cones clear the ray beyond it, the walk goes on from where they stop
+		if( !_coneSlopes.empty() )
+		{
+			float ahead = coneSteps( current + step * start, step, layerIn, layerOut );
+			if( ahead > stop - start )
+			{
+				start += ahead;
+				if( start >= end )
+					return END;
+				for( int axis = 0; axis < 2; ++axis )
+					cell[axis] = (int)floorf( vr::clampTo( origin[axis] + dir[axis] * start, 0.0f, layerSize[axis] - 1.0f ) );
+				continue;
+			}
+		}
+
+		// Layers are flat within the texel, the ray is below or above them from the texel side or from the crossing
+		int t = cell[1] * _width + cell[0];
+		float startZ = current.z + start * step.z;
+		float hitIn = FLT_MAX;
+		float hitOut = FLT_MAX;
+		if( layerIn >= 0 )
+		{
+			float height = layerHeight( layerIn, t );
+			if( startZ < height )
+				hitIn = start;
+			else if( step.z < 0.0f )
+				hitIn = ( height - current.z ) / step.z;
+		}
+		if( layerOut >= 0 )
+		{
+			float height = layerHeight( layerOut, t );
+			if( startZ > height )
+				hitOut = start;
+			else if( step.z > 0.0f )
+				hitOut = ( height - current.z ) / step.z;
+		}
+
+		float hit = vr::min( hitIn, hitOut );
+		if( hit <= stop )
+		{
+			// A hundredth of a step further, without leaving the texel
+			current += step * vr::min( hit + 0.01f, ( hit + stop ) * 0.5f );
+			return ( hitIn <= hitOut ) ? ENTER : EXIT;
+		}
+		if( stop >= end )
+			return END;
+
+		if( side[0] < side[1] )
+			cell[0] += ( dir[0] > 0.0f ) ? 1 : -1;
+		else
+			cell[1] += ( dir[1] > 0.0f ) ? 1 : -1;
+		start = stop;
+	}
+	return END;
+}
+
+void CpuRayCaster::skipEmptySpace( vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut, int& level ) const
+{
+	// Samples within a 64th of a texel of a cell side may be rounded to the next cell
+	const float margin = 1.0f / 64.0f;
+	float layerSize[2] = { (float)_width, (float)_height };
+	float stepXY[2] = { step.x, step.y };
+	for( int i = 0; i < MAX_SKIPPED_CELLS; ++i )
+	{
+		vr::vec4f next = current + step;
+		if( ( level == 0 ) || ( next.w <= 0.0f ) )
+			return;
+
+		// Cell of the next sample, unbounded past the layer sides as texels are clamped,
+		// and the samples in it before the box exit
+		float cellSize = (float)( 1 << level );
+		float last = -next.w / step.w - 0.001f;
+		float cell[2];
+		bool inside = true;
+		for( int axis = 0; axis < 2; ++axis )
+		{
+			float texel = ( ( axis == 0 ) ? next.x : next.y ) * layerSize[axis];
+			cell[axis] = floorf( vr::clampTo( texel, 0.0f, layerSize[axis] - 1.0f ) / cellSize );
+			float low = cell[axis] * cellSize + margin;
+			float high = low + cellSize - 2.0f * margin;
+			if( cell[axis] == 0.0f )
+				low = -1e9f;
+			if( ( cell[axis] + 1.0f ) * cellSize >= layerSize[axis] )
+				high = 1e9f;
+
+			inside = inside && ( texel >= low ) && ( texel < high );
+			float stepTexels = stepXY[axis] * layerSize[axis];
+			if( stepTexels > 0.0f )
+				last = vr::min( last, ( high - texel ) / stepTexels );
+			else if( stepTexels < 0.0f )
+				last = vr::min( last, ( low - texel ) / stepTexels );
+		}
+
+		inside = inside && ( last >= 0.0f );
+		float count = floorf( last ) + 1.0f;
+		float lastZ = next.z + ( count - 1.0f ) * step.z;
+		float minZ = vr::min( next.z, lastZ );
+		float maxZ = vr::max( next.z, lastZ );
+		float minHeight;
+		float maxHeight;
+		if( inside && ( layerIn >= 0 ) )
+		{
+			cellBounds( layerIn, level, (int)cell[0], (int)cell[1], minHeight, maxHeight );
+			inside = ( minZ > maxHeight );
+		}
+		if( inside && ( layerOut >= 0 ) )
+		{
+			cellBounds( layerOut, level, (int)cell[0], (int)cell[1], minHeight, maxHeight );
+			inside = ( maxZ <= minHeight );
+		}
+
+		if( inside )
+		{
+			current += step * count;
+			level = vr::min( level + 1, _bounds.levelCount() );
+		}
+		else if( level > 1 )
+			--level;
+		else
+			return;
+	}
+}
+
+void CpuRayCaster::coneSkip( vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut ) const
+{
+	if( _coneSlopes.empty() )
+		return;
+
+	// Whole steps with every sample inside the cones and before the box exit
+	float steps = ceilf( vr::min( coneSteps( current, step, layerIn, layerOut ), -current.w / step.w - 0.001f ) ) - 1.0f;
+	if( steps > 0.0f )
+		current += step * steps;
+}
+
+float CpuRayCaster::coneSteps( const vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut ) const
+{
+	// Texels crossed per step along the farthest axis. Texel centers are at most one texel farther
+	// apart than the ray moves, so the ray stays clear of layerIn (and below layerOut) while its
+	// height above the cone of the current texel, less the slope over one texel, is not used up.
+	float texels = vr::max( vr::abs( step.x ) * _width, vr::abs( step.y ) * _height );
+	int t = texel( current.x, current.y );
+	float steps = FLT_MAX;
+	for( int k = 0; k < 2; ++k )
+	{
+		int layer = ( k == 0 ) ? layerIn : layerOut;
+		if( layer < 0 )
+			continue;
+
+		float slope = _coneSlopes[(size_t)t * _layerStride + layer];
+		float clearance = ( k == 0 ) ? current.z - layerHeight( layer, t ) : layerHeight( layer, t ) - current.z;
+		float descent = ( k == 0 ) ? -step.z : step.z;
+		float rise = clearance - CONE_MARGIN - slope;
+		if( rise <= 0.0f )
+			return 0.0f;
+		float speed = descent + slope * texels;
+		if( speed > 0.0f )
+			steps = vr::min( steps, rise / speed );
+	}
+	return steps;
+}
+
+void CpuRayCaster::cellBounds( int layer, int level, int cellX, int cellY, float& minHeight, float& maxHeight ) const
+{
+	if( layer >= _layerCount )
+	{
+		minHeight = maxHeight = 0.0f;
+		return;
+	}
+	const float* cell = _bounds.cell( layer, level, cellX, cellY );
+	minHeight = cell[0];
+	maxHeight = cell[1];
+}
+
+vr::vec3f CpuRayCaster::computeNormal( float neighborDist, const vr::vec4f& current, int layer ) const
+{
+	// Central differences along x and y, with the height difference doubled as in the shader
+	vr::vec3f dx( 2.0f * neighborDist, 0.0f, layerHeight( layer, texel( current.x + neighborDist, current.y ) ) -
+		                                     layerHeight( layer, texel( current.x - neighborDist, current.y ) ) );
+	vr::vec3f dy( 0.0f, 2.0f * neighborDist, layerHeight( layer, texel( current.x, current.y + neighborDist ) ) -
+		                                     layerHeight( layer, texel( current.x, current.y - neighborDist ) ) );
+	vr::vec3f n = dx.cross( dy );
+	n.z *= 2.0f;
+	safeNormalize( n );
+	return n;
+}
+
+vr::vec3f CpuRayCaster::layerNormal( int layer, const vr::vec4f& current, float facing ) const
+{
+	if( _computeNormals )
+		return computeNormal( _texelSize, current, layer ) * facing;
+	if( layer >= _layerCount )
+		return vr::vec3f( 0, 0, 0 );
+	return vr::vec3f( _normals[layer] + texel( current.x, current.y ) * 3 );
+}
+
+vr::vec3f CpuRayCaster::computeHalfInterpolation( const vr::vec4f& current, const vr::vec3f& currNormal, int otherLayer,
+												  float otherHeight, float otherFacing ) const
+{
+	// Close to the other layer, its normal is blended in up to half
+	const float threshold = 0.075f;
+	float diff = vr::abs( current.z - otherHeight );
+	if( diff > threshold )
+		return currNormal;
+
+	float factor = ( diff / threshold ) * 0.5f + 0.5f;
+	return mix( layerNormal( otherLayer, current, otherFacing ), currNormal, factor );
+}
+
+void CpuRayCaster::computeBoxExitInW( vr::vec4f& current, vr::vec4f& step )
+{
+	// Steps left to each exit face, the ray leaves through the nearest
+	float exit[3];
+	float dist[3];
+	for( int i = 0; i < 3; ++i )
+	{
+		float dir01 = ( step[i] > 0.0f ) ? 1.0f : ( ( step[i] < 0.0f ) ? 0.0f : 0.5f );
+		exit[i] = dir01;
+		dist[i] = ( dir01 - current[i] ) / step[i];
+	}
+
+	int axis;
+	if( ( dist[0] < dist[1] ) && ( dist[0] < dist[2] ) )
+		axis = 0;
+	else if( dist[1] < dist[2] )
+		axis = 1;
+	else
+		axis = 2;
+
+	// Distance to exit in w is positive and the step negative, so that it eventually reaches zero
+	step.w = -vr::abs( step[axis] );
+	current.w = vr::abs( exit[axis] - current[axis] );
+}
@@ -0,0 +1,132 @@
+#ifndef _CPURAYCASTER_H_
+#define _CPURAYCASTER_H_
+
+#include <vector>
+#include <vr/vec3.h>
+#include <vr/vec4.h>
+#include "LayerFrame.h"
+#include "LayerSet.h"
+#include "HeightBounds.h"
+
+/*!
+	CPU port of rayCast_FS.glsl, renders layers without OpenGL (thumbnails, nodes without
+	a GPU) and gives a reference to compare traversal changes against.
+	Rays start where they enter the layer cube and go through the same linear casts,
+	refinements and normal blending as the shader, with nearest sampling and clamping
+	at the edges as the layer textures, or through the texel walk of texelCast. Any number of layers is cast.
+	Heights are kept in one flat array with the layers of a texel next to each other,
+	so that the two layers tested at each step share a cache line. Casts skip the cells of the
+	min/max height pyramids a ray cannot hit, as the shader does with u_heightBounds, and
+	take the safe steps of cone maps when they are given, as with u_cones.
+	The image is split into tiles rendered in parallel.
+ */
+class CpuRayCaster
+{
+public:
+	CpuRayCaster();
+
+	// Heights are copied and their pyramids built, normals are read from layers, which must outlive the caster
+	void setLayers( const LayerSet* layers );
+
+	// Places the layer cube in world space, as Canvas does. The camera is then given in world
+	// space. Without a frame (or with NULL), the camera is given in cube space.
+	void setFrame( const LayerFrame* frame );
+
+	// Derive normals from heights, one texel apart, instead of reading normal maps (as u_computeNormals)
+	void setComputeNormals( bool enabled );
+
+	// Skip empty space with the height pyramids, on by default. Texel casts hit the same texels
+	// either way. Linear casts jump several steps at once, and the rounding of that sum differs
+	// from that of single steps, so samples move slightly and a few pixels can change.
+	void setSkipEmptySpace( bool enabled );
+
+	// Walk the layers texel by texel with exact intersections instead of linear casts (as u_texelTraversal)
+	void setTexelTraversal( bool enabled );
+
+	// Cone map of a layer (width*height codes, see ConeMaps), after setLayers, which drops them.
+	// Casts step over the space cones clear, layers without a map clear none.
+	// Texel casts hit the same texels either way, linear casts resume sampling where a cone step
+	// ends, so silhouettes can move by a sample.
+	void setConeMap( int layer, const vr::uint8* codes );
+
+	// Perspective camera, fovy in degrees as gluPerspective
+	void setCamera( const vr::vec3d& eye, const vr::vec3d& center, const vr::vec3d& up, double fovy = 60.0 );
+
+	// Looks at the center of the cube from direction (in the same space as the camera),
+	// far enough for the whole cube to fit
+	void fitCamera( const vr::vec3d& direction, const vr::vec3d& up, double fovy = 60.0 );
+
+	void setTileSize( int size );
+
+	// Renders width x height RGBA pixels, rows from bottom to top as glReadPixels.
+	// Rays that miss are white and transparent. With depth, the distance of each hit along
+	// the view axis is written as well (FLT_MAX where rays miss).
+	// Returns the number of rays that hit.
+	int render( int width, int height, std::vector<unsigned char>& rgba, std::vector<float>* depth = NULL ) const;
+
+private:
+	// Ray in cube space, as set up by rayCast_VS.glsl
+	struct Ray
+	{
+		vr::vec3f origin;  // on the cube faces
+		vr::vec3f viewDir; // normalized
+		vr::vec3d eye;
+		vr::vec3d dir;     // one unit along the view axis of the camera
+	};
+
+	void renderTile( int x0, int y0, int x1, int y1, int width, int height,
+		             unsigned char* rgba, float* depth, int& hits ) const;
+
+	// Cube space ray through pixel center (px, py). False when it misses the cube.
+	bool setupRay( double px, double py, int width, int height, Ray& ray ) const;
+
+	// Main of the shader: false where it discards, otherwise the hit and its normal
+	bool castRay( const Ray& ray, vr::vec4f& current, vr::vec3f& normal ) const;
+
+	// Nearest texel of (u, v), clamped to the edges
+	int texel( float u, float v ) const;
+
+	// Functions of the shader with the same names. Layers past the last one are empty (height 0).
+	float layerHeight( int layer, int texel ) const;
+	int inCastLinear( vr::vec4f& current, vr::vec4f step, int layer ) const;
+	int outCastLinear( vr::vec4f& current, vr::vec4f step, int layer ) const;
+	void skipEmptySpace( vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut, int& level ) const;
+	void cellBounds( int layer, int level, int cellX, int cellY, float& minHeight, float& maxHeight ) const;
+	void coneSkip( vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut ) const;
+	float coneSteps( const vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut ) const;
+	int inOutCastLinear( vr::vec4f& current, vr::vec4f step, int layerIn, int layerOut ) const;
+	int texelCast( vr::vec4f& current, const vr::vec4f& step, int layerIn, int layerOut ) const;
+	vr::vec3f computeNormal( float neighborDist, const vr::vec4f& current, int layer ) const;
+	vr::vec3f layerNormal( int layer, const vr::vec4f& current, float facing ) const;
+	vr::vec3f computeHalfInterpolation( const vr::vec4f& current, const vr::vec3f& currNormal, int otherLayer,
+		                                float otherHeight, float otherFacing ) const;
+
+	static void computeBoxExitInW( vr::vec4f& current, vr::vec4f& step );
+
+private:
+	std::vector<float> _heights;         // per texel, _layerStride layers
+	std::vector<const float*> _normals; // per layer
+	int _layerCount;
+	int _layerStride;                   // layer count rounded up to pairs, the last one empty when odd
+	int _width;
+	int _height;
+	HeightBounds _bounds;
+	std::vector<float> _coneSlopes;     // per texel, _layerStride layers, empty without cone maps
+	bool _computeNormals;
+	bool _skipEmptySpace;
+	bool _texelTraversal;
+	float _texelSize;
+	int _tileSize;
+
+	bool _hasFrame;
+	LayerFrame _frame;
+
+	// Camera, in world space with a frame
+	vr::vec3d _eye;
+	vr::vec3d _forward;
+	vr::vec3d _right;
+	vr::vec3d _up;
+	double _tanHalfFovy;
+};
+
+#endif // _CPURAYCASTER_H_
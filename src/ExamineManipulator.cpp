@@ -9,6 +9,11 @@
 #include <GL/gl.h>
 #include <GL/glu.h>
 
+// Motions older than this are over, the camera is not predicted to move
+static const double MOTION_TIMEOUT = 0.1;
+// Largest predicted rotation, in radians
+static const float MAX_PREDICTED_ROTATION = 1.0f;
+
 ExamineManipulator::ExamineManipulator()
 {
 	_objectCenter.set( 0, 0, 0 );
@@ -31,10 +36,38 @@ const mat4f & ExamineManipulator::getInverseTransform() const
 	return _invLookAt;
 }
 
+void ExamineManipulator::getPredictedTransform( float seconds, mat4f& transform ) const
+{
+	if( ( _motionInterval <= 0.0 ) || ( _motionTimer.elapsed() > MOTION_TIMEOUT ) )
+	{
+		transform = _lookAt;
+		return;
+	}
+
+	// Same motion per interval: rotation delta to the power of t, on the right as in Arcball
+	float t = (float)( seconds / _motionInterval );
+	quatf orientation = _arcball.getOrientation();
+	if( !_rotationDelta.isZeroRotation() )
+	{
+		float radians;
+		vec3f axis;
+		_rotationDelta.getRotation( radians, axis );
+		if( radians > vr::Math<float>::PI )
+			radians -= vr::Math<float>::TWO_PI;
+		radians = vr::clampTo( radians * t, -MAX_PREDICTED_ROTATION, MAX_PREDICTED_ROTATION );
+		orientation = orientation * quatf( radians, axis );
+	}
+
+	buildTransform( orientation, _translation + _translationDelta * t, transform );
+}
+
 void ExamineManipulator::reset()
 {
 	_arcball.setOrientation( quatf( 0, 0, 0, 1 ) );
 	_translation.set( 0, 0, ( _objectDiameter * -0.5 ) / atan( vr::toRadians( 30.0f /* half fovy */ ) ) );
+	_motionInterval = 0.0;
+	_rotationDelta.makeZeroRotation();
+	_translationDelta.set( 0, 0, 0 );
 	updateTransform();
 }
 
@@ -70,6 +103,8 @@ bool ExamineManipulator::mouseMoveEvent( QMouseEvent* e )
 	}
 
 	QPoint pos( e->pos() );
+	quatf lastOrientation = _arcball.getOrientation();
+	vec3f lastTranslation = _translation;
 	vec3f dMouse( pos.x() - _lastMousePos.x(), -( pos.y() - _lastMousePos.y() ), 0 );
 
 	// rotate
@@ -92,6 +127,11 @@ bool ExamineManipulator::mouseMoveEvent( QMouseEvent* e )
 
 	_lastMousePos = pos;
 
+	// Velocity for getPredictedTransform
+	_rotationDelta = lastOrientation.inverse() * _arcball.getOrientation();
+	_translationDelta = _translation - lastTranslation;
+	_motionInterval = _motionTimer.restart();
+
 	updateTransform();
 
 	return true;
@@ -115,16 +155,21 @@ bool ExamineManipulator::keyPressEvent( QKeyEvent* e )
 
 void ExamineManipulator::updateTransform()
 {
-	mat4f translation;
-	translation.makeTranslation( -_objectCenter );
+	buildTransform( _arcball.getOrientation(), _translation, _lookAt );
 
-	_lookAt.set( _arcball.getOrientation() );
-	_lookAt.product( translation, _lookAt );
+	_invLookAt = _lookAt;
+	_invLookAt.invert();
+}
 
-	translation.makeTranslation( _translation );
+void ExamineManipulator::buildTransform( const quatf& orientation, const vec3f& translation, mat4f& transform ) const
+{
+	mat4f t;
+	t.makeTranslation( -_objectCenter );
 
-	_lookAt.product( _lookAt, translation );
+	transform.set( orientation );
+	transform.product( t, transform );
 
-	_invLookAt = _lookAt;
-	_invLookAt.invert();
+	t.makeTranslation( translation );
+
+	transform.product( transform, t );
 }
@@ -3,6 +3,7 @@
 
 #include "ArcBall.h"
 #include "IManipulator.h"
+#include <vr/timer.h>
 
 /*!
 	3D Manipulator based on an ArcBall.
@@ -28,6 +29,10 @@ public:
 	virtual const mat4f& getTransform() const;
 	virtual const mat4f& getInverseTransform() const;
 
+	//! Transform expected in the given time, extrapolated from the last mouse motion.
+	//! The current transform once the mouse stops.
+	void getPredictedTransform( float seconds, mat4f& transform ) const;
+
 	virtual void reset();
 
 	virtual void resizeEvent( int width, int height );
@@ -39,6 +44,7 @@ public:
 
 private:
 	void updateTransform();
+	void buildTransform( const quatf& orientation, const vec3f& translation, mat4f& transform ) const;
 
 private:
 	vec3f _objectCenter;
@@ -59,6 +65,11 @@ private:
 
 	mat4f _lookAt;		// model/view transform
 	mat4f _invLookAt;
+
+	vr::Timer _motionTimer;	// since the last mouse motion
+	double _motionInterval;	// between the last two motions
+	quatf _rotationDelta;	// orientation change of the last motion
+	vec3f _translationDelta;
 };
 
 #endif
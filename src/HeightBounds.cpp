@@ -0,0 +1,197 @@
+#include "HeightBounds.h"
+#include <vr/math.h>
+#include <cfloat>
+
+// Smallest power of two not below size
+static int padToPowerOfTwo( int size )
+{
+	int padded = 1;
+	while( padded < size )
+		padded *= 2;
+	return padded;
+}
+
+// Heights as OpenGL samples them
+static inline float sampledHeight( float height )
+{
+	return height;
+}
+
+static inline float sampledHeight( vr::uint16 code )
+{
+	return code / 65535.0f;
+}
+
+// Level 1 of one layer: bounds of 2x2 texels, clipped to the layer
+template<typename T>
+static void buildFirstLevel( const T* heights, int width, int height, int cellsX, int cellsY, int atlasWidth, float* atlas )
+{
+#pragma omp parallel for
+	for( int cy = 0; cy < cellsY; ++cy )
+	{
+		int y1 = vr::min( 2*cy + 2, height );
+		for( int cx = 0; cx < cellsX; ++cx )
+		{
+			int x1 = vr::min( 2*cx + 2, width );
+			float minHeight = FLT_MAX;
+			float maxHeight = -FLT_MAX;
+			for( int y = 2*cy; y < y1; ++y )
+			{
+				for( int x = 2*cx; x < x1; ++x )
+				{
+					float h = sampledHeight( heights[(size_t)y * width + x] );
+					minHeight = vr::min( minHeight, h );
+					maxHeight = vr::max( maxHeight, h );
+				}
+			}
+
+			float* cell = atlas + ( (size_t)cy * atlasWidth + cx ) * 2;
+			cell[0] = minHeight;
+			cell[1] = maxHeight;
+		}
+	}
+}
+
+HeightBounds::HeightBounds()
+: _width( 0 ), _height( 0 ), _layerCount( 0 ), _levelCount( 0 ), _paddedWidth( 0 ), _paddedHeight( 0 ),
+  _atlasWidth( 0 ), _atlasHeight( 0 )
+{
+}
+
+void HeightBounds::resize( int width, int height, int layerCount )
+{
+	clear();
+
+	_width = width;
+	_height = height;
+	_layerCount = layerCount;
+	_paddedWidth = padToPowerOfTwo( width );
+	_paddedHeight = padToPowerOfTwo( height );
+	while( ( ( _paddedWidth >> _levelCount ) > 1 ) && ( ( _paddedHeight >> _levelCount ) > 1 ) )
+		++_levelCount;
+	if( _levelCount == 0 )
+		return;
+
+	_atlasWidth = _paddedWidth - ( _paddedWidth >> _levelCount );
+	_atlasHeight = _paddedHeight / 2;
+	_cells.assign( (size_t)_atlasWidth * _atlasHeight * 2 * layerCount, 0.0f );
+}
+
+void HeightBounds::clear()
+{
+	_width = 0;
+	_height = 0;
+	_layerCount = 0;
+	_levelCount = 0;
+	_paddedWidth = 0;
+	_paddedHeight = 0;
+	_atlasWidth = 0;
+	_atlasHeight = 0;
+	_cells.clear();
+}
+
+void HeightBounds::build( int layer, const float* heights )
+{
+	if( _levelCount == 0 )
+		return;
+	buildFirstLevel( heights, _width, _height, _paddedWidth / 2, _paddedHeight / 2, _atlasWidth, layerCells( layer ) );
+	buildLevels( layer );
+}
+
+void HeightBounds::build( int layer, const vr::uint16* unitHeights )
+{
+	if( _levelCount == 0 )
+		return;
+	buildFirstLevel( unitHeights, _width, _height, _paddedWidth / 2, _paddedHeight / 2, _atlasWidth, layerCells( layer ) );
+	buildLevels( layer );
+}
+
+int HeightBounds::width() const
+{
+	return _width;
+}
+
+int HeightBounds::height() const
+{
+	return _height;
+}
+
+int HeightBounds::layerCount() const
+{
+	return _layerCount;
+}
+
+int HeightBounds::levelCount() const
+{
+	return _levelCount;
+}
+
+int HeightBounds::paddedWidth() const
+{
+	return _paddedWidth;
+}
+
+int HeightBounds::paddedHeight() const
+{
+	return _paddedHeight;
+}
+
+int HeightBounds::atlasWidth() const
+{
+	return _atlasWidth;
+}
+
+int HeightBounds::atlasHeight() const
+{
+	return _atlasHeight;
+}
+
+const float* HeightBounds::atlas( int layer ) const
+{
+	return &_cells[(size_t)_atlasWidth * _atlasHeight * 2 * layer];
+}
+
+const float* HeightBounds::cell( int layer, int level, int x, int y ) const
+{
+	return atlas( layer ) + ( (size_t)y * _atlasWidth + levelOffset( level ) + x ) * 2;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+float* HeightBounds::layerCells( int layer )
+{
+	return &_cells[(size_t)_atlasWidth * _atlasHeight * 2 * layer];
+}
+
+int HeightBounds::levelOffset( int level ) const
+{
+	return _paddedWidth - ( _paddedWidth >> ( level - 1 ) );
+}
+
+void HeightBounds::buildLevels( int layer )
+{
+	float* cells = layerCells( layer );
+	for( int level = 2; level <= _levelCount; ++level )
+	{
+		// Each cell bounds the 2x2 cells below it, which always exist in the padded grid
+		const float* below = cells + (size_t)levelOffset( level - 1 ) * 2;
+		float* dst = cells + (size_t)levelOffset( level ) * 2;
+		int cellsX = _paddedWidth >> level;
+		int cellsY = _paddedHeight >> level;
+
+#pragma omp parallel for
+		for( int cy = 0; cy < cellsY; ++cy )
+		{
+			for( int cx = 0; cx < cellsX; ++cx )
+			{
+				const float* c00 = below + ( (size_t)( 2*cy ) * _atlasWidth + 2*cx ) * 2;
+				const float* c01 = c00 + (size_t)_atlasWidth * 2;
+				float* cell = dst + ( (size_t)cy * _atlasWidth + cx ) * 2;
+				cell[0] = vr::min( vr::min( c00[0], c00[2] ), vr::min( c01[0], c01[2] ) );
+				cell[1] = vr::max( vr::max( c00[1], c00[3] ), vr::max( c01[1], c01[3] ) );
+			}
+		}
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef _HEIGHTBOUNDS_H_
+#define _HEIGHTBOUNDS_H_
+
+#include <vr/platform.h>
+#include <vector>
+
+/*!
+	Min/max pyramid of the heights of each layer, so that ray casts skip whole cells
+	a ray cannot hit instead of stepping through them (see rayCast_FS.glsl).
+	Level l has one cell per 2^l x 2^l texels of the layer, padded to powers of two,
+	and levels go up until the smaller side is a single cell. Padding cells are empty
+	(min FLT_MAX, max -FLT_MAX). Level 0 is the heights themselves and is not stored.
+
+	Each layer is an atlas of min, max pairs with the levels side by side from level 1:
+	level l starts at x = paddedWidth - paddedWidth / 2^(l-1), y = 0, so that shaders
+	find them without a table.
+ */
+class HeightBounds
+{
+public:
+	HeightBounds();
+
+	// Discards previous contents and sizes the pyramids of layerCount layers of width x height
+	void resize( int width, int height, int layerCount );
+	void clear();
+
+	// Builds the pyramid of layer from its heights, as the shader samples them:
+	// floats, or 16-bit codes for [0,1] (see LayerEncoding::unitHeights16)
+	void build( int layer, const float* heights );
+	void build( int layer, const vr::uint16* unitHeights );
+
+	int width() const;
+	int height() const;
+	int layerCount() const;
+
+	// 0 when the layers are too small for a pyramid
+	int levelCount() const;
+	int paddedWidth() const;
+	int paddedHeight() const;
+	int atlasWidth() const;
+	int atlasHeight() const;
+
+	// Min, max pairs of atlasWidth x atlasHeight cells, rows from bottom to top
+	const float* atlas( int layer ) const;
+
+	// Min, max pair of cell (x, y) of level, 1 to levelCount
+	const float* cell( int layer, int level, int x, int y ) const;
+
+private:
+	float* layerCells( int layer );
+
+	// Level offset in the atlas, in cells
+	int levelOffset( int level ) const;
+
+	// Levels 2 and up from level 1
+	void buildLevels( int layer );
+
+private:
+	int _width;
+	int _height;
+	int _layerCount;
+	int _levelCount;
+	int _paddedWidth;
+	int _paddedHeight;
+	int _atlasWidth;
+	int _atlasHeight;
+	std::vector<float> _cells;
+};
+
+#endif // _HEIGHTBOUNDS_H_
@@ -0,0 +1,264 @@
+#include "LayerCompression.h"
+#include <vr/math.h>
+#include <cstring>
+
+static const int MIN_MATCH = 4;
+static const int HASH_BITS = 16;
+static const size_t MAX_OFFSET = 65535;
+
+/************************************************************************/
+/* Prediction                                                           */
+/************************************************************************/
+
+// Words are unsigned and wrap around, so every step is exactly reversible
+template<typename T>
+static inline T predict( const T* words, int x, int y, int stride, int components )
+{
+	if( y == 0 )
+		return ( x == 0 ) ? (T)0 : words[-components];
+	if( x == 0 )
+		return words[-stride];
+	return (T)( words[-components] + words[-stride] - words[-stride-components] );
+}
+
+template<typename T>
+static inline T zigzag( T r )
+{
+	T sign = (T)( r >> ( sizeof(T)*8 - 1 ) );
+	return (T)( (T)( r << 1 ) ^ (T)( 0 - sign ) );
+}
+
+template<typename T>
+static inline T unzigzag( T z )
+{
+	return (T)( (T)( z >> 1 ) ^ (T)( 0 - (T)( z & 1 ) ) );
+}
+
+// Residual words of the block, split into byte planes (least significant first)
+template<typename T>
+static void predictBlock( const unsigned char* src, int width, int rows, int components, unsigned char* planes )
+{
+	int stride = width * components;
+	size_t count = (size_t)stride * rows;
+	const T* words = (const T*)src;
+
+	for( int y = 0; y < rows; ++y )
+	{
+		for( int x = 0; x < width; ++x )
+		{
+			for( int c = 0; c < components; ++c )
+			{
+				size_t i = (size_t)y * stride + x * components + c;
+				T residual = zigzag( (T)( words[i] - predict( words + i, x, y, stride, components ) ) );
+				for( size_t b = 0; b < sizeof(T); ++b )
+					planes[b*count + i] = (unsigned char)( residual >> ( b*8 ) );
+			}
+		}
+	}
+}
+
+template<typename T>
+static void reconstructBlock( const unsigned char* planes, int width, int rows, int components, unsigned char* dst )
+{
+	int stride = width * components;
+	size_t count = (size_t)stride * rows;
+	T* words = (T*)dst;
+
+	// Residuals back together first, then prediction, with edges out of the inner loop
+	for( size_t i = 0; i < count; ++i )
+	{
+		T residual = 0;
+		for( size_t b = 0; b < sizeof(T); ++b )
+			residual |= (T)( (T)planes[b*count + i] << ( b*8 ) );
+		words[i] = unzigzag( residual );
+	}
+
+	for( int c = components; c < stride; ++c )
+		words[c] = (T)( words[c] + words[c - components] );
+
+	for( int y = 1; y < rows; ++y )
+	{
+		T* row = words + (size_t)y * stride;
+		const T* up = row - stride;
+		for( int c = 0; c < components; ++c )
+			row[c] = (T)( row[c] + up[c] );
+		for( int i = components; i < stride; ++i )
+			row[i] = (T)( row[i] + row[i - components] + up[i] - up[i - components] );
+	}
+}
+
+/************************************************************************/
+/* LZ77 back end                                                        */
+/************************************************************************/
+
+static inline vr::uint32 read32( const unsigned char* p )
+{
+	vr::uint32 v;
+	memcpy( &v, p, 4 );
+	return v;
+}
+
+static inline vr::uint32 hash32( vr::uint32 v )
+{
+	return ( v * 2654435761u ) >> ( 32 - HASH_BITS );
+}
+
+// Lengths of 15 and above continue in bytes of 255, ended by a smaller one
+static void writeLength( size_t length, std::vector<unsigned char>& dst )
+{
+	for( ; length >= 255; length -= 255 )
+		dst.push_back( 255 );
+	dst.push_back( (unsigned char)length );
+}
+
+static bool readLength( const unsigned char*& ip, const unsigned char* end, size_t& length )
+{
+	unsigned char b;
+	do
+	{
+		if( ip >= end )
+			return false;
+		b = *ip++;
+		length += b;
+	}
+	while( b == 255 );
+	return true;
+}
+
+static void writeSequence( const unsigned char* literals, size_t literalCount, size_t offset, size_t matchLength,
+						   std::vector<unsigned char>& dst )
+{
+	size_t matchCode = ( matchLength > 0 ) ? matchLength - MIN_MATCH : 0;
+	unsigned char token = (unsigned char)( ( vr::min( literalCount, (size_t)15 ) << 4 ) | vr::min( matchCode, (size_t)15 ) );
+	dst.push_back( token );
+	if( literalCount >= 15 )
+		writeLength( literalCount - 15, dst );
+	dst.insert( dst.end(), literals, literals + literalCount );
+
+	// The last sequence has literals only
+	if( matchLength == 0 )
+		return;
+	dst.push_back( (unsigned char)( offset & 0xFF ) );
+	dst.push_back( (unsigned char)( offset >> 8 ) );
+	if( matchCode >= 15 )
+		writeLength( matchCode - 15, dst );
+}
+
+void LayerCompression::lzCompress( const unsigned char* src, size_t size, std::vector<unsigned char>& dst )
+{
+	std::vector<vr::int64> table( (size_t)1 << HASH_BITS, -1 );
+	size_t anchor = 0;
+	size_t i = 0;
+
+	while( i + MIN_MATCH <= size )
+	{
+		vr::uint32 h = hash32( read32( src + i ) );
+		vr::int64 candidate = table[h];
+		table[h] = (vr::int64)i;
+
+		if( ( candidate < 0 ) || ( i - (size_t)candidate > MAX_OFFSET ) || ( read32( src + candidate ) != read32( src + i ) ) )
+		{
+			// Skip faster through data that does not compress
+			i += 1 + ( ( i - anchor ) >> 6 );
+			continue;
+		}
+
+		size_t length = MIN_MATCH;
+		while( ( i + length < size ) && ( src[candidate + length] == src[i + length] ) )
+			++length;
+
+		writeSequence( src + anchor, i - anchor, i - (size_t)candidate, length, dst );
+		i += length;
+		anchor = i;
+	}
+
+	writeSequence( src + anchor, size - anchor, 0, 0, dst );
+}
+
+bool LayerCompression::lzDecompress( const unsigned char* src, size_t size, unsigned char* dst, size_t dstSize )
+{
+	const unsigned char* ip = src;
+	const unsigned char* end = src + size;
+	size_t op = 0;
+
+	while( ip < end )
+	{
+		unsigned char token = *ip++;
+
+		size_t literalCount = token >> 4;
+		if( ( literalCount == 15 ) && !readLength( ip, end, literalCount ) )
+			return false;
+		if( ( literalCount > (size_t)( end - ip ) ) || ( literalCount > dstSize - op ) )
+			return false;
+		memcpy( dst + op, ip, literalCount );
+		ip += literalCount;
+		op += literalCount;
+
+		if( ip == end )
+			break;
+
+		if( end - ip < 2 )
+			return false;
+		size_t offset = ip[0] | ( (size_t)ip[1] << 8 );
+		ip += 2;
+
+		size_t length = token & 15;
+		if( ( length == 15 ) && !readLength( ip, end, length ) )
+			return false;
+		length += MIN_MATCH;
+		if( ( offset == 0 ) || ( offset > op ) || ( length > dstSize - op ) )
+			return false;
+
+		// Matches may overlap what they copy, runs are the common case
+		if( offset == 1 )
+			memset( dst + op, dst[op - 1], length );
+		else if( offset >= length )
+			memcpy( dst + op, dst + op - offset, length );
+		else
+		{
+			for( size_t k = 0; k < length; ++k )
+				dst[op + k] = dst[op + k - offset];
+		}
+		op += length;
+	}
+	return op == dstSize;
+}
+
+/************************************************************************/
+/* Blocks                                                               */
+/************************************************************************/
+
+void LayerCompression::compressBlock( const unsigned char* src, int width, int rows, int components, int wordSize,
+									  std::vector<unsigned char>& dst )
+{
+	size_t bytes = (size_t)width * rows * components * wordSize;
+	std::vector<unsigned char> planes( bytes );
+	if( bytes == 0 )
+		return;
+
+	if( wordSize == 4 )
+		predictBlock<vr::uint32>( src, width, rows, components, &planes[0] );
+	else if( wordSize == 2 )
+		predictBlock<vr::uint16>( src, width, rows, components, &planes[0] );
+	else
+		predictBlock<vr::uint8>( src, width, rows, components, &planes[0] );
+
+	lzCompress( &planes[0], bytes, dst );
+}
+
+bool LayerCompression::decompressBlock( const unsigned char* src, size_t size, int width, int rows, int components, int wordSize,
+										unsigned char* dst )
+{
+	size_t bytes = (size_t)width * rows * components * wordSize;
+	std::vector<unsigned char> planes( bytes );
+	if( ( bytes == 0 ) || !lzDecompress( src, size, &planes[0], bytes ) )
+		return false;
+
+	if( wordSize == 4 )
+		reconstructBlock<vr::uint32>( &planes[0], width, rows, components, dst );
+	else if( wordSize == 2 )
+		reconstructBlock<vr::uint16>( &planes[0], width, rows, components, dst );
+	else
+		reconstructBlock<vr::uint8>( &planes[0], width, rows, components, dst );
+	return true;
+}
@@ -0,0 +1,35 @@
+#ifndef _LAYERCOMPRESSION_H_
+#define _LAYERCOMPRESSION_H_
+
+#include <vr/platform.h>
+#include <vector>
+#include <cstddef>
+
+/*!
+	Lossless compression of blocks of layer rows, in any channel encoding.
+	Texels are words of 1, 2 or 4 bytes (one per component), compressed in three steps:
+	- planar prediction from left, up and up-left neighbors of the same component, on the
+	  integer bits of the words, so floats come back bit exact. Rows of the block before
+	  the first one are not used, blocks are independent of each other;
+	- zigzag residuals split into byte planes, so that high bytes of small residuals and
+	  empty regions become long runs of zeros;
+	- an LZ77 back end with LZ4 style tokens, where runs are matches at distance one.
+	Blocks are meant to be compressed and decompressed in parallel.
+ */
+class LayerCompression
+{
+public:
+	// Appends the compressed block of rows x width texels to dst
+	static void compressBlock( const unsigned char* src, int width, int rows, int components, int wordSize,
+		                       std::vector<unsigned char>& dst );
+
+	// Fills dst with rows x width texels, false if src is not a valid block of that size
+	static bool decompressBlock( const unsigned char* src, size_t size, int width, int rows, int components, int wordSize,
+		                         unsigned char* dst );
+
+	// Back end on its own
+	static void lzCompress( const unsigned char* src, size_t size, std::vector<unsigned char>& dst );
+	static bool lzDecompress( const unsigned char* src, size_t size, unsigned char* dst, size_t dstSize );
+};
+
+#endif // _LAYERCOMPRESSION_H_
@@ -0,0 +1,264 @@
+#include "LayerEncoding.h"
+#include <cmath>
+#include <cfloat>
+
+// Kernels split channels into blocks, processed in parallel, with a plain loop inside
+static const int BLOCK_SIZE = 4096;
+
+static const float HEIGHT_LEVELS = 65534.0f;
+static const float OCT16_LEVELS = 65534.0f;
+static const float OCT8_LEVELS = 254.0f;
+
+static int blockCount( size_t count )
+{
+	return (int)( ( count + BLOCK_SIZE - 1 ) / BLOCK_SIZE );
+}
+
+static size_t blockEnd( int block, size_t count )
+{
+	size_t end = (size_t)( block + 1 ) * BLOCK_SIZE;
+	return ( end < count ) ? end : count;
+}
+
+static inline float signNotZero( float v )
+{
+	return ( v >= 0.0f ) ? 1.0f : -1.0f;
+}
+
+// Octahedral projection of n to [0, levels]^2, false for empty texels
+static inline bool octEncode( const float* n, float levels, float& u, float& v )
+{
+	float sum = fabsf( n[0] ) + fabsf( n[1] ) + fabsf( n[2] );
+	if( ( ( n[0] == 1.0f ) && ( n[1] == 1.0f ) && ( n[2] == 1.0f ) ) || !( sum > 0.0f ) )
+		return false;
+
+	float px = n[0] / sum;
+	float py = n[1] / sum;
+	if( n[2] < 0.0f )
+	{
+		// Lower hemisphere folded over the diagonals
+		float fx = ( 1.0f - fabsf( py ) ) * signNotZero( px );
+		float fy = ( 1.0f - fabsf( px ) ) * signNotZero( py );
+		px = fx;
+		py = fy;
+	}
+	u = floorf( ( px * 0.5f + 0.5f ) * levels + 0.5f );
+	v = floorf( ( py * 0.5f + 0.5f ) * levels + 0.5f );
+	return true;
+}
+
+static inline void octDecode( float u, float v, float levels, float* n )
+{
+	float px = u / levels * 2.0f - 1.0f;
+	float py = v / levels * 2.0f - 1.0f;
+	float pz = 1.0f - fabsf( px ) - fabsf( py );
+	if( pz < 0.0f )
+	{
+		float fx = ( 1.0f - fabsf( py ) ) * signNotZero( px );
+		float fy = ( 1.0f - fabsf( px ) ) * signNotZero( py );
+		px = fx;
+		py = fy;
+	}
+	float invLength = 1.0f / sqrtf( px*px + py*py + pz*pz );
+	n[0] = px * invLength;
+	n[1] = py * invLength;
+	n[2] = pz * invLength;
+}
+
+bool LayerEncoding::heightRange( const float* heights, size_t count, float& minHeight, float& maxHeight )
+{
+	minHeight = FLT_MAX;
+	maxHeight = -FLT_MAX;
+	for( size_t i = 0; i < count; ++i )
+	{
+		if( heights[i] == 0.0f )
+			continue;
+		minHeight = ( heights[i] < minHeight ) ? heights[i] : minHeight;
+		maxHeight = ( heights[i] > maxHeight ) ? heights[i] : maxHeight;
+	}
+
+	if( minHeight > maxHeight )
+	{
+		minHeight = 0.0f;
+		maxHeight = 0.0f;
+		return false;
+	}
+	return true;
+}
+
+void LayerEncoding::encodeHeights16( const float* heights, size_t count, float minHeight, float maxHeight, vr::uint16* dst )
+{
+	// A flat layer has a single level
+	float scale = ( maxHeight > minHeight ) ? HEIGHT_LEVELS / ( maxHeight - minHeight ) : 0.0f;
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float q = ( heights[i] - minHeight ) * scale;
+			q = ( q < 0.0f ) ? 0.0f : ( ( q > HEIGHT_LEVELS ) ? HEIGHT_LEVELS : q );
+			dst[i] = ( heights[i] == 0.0f ) ? (vr::uint16)0 : (vr::uint16)( 1.0f + floorf( q + 0.5f ) );
+		}
+	}
+}
+
+void LayerEncoding::decodeHeights16( const vr::uint16* src, size_t count, float minHeight, float maxHeight, float* dst )
+{
+	float step = ( maxHeight - minHeight ) / HEIGHT_LEVELS;
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+			dst[i] = ( src[i] == 0 ) ? 0.0f : minHeight + (float)( src[i] - 1 ) * step;
+	}
+}
+
+void LayerEncoding::quantizeHeights( const float* heights, size_t count, float minHeight, float step, vr::uint32* dst )
+{
+	float scale = 1.0f / step;
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float k = floorf( ( heights[i] - minHeight ) * scale + 0.5f );
+			k = ( k < 1.0f ) ? 1.0f : k;
+
+			// Decoded heights are rounded to float, so the nearest of the neighboring codes is kept
+			float best = k;
+			float bestError = fabsf( minHeight + k * step - heights[i] );
+			for( float c = k - 1.0f; c <= k + 1.0f; c += 2.0f )
+			{
+				float error = fabsf( minHeight + c * step - heights[i] );
+				if( error < bestError )
+				{
+					best = c;
+					bestError = error;
+				}
+			}
+			dst[i] = ( heights[i] == 0.0f ) ? 0 : (vr::uint32)best + 1;
+		}
+	}
+}
+
+void LayerEncoding::dequantizeHeights( const vr::uint32* src, size_t count, float minHeight, float step, float* dst )
+{
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+			dst[i] = ( src[i] == 0 ) ? 0.0f : minHeight + (float)( src[i] - 1 ) * step;
+	}
+}
+
+void LayerEncoding::unitHeights16( const vr::uint16* src, size_t count, float minHeight, float maxHeight, vr::uint16* dst )
+{
+	float step = ( maxHeight - minHeight ) / HEIGHT_LEVELS;
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float q = floorf( ( minHeight + (float)( src[i] - 1 ) * step ) * 65535.0f + 0.5f );
+			q = ( q < 1.0f ) ? 1.0f : ( ( q > 65535.0f ) ? 65535.0f : q );
+			dst[i] = ( src[i] == 0 ) ? (vr::uint16)0 : (vr::uint16)q;
+		}
+	}
+}
+
+void LayerEncoding::encodeOct16( const float* normals, size_t count, vr::uint16* dst )
+{
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float u, v;
+			bool surface = octEncode( normals + i*3, OCT16_LEVELS, u, v );
+			dst[i*2]   = surface ? (vr::uint16)u : EMPTY_OCT16;
+			dst[i*2+1] = surface ? (vr::uint16)v : EMPTY_OCT16;
+		}
+	}
+}
+
+void LayerEncoding::decodeOct16( const vr::uint16* src, size_t count, float* dst )
+{
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float* n = dst + i*3;
+			if( src[i*2] == EMPTY_OCT16 )
+			{
+				n[0] = 1.0f;
+				n[1] = 1.0f;
+				n[2] = 1.0f;
+				continue;
+			}
+			octDecode( src[i*2], src[i*2+1], OCT16_LEVELS, n );
+		}
+	}
+}
+
+void LayerEncoding::encodeOct8( const float* normals, size_t count, vr::uint8* dst )
+{
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float u, v;
+			bool surface = octEncode( normals + i*3, OCT8_LEVELS, u, v );
+			dst[i*2]   = surface ? (vr::uint8)u : EMPTY_OCT8;
+			dst[i*2+1] = surface ? (vr::uint8)v : EMPTY_OCT8;
+		}
+	}
+}
+
+void LayerEncoding::decodeOct8( const vr::uint8* src, size_t count, float* dst )
+{
+	int blocks = blockCount( count );
+
+#pragma omp parallel for
+	for( int b = 0; b < blocks; ++b )
+	{
+		size_t end = blockEnd( b, count );
+		for( size_t i = (size_t)b * BLOCK_SIZE; i < end; ++i )
+		{
+			float* n = dst + i*3;
+			if( src[i*2] == EMPTY_OCT8 )
+			{
+				n[0] = 1.0f;
+				n[1] = 1.0f;
+				n[2] = 1.0f;
+				continue;
+			}
+			octDecode( src[i*2], src[i*2+1], OCT8_LEVELS, n );
+		}
+	}
+}
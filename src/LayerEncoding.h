@@ -0,0 +1,54 @@
+#ifndef _LAYERENCODING_H_
+#define _LAYERENCODING_H_
+
+#include <vr/platform.h>
+#include <cstddef>
+
+/*!
+	Compact texel encodings for layer files, with encode and decode kernels.
+	Kernels are plain loops over independent texels, written so that the compiler
+	can vectorize them, and run in parallel over large channels.
+
+	Heights: 16-bit unorm relative to the layer's [min, max]. Code 0 keeps the
+	empty texel (height 0), surface heights use codes 1..65535.
+	Error is (max - min) / 65534 / 2, plus float rounding.
+
+	Quantized heights: 32-bit codes on a grid of given step from the layer's min,
+	code 0 again for empty texels. Each texel takes the code that decodes nearest to it,
+	so the error is step / 2 plus the float rounding of decoded heights (an ulp).
+	Codes are meant to be compressed (see LayerCompression), where neighbors on a
+	smooth surface leave residuals of a few bits.
+
+	Normals: octahedral projection to two components, 16 or 8 bits each, stored
+	unsigned so that OpenGL can sample them as luminance-alpha textures.
+	The all-ones code marks empty texels, decoded as (1,1,1).
+	Measured angular error over 2M random directions: at most 0.0037 degrees
+	(16 bits) and 0.96 degrees (8 bits).
+ */
+class LayerEncoding
+{
+public:
+	static const vr::uint16 EMPTY_OCT16 = 0xFFFF;
+	static const vr::uint8 EMPTY_OCT8 = 0xFF;
+
+	// Range of the non-empty heights, false if there are none
+	static bool heightRange( const float* heights, size_t count, float& minHeight, float& maxHeight );
+
+	static void encodeHeights16( const float* heights, size_t count, float minHeight, float maxHeight, vr::uint16* dst );
+	static void decodeHeights16( const vr::uint16* src, size_t count, float minHeight, float maxHeight, float* dst );
+
+	static void quantizeHeights( const float* heights, size_t count, float minHeight, float step, vr::uint32* dst );
+	static void dequantizeHeights( const vr::uint32* src, size_t count, float minHeight, float step, float* dst );
+
+	// Re-expresses codes relative to [0, 1], as OpenGL reads 16-bit textures (height = code / 65535).
+	// Surface texels stay above 0. Adds up to 1 / 65535 / 2 of error.
+	static void unitHeights16( const vr::uint16* src, size_t count, float minHeight, float maxHeight, vr::uint16* dst );
+
+	// Two codes per texel
+	static void encodeOct16( const float* normals, size_t count, vr::uint16* dst );
+	static void decodeOct16( const vr::uint16* src, size_t count, float* dst );
+	static void encodeOct8( const float* normals, size_t count, vr::uint8* dst );
+	static void decodeOct8( const vr::uint8* src, size_t count, float* dst );
+};
+
+#endif // _LAYERENCODING_H_
@@ -0,0 +1,62 @@
+#include "LayerFrame.h"
+#include <cstdio>
+
+void LayerFrame::layerToWorld( double m[16] ) const
+{
+	// Inverse of toTexture, with z flipped from depth to height
+	vr::vec3d depthAxis = forward * ( zFar - zNear );
+	vr::vec3d axes[3] = { right * ( 2.0 * halfWidth ), up * ( 2.0 * halfHeight ), -depthAxis };
+	vr::vec3d origin = eye - right * halfWidth - up * halfHeight + forward * zNear + depthAxis;
+
+	for( int c = 0; c < 3; ++c )
+	{
+		m[c*4]   = axes[c].x;
+		m[c*4+1] = axes[c].y;
+		m[c*4+2] = axes[c].z;
+		m[c*4+3] = 0.0;
+	}
+	m[12] = origin.x;
+	m[13] = origin.y;
+	m[14] = origin.z;
+	m[15] = 1.0;
+}
+
+bool LayerFrame::save( const std::string& filename ) const
+{
+	FILE* file = fopen( filename.c_str(), "w" );
+	if( file == NULL )
+	{
+		printf( "Could not write frame %s\n", filename.c_str() );
+		return false;
+	}
+
+	const vr::vec3d* vectors[5] = { &center, &eye, &right, &up, &forward };
+	for( int i = 0; i < 5; ++i )
+		fprintf( file, "%.17g %.17g %.17g\n", vectors[i]->x, vectors[i]->y, vectors[i]->z );
+	fprintf( file, "%.17g %.17g %.17g %.17g\n", halfWidth, halfHeight, zNear, zFar );
+
+	fclose( file );
+	return true;
+}
+
+bool LayerFrame::load( const std::string& filename )
+{
+	FILE* file = fopen( filename.c_str(), "r" );
+	if( file == NULL )
+		return false;
+
+	int read = 0;
+	vr::vec3d* vectors[5] = { &center, &eye, &right, &up, &forward };
+	for( int i = 0; i < 5; ++i )
+		read += fscanf( file, "%lf %lf %lf", &vectors[i]->x, &vectors[i]->y, &vectors[i]->z );
+	read += fscanf( file, "%lf %lf %lf %lf", &halfWidth, &halfHeight, &zNear, &zFar );
+
+	fclose( file );
+
+	if( read != 19 )
+	{
+		printf( "Invalid frame file %s\n", filename.c_str() );
+		return false;
+	}
+	return true;
+}
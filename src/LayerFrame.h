@@ -0,0 +1,111 @@
+#ifndef _LAYERFRAME_H_
+#define _LAYERFRAME_H_
+
+#include <vr/vec3.h>
+#include <string>
+#include "AABB.h"
+#include "OrientedBox.h"
+
+/*!
+	Orthographic viewing frame used to generate layers.
+	Mirrors the glOrtho/gluLookAt setup of LayerGenerator, so that a point mapped
+	through toTexture() lands in the same texel and with the same depth as in the
+	depth peeling passes.
+ */
+class LayerFrame
+{
+public:
+	// Look at the box from its maximum face along the given axis (0 = -X, 1 = -Y, 2 = -Z).
+	// Uses the same padding and up vectors as the depth peeling setup.
+	static LayerFrame fromBox( const AABB& box, int axis )
+	{
+		return fromBox( OrientedBox::fromAABB( box ), axis );
+	}
+
+	// Same as above, along the box's own axes
+	static LayerFrame fromBox( const OrientedBox& box, int axis )
+	{
+		static const int upAxis[3] = { 1, 2, 1 };
+		return fromDirection( box, -box.axis[axis], box.axis[upAxis[axis]] );
+	}
+
+	// Look at the box along an arbitrary unit direction, fitting the frame to the box corners
+	static LayerFrame fromDirection( const OrientedBox& box, const vr::vec3d& dir, const vr::vec3d& up )
+	{
+		LayerFrame frame;
+		frame.center = box.center;
+		frame.forward = dir;
+		frame.right = frame.forward.cross( up );
+		frame.right.normalize();
+		frame.up = frame.right.cross( frame.forward );
+
+		// Extents of the box corners along each frame axis
+		double extent[3] = { 0, 0, 0 };
+		for( int i = 0; i < 8; ++i )
+		{
+			vr::vec3d corner = box.corner( i ) - frame.center;
+			extent[0] = vr::max( extent[0], vr::abs( corner.dot( frame.right ) ) * 2.0 );
+			extent[1] = vr::max( extent[1], vr::abs( corner.dot( frame.up ) ) * 2.0 );
+			extent[2] = vr::max( extent[2], vr::abs( corner.dot( frame.forward ) ) * 2.0 );
+		}
+
+		frame.eye = frame.center - frame.forward * ( extent[2] * 0.5 );
+		frame.halfWidth = extent[0] * 0.51;
+		frame.halfHeight = extent[1] * 0.51;
+		frame.zNear = -0.01;
+		frame.zFar = extent[2] * 1.01;
+		return frame;
+	}
+
+	// Frame covering only texels [x0,x1) x [y0,y1) of a width x height image, with the same depth range.
+	// Texel centers land on the same world positions as in the full frame.
+	LayerFrame tile( int x0, int y0, int x1, int y1, int width, int height ) const
+	{
+		double dx = ( ( x0 + x1 ) / ( 2.0 * width ) - 0.5 ) * 2.0 * halfWidth;
+		double dy = ( ( y0 + y1 ) / ( 2.0 * height ) - 0.5 ) * 2.0 * halfHeight;
+
+		LayerFrame frame = *this;
+		frame.center = center + right * dx + up * dy;
+		frame.eye = eye + right * dx + up * dy;
+		frame.halfWidth = halfWidth * ( x1 - x0 ) / width;
+		frame.halfHeight = halfHeight * ( y1 - y0 ) / height;
+		return frame;
+	}
+
+	// Maps a world position to [0,1] image coordinates (x, y) and window depth (z)
+	vr::vec3d toTexture( const vr::vec3d& p ) const
+	{
+		vr::vec3d d = p - eye;
+		return vr::vec3d( ( d.dot( right ) + halfWidth ) / ( 2.0 * halfWidth ),
+			              ( d.dot( up ) + halfHeight ) / ( 2.0 * halfHeight ),
+						  ( d.dot( forward ) - zNear ) / ( zFar - zNear ) );
+	}
+
+	// Maps a world direction to eye space, as gl_NormalMatrix does
+	vr::vec3d toEye( const vr::vec3d& n ) const
+	{
+		return vr::vec3d( n.dot( right ), n.dot( up ), -n.dot( forward ) );
+	}
+
+	// Column-major matrix (for glMultMatrixd) taking the unit layer cube to world space.
+	// Cube x and y are texture coordinates and z is the stored height (1 - depth).
+	void layerToWorld( double m[16] ) const;
+
+	// Text form, kept for legacy <prefix>.frame files next to .height/.normal layers
+	// and for job files. Layer files (.shs) carry the frame in their header.
+	bool save( const std::string& filename ) const;
+	bool load( const std::string& filename );
+
+public:
+	vr::vec3d center;
+	vr::vec3d eye;
+	vr::vec3d right;
+	vr::vec3d up;
+	vr::vec3d forward;
+	double halfWidth;
+	double halfHeight;
+	double zNear;
+	double zFar;
+};
+
+#endif // _LAYERFRAME_H_
@@ -1,18 +1,106 @@
 #include "LayerGenerator.h"
 #include "Canvas.h"
+#include "SoftwareLayerGenerator.h"
+#include "BvhLayerGenerator.h"
+#include "OrientationEstimator.h"
+#include "TiledLayerWriter.h"
+#include "ShsFile.h"
 #include <string>
 #include <fstream>
 #include <cassert>
+#include <algorithm>
 
 #include <osg/NodeVisitor>
 #include <osg/Geometry>
 #include <osg/Transform>
 #include <osg/Geode>
+#include <osg/BlendEquation>
+#include <osg/Depth>
+#include <osg/Stencil>
 
 #include <QGLFramebufferObject>
 #include <QDir>
 #include <QFile>
 
+// Every generation path writes the layers, frame and box to this container
+static const char* LAYER_FILE = "../data/out/layers.shs";
+
+// Depth peeling stops after this many layers, whatever is left
+static const int MAX_PEELED_LAYERS = 100;
+
+// Layers in flight during peeling: one is read back while the next one is drawn
+static const int READBACK_BUFFERS = 2;
+
+// Sorted fragment lists are written this many layers at a time
+static const int LIST_LAYERS_PER_DISPATCH = 4;
+
+// Fragment struct of createLayersList_FS.glsl: depth, normal and next index
+static const int FRAGMENT_BYTES = 20;
+
+// Fragment lists are reserved for this many layers on average the first time
+static const int INITIAL_LIST_LAYERS = 4;
+
+// Last fragment of an empty list
+static const unsigned int LIST_END = 0xffffffff;
+
+// Copies a layer read back into pixelBuffer, false if the buffer cannot be mapped
+static bool readPixelBuffer( unsigned int pixelBuffer, std::vector<float>& pixels )
+{
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBuffer );
+	const float* mapped = (const float*)glMapBuffer( GL_PIXEL_PACK_BUFFER, GL_READ_ONLY );
+	if( mapped != NULL )
+	{
+		std::copy( mapped, mapped + pixels.size(), pixels.begin() );
+		glUnmapBuffer( GL_PIXEL_PACK_BUFFER );
+	}
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+	return mapped != NULL;
+}
+
+// Orders the front and back layers of dual depth peeling (depth first, channels floats per texel) as
+// front to back peeling does: at each texel the front layers come first, then the back layers
+// farthest last. A surface met from both sides in the last pass of a texel is kept once.
+// Layers of a texel are contiguous, empty texels hold 1.0 like the cleared peeling targets.
+static void mergeDualLayers( const std::vector< std::vector<float> >& fronts, const std::vector< std::vector<float> >& backs,
+							 unsigned int count, int channels, std::vector< std::vector<float> >& layers )
+{
+	layers.clear();
+	layers.reserve( fronts.size() + backs.size() );
+	for( unsigned int t = 0, k = 0; t < count; ++t, k+=channels )
+	{
+		int frontCount = 0;
+		while( ( frontCount < (int)fronts.size() ) && ( fronts[frontCount][k] < 1.0f ) )
+			++frontCount;
+		int backCount = 0;
+		while( ( backCount < (int)backs.size() ) && ( backs[backCount][k] < 1.0f ) )
+			++backCount;
+		if( ( frontCount > 0 ) && ( frontCount == backCount ) && ( fronts[frontCount-1][k] == backs[backCount-1][k] ) )
+			--backCount;
+
+		while( (int)layers.size() < frontCount + backCount )
+			layers.push_back( std::vector<float>( count*channels, 1.0f ) );
+
+		for( int i = 0; i < frontCount; ++i )
+			std::copy( &fronts[i][k], &fronts[i][k] + channels, &layers[i][k] );
+		for( int i = 0; i < backCount; ++i )
+			std::copy( &backs[backCount-1-i][k], &backs[backCount-1-i][k] + channels, &layers[frontCount+i][k] );
+	}
+}
+
+// Stored bytes of a channel, mapped or read into buffer, NULL if it cannot be read.
+// Like raw channel views, mapped channels are not verified.
+static const void* storedChannel( ShsFile& file, int layer, ShsFile::Channel channel, std::vector<unsigned char>& buffer )
+{
+	const void* stored = file.storedData( layer, channel );
+	if( stored != NULL )
+		return stored;
+
+	buffer.resize( (size_t)file.storedSize( layer, channel ) );
+	if( buffer.empty() || !file.readStored( layer, channel, &buffer[0] ) )
+		return NULL;
+	return &buffer[0];
+}
+
 class ComputeBoundingBoxVisitor : public osg::NodeVisitor
 {
 public:
@@ -72,12 +160,25 @@ void ComputeBoundingBoxVisitor::apply( osg::Geode& geode )
 }
 
 LayerGenerator::LayerGenerator()
-: _model( NULL )
+: _model( NULL ), _spillToDisk( false ), _debugImages( false ), _peelingMethod( FRONT_TO_BACK ), _activePeeling( FRONT_TO_BACK ), _coarseSearch( true ), _extraDirections( false ), _orientedBox( true ),
+  _tileSize( 2048 ), _storeNormals( true ), _shaderNormals( false ), _texelTraversal( false ),
+  _heightEncoding( ShsFile::RAW_FLOAT32 ), _normalEncoding( ShsFile::RAW_FLOAT32 ), _compression( ShsFile::COMPRESSION_NONE ),
+  _maxHeightError( 0.0f ), _pyramid( false ), _coneMaps( false ), _streamingMemoryMB( 1024 ), _streamingTextureMB( 512 ), _hasLayerFrame( false )
 {
 	 _fbo = 0;
 	 _depthBuffer = 0;
 	 _refTex = 0;
 	 _renderTex = 0;
+	 _minMaxTex[0] = 0;
+	 _minMaxTex[1] = 0;
+	 _frontTex = 0;
+	 _backTex = 0;
+	 _headBuffer = 0;
+	 _fragmentBuffer = 0;
+	 _fragmentCounter = 0;
+	 _listInfoBuffer = 0;
+	 _layerBuffer = 0;
+	 _listCapacity = 0;
 }
 
 void LayerGenerator::setCurrentModel( tecosg::OsgModel* model )
@@ -97,247 +198,296 @@ void LayerGenerator::computeBoundingBox()
 	_bbox.minV.set( vmin.x(), vmin.y(), vmin.z() );
 	const osg::Vec3& vmax = cbbv.getBoundingBox()._max;
 	_bbox.maxV.set( vmax.x(), vmax.y(), vmax.z() );
+
+	_obox = OrientedBox::fromAABB( _bbox );
+	if( !_orientedBox )
+		return;
+
+	// Long rotated parts waste most texels in an AABB
+	TriangleMesh mesh;
+	mesh.build( _model->rawData() );
+	if( mesh.triangleCount() == 0 )
+		return;
+	_obox = mesh.computeOrientedBox();
+
+	double aabbVolume = OrientedBox::fromAABB( _bbox ).volume();
+	if( aabbVolume > 0.0 )
+		printf( "Oriented box volume: %.1f%% of AABB\n", _obox.volume() / aabbVolume * 100.0 );
 }
 
 void LayerGenerator::generateLayers()
 {
 	// Get OpenGL state attributes
 	glGetIntegerv( GL_VIEWPORT, _vp );
-	_width = _vp[2];
-	_height = _vp[3];
 
-	// Multi-use pixel container, to send values to textures and to read back from gl buffers
-	std::vector<float> pixels( _width*_height*4 );
+	// Window sized layers through the offscreen path
+	if( _coarseSearch )
+	{
+		generateLayers( _vp[2], _vp[3] );
+		return;
+	}
 
-	// Disable face culling, to guarantee we only discard fragments through z-test and our frag. shader
-	osg::StateSet* ss = _model->rawData()->getOrCreateStateSet();
-	ss->setMode( GL_CULL_FACE, osg::StateAttribute::OFF );
-	glDisable( GL_CULL_FACE );
+	_width = _vp[2];
+	_height = _vp[3];
 
 	// FBO for testing
 	QGLFramebufferObject qfbo( _width, _height, QGLFramebufferObject::Depth );
 
-	// Store best matrices for generating layers later
-	float bestModelView[16];
-	float bestProjection[16];
-
-	// Bounding box data
-	const vr::vec3d& center = _bbox.center();
-	vr::vec3d eye;
+	preparePeeling();
 
-	// Setup fragment shader for depth peeling.
-	// Send correct shader parameters.
-	ShaderManager& shaders = Canvas::instance()->shaderManager();
-	shaders.reset();
-	shaders.setVertexProgram( "../shaders/createLayers_VS.glsl" );
-	shaders.setFragmentProgram( "../shaders/createLayers_FS.glsl" );
-	shaders.addUniformi( "depthTexSampler", 0 ); // shader always reads from unit 0
-	shaders.addUniformf( "invDepthTexWidth", 1.0f / (float)_width );
-	shaders.addUniformf( "invDepthTexHeight", 1.0f / (float)_height );
-	shaders.initShaders();
+	peelBestAxis( qfbo );
 
-	// Save previous OpenGL matrices
-	glMatrixMode( GL_MODELVIEW );
-	glPushMatrix();
-	glMatrixMode( GL_PROJECTION );
-	glPushMatrix();
-	
-	//////////////////////////////////////////////////////////////////////////
-	// Minimize number of layers needed from 3 box faces: towards -X, -Y and -Z
-	
-	//////////////////////////////////////////////////////////////////////////
-	// Toward -Z
-	//////////////////////////////////////////////////////////////////////////
-	eye = center;
-	eye.z += _bbox.extent(2)*0.5;
-	
-	glMatrixMode( GL_PROJECTION );
-	glLoadIdentity();
-	glOrtho( -_bbox.extent(0)*0.51, _bbox.extent(0)*0.51, 
-		     -_bbox.extent(1)*0.51, _bbox.extent(1)*0.51, 
-		                     -0.01, _bbox.extent(2)*1.01 );
+	finishPeeling();
+}
 
-	glMatrixMode( GL_MODELVIEW );
-	glLoadIdentity();
-	gluLookAt( eye.x, eye.y, eye.z, center.x, center.y, center.z, 0, 1, 0 );
+void LayerGenerator::generateLayers( int width, int height )
+{
+	if( ( _model == NULL ) || ( width <= 0 ) || ( height <= 0 ) )
+		return;
 
-	// Test camera view
-	shaders.setEnabled( false );
-	qfbo.bind();
-	Canvas::instance()->updateGL();
-	qfbo.release();
-	qfbo.toImage().save( "cameraTestZ.bmp" );
-	shaders.setEnabled( true );
-	
-	// Compute number of layers needed for current viewpoint
-	unsigned int layerCountZ = computeLayersNeededWithQuery();
-	printf( "Layers needed (-z): %d\n\n", layerCountZ );
+	// Tiles are limited by the largest FBO the driver supports
+	int maxTextureSize = 0;
+	int maxRenderbufferSize = 0;
+	glGetIntegerv( GL_MAX_TEXTURE_SIZE, &maxTextureSize );
+	glGetIntegerv( GL_MAX_RENDERBUFFER_SIZE_EXT, &maxRenderbufferSize );
+	int tileSize = vr::min( _tileSize, vr::min( maxTextureSize, maxRenderbufferSize ) );
 
-	// Save as best position
-	unsigned int minLayerCount = layerCountZ;
-	// TODO: 
-	if( 0 )
-	{
-		glGetFloatv( GL_MODELVIEW_MATRIX, bestModelView );
-		glGetFloatv( GL_PROJECTION_MATRIX, bestProjection );
-	}
+	_width = vr::min( tileSize, width );
+	_height = vr::min( tileSize, height );
+	int tilesX = ( width + _width - 1 ) / _width;
+	int tilesY = ( height + _height - 1 ) / _height;
 
-	//////////////////////////////////////////////////////////////////////////
-	// Toward -X
-	//////////////////////////////////////////////////////////////////////////
-	eye = center;
-	eye.x += _bbox.extent(0)*0.5;
+	// Pick the orientation on a coarse grid, then peel each tile only once
+	LayerFrame frame = estimateBestFrame();
 
-	glMatrixMode( GL_PROJECTION );
-	glLoadIdentity();
-	glOrtho( -_bbox.extent(2)*0.51, _bbox.extent(2)*0.51, 
-		     -_bbox.extent(1)*0.51, _bbox.extent(1)*0.51, 
-		                     -0.01, _bbox.extent(0)*1.01 );
+	TiledLayerWriter writer;
+	if( !openWriter( writer, width, height, frame ) )
+		return;
 
-	glMatrixMode( GL_MODELVIEW );
-	glLoadIdentity();
-	gluLookAt( eye.x, eye.y, eye.z, center.x, center.y, center.z, 0, 1, 0 );
+	printf( "*** Generating Layers: %dx%d in %d tiles of %dx%d ***\n", width, height, tilesX*tilesY, _width, _height );
 
-	// Test camera view
-	shaders.setEnabled( false );
-	qfbo.bind();
-	Canvas::instance()->updateGL();
-	qfbo.release();
-	qfbo.toImage().save( "cameraTestX.bmp" );
-	shaders.setEnabled( true );
+	// Peel at tile size, whatever the window size
+	_vp[0] = 0;
+	_vp[1] = 0;
+	_vp[2] = _width;
+	_vp[3] = _height;
+	Canvas::instance()->setViewport( 0, 0, _width, _height );
 
-	// Compute number of layers needed for current viewpoint
-	unsigned int layerCountX = computeLayersNeededWithQuery();
-	printf( "Layers needed (-x): %d\n\n", layerCountX );
+	preparePeeling();
 
-	// TODO: 
-	if( 0 )//layerCountX < minLayerCount )
+	// Layers go straight to the writer, a few at a time are in memory while they are written.
+	// Edge tiles are peeled at full tile size too, the writer clips them.
+	for( int ty = 0; ty < tilesY; ++ty )
 	{
-		// Save as best camera position
-		minLayerCount = layerCountX;
-		glGetFloatv( GL_MODELVIEW_MATRIX, bestModelView );
-		glGetFloatv( GL_PROJECTION_MATRIX, bestProjection );
+		for( int tx = 0; tx < tilesX; ++tx )
+		{
+			int x0 = tx * _width;
+			int y0 = ty * _height;
+			loadFrame( frame.tile( x0, y0, x0 + _width, y0 + _height, width, height ) );
+
+			// Debug images only make sense for whole layers
+			peelLayers( NULL, &writer, x0, y0, ( tilesX == 1 ) && ( tilesY == 1 ) );
+		}
 	}
 
-	//////////////////////////////////////////////////////////////////////////
-	// Toward -Y
-	//////////////////////////////////////////////////////////////////////////
-	eye = center;
-	eye.y += _bbox.extent(1)*0.5;
+	if( !_writeQueue.finish() )
+		printf( "Warning: some layers could not be written to %s\n", LAYER_FILE );
+	printf( "Layers needed: %d\n", writer.layerCount() );
+	writer.close();
 
-	// Set projection view based on bounding box to generate correct layer images
-	glMatrixMode( GL_PROJECTION );
-	glLoadIdentity();
-	glOrtho( -_bbox.extent(0)*0.51, _bbox.extent(0)*0.51, 
-		     -_bbox.extent(2)*0.51, _bbox.extent(2)*0.51, 
-		                     -0.01, _bbox.extent(1)*1.01 );
+	finishPeeling();
 
-	// Set camera view based on bounding box to generate correct layer images
-	glMatrixMode( GL_MODELVIEW );
-	glLoadIdentity();
-	gluLookAt( eye.x, eye.y, eye.z, center.x, center.y, center.z, 0, 0, 1 );
+	Canvas::instance()->setViewport( 0, 0, Canvas::instance()->width(), Canvas::instance()->height() );
+	_width = width;
+	_height = height;
+}
 
-	// Test camera view
-	shaders.setEnabled( false );
-	qfbo.bind();
-	Canvas::instance()->updateGL();
-	qfbo.release();
-	qfbo.toImage().save( "cameraTestY.bmp" );
-	shaders.setEnabled( true );
+void LayerGenerator::setSpillToDisk( bool enabled )
+{
+	_spillToDisk = enabled;
+}
 
-	// Compute number of layers needed for current viewpoint
-	unsigned int layerCountY = computeLayersNeededWithQuery();
-	printf( "Layers needed (-y): %d\n\n", layerCountY );
+void LayerGenerator::setDebugImages( bool enabled )
+{
+	_debugImages = enabled;
+}
 
-	// TODO: 
-	if( 1 )//layerCountY < minLayerCount )
-	{
-		// Save as best camera position
-		minLayerCount = layerCountY;
-		glGetFloatv( GL_MODELVIEW_MATRIX, bestModelView );
-		glGetFloatv( GL_PROJECTION_MATRIX, bestProjection );
-	}
+void LayerGenerator::setPeelingMethod( PeelingMethod method )
+{
+	_peelingMethod = method;
+}
 
-	// Set camera to generate the minimum number of layers
-	glMatrixMode( GL_PROJECTION );
-	glLoadMatrixf( bestProjection );
-	glMatrixMode( GL_MODELVIEW );
-	glLoadMatrixf( bestModelView );
+void LayerGenerator::setCoarseSearch( bool enabled )
+{
+	_coarseSearch = enabled;
+}
 
-	// Sanity check with occlusion queries
-	unsigned int queryId;
-	unsigned int queryResult;
-	glGenQueries( 1, &queryId );
+void LayerGenerator::setExtraDirections( bool enabled )
+{
+	_extraDirections = enabled;
+}
 
-	// Setup layer generation
-	beginLayerGeneration();
+void LayerGenerator::setOrientedBox( bool enabled )
+{
+	_orientedBox = enabled;
+}
 
-	printf( "*** Generating Layers ***\n" );
+void LayerGenerator::setStoreNormals( bool enabled )
+{
+	_storeNormals = enabled;
+}
 
-	// Loop through all layers
-	char layerName[64];
-	int layerId = 1;
-	for( int i = 0; i < minLayerCount; ++i, ++layerId )
-	{
-		glBeginQuery( GL_SAMPLES_PASSED, queryId );
+void LayerGenerator::setEncodings( ShsFile::Encoding heights, ShsFile::Encoding normals )
+{
+	_heightEncoding = heights;
+	_normalEncoding = normals;
+}
 
-		Canvas::instance()->updateGL();
+void LayerGenerator::setCompression( ShsFile::Compression compression )
+{
+	_compression = compression;
+}
 
-		glEndQuery( GL_SAMPLES_PASSED );
+void LayerGenerator::setMaxHeightError( float maxError )
+{
+	_maxHeightError = maxError;
+}
 
-		glGetQueryObjectuiv( queryId, GL_QUERY_RESULT, &queryResult );
-		printf( "LAYER ID: %d     SAMPLES PASSED: %d\n", layerId, queryResult );
+void LayerGenerator::setPyramid( bool enabled )
+{
+	_pyramid = enabled;
+}
 
-		if( queryResult == 0 )
-		{
-			printf( "No samples passed, terminating...\n" );
-			break;
-		}
+void LayerGenerator::setConeMaps( bool enabled )
+{
+	_coneMaps = enabled;
+}
+
+void LayerGenerator::setStreamingBudgets( int memoryMB, int textureMB )
+{
+	_streamingMemoryMB = memoryMB;
+	_streamingTextureMB = textureMB;
+}
+
+void LayerGenerator::setShaderNormals( bool enabled )
+{
+	_shaderNormals = enabled;
+}
 
-		// Read pixels from fbo
-		glReadPixels( _vp[0], _vp[1], _width, _height, GL_RGBA, GL_FLOAT, &pixels[0] );
+void LayerGenerator::setTexelTraversal( bool enabled )
+{
+	_texelTraversal = enabled;
+	Canvas::instance()->layerShaderManager().setUniformi( "u_texelTraversal", enabled ? 1 : 0 );
+}
 
-		// Save render texture to file
-		sprintf_s( layerName, "../data/out/layer%d", layerId );
-		saveLayer( layerName, &pixels[0] );
+void LayerGenerator::setTileSize( int size )
+{
+	_tileSize = vr::max( size, 1 );
+}
 
-		// Swap reference texture <-> render texture.
-		// The fragment shader always reads from texture unit 0 (zero).
-		if( i % 2 )
-		{
-			// Shader texture
-			glActiveTexture( GL_TEXTURE0 );
-			glBindTexture( GL_TEXTURE_2D, _refTex );
-
-			// Render texture
-			glActiveTexture( GL_TEXTURE1 );
-			glBindTexture( GL_TEXTURE_2D, _renderTex );
-			glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _renderTex, 0 );
-		}
-		else
+bool LayerGenerator::checkDualPeeling( int width, int height )
+{
+	if( ( _model == NULL ) || ( width <= 0 ) || ( height <= 0 ) )
+		return false;
+
+	computeBoundingBox();
+	LayerFrame frame = LayerFrame::fromBox( _obox, 2 );
+
+	_width = width;
+	_height = height;
+	_vp[0] = 0;
+	_vp[1] = 0;
+	_vp[2] = _width;
+	_vp[3] = _height;
+	Canvas::instance()->setViewport( 0, 0, _width, _height );
+
+	// Normals are read back whatever the settings, ties only show in them
+	PeelingMethod method = _peelingMethod;
+	bool storeNormals = _storeNormals;
+	_storeNormals = true;
+
+	LayerSet layers[2];
+	const PeelingMethod methods[2] = { FRONT_TO_BACK, DUAL_DEPTH };
+	for( int i = 0; i < 2; ++i )
+	{
+		_peelingMethod = methods[i];
+		preparePeeling();
+		loadFrame( frame );
+		peelLayers( &layers[i], NULL );
+		_writeQueue.finish();
+		finishPeeling();
+	}
+
+	_peelingMethod = method;
+	_storeNormals = storeNormals;
+	Canvas::instance()->setViewport( 0, 0, Canvas::instance()->width(), Canvas::instance()->height() );
+
+	if( layers[0].layerCount() != layers[1].layerCount() )
+	{
+		printf( "Front to back peeling found %d layers, dual depth peeling %d\n", layers[0].layerCount(), layers[1].layerCount() );
+		return false;
+	}
+
+	unsigned int count = _width*_height;
+	int differences = 0;
+	for( int i = 0; i < layers[0].layerCount(); ++i )
+	{
+		for( unsigned int t = 0; t < count; ++t )
 		{
-			// Shader texture
-			glActiveTexture( GL_TEXTURE0 );
-			glBindTexture( GL_TEXTURE_2D, _renderTex );
-
-			// Render texture
-			glActiveTexture( GL_TEXTURE1 );
-			glBindTexture( GL_TEXTURE_2D, _refTex );
-			glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _refTex, 0 );
+			float height0 = layers[0].heights( i )[t];
+			float height1 = layers[1].heights( i )[t];
+			vr::vec3f normal0( &layers[0].normals( i )[t*3] );
+			vr::vec3f normal1( &layers[1].normals( i )[t*3] );
+			if( ( height0 == height1 ) && ( ( normal0 - normal1 ).length() < 1e-5f ) )
+				continue;
+
+			if( differences < 10 )
+				printf( "Layer %d, texel (%d, %d): height %f against %f, normal (%.3f, %.3f, %.3f) against (%.3f, %.3f, %.3f)\n",
+						i, t % _width, t / _width, height0, height1, normal0.x, normal0.y, normal0.z, normal1.x, normal1.y, normal1.z );
+			++differences;
 		}
 	}
+	printf( "%d layers of %dx%d compared, %d texels differ\n", layers[0].layerCount(), _width, _height, differences );
+	return differences == 0;
+}
 
-	// Cleanup
-	glDeleteQueries( 1, &queryId );
+void LayerGenerator::generateLayersSoftware( int width, int height, SoftwareMethod method )
+{
+	if( _model == NULL )
+		return;
 
-	endLayerGeneration();
+	_width = width;
+	_height = height;
 
-	glMatrixMode( GL_MODELVIEW );
-	glPopMatrix();
-	glMatrixMode( GL_PROJECTION );
-	glPopMatrix();
+	TriangleMesh mesh;
+	mesh.build( _model->rawData() );
+	printf( "*** Generating Layers (CPU): %d triangles ***\n", mesh.triangleCount() );
 
-	Canvas::instance()->resetShaders();
+	LayerFrame frame = estimateBestFrame();
+
+	if( method == RAY_CASTING )
+	{
+		LayerSet layers;
+		BvhLayerGenerator generator;
+		generator.setMesh( &mesh );
+		generator.setFrame( frame );
+		generator.setResolution( _width, _height );
+		generator.generateLayers( layers );
+		saveLayers( layers, frame );
+	}
+	else
+	{
+		// Tiles are written as they are resolved, full layers are never in memory
+		TiledLayerWriter writer;
+		if( !openWriter( writer, _width, _height, frame ) )
+			return;
+
+		SoftwareLayerGenerator generator;
+		generator.setMesh( &mesh );
+		generator.setFrame( frame );
+		generator.setResolution( _width, _height );
+		generator.generateLayers( writer );
+	}
 }
 
 void LayerGenerator::deleteAllLayers()
@@ -345,7 +495,7 @@ void LayerGenerator::deleteAllLayers()
 	// Remove previously generated files
 	QDir outDir( "../data/out" ) ;
 	QStringList exts;
-	exts << "*.height" << "*.normal" << "*.bmp";
+	exts << "*.shs" << "*.height" << "*.normal" << "*.frame" << "*.bmp";
 	QStringList files = outDir.entryList( exts );
 	for( unsigned int i = 0; i < files.size(); ++i )
 	{
@@ -363,80 +513,9 @@ const AABB& LayerGenerator::boundingBox()
 	return _bbox;
 }
 
-void LayerGenerator::saveLayer( const std::string& filename, float* pixels )
+const OrientedBox& LayerGenerator::orientedBoundingBox()
 {
-	unsigned int count = _width * _height;
-
-	//////////////////////////////////////////////////////////////////////////
-	// Height Map
-	//////////////////////////////////////////////////////////////////////////
-	std::ofstream heightOut( (filename + ".height").c_str(), std::ios_base::binary );
-	if( !heightOut )
-		return;
-
-	// Save height map as unsigned char image for debugging
-	// Note: will be inverted since qt uses different image origin
-	QImage testImgHeight( _width, _height, QImage::Format_RGB32 );
-	int i = 0;
-	for( int y = 0; y < _height; ++y )
-	{
-		for( int x = 0; x < _width; ++x )
-		{
-			// Convert R value to "height"
-			pixels[i] = ( pixels[i] == 0.0f ) ? 0.0f : 1.0f - pixels[i];
-			testImgHeight.setPixel( x, y, qRgb( (int)(pixels[i]*255.0f), 0, 0 ) );
-			i+=4;
-		}
-	}
-	testImgHeight.save( (filename + ".height.bmp").c_str() );
-
-	// Save image description in binary file
-	heightOut.write( (const char*)&_width, sizeof(int) );
-	heightOut.write( (const char*)&_height, sizeof(int) );
-
-	// Save R component as height map
-	for( int i = 0, k = 0; i < count; ++i, k+=4 )
-	{
-		//pixels[k] = ( pixels[k] == 0.0f ) ? 0.0f : 1.0f - pixels[k];
-		heightOut.write( (const char*)(pixels + k), sizeof(float) );
-	}
-
-	heightOut.close();
-
-	//////////////////////////////////////////////////////////////////////////
-	// Normal Map
-	//////////////////////////////////////////////////////////////////////////
-	std::ofstream normalOut( (filename + ".normal").c_str(), std::ios_base::binary );
-	if( !normalOut )
-		return;
-
-	// Save normal map as unsigned char image for debugging
-	// Note: will be inverted since qt uses different image origin
-	QImage testImgNormal( _width, _height, QImage::Format_RGB32 );
-	i = 0;
-	for( int y = 0; y < _height; ++y )
-	{
-		for( int x = 0; x < _width; ++x )
-		{
-			testImgNormal.setPixel( x, y, qRgb( (int)( vr::abs(pixels[i+1]*255.0f) ), 
-				                                (int)( vr::abs(pixels[i+2]*255.0f) ), 
-												(int)( vr::abs(pixels[i+3]*255.0f) ) ) );
-			i+=4;
-		}
-	}
-	testImgNormal.save( (filename + ".normal.bmp").c_str() );
-
-	// Save image description in binary file
-	normalOut.write( (const char*)&_width, sizeof(int) );
-	normalOut.write( (const char*)&_height, sizeof(int) );
-
-	// Save GBA components as normal map
-	for( int i = 0, k = 0; i < count; ++i, k+=4 )
-	{
-		normalOut.write( (const char*)(pixels + k + 1), sizeof(float)*3 );
-	}
-
-	normalOut.close();
+	return _obox;
 }
 
 void LayerGenerator::beginLayerLoading()
@@ -446,6 +525,19 @@ void LayerGenerator::beginLayerLoading()
 	layerShaderManager.reset();
 	layerShaderManager.setFragmentProgram( "../shaders/rayCast_FS.glsl" );
 	layerShaderManager.setVertexProgram( "../shaders/rayCast_VS.glsl" );
+	layerShaderManager.addUniformi( "u_computeNormals", _shaderNormals ? 1 : 0 );
+	layerShaderManager.addUniformi( "u_texelTraversal", _texelTraversal ? 1 : 0 );
+	layerShaderManager.addUniformi( "u_bricked", 0 );
+	_layerTextures.destroy();
+	_legacyLayers.clear();
+
+	// Streamed and progressively loaded layers are replaced as well
+	Canvas::instance()->setBrickTextures( NULL );
+	_brickTextures.close();
+	Canvas::instance()->setProgressiveLayers( NULL );
+	_progressiveLayers.close();
+
+	_hasLayerFrame = false;
 }
 
 void LayerGenerator::loadLayerToOpenGL( const std::string& filename )
@@ -469,18 +561,15 @@ void LayerGenerator::loadLayerToOpenGL( const std::string& filename )
 		return;
 	}
 
+	// All layers of a set share the frame stored as <prefix>.frame
+	if( !_hasLayerFrame )
+		_hasLayerFrame = _layerFrame.load( filePath + baseName.substr( 0, nb ) + ".frame" );
+
 	// Extract layer id string
 	std::string layerIdStr = baseName.substr( nb, baseName.length() - nb );
 	// Convert to number
 	unsigned int layerId = QString( layerIdStr.c_str() ).toInt();
 
-	// Base height uniform name
-	std::string baseHeightUniformName( "u_hm" );
-	std::string baseNormalUniformName( "u_normal" );
-
-	std::vector<float> pixels;
-	GLuint texId;
-
 	// Load heightmap
 	std::ifstream heightIn( (filePath + baseName + ".height").c_str(), std::ios_base::binary );
 	if( !heightIn )
@@ -490,83 +579,298 @@ void LayerGenerator::loadLayerToOpenGL( const std::string& filename )
 	heightIn.read( (char*)&_height, sizeof(int) );
 
 	unsigned int count = _width*_height;
+	std::vector<float> heights( count, -1.0f );
+	std::vector<float> normals( count*3, -1.0f );
 
-	pixels.reserve( count*3 );
-	pixels.resize( count*3, -1.0f );
-
-	heightIn.read( (char*)( &pixels[0] ), sizeof(float)*count );
+	heightIn.read( (char*)( &heights[0] ), sizeof(float)*count );
 	heightIn.close();
 
-	// Setup texture
-	glActiveTexture( GL_TEXTURE0 + layerId ); // TODO: is this guaranteed to work?
-	glGenTextures( 1, &texId );
-	glBindTexture( GL_TEXTURE_2D, texId );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_LUMINANCE32F_ARB, _width, _height, 0, GL_LUMINANCE, GL_FLOAT, &pixels[0] );
-
-	Canvas::instance()->layerShaderManager().addUniformi( ( baseHeightUniformName + layerIdStr ).c_str(), layerId );
-
-	// TODO: loading hard-coded texture unit 4 after height textures
-	// TODO: in other words, we assume we have only 4 heightmaps, if this changes we need to change here as well!
 	// Load normal map
 	std::ifstream normalIn( (filePath + baseName + ".normal").c_str(), std::ios_base::binary );
 	if( !normalIn )
 		return;
 
-	std::fill( pixels.begin(), pixels.end(), -1.0f );
-
 	normalIn.read( (char*)&_width, sizeof(int) );
 	normalIn.read( (char*)&_height, sizeof(int) );
 
-	normalIn.read( (char*)( &pixels[0] ), sizeof(float)*count*3 );
+	normalIn.read( (char*)( &normals[0] ), sizeof(float)*count*3 );
 	normalIn.close();
 
-	// Setup texture
-	// TODO: should be GL_LINEAR for improved image quality
-	// TODO: doesn't work in Quadro 3400
-	glActiveTexture( GL_TEXTURE0 + layerId + 6 );
-	glGenTextures( 1, &texId );
-	glBindTexture( GL_TEXTURE_2D, texId );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, /*GL_LINEAR*/ GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, /*GL_LINEAR*/ GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGB32F_ARB, _width, _height, 0, GL_RGB, GL_FLOAT, &pixels[0] );
-
-	Canvas::instance()->layerShaderManager().addUniformi( ( baseNormalUniformName + layerIdStr ).c_str(), layerId + 6 );
+	// Layers are numbered from 1 and come in any order, they go to OpenGL together in endLayerLoading
+	if( layerId == 0 )
+	{
+		printf( "Invalid layer file\n" );
+		return;
+	}
+	if( ( _legacyLayers.width() != _width ) || ( _legacyLayers.height() != _height ) )
+		_legacyLayers.resize( _width, _height, 0 );
+	while( _legacyLayers.layerCount() < (int)layerId )
+		_legacyLayers.addLayer();
+	std::copy( heights.begin(), heights.end(), _legacyLayers.heights( layerId - 1 ) );
+	std::copy( normals.begin(), normals.end(), _legacyLayers.normals( layerId - 1 ) );
 }
 
-void LayerGenerator::endLayerLoading()
+bool LayerGenerator::loadLayers( const std::string& filename )
 {
-	Canvas::instance()->layerShaderManager().initShaders();
-}
+	// Header and directory in one open. Mapped channels go straight to OpenGL,
+	// otherwise each one is read into a buffer first.
+	ShsFile file;
+	if( !file.open( filename ) )
+		return false;
+	if( file.isBricked() )
+	{
+		file.close();
+		return streamLayers( filename );
+	}
+	if( file.levelCount() > 0 )
+	{
+		file.close();
+		return loadProgressively( filename );
+	}
 
-int LayerGenerator::width() const
-{
-	return _width;
-}
+	_width = file.width();
+	_height = file.height();
+	if( file.hasFrame() )
+	{
+		_layerFrame = file.frame();
+		_hasLayerFrame = true;
+	}
 
-int LayerGenerator::height() const
-{
-	return _height;
-}
+	int layerCount = file.layerCount();
+	int maxLayers = LayerTextures::maxLayers();
+	if( layerCount > maxLayers )
+	{
+		printf( "Warning: only the first %d of %d layers are loaded\n", maxLayers, layerCount );
+		layerCount = maxLayers;
+	}
 
-/************************************************************************/
-/* Private                                                              */
-/************************************************************************/
+	// Octahedral normals stay encoded in texture memory, the shader decodes them
+	ShsFile::Encoding normalEncoding = ( layerCount > 0 ) ? file.encoding( 0, ShsFile::NORMAL ) : ShsFile::RAW_FLOAT32;
+	bool octNormals = !_shaderNormals && ( ( normalEncoding == ShsFile::NORMAL_OCT16 ) || ( normalEncoding == ShsFile::NORMAL_OCT8 ) );
+	ShaderManager& layerShaderManager = Canvas::instance()->layerShaderManager();
+	layerShaderManager.addUniformi( "u_octNormals", octNormals ? 1 : 0 );
+	layerShaderManager.addUniformf( "u_octScale", ( normalEncoding == ShsFile::NORMAL_OCT8 ) ? 255.0f / 254.0f : 65535.0f / 65534.0f );
+
+	// 16-bit heights go to a 16-bit array, rescaled from the layer range to [0,1].
+	// All layers of an array share its format, a single float layer makes it a float array.
+	bool unitHeights16 = ( layerCount > 0 );
+	for( int i = 0; i < layerCount; ++i )
+		unitHeights16 = unitHeights16 && ( file.layer( i ).channels[ShsFile::HEIGHT].encoding == ShsFile::HEIGHT_UNORM16 );
+	LayerTextures::Format heightFormat = { GL_LUMINANCE32F_ARB, GL_LUMINANCE, GL_FLOAT };
+	if( unitHeights16 )
+	{
+		heightFormat.internalFormat = GL_LUMINANCE16;
+		heightFormat.type = GL_UNSIGNED_SHORT;
+	}
+	LayerTextures::Format normalFormat = { GL_RGB32F_ARB, GL_RGB, GL_FLOAT };
+	if( octNormals )
+	{
+		bool oct16 = ( normalEncoding == ShsFile::NORMAL_OCT16 );
+		normalFormat.internalFormat = oct16 ? GL_LUMINANCE16_ALPHA16 : GL_LUMINANCE8_ALPHA8;
+		normalFormat.format = GL_LUMINANCE_ALPHA;
+		normalFormat.type = oct16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE;
+	}
+	_layerTextures.create( _width, _height, layerCount, heightFormat, _shaderNormals ? NULL : &normalFormat, layerShaderManager );
+	HeightBounds bounds;
+	bounds.resize( _width, _height, layerCount );
 
-void LayerGenerator::minMaxVertices( vr::vec3d& minVertex, vr::vec3d& maxVertex, const double* vertices, unsigned int size ) const
-{
-	assert( vertices != NULL );
-	assert( size >= 3 );
-	assert( ( size % 3 ) == 0 );
+	unsigned int count = _width*_height;
+	std::vector<float> heightBuffer;
+	std::vector<float> normalBuffer;
+	std::vector<vr::uint16> unitHeights;
+	std::vector<unsigned char> storedBuffer;
+	double textureBytes = 0.0;
+	for( int i = 0; i < layerCount; ++i )
+	{
+		const ShsFile::ChannelEntry& heightEntry = file.layer( i ).channels[ShsFile::HEIGHT];
+		if( unitHeights16 )
+		{
+			const void* stored = storedChannel( file, i, ShsFile::HEIGHT, storedBuffer );
+			if( stored == NULL )
+				return false;
+			unitHeights.resize( count );
+			LayerEncoding::unitHeights16( (const vr::uint16*)stored, count, heightEntry.rangeMin, heightEntry.rangeMax, &unitHeights[0] );
+			_layerTextures.uploadHeights( i, 0, 0, _width, _height, &unitHeights[0] );
+			bounds.build( i, &unitHeights[0] );
+			textureBytes += count * 2.0;
+		}
 
-	// Get initial values
-	minVertex.set( &vertices[0] );
-	maxVertex.set( &vertices[0] );
+		// Float heights are needed for raw textures and for deriving normals
+		const float* heights = file.heights( i );
+		bool deriveNormals = !_shaderNormals && !file.hasNormals();
+		if( ( heights == NULL ) && ( deriveNormals || !unitHeights16 ) )
+		{
+			heightBuffer.resize( count );
+			if( !file.readChannel( i, ShsFile::HEIGHT, &heightBuffer[0] ) )
+				return false;
+			heights = &heightBuffer[0];
+		}
+		if( !unitHeights16 )
+		{
+			_layerTextures.uploadHeights( i, 0, 0, _width, _height, heights );
+			bounds.build( i, heights );
+			textureBytes += count * 4.0;
+		}
+
+		if( _shaderNormals )
+			continue;
+
+		if( octNormals )
+		{
+			if( file.encoding( i, ShsFile::NORMAL ) != normalEncoding )
+			{
+				printf( "Warning: layers of %s mix normal encodings\n", filename.c_str() );
+				return false;
+			}
+
+			const void* stored = storedChannel( file, i, ShsFile::NORMAL, storedBuffer );
+			if( stored == NULL )
+				return false;
+			_layerTextures.uploadNormals( i, 0, 0, _width, _height, stored );
+			textureBytes += count * (double)ShsFile::texelSize( normalEncoding, ShsFile::NORMAL );
+			continue;
+		}
+
+		// Normals that are not stored are derived here, unless the shader does it
+		const float* normals = file.normals( i );
+		if( normals == NULL )
+		{
+			normalBuffer.resize( count*3 );
+			if( deriveNormals )
+				LayerSet::computeNormals( heights, _width, _height, file.hasFrame() ? &_layerFrame : NULL, i, &normalBuffer[0] );
+			else if( !file.readChannel( i, ShsFile::NORMAL, &normalBuffer[0] ) )
+				return false;
+			normals = &normalBuffer[0];
+		}
+		_layerTextures.uploadNormals( i, 0, 0, _width, _height, normals );
+		textureBytes += count * 12.0;
+	}
+
+	_layerTextures.uploadBounds( bounds, layerShaderManager );
+
+	// Cone maps of files that have them, the casts take longer steps
+	if( file.hasConeMaps() )
+	{
+		std::vector<vr::uint8> codes( count );
+		for( int i = 0; i < layerCount; ++i )
+		{
+			if( !file.readConeMap( i, &codes[0] ) )
+				return false;
+			_layerTextures.uploadConeMap( i, &codes[0], layerShaderManager );
+		}
+		textureBytes += (double)count * layerCount;
+	}
+
+	// Texture memory, to weigh encodings and stored, derived and shader normals against each other
+	printf( "Loaded %d layers of %dx%d from %s (%s normals, %.1f MB of textures)\n", layerCount, _width, _height, filename.c_str(),
+		    _shaderNormals ? "shader" : ( file.hasNormals() ? ( octNormals ? "octahedral" : "stored" ) : "derived" ), textureBytes / ( 1024.0 * 1024.0 ) );
+	return true;
+}
+
+void LayerGenerator::endLayerLoading()
+{
+	if( _legacyLayers.layerCount() > 0 )
+	{
+		uploadLayers( _legacyLayers );
+		_legacyLayers.clear();
+	}
+
+	// Layers without a frame are drawn in the unit cube, as before
+	Canvas::instance()->setLayerFrame( _hasLayerFrame ? &_layerFrame : NULL );
+
+	// Shader normals sample neighbors one texel away, progressive layers follow their level
+	if( ( _width > 0 ) && ( _height > 0 ) && !_progressiveLayers.isOpen() )
+		Canvas::instance()->layerShaderManager().addUniformf( "u_texelSize", 1.0f / vr::min( _width, _height ) );
+	Canvas::instance()->layerShaderManager().initShaders();
+}
+
+int LayerGenerator::width() const
+{
+	return _width;
+}
+
+int LayerGenerator::height() const
+{
+	return _height;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void LayerGenerator::uploadLayers( const LayerSet& layers )
+{
+	int layerCount = layers.layerCount();
+	int maxLayers = LayerTextures::maxLayers();
+	if( layerCount > maxLayers )
+	{
+		printf( "Warning: only the first %d of %d layers are loaded\n", maxLayers, layerCount );
+		layerCount = maxLayers;
+	}
+
+	LayerTextures::Format heightFormat = { GL_LUMINANCE32F_ARB, GL_LUMINANCE, GL_FLOAT };
+	LayerTextures::Format normalFormat = { GL_RGB32F_ARB, GL_RGB, GL_FLOAT };
+	ShaderManager& layerShaderManager = Canvas::instance()->layerShaderManager();
+	_layerTextures.create( layers.width(), layers.height(), layerCount, heightFormat, _shaderNormals ? NULL : &normalFormat, layerShaderManager );
+	HeightBounds bounds;
+	bounds.resize( layers.width(), layers.height(), layerCount );
+	for( int i = 0; i < layerCount; ++i )
+	{
+		_layerTextures.uploadHeights( i, 0, 0, layers.width(), layers.height(), layers.heights( i ) );
+		bounds.build( i, layers.heights( i ) );
+		if( !_shaderNormals )
+			_layerTextures.uploadNormals( i, 0, 0, layers.width(), layers.height(), layers.normals( i ) );
+	}
+	_layerTextures.uploadBounds( bounds, layerShaderManager );
+}
+
+bool LayerGenerator::streamLayers( const std::string& filename )
+{
+	ShaderManager& layerShaderManager = Canvas::instance()->layerShaderManager();
+	if( !_brickTextures.open( filename, LayerTextures::maxLayers(), (vr::uint64)_streamingMemoryMB << 20, (vr::uint64)_streamingTextureMB << 20,
+		                      _shaderNormals, layerShaderManager ) )
+		return false;
+
+	const ShsFile& file = _brickTextures.file();
+	_width = file.width();
+	_height = file.height();
+	if( file.hasFrame() )
+	{
+		_layerFrame = file.frame();
+		_hasLayerFrame = true;
+	}
+
+	Canvas::instance()->setBrickTextures( &_brickTextures );
+	return true;
+}
+
+bool LayerGenerator::loadProgressively( const std::string& filename )
+{
+	if( !_progressiveLayers.open( filename, LayerTextures::maxLayers(), _shaderNormals, Canvas::instance()->layerShaderManager() ) )
+		return false;
+
+	const ShsFile& file = _progressiveLayers.file();
+	_width = file.width();
+	_height = file.height();
+	if( file.hasFrame() )
+	{
+		_layerFrame = file.frame();
+		_hasLayerFrame = true;
+	}
+
+	Canvas::instance()->setProgressiveLayers( &_progressiveLayers );
+	return true;
+}
+
+void LayerGenerator::minMaxVertices( vr::vec3d& minVertex, vr::vec3d& maxVertex, const double* vertices, unsigned int size ) const
+{
+	assert( vertices != NULL );
+	assert( size >= 3 );
+	assert( ( size % 3 ) == 0 );
+
+	// Get initial values
+	minVertex.set( &vertices[0] );
+	maxVertex.set( &vertices[0] );
 
 	// For each vertex beyond first
 	for( unsigned int i = 3; i < size; i+=3 )
@@ -620,65 +924,648 @@ unsigned int LayerGenerator::computeLayersNeededWithStencil() const
 	return layerCount;
 }
 
-unsigned int LayerGenerator::computeLayersNeededWithQuery()
+LayerFrame LayerGenerator::estimateBestFrame()
 {
-	unsigned int queryId;
-	unsigned int queryResult;
-	unsigned int layerCount;
-	glGenQueries( 1, &queryId );
+	TriangleMesh mesh;
+	mesh.build( _model->rawData() );
 
-	beginLayerGeneration();
+	OrientationEstimator estimator;
+	estimator.setMesh( &mesh );
+	estimator.setExtraDirections( _extraDirections );
+
+	int best = estimator.estimate( _obox );
+	if( best < 0 )
+		return LayerFrame::fromBox( _obox, 1 );
+
+	printf( "Best orientation: %s (%d layers estimated)\n\n", estimator.candidate( best ).name.c_str(), estimator.candidate( best ).layerCount );
+	return estimator.candidate( best ).frame;
+}
+
+void LayerGenerator::peelBestAxis( QGLFramebufferObject& qfbo )
+{
+	//////////////////////////////////////////////////////////////////////////
+	// Minimize number of layers needed from 3 box faces: towards -Z, -X and -Y.
+	// Each axis is peeled only once: layers are counted and captured in the same passes.
+	// Only the best axis so far is kept, either in memory or spilled to disk.
+	//////////////////////////////////////////////////////////////////////////
+	static const int axisOrder[3] = { 2, 0, 1 };
+	static const char* axisNames[3] = { "x", "y", "z" };
+	static const char* cameraTestNames[3] = { "cameraTestX.bmp", "cameraTestY.bmp", "cameraTestZ.bmp" };
 
-	// While we generate fragments
-	for( layerCount = 0; layerCount < 100; ++layerCount )
+	LayerSet candidates[2];
+	TiledLayerWriter spills[2];
+	int best = -1;
+	int current = 0;
+	unsigned int minLayerCount = 0;
+
+	for( int i = 0; i < 3; ++i )
 	{
-		glBeginQuery( GL_SAMPLES_PASSED, queryId );
+		int axis = axisOrder[i];
+		loadFrame( LayerFrame::fromBox( _obox, axis ) );
 
+		// Test camera view
+		Canvas::instance()->shaderManager().setEnabled( false );
+		qfbo.bind();
 		Canvas::instance()->updateGL();
+		qfbo.release();
+		qfbo.toImage().save( cameraTestNames[axis] );
+		Canvas::instance()->shaderManager().setEnabled( true );
 
-		glEndQuery( GL_SAMPLES_PASSED );
+		// Count and capture layers for current viewpoint
+		if( _spillToDisk )
+		{
+			spills[current].setStoreNormals( _storeNormals );
+			spills[current].open( spillFilename( axis ), _width, _height );
+		}
+		unsigned int layerCount = peelLayers( _spillToDisk ? NULL : &candidates[current], &spills[current], 0, 0, false );
+		if( !_writeQueue.finish() )
+			printf( "Warning: some layers could not be spilled to %s\n", spillFilename( axis ).c_str() );
+		printf( "Layers needed (-%s): %d\n\n", axisNames[axis], layerCount );
 
-		glGetQueryObjectuiv( queryId, GL_QUERY_RESULT, &queryResult );
-		printf( "LAYER ID: %d     SAMPLES PASSED: %d\n", layerCount, queryResult );
+		// Ties keep the later axis, -Y is evaluated last as before
+		if( ( best < 0 ) || ( layerCount <= minLayerCount ) )
+		{
+			if( best >= 0 )
+				discardLayers( candidates[current^1], spills[current^1], axisOrder[best] );
+			best = i;
+			minLayerCount = layerCount;
+			current ^= 1;
+		}
+		else
+		{
+			discardLayers( candidates[current], spills[current], axis );
+		}
+	}
+
+	printf( "*** Saving Layers (-%s) ***\n", axisNames[axisOrder[best]] );
+
+	// Winner was stored in the other slot
+	keepLayers( candidates[current^1], spills[current^1], axisOrder[best] );
+}
+
+void LayerGenerator::preparePeeling()
+{
+	// Disable face culling, to guarantee we only discard fragments through z-test and our frag. shader
+	osg::StateSet* ss = _model->rawData()->getOrCreateStateSet();
+	ss->setMode( GL_CULL_FACE, osg::StateAttribute::OFF );
+	glDisable( GL_CULL_FACE );
+
+	_activePeeling = _peelingMethod;
+	if( ( _activePeeling == FRAGMENT_LISTS ) && !GLEW_VERSION_4_3 )
+	{
+		printf( "Warning: fragment lists need OpenGL 4.3, peeling front to back instead\n" );
+		_activePeeling = FRONT_TO_BACK;
+	}
+
+	// Setup fragment shader for depth peeling.
+	// Send correct shader parameters.
+	ShaderManager& shaders = Canvas::instance()->shaderManager();
+	shaders.reset();
+	shaders.setVertexProgram( "../shaders/createLayers_VS.glsl" );
+	switch( _activePeeling )
+	{
+	case DUAL_DEPTH:
+		shaders.setFragmentProgram( "../shaders/createLayersDual_FS.glsl" );
+		shaders.addUniformi( "minMaxTexSampler", 0 ); // shader always reads from unit 0
+		shaders.addUniformi( "normalPass", 0 ); // set before each draw
+		break;
+	case FRAGMENT_LISTS:
+		shaders.setFragmentProgram( "../shaders/createLayersList_FS.glsl" );
+		shaders.addUniformi( "u_width", _width );
+		shaders.addUniformi( "u_maxFragments", 0 ); // set before each pass
+		break;
+	default:
+		shaders.setFragmentProgram( "../shaders/createLayers_FS.glsl" );
+		shaders.addUniformi( "depthTexSampler", 0 ); // shader always reads from unit 0
+		break;
+	}
+	shaders.addUniformf( "invDepthTexWidth", 1.0f / (float)_width );
+	shaders.addUniformf( "invDepthTexHeight", 1.0f / (float)_height );
+	shaders.initShaders();
+
+	// Save previous OpenGL matrices
+	glMatrixMode( GL_MODELVIEW );
+	glPushMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPushMatrix();
+}
+
+void LayerGenerator::finishPeeling()
+{
+	glMatrixMode( GL_MODELVIEW );
+	glPopMatrix();
+	glMatrixMode( GL_PROJECTION );
+	glPopMatrix();
+
+	Canvas::instance()->resetShaders();
+}
+
+void LayerGenerator::loadFrame( const LayerFrame& frame )
+{
+	vr::vec3d center = frame.eye + frame.forward;
+
+	glMatrixMode( GL_PROJECTION );
+	glLoadIdentity();
+	glOrtho( -frame.halfWidth, frame.halfWidth, -frame.halfHeight, frame.halfHeight, frame.zNear, frame.zFar );
+
+	glMatrixMode( GL_MODELVIEW );
+	glLoadIdentity();
+	gluLookAt( frame.eye.x, frame.eye.y, frame.eye.z, center.x, center.y, center.z, frame.up.x, frame.up.y, frame.up.z );
+}
+
+unsigned int LayerGenerator::peelLayers( LayerSet* layers, TiledLayerWriter* writer, int x0, int y0, bool wholeLayers )
+{
+	if( _activePeeling == DUAL_DEPTH )
+		return peelLayersDual( layers, writer, x0, y0, wholeLayers );
+	if( _activePeeling == FRAGMENT_LISTS )
+		return peelLayersLists( layers, writer, x0, y0, wholeLayers );
+
+	// Normals are only read back when they are kept
+	bool readNormals = _storeNormals || ( _debugImages && wholeLayers );
+	int channels = readNormals ? 4 : 1;
+	unsigned int count = _width*_height;
+
+	// Each layer is read back into a pixel buffer of the ring, without waiting for it.
+	// The previous layer is taken while the current one is drawn: its sample count says whether
+	// peeling is over and its pixels are in the buffer by then, so the pipeline never drains.
+	unsigned int queryIds[READBACK_BUFFERS];
+	unsigned int pixelBuffers[READBACK_BUFFERS];
+	glGenQueries( READBACK_BUFFERS, queryIds );
+	glGenBuffers( READBACK_BUFFERS, pixelBuffers );
+	for( int i = 0; i < READBACK_BUFFERS; ++i )
+	{
+		glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBuffers[i] );
+		glBufferData( GL_PIXEL_PACK_BUFFER, count * channels * sizeof(float), NULL, GL_STREAM_READ );
+	}
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+	// Swapped with a free buffer by the write queue after each layer
+	std::vector<float> pixels( count * channels );
+
+	if( layers != NULL )
+		layers->resize( _width, _height, 0 );
+
+	beginLayerGeneration();
+
+	// Layers are taken one pass behind, the last pass only takes the last layer
+	unsigned int layerCount = 0;
+	for( int pass = 0; pass <= MAX_PEELED_LAYERS; ++pass )
+	{
+		if( pass < MAX_PEELED_LAYERS )
+			peelLayer( pass, queryIds[pass % READBACK_BUFFERS], pixelBuffers[pass % READBACK_BUFFERS], readNormals );
+
+		if( pass == 0 )
+			continue;
+
+		// Previous layer, queued before the current one and done by now or soon
+		int previous = ( pass - 1 ) % READBACK_BUFFERS;
+		unsigned int queryResult;
+		glGetQueryObjectuiv( queryIds[previous], GL_QUERY_RESULT, &queryResult );
+		printf( "LAYER ID: %d     SAMPLES PASSED: %d\n", pass, queryResult );
 
 		if( queryResult == 0 )
 		{
+			// The current layer is empty as well and is dropped
 			printf( "No samples passed, terminating...\n" );
 			break;
 		}
 
-		// Swap reference texture <-> render texture.
-		// The fragment shader always reads from texture unit 0 (zero).
-		if( layerCount % 2 )
+		// Copy out of the mapped buffer, conversion and writing happen in the background
+		if( !readPixelBuffer( pixelBuffers[previous], pixels ) )
 		{
-			// Shader texture
-			glActiveTexture( GL_TEXTURE0 );
-			glBindTexture( GL_TEXTURE_2D, _refTex );
-
-			// Render texture
-			glActiveTexture( GL_TEXTURE1 );
-			glBindTexture( GL_TEXTURE_2D, _renderTex );
-			glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _renderTex, 0 );
+			printf( "Warning: could not map layer %d, terminating...\n", pass );
+			break;
 		}
-		else
+
+		std::string debugName;
+		if( _debugImages && wholeLayers )
 		{
-			// Shader texture
-			glActiveTexture( GL_TEXTURE0 );
-			glBindTexture( GL_TEXTURE_2D, _renderTex );
-
-			// Render texture
-			glActiveTexture( GL_TEXTURE1 );
-			glBindTexture( GL_TEXTURE_2D, _refTex );
-			glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _refTex, 0 );
+			char layerName[64];
+			sprintf( layerName, "../data/out/layer%d", layerCount + 1 );
+			debugName = layerName;
 		}
+
+		if( layers != NULL )
+			_writeQueue.convert( *layers, _width, _height, pixels, debugName );
+		else
+			_writeQueue.write( *writer, layerCount, x0, y0, _width, _height, pixels, debugName );
+		++layerCount;
 	}
 
-	glDeleteQueries( 1, &queryId );
+	glDeleteBuffers( READBACK_BUFFERS, pixelBuffers );
+	glDeleteQueries( READBACK_BUFFERS, queryIds );
 	endLayerGeneration();
 
 	return layerCount;
 }
 
+void LayerGenerator::peelLayer( int pass, unsigned int queryId, unsigned int pixelBuffer, bool readNormals )
+{
+	glBeginQuery( GL_SAMPLES_PASSED, queryId );
+
+	Canvas::instance()->updateGL();
+
+	glEndQuery( GL_SAMPLES_PASSED );
+
+	// Capture layer while it is still in the fbo. Into a pixel buffer, glReadPixels returns at once.
+	// Depth alone is in the red channel.
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBuffer );
+	glReadPixels( _vp[0], _vp[1], _width, _height, readNormals ? GL_RGBA : GL_RED, GL_FLOAT, NULL );
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+	// Swap reference texture <-> render texture.
+	// The fragment shader always reads from texture unit 0 (zero).
+	if( pass % 2 )
+	{
+		// Shader texture
+		glActiveTexture( GL_TEXTURE0 );
+		glBindTexture( GL_TEXTURE_2D, _refTex );
+
+		// Render texture
+		glActiveTexture( GL_TEXTURE1 );
+		glBindTexture( GL_TEXTURE_2D, _renderTex );
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _renderTex, 0 );
+	}
+	else
+	{
+		// Shader texture
+		glActiveTexture( GL_TEXTURE0 );
+		glBindTexture( GL_TEXTURE_2D, _renderTex );
+
+		// Render texture
+		glActiveTexture( GL_TEXTURE1 );
+		glBindTexture( GL_TEXTURE_2D, _refTex );
+		glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _refTex, 0 );
+	}
+}
+
+unsigned int LayerGenerator::peelLayersDual( LayerSet* layers, TiledLayerWriter* writer, int x0, int y0, bool wholeLayers )
+{
+	bool readNormals = _storeNormals || ( _debugImages && wholeLayers );
+	int channels = readNormals ? 4 : 1;
+	unsigned int count = _width*_height;
+
+	// Front and back layers go through the pixel buffer ring as in peelLayers, two buffers per pass
+	unsigned int queryIds[READBACK_BUFFERS];
+	unsigned int pixelBuffers[READBACK_BUFFERS*2];
+	glGenQueries( READBACK_BUFFERS, queryIds );
+	glGenBuffers( READBACK_BUFFERS*2, pixelBuffers );
+	for( int i = 0; i < READBACK_BUFFERS*2; ++i )
+	{
+		glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBuffers[i] );
+		glBufferData( GL_PIXEL_PACK_BUFFER, count * channels * sizeof(float), NULL, GL_STREAM_READ );
+	}
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+
+	if( layers != NULL )
+		layers->resize( _width, _height, 0 );
+
+	beginDualGeneration();
+
+	// Pass 0 only finds the nearest and farthest surfaces, pass p > 0 peels front and back layers p.
+	// Layers are taken one pass behind, the last pass only takes the last layers.
+	std::vector< std::vector<float> > fronts;
+	std::vector< std::vector<float> > backs;
+	int maxPasses = MAX_PEELED_LAYERS / 2 + 1;
+
+	// Reserved for every pass, growing would copy every layer read so far
+	fronts.reserve( maxPasses );
+	backs.reserve( maxPasses );
+	int passCount = 0;
+	for( int pass = 0; pass <= maxPasses; ++pass )
+	{
+		if( pass < maxPasses )
+		{
+			peelDualPass( pass, queryIds[pass % READBACK_BUFFERS], &pixelBuffers[( pass % READBACK_BUFFERS ) * 2], readNormals );
+			++passCount;
+		}
+
+		if( pass == 0 )
+			continue;
+
+		int previous = ( pass - 1 ) % READBACK_BUFFERS;
+		unsigned int queryResult;
+		glGetQueryObjectuiv( queryIds[previous], GL_QUERY_RESULT, &queryResult );
+		printf( "PASS: %d     SAMPLES PASSED: %d\n", pass, queryResult );
+
+		if( queryResult == 0 )
+		{
+			printf( "No samples passed, terminating...\n" );
+			break;
+		}
+		if( pass == 1 )
+			continue;
+
+		fronts.push_back( std::vector<float>( count * channels ) );
+		backs.push_back( std::vector<float>( count * channels ) );
+		if( !readPixelBuffer( pixelBuffers[previous*2], fronts.back() ) || !readPixelBuffer( pixelBuffers[previous*2 + 1], backs.back() ) )
+		{
+			printf( "Warning: could not map layers of pass %d, terminating...\n", pass );
+			fronts.pop_back();
+			backs.pop_back();
+			break;
+		}
+	}
+
+	glDeleteBuffers( READBACK_BUFFERS*2, pixelBuffers );
+	glDeleteQueries( READBACK_BUFFERS, queryIds );
+	endDualGeneration();
+
+	// Only now is the number of layers of each texel known
+	std::vector< std::vector<float> > merged;
+	mergeDualLayers( fronts, backs, count, channels, merged );
+	std::vector< std::vector<float> >().swap( fronts );
+	std::vector< std::vector<float> >().swap( backs );
+
+	for( unsigned int i = 0; i < merged.size(); ++i )
+	{
+		std::string debugName;
+		if( _debugImages && wholeLayers )
+		{
+			char layerName[64];
+			sprintf( layerName, "../data/out/layer%d", i + 1 );
+			debugName = layerName;
+		}
+
+		if( layers != NULL )
+			_writeQueue.convert( *layers, _width, _height, merged[i], debugName );
+		else
+			_writeQueue.write( *writer, i, x0, y0, _width, _height, merged[i], debugName );
+		std::vector<float>().swap( merged[i] );
+	}
+
+	printf( "%d layers peeled in %d passes\n", (int)merged.size(), passCount );
+	return (unsigned int)merged.size();
+}
+
+void LayerGenerator::peelDualPass( int pass, unsigned int queryId, const unsigned int* pixelBuffers, bool readNormals )
+{
+	// Depths of this pass go to one min max texture while the shader reads the other one from unit 0
+	glActiveTexture( GL_TEXTURE0 );
+	glBindTexture( GL_TEXTURE_2D, _minMaxTex[pass % 2] );
+	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _minMaxTex[( pass + 1 ) % 2], 0 );
+
+	// Samples of the depth draw alone say whether anything was left to peel
+	Canvas::instance()->shaderManager().setUniformi( "normalPass", 0 );
+	glBeginQuery( GL_SAMPLES_PASSED, queryId );
+
+	Canvas::instance()->updateGL();
+
+	glEndQuery( GL_SAMPLES_PASSED );
+
+	if( readNormals )
+		drawDualNormals();
+
+	// Front and back layers, read back without waiting
+	GLenum format = readNormals ? GL_RGBA : GL_RED;
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBuffers[0] );
+	glReadBuffer( GL_COLOR_ATTACHMENT1_EXT );
+	glReadPixels( _vp[0], _vp[1], _width, _height, format, GL_FLOAT, NULL );
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, pixelBuffers[1] );
+	glReadBuffer( GL_COLOR_ATTACHMENT2_EXT );
+	glReadPixels( _vp[0], _vp[1], _width, _height, format, GL_FLOAT, NULL );
+	glBindBuffer( GL_PIXEL_PACK_BUFFER, 0 );
+}
+
+void LayerGenerator::drawDualNormals()
+{
+	// The next range was drawn already, only the layers are cleared and drawn again
+	GLenum drawBuffers[3] = { GL_NONE, GL_COLOR_ATTACHMENT1_EXT, GL_COLOR_ATTACHMENT2_EXT };
+	glDrawBuffers( 3, drawBuffers );
+
+	// The canvas clears depth but not stencil
+	glClearStencil( 0 );
+	glClear( GL_STENCIL_BUFFER_BIT );
+
+	// Front, back and both kinds of fragments have their own depth, see createLayersDual_FS.glsl.
+	// The stencil counts the fragments written, two at most.
+	osg::StateSet* ss = _model->rawData()->getOrCreateStateSet();
+	osg::Stencil* stencil = new osg::Stencil;
+	stencil->setFunction( osg::Stencil::GREATER, 2, ~0u );
+	stencil->setOperation( osg::Stencil::KEEP, osg::Stencil::KEEP, osg::Stencil::INCR );
+	ss->setAttributeAndModes( new osg::Depth( osg::Depth::NOTEQUAL ), osg::StateAttribute::ON );
+	ss->setAttributeAndModes( stencil, osg::StateAttribute::ON );
+	Canvas::instance()->shaderManager().setUniformi( "normalPass", 1 );
+
+	Canvas::instance()->updateGL();
+
+	ss->removeAttribute( osg::StateAttribute::DEPTH );
+	ss->removeAttribute( osg::StateAttribute::STENCIL );
+	ss->removeMode( GL_STENCIL_TEST );
+	ss->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF );
+
+	drawBuffers[0] = GL_COLOR_ATTACHMENT0_EXT;
+	glDrawBuffers( 3, drawBuffers );
+}
+
+unsigned int LayerGenerator::peelLayersLists( LayerSet* layers, TiledLayerWriter* writer, int x0, int y0, bool wholeLayers )
+{
+	bool readNormals = _storeNormals || ( _debugImages && wholeLayers );
+	int channels = readNormals ? 4 : 1;
+	unsigned int count = _width*_height;
+
+	if( layers != NULL )
+		layers->resize( _width, _height, 0 );
+
+	beginListGeneration( channels );
+
+	// Fragments beyond the largest buffer the driver takes are dropped
+	GLint64 maxBlockSize = 0;
+	glGetInteger64v( GL_MAX_SHADER_STORAGE_BLOCK_SIZE, &maxBlockSize );
+	unsigned int maxFragments = (unsigned int)vr::min( maxBlockSize / FRAGMENT_BYTES, (GLint64)0x7fffffff );
+	if( _listCapacity == 0 )
+		_listCapacity = count * INITIAL_LIST_LAYERS;
+	_listCapacity = vr::min( _listCapacity, maxFragments );
+
+	// One geometry pass, a second one when the fragments did not fit
+	unsigned int fragmentCount = 0;
+	for( int attempt = 0; attempt < 2; ++attempt )
+	{
+		glBindBuffer( GL_SHADER_STORAGE_BUFFER, _fragmentBuffer );
+		glBufferData( GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)_listCapacity * FRAGMENT_BYTES, NULL, GL_DYNAMIC_COPY );
+		glBindBuffer( GL_SHADER_STORAGE_BUFFER, _headBuffer );
+		glClearBufferData( GL_SHADER_STORAGE_BUFFER, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, &LIST_END );
+		glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+		GLuint zero = 0;
+		glBindBuffer( GL_ATOMIC_COUNTER_BUFFER, _fragmentCounter );
+		glBufferSubData( GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &zero );
+
+		Canvas::instance()->shaderManager().setUniformi( "u_maxFragments", (int)_listCapacity );
+		Canvas::instance()->updateGL();
+
+		glMemoryBarrier( GL_BUFFER_UPDATE_BARRIER_BIT );
+		glGetBufferSubData( GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(GLuint), &fragmentCount );
+		glBindBuffer( GL_ATOMIC_COUNTER_BUFFER, 0 );
+		printf( "FRAGMENTS: %u     CAPACITY: %u\n", fragmentCount, _listCapacity );
+
+		if( fragmentCount <= _listCapacity )
+			break;
+
+		// Some room for the next tiles, which are likely alike
+		unsigned int capacity = vr::min( fragmentCount + fragmentCount / 4, maxFragments );
+		if( capacity <= _listCapacity )
+		{
+			printf( "Warning: only %u of %u fragments fit in a list buffer, use smaller tiles\n", _listCapacity, fragmentCount );
+			break;
+		}
+		_listCapacity = capacity;
+	}
+
+	// Sort each list nearest first, which also gives the most layers of a texel
+	GLuint zero = 0;
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, _listInfoBuffer );
+	glBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &zero );
+	glMemoryBarrier( GL_SHADER_STORAGE_BARRIER_BIT );
+	GLuint groupsX = ( _width + 7 ) / 8;
+	GLuint groupsY = ( _height + 7 ) / 8;
+	_sortShaders.bindProgram();
+	glDispatchCompute( groupsX, groupsY, 1 );
+	_sortShaders.unbindProgram();
+
+	GLuint layerCount = 0;
+	glMemoryBarrier( GL_BUFFER_UPDATE_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT );
+	glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, 0, sizeof(GLuint), &layerCount );
+	printf( "Layers needed: %u\n", layerCount );
+
+	// A few layers at a time through the layer buffer, then to the write queue
+	std::vector<float> pixels( count * channels );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, _layerBuffer );
+	for( unsigned int first = 0; first < layerCount; first += LIST_LAYERS_PER_DISPATCH )
+	{
+		int batch = (int)vr::min( layerCount - first, (unsigned int)LIST_LAYERS_PER_DISPATCH );
+		_writeLayersShaders.setUniformi( "u_firstLayer", (int)first );
+		_writeLayersShaders.setUniformi( "u_layerCount", batch );
+		_writeLayersShaders.bindProgram();
+		glDispatchCompute( groupsX, groupsY, 1 );
+		_writeLayersShaders.unbindProgram();
+		glMemoryBarrier( GL_BUFFER_UPDATE_BARRIER_BIT );
+
+		for( int i = 0; i < batch; ++i )
+		{
+			glGetBufferSubData( GL_SHADER_STORAGE_BUFFER, (GLintptr)i * pixels.size() * sizeof(float), pixels.size() * sizeof(float), &pixels[0] );
+
+			std::string debugName;
+			if( _debugImages && wholeLayers )
+			{
+				char layerName[64];
+				sprintf( layerName, "../data/out/layer%d", first + i + 1 );
+				debugName = layerName;
+			}
+
+			if( layers != NULL )
+				_writeQueue.convert( *layers, _width, _height, pixels, debugName );
+			else
+				_writeQueue.write( *writer, first + i, x0, y0, _width, _height, pixels, debugName );
+		}
+	}
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+
+	endListGeneration();
+
+	return layerCount;
+}
+
+std::string LayerGenerator::spillFilename( int axis ) const
+{
+	static const char* axisNames[3] = { "x", "y", "z" };
+	return std::string( "../data/out/axis_" ) + axisNames[axis] + ".shs";
+}
+
+void LayerGenerator::discardLayers( LayerSet& layers, TiledLayerWriter& spill, int axis )
+{
+	layers.clear();
+
+	if( !_spillToDisk )
+		return;
+
+	spill.close();
+	QDir().remove( spillFilename( axis ).c_str() );
+}
+
+void LayerGenerator::keepLayers( LayerSet& layers, TiledLayerWriter& spill, int axis )
+{
+	LayerFrame frame = LayerFrame::fromBox( _obox, axis );
+
+	if( !_spillToDisk )
+	{
+		saveLayers( layers, frame );
+		layers.clear();
+	}
+	else
+	{
+		// Complete the spilled file and move it into place, encoding it if needed
+		spill.setFrame( frame );
+		spill.setBoundingBox( _obox );
+		if( !spill.close() )
+			return;
+
+		QDir outDir;
+		outDir.remove( LAYER_FILE );
+		if( ( _heightEncoding == ShsFile::RAW_FLOAT32 ) && ( !_storeNormals || ( _normalEncoding == ShsFile::RAW_FLOAT32 ) ) &&
+			( _compression == ShsFile::COMPRESSION_NONE ) && !_pyramid && !_coneMaps )
+		{
+			outDir.rename( spillFilename( axis ).c_str(), LAYER_FILE );
+		}
+		else
+		{
+			TiledLayerWriter::transcode( spillFilename( axis ), LAYER_FILE, _heightEncoding, _storeNormals ? _normalEncoding : ShsFile::NOT_STORED,
+				                         _compression, _maxHeightError, 0, _pyramid ? ShsFile::pyramidLevels( spill.width(), spill.height() ) : 0,
+				                         _coneMaps );
+			outDir.remove( spillFilename( axis ).c_str() );
+		}
+	}
+
+	// From the written file either way, so that spilling does not change the images
+	if( _debugImages )
+		saveLayerImages( LAYER_FILE );
+}
+
+void LayerGenerator::saveLayerImages( const std::string& filename ) const
+{
+	ShsFile file;
+	if( !file.open( filename ) )
+		return;
+
+	// One layer at a time, normals that are not stored are derived from heights
+	std::vector<float> heights( (size_t)file.width() * file.height() );
+	std::vector<float> normals( heights.size() * 3 );
+	char layerName[64];
+	for( int i = 0; i < file.layerCount(); ++i )
+	{
+		if( !file.readChannel( i, ShsFile::HEIGHT, &heights[0] ) || !file.readChannel( i, ShsFile::NORMAL, &normals[0] ) )
+			return;
+		sprintf( layerName, "../data/out/layer%d", i + 1 );
+		LayerWriteQueue::saveDebugImages( layerName, &heights[0], &normals[0], file.width(), file.height() );
+	}
+}
+
+bool LayerGenerator::openWriter( TiledLayerWriter& writer, int width, int height, const LayerFrame& frame ) const
+{
+	writer.setStoreNormals( _storeNormals );
+	writer.setEncodings( _heightEncoding, _normalEncoding );
+	writer.setCompression( _compression );
+	writer.setMaxHeightError( _maxHeightError );
+	writer.setPyramidLevels( _pyramid ? ShsFile::pyramidLevels( width, height ) : 0 );
+	writer.setConeMaps( _coneMaps );
+	if( !writer.open( LAYER_FILE, width, height ) )
+		return false;
+
+	writer.setFrame( frame );
+	writer.setBoundingBox( _obox );
+	return true;
+}
+
+bool LayerGenerator::saveLayers( const LayerSet& layers, const LayerFrame& frame ) const
+{
+	// The whole set is a single tile
+	TiledLayerWriter writer;
+	if( !openWriter( writer, layers.width(), layers.height(), frame ) )
+		return false;
+	if( !writer.writeTile( layers, 0, 0 ) )
+		return false;
+	return writer.close();
+}
+
 void LayerGenerator::beginLayerGeneration()
 {
 	// Create FBO to store frame buffer image in floating point precision
@@ -692,28 +1579,15 @@ void LayerGenerator::beginLayerGeneration()
 	glFramebufferRenderbufferEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, _depthBuffer );
 
 	// Setup reference texture
-	glActiveTexture( GL_TEXTURE0 );
-	glGenTextures( 1, &_refTex );
-	glBindTexture( GL_TEXTURE_2D, _refTex );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-
 	// Initial values should be small enough so first test always pass
 	std::vector<float> pixels( _width*_height*4 );
 	std::fill( pixels.begin(), pixels.end(), -1000.0f );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, _width, _height, 0, GL_RGBA, GL_FLOAT, &pixels[0] );
+	glActiveTexture( GL_TEXTURE0 );
+	_refTex = createPeelTexture( &pixels[0] );
 
 	// Setup render texture
 	glActiveTexture( GL_TEXTURE1 );
-	glGenTextures( 1, &_renderTex );
-	glBindTexture( GL_TEXTURE_2D, _renderTex );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
-	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
-	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, _width, _height, 0, GL_RGBA, GL_FLOAT, NULL );
+	_renderTex = createPeelTexture( NULL );
 
 	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _renderTex, 0 );
 
@@ -721,10 +1595,15 @@ void LayerGenerator::beginLayerGeneration()
 	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
 	if( status != GL_FRAMEBUFFER_COMPLETE_EXT )
 		printf( "Warning: failed to initialize FBO in layer generation!\n" );
+
+	// Layers are drawn into the fbo, swapping the window buffers after each one would only wait
+	Canvas::instance()->setAutoBufferSwap( false );
 }
 
 void LayerGenerator::endLayerGeneration()
 {
+	Canvas::instance()->setAutoBufferSwap( true );
+
 	glDeleteRenderbuffersEXT( 1, &_depthBuffer );
 	glDeleteFramebuffersEXT( 1, &_fbo );
 	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
@@ -738,3 +1617,161 @@ void LayerGenerator::endLayerGeneration()
 	glActiveTexture( GL_TEXTURE0 );
 	glBindTexture( GL_TEXTURE_2D, 0 );
 }
+
+void LayerGenerator::beginDualGeneration()
+{
+	// Blending keeps the nearest and farthest fragments, the depth test is off so that every one reaches
+	// the shader. Only the normal draws test against the depth and stencil buffer.
+	glGenFramebuffersEXT( 1, &_fbo );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, _fbo );
+
+	glGenRenderbuffersEXT( 1, &_depthBuffer );
+	glBindRenderbufferEXT( GL_RENDERBUFFER_EXT, _depthBuffer );
+	glRenderbufferStorageEXT( GL_RENDERBUFFER_EXT, GL_DEPTH24_STENCIL8_EXT, _width, _height );
+	glFramebufferRenderbufferEXT( GL_FRAMEBUFFER_EXT, GL_DEPTH_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, _depthBuffer );
+	glFramebufferRenderbufferEXT( GL_FRAMEBUFFER_EXT, GL_STENCIL_ATTACHMENT_EXT, GL_RENDERBUFFER_EXT, _depthBuffer );
+
+	// Before the first pass every surface lies between -1 and 2 (the farthest depth is stored negated)
+	std::vector<float> pixels( _width*_height*4 );
+	for( unsigned int i = 0; i < pixels.size(); i+=4 )
+	{
+		pixels[i] = -1.0f;
+		pixels[i+1] = -2.0f;
+		pixels[i+2] = 1.0f;
+		pixels[i+3] = 1.0f;
+	}
+	glActiveTexture( GL_TEXTURE0 );
+	_minMaxTex[0] = createPeelTexture( &pixels[0] );
+	_minMaxTex[1] = createPeelTexture( NULL );
+	_frontTex = createPeelTexture( NULL );
+	_backTex = createPeelTexture( NULL );
+
+	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT0_EXT, GL_TEXTURE_2D, _minMaxTex[1], 0 );
+	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT1_EXT, GL_TEXTURE_2D, _frontTex, 0 );
+	glFramebufferTexture2DEXT( GL_FRAMEBUFFER_EXT, GL_COLOR_ATTACHMENT2_EXT, GL_TEXTURE_2D, _backTex, 0 );
+	GLenum drawBuffers[3] = { GL_COLOR_ATTACHMENT0_EXT, GL_COLOR_ATTACHMENT1_EXT, GL_COLOR_ATTACHMENT2_EXT };
+	glDrawBuffers( 3, drawBuffers );
+
+	GLenum status = glCheckFramebufferStatusEXT( GL_FRAMEBUFFER_EXT );
+	if( status != GL_FRAMEBUFFER_COMPLETE_EXT )
+		printf( "Warning: failed to initialize FBO in dual layer generation!\n" );
+
+	// Targets are cleared to 1 by the canvas and the shader writes 1 to leave them as they are.
+	// The negated farthest depth must not be clamped.
+	osg::StateSet* ss = _model->rawData()->getOrCreateStateSet();
+	ss->setAttributeAndModes( new osg::BlendEquation( osg::BlendEquation::RGBA_MIN ), osg::StateAttribute::ON );
+	ss->setMode( GL_DEPTH_TEST, osg::StateAttribute::OFF );
+	glClampColorARB( GL_CLAMP_FRAGMENT_COLOR_ARB, GL_FALSE );
+
+	Canvas::instance()->setAutoBufferSwap( false );
+}
+
+void LayerGenerator::endDualGeneration()
+{
+	Canvas::instance()->setAutoBufferSwap( true );
+
+	osg::StateSet* ss = _model->rawData()->getOrCreateStateSet();
+	ss->removeAttribute( osg::StateAttribute::BLENDEQUATION );
+	ss->removeMode( GL_BLEND );
+	ss->removeMode( GL_DEPTH_TEST );
+	glClampColorARB( GL_CLAMP_FRAGMENT_COLOR_ARB, GL_FIXED_ONLY_ARB );
+
+	glDeleteRenderbuffersEXT( 1, &_depthBuffer );
+	glDeleteFramebuffersEXT( 1, &_fbo );
+	glBindFramebufferEXT( GL_FRAMEBUFFER_EXT, 0 );
+	glDrawBuffer( GL_BACK );
+	glReadBuffer( GL_BACK );
+
+	glDeleteTextures( 2, _minMaxTex );
+	glDeleteTextures( 1, &_frontTex );
+	glDeleteTextures( 1, &_backTex );
+
+	glActiveTexture( GL_TEXTURE0 );
+	glBindTexture( GL_TEXTURE_2D, 0 );
+}
+
+void LayerGenerator::beginListGeneration( int channels )
+{
+	// Nothing is drawn: an fbo without attachments only sets the size of the pass
+	glGenFramebuffers( 1, &_fbo );
+	glBindFramebuffer( GL_FRAMEBUFFER, _fbo );
+	glFramebufferParameteri( GL_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_WIDTH, _width );
+	glFramebufferParameteri( GL_FRAMEBUFFER, GL_FRAMEBUFFER_DEFAULT_HEIGHT, _height );
+	GLenum status = glCheckFramebufferStatus( GL_FRAMEBUFFER );
+	if( status != GL_FRAMEBUFFER_COMPLETE )
+		printf( "Warning: failed to initialize FBO in fragment list generation!\n" );
+
+	// Bindings as in the list shaders, the fragment buffer is sized before each pass
+	GLsizeiptr count = _width*_height;
+	glGenBuffers( 1, &_headBuffer );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, _headBuffer );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, count * sizeof(GLuint), NULL, GL_DYNAMIC_COPY );
+	glGenBuffers( 1, &_fragmentBuffer );
+	glGenBuffers( 1, &_listInfoBuffer );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, _listInfoBuffer );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_COPY );
+	glGenBuffers( 1, &_layerBuffer );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, _layerBuffer );
+	glBufferData( GL_SHADER_STORAGE_BUFFER, count * channels * LIST_LAYERS_PER_DISPATCH * sizeof(float), NULL, GL_STREAM_READ );
+	glBindBuffer( GL_SHADER_STORAGE_BUFFER, 0 );
+	glGenBuffers( 1, &_fragmentCounter );
+	glBindBuffer( GL_ATOMIC_COUNTER_BUFFER, _fragmentCounter );
+	glBufferData( GL_ATOMIC_COUNTER_BUFFER, sizeof(GLuint), NULL, GL_DYNAMIC_COPY );
+	glBindBuffer( GL_ATOMIC_COUNTER_BUFFER, 0 );
+
+	glBindBufferBase( GL_ATOMIC_COUNTER_BUFFER, 0, _fragmentCounter );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 0, _headBuffer );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 1, _fragmentBuffer );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 2, _listInfoBuffer );
+	glBindBufferBase( GL_SHADER_STORAGE_BUFFER, 3, _layerBuffer );
+
+	_sortShaders.reset();
+	_sortShaders.setComputeProgram( "../shaders/sortFragmentLists_CS.glsl" );
+	_sortShaders.addUniformi( "u_width", _width );
+	_sortShaders.addUniformi( "u_height", _height );
+	_sortShaders.initShaders();
+
+	_writeLayersShaders.reset();
+	_writeLayersShaders.setComputeProgram( "../shaders/writeLayers_CS.glsl" );
+	_writeLayersShaders.addUniformi( "u_width", _width );
+	_writeLayersShaders.addUniformi( "u_height", _height );
+	_writeLayersShaders.addUniformi( "u_channels", channels );
+	_writeLayersShaders.addUniformi( "u_firstLayer", 0 );
+	_writeLayersShaders.addUniformi( "u_layerCount", 0 );
+	_writeLayersShaders.initShaders();
+
+	Canvas::instance()->setAutoBufferSwap( false );
+}
+
+void LayerGenerator::endListGeneration()
+{
+	Canvas::instance()->setAutoBufferSwap( true );
+
+	_sortShaders.reset();
+	_writeLayersShaders.reset();
+
+	for( GLuint i = 0; i < 4; ++i )
+		glBindBufferBase( GL_SHADER_STORAGE_BUFFER, i, 0 );
+	glBindBufferBase( GL_ATOMIC_COUNTER_BUFFER, 0, 0 );
+	glDeleteBuffers( 1, &_headBuffer );
+	glDeleteBuffers( 1, &_fragmentBuffer );
+	glDeleteBuffers( 1, &_fragmentCounter );
+	glDeleteBuffers( 1, &_listInfoBuffer );
+	glDeleteBuffers( 1, &_layerBuffer );
+
+	glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+	glDeleteFramebuffers( 1, &_fbo );
+}
+
+unsigned int LayerGenerator::createPeelTexture( const float* pixels ) const
+{
+	unsigned int texId;
+	glGenTextures( 1, &texId );
+	glBindTexture( GL_TEXTURE_2D, texId );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+	glTexImage2D( GL_TEXTURE_2D, 0, GL_RGBA32F_ARB, _width, _height, 0, GL_RGBA, GL_FLOAT, pixels );
+	return texId;
+}
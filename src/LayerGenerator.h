@@ -4,28 +4,131 @@
 #include <vector>
 #include <vr/vec3.h>
 #include "AABB.h"
+#include "OrientedBox.h"
+#include "LayerFrame.h"
+#include "LayerSet.h"
+#include "TiledLayerWriter.h"
 #include "ShaderManager.h"
+#include "BrickTextureCache.h"
+#include "ProgressiveLayerLoader.h"
+#include "LayerTextures.h"
+#include "LayerWriteQueue.h"
 #include <tecosg/OsgRenderer.h>
 
+class QGLFramebufferObject;
+
 class LayerGenerator
 {
+public:
+	enum SoftwareMethod
+	{
+		RASTERIZATION,
+		RAY_CASTING,
+	};
+
+	enum PeelingMethod
+	{
+		FRONT_TO_BACK,  // one geometry pass per layer
+		DUAL_DEPTH,     // nearest and farthest layers in each pass
+		FRAGMENT_LISTS, // one pass into per-pixel fragment lists, sorted by a compute shader
+	};
+
 public:
 	LayerGenerator();
 
 	void setCurrentModel( tecosg::OsgModel* model );
 	void computeBoundingBox();
+
+	// Layers at the current viewport size
 	void generateLayers();
 
+	// Layers at any resolution, peeled tile by tile in an offscreen FBO and written
+	// straight to the layer file. Memory is bounded by the tile size.
+	void generateLayers( int width, int height );
+
+	// Largest tile edge for generateLayers, 2048 by default (also capped by the driver)
+	void setTileSize( int size );
+
+	// Keep the best axis layers on disk instead of in memory during generateLayers
+	void setSpillToDisk( bool enabled );
+
+	// Save whole generated layers as BMP images in ../data/out for debugging, off by default
+	void setDebugImages( bool enabled );
+
+	// How layers are peeled on the GPU, FRONT_TO_BACK by default. All methods give the same layers.
+	// DUAL_DEPTH peels the nearest and the farthest remaining surfaces in the same pass, which takes
+	// about half the passes. It needs float blending and keeps the layers of a tile in memory until
+	// the last pass. FRAGMENT_LISTS draws the geometry once whatever the depth complexity, at the
+	// cost of storing every fragment of a tile on the GPU. It needs OpenGL 4.3, front to back
+	// peeling is used without it.
+	void setPeelingMethod( PeelingMethod method );
+
+	// Choose orientation from a coarse depth complexity estimate (default),
+	// instead of peeling all three axes at full resolution
+	void setCoarseSearch( bool enabled );
+
+	// Coarse search also tries box and face diagonals
+	void setExtraDirections( bool enabled );
+
+	// Fit layers to a tight oriented box (default) instead of the world-axis AABB.
+	// Takes effect on the next computeBoundingBox.
+	void setOrientedBox( bool enabled );
+
+	// Store normal maps next to heights (default). Without them files are four times
+	// smaller and normals are derived from heights on load.
+	void setStoreNormals( bool enabled );
+
+	// Channel encodings of generated layer files, raw floats by default. Compact heights
+	// (16 bits) and octahedral normals (16 or 8 bits) also stay compact in texture memory.
+	void setEncodings( ShsFile::Encoding heights, ShsFile::Encoding normals );
+
+	// Lossless compression of generated layer files, none by default
+	void setCompression( ShsFile::Compression compression );
+
+	// Error bound of HEIGHT_QUANTIZED heights, in model units
+	void setMaxHeightError( float maxError );
+
+	// Store coarser levels down to 256 texels in generated layer files, for progressive loading.
+	// Off by default.
+	void setPyramid( bool enabled );
+
+	// Store cone maps in generated layer files, so that ray casts of loaded files take longer
+	// safe steps (see ConeMaps). Files loaded whole use them, bricked and progressive loading
+	// do not. Off by default.
+	void setConeMaps( bool enabled );
+
+	// Let the ray casting shader derive normals from heights instead of uploading normal maps.
+	// Takes effect on the next beginLayerLoading.
+	void setShaderNormals( bool enabled );
+
+	// Let the ray casting shader walk the layers texel by texel instead of stepping linearly.
+	// Takes effect at once.
+	void setTexelTraversal( bool enabled );
+
+	// CPU layer generation along the estimated best orientation, does not need an OpenGL context
+	void generateLayersSoftware( int width, int height, SoftwareMethod method = RASTERIZATION );
+
+	// Peels the current model front to back and with dual depth peeling at width x height, looking
+	// down its Z axis, and compares both texel by texel. True when depths and normals agree.
+	bool checkDualPeeling( int width, int height );
+
 	void deleteAllLayers();
 
 	tecosg::OsgModel* currentModel();
 	const AABB& boundingBox();
+	const OrientedBox& orientedBoundingBox();
 
-	// Converts height (red component) to 1 - value
-	void saveLayer( const std::string& filename, float* pixels );
+	// Memory and texture memory for bricked layer files, in MB, 1024 and 512 by default.
+	// Takes effect on the next loadLayers.
+	void setStreamingBudgets( int memoryMB, int textureMB );
 
 	// Load height and normal maps
 	void beginLayerLoading();
+	// Loads every layer of a .shs file, along with its frame.
+	// Bricked files are streamed instead, see BrickTextureCache, and files with
+	// a pyramid are loaded coarsest level first, see ProgressiveLayerLoader.
+	bool loadLayers( const std::string& filename );
+	// Legacy per-layer .height/.normal files
 	void loadLayerToOpenGL( const std::string& filename );
 	void endLayerLoading();
 
@@ -35,14 +138,81 @@ public:
 private:
 	void minMaxVertices( vr::vec3d& minVertex, vr::vec3d& maxVertex, const double* vertices, unsigned int size ) const;
 	unsigned int computeLayersNeededWithStencil() const;
-	unsigned int computeLayersNeededWithQuery();
+
+	LayerFrame estimateBestFrame();
+
+	// Peels all three axes at full resolution and saves the one with fewest layers
+	void peelBestAxis( QGLFramebufferObject& qfbo );
+
+	// Shader and OpenGL state around peeling passes of _width x _height
+	void preparePeeling();
+	void finishPeeling();
+
+	// Sets up OpenGL matrices to look through given frame
+	void loadFrame( const LayerFrame& frame );
+
+	// Peels all layers from the current viewpoint, counting and capturing them in the same passes.
+	// Layers go to memory when layers is not NULL, otherwise to the open writer with the lower left
+	// texel at (x0, y0). They are converted and written by _writeQueue while the next one is peeled,
+	// so they are complete after its finish(). Whole layers are saved as debug images when enabled.
+	unsigned int peelLayers( LayerSet* layers, TiledLayerWriter* writer, int x0 = 0, int y0 = 0, bool wholeLayers = true );
+
+	// Draws the layer of given pass counting its samples with queryId, starts reading it back into
+	// pixelBuffer (depth only unless readNormals) and makes it the reference for the next pass
+	void peelLayer( int pass, unsigned int queryId, unsigned int pixelBuffer, bool readNormals );
+
+	// Same as peelLayers with dual depth peeling. Front and back layers are merged into the
+	// front to back order when peeling is over, and only then queued for writing.
+	unsigned int peelLayersDual( LayerSet* layers, TiledLayerWriter* writer, int x0, int y0, bool wholeLayers );
+
+	// Draws the front and back layers of given pass, reading them back into pixelBuffers[0] and [1]
+	void peelDualPass( int pass, unsigned int queryId, const unsigned int* pixelBuffers, bool readNormals );
+
+	// Draws again to write the normals of the front and back layers, one fragment each
+	void drawDualNormals();
+
+	// Same as peelLayers with fragment lists. The geometry is drawn again only when the fragments
+	// do not fit, with room for as many as were drawn. Sorted lists are written a few layers at a time.
+	unsigned int peelLayersLists( LayerSet* layers, TiledLayerWriter* writer, int x0, int y0, bool wholeLayers );
+
+	// Float heights, their pyramids and normals of every layer to _layerTextures,
+	// without normals when the shader computes them
+	void uploadLayers( const LayerSet& layers );
+
+	// Bricks of the file go to texture memory as the view needs them, starting from a coarse level
+	bool streamLayers( const std::string& filename );
+
+	// The coarsest level of the file goes to texture memory at once, finer levels as they are read
+	bool loadProgressively( const std::string& filename );
+
+	// Opens writer on LAYER_FILE with the normal and encoding settings, for layers seen through frame
+	bool openWriter( TiledLayerWriter& writer, int width, int height, const LayerFrame& frame ) const;
+	bool saveLayers( const LayerSet& layers, const LayerFrame& frame ) const;
+
+	std::string spillFilename( int axis ) const;
+	void discardLayers( LayerSet& layers, TiledLayerWriter& spill, int axis );
+	void keepLayers( LayerSet& layers, TiledLayerWriter& spill, int axis );
+	// Debug images of every layer of a written file, as the peeling passes save them
+	void saveLayerImages( const std::string& filename ) const;
 
 	void beginLayerGeneration();
 	void endLayerGeneration();
 
+	// Targets of dual depth peeling, with a depth and stencil buffer only the normal draws test against
+	void beginDualGeneration();
+	void endDualGeneration();
+
+	// Buffers and compute shaders of fragment lists, layers of channels floats per texel
+	void beginListGeneration( int channels );
+	void endListGeneration();
+
+	// RGBA float texture of _width x _height on the active unit, for peeling
+	unsigned int createPeelTexture( const float* pixels ) const;
+
 private:
 	tecosg::OsgModel* _model;
 	AABB _bbox;
+	OrientedBox _obox;
 	int _vp[4];
 	int _width;
 	int _height;
@@ -50,6 +220,43 @@ private:
 	unsigned int _depthBuffer;
 	unsigned int _refTex;
 	unsigned int _renderTex;
+	unsigned int _minMaxTex[2];
+	unsigned int _frontTex;
+	unsigned int _backTex;
+	unsigned int _headBuffer;
+	unsigned int _fragmentBuffer;
+	unsigned int _fragmentCounter;
+	unsigned int _listInfoBuffer;
+	unsigned int _layerBuffer;
+	unsigned int _listCapacity; // fragments, kept from tile to tile
+	ShaderManager _sortShaders;
+	ShaderManager _writeLayersShaders;
+	bool _spillToDisk;
+	bool _debugImages;
+	PeelingMethod _peelingMethod;
+	PeelingMethod _activePeeling; // _peelingMethod when the driver supports it
+	bool _coarseSearch;
+	bool _extraDirections;
+	bool _orientedBox;
+	int _tileSize;
+	bool _storeNormals;
+	bool _shaderNormals;
+	bool _texelTraversal;
+	ShsFile::Encoding _heightEncoding;
+	ShsFile::Encoding _normalEncoding;
+	ShsFile::Compression _compression;
+	float _maxHeightError;
+	bool _pyramid;
+	bool _coneMaps;
+	int _streamingMemoryMB;
+	int _streamingTextureMB;
+	LayerWriteQueue _writeQueue;
+	BrickTextureCache _brickTextures;
+	ProgressiveLayerLoader _progressiveLayers;
+	LayerTextures _layerTextures;
+	LayerSet _legacyLayers; // .height/.normal files, until endLayerLoading
+	LayerFrame _layerFrame;
+	bool _hasLayerFrame;
 };
 
 #endif // _LAYERGENERATOR_H_
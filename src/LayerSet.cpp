@@ -0,0 +1,172 @@
+#include "LayerSet.h"
+#include "ShsFile.h"
+#include "TiledLayerWriter.h"
+#include <cfloat>
+
+LayerSet::LayerSet()
+: _width( 0 ), _height( 0 )
+{
+	// empty
+}
+
+void LayerSet::resize( int width, int height, int layerCount )
+{
+	clear();
+
+	_width = width;
+	_height = height;
+
+	unsigned int count = _width * _height;
+	_heights.resize( layerCount );
+	_normals.resize( layerCount );
+	for( int i = 0; i < layerCount; ++i )
+	{
+		_heights[i].resize( count, 0.0f );
+		_normals[i].resize( count*3, 1.0f );
+	}
+}
+
+void LayerSet::clear()
+{
+	_width = 0;
+	_height = 0;
+	_heights.clear();
+	_normals.clear();
+}
+
+int LayerSet::addLayer()
+{
+	unsigned int count = _width * _height;
+	_heights.push_back( std::vector<float>( count, 0.0f ) );
+	_normals.push_back( std::vector<float>( count*3, 1.0f ) );
+	return (int)_heights.size() - 1;
+}
+
+int LayerSet::addLayer( std::vector<float>& heights, std::vector<float>& normals )
+{
+	_heights.push_back( std::vector<float>() );
+	_normals.push_back( std::vector<float>() );
+	_heights.back().swap( heights );
+	_normals.back().swap( normals );
+	heights.clear();
+	normals.clear();
+	return (int)_heights.size() - 1;
+}
+
+int LayerSet::width() const
+{
+	return _width;
+}
+
+int LayerSet::height() const
+{
+	return _height;
+}
+
+int LayerSet::layerCount() const
+{
+	return (int)_heights.size();
+}
+
+float* LayerSet::heights( int layer )
+{
+	return &_heights[layer][0];
+}
+
+const float* LayerSet::heights( int layer ) const
+{
+	return &_heights[layer][0];
+}
+
+float* LayerSet::normals( int layer )
+{
+	return &_normals[layer][0];
+}
+
+const float* LayerSet::normals( int layer ) const
+{
+	return &_normals[layer][0];
+}
+
+bool LayerSet::save( const std::string& filename, const LayerFrame& frame, const OrientedBox& box, bool storeNormals ) const
+{
+	// The whole set is a single tile
+	TiledLayerWriter writer;
+	writer.setStoreNormals( storeNormals );
+	if( !writer.open( filename, _width, _height ) )
+		return false;
+
+	writer.setFrame( frame );
+	writer.setBoundingBox( box );
+	if( !writer.writeTile( *this, 0, 0 ) )
+		return false;
+	return writer.close();
+}
+
+bool LayerSet::load( const std::string& filename )
+{
+	ShsFile file;
+	if( !file.open( filename ) )
+		return false;
+	return file.readLayers( *this );
+}
+
+void LayerSet::computeNormals( const LayerFrame* frame )
+{
+	for( int i = 0; i < layerCount(); ++i )
+		computeNormals( heights( i ), _width, _height, frame, i, normals( i ) );
+}
+
+// Height difference towards the neighbors at -offset and +offset. Empty neighbors are ignored,
+// and the smaller one-sided difference wins so that steps between surfaces do not tilt the normal.
+static inline float heightDifference( const float* h, int offset, bool hasPrev, bool hasNext )
+{
+	float prev = ( hasPrev && ( h[-offset] != 0.0f ) ) ? h[0] - h[-offset] : FLT_MAX;
+	float next = ( hasNext && ( h[offset] != 0.0f ) ) ? h[offset] - h[0] : FLT_MAX;
+	if( ( prev == FLT_MAX ) && ( next == FLT_MAX ) )
+		return 0.0f;
+	return ( vr::abs( prev ) < vr::abs( next ) ) ? prev : next;
+}
+
+void LayerSet::computeNormals( const float* heights, int width, int height, const LayerFrame* frame,
+							   int layer, float* normals )
+{
+	// Texel and height extents in eye space
+	float sx = 1.0f / width;
+	float sy = 1.0f / height;
+	float sz = 1.0f;
+	if( frame != NULL )
+	{
+		sx = (float)( 2.0 * frame->halfWidth / width );
+		sy = (float)( 2.0 * frame->halfHeight / height );
+		sz = (float)( frame->zFar - frame->zNear );
+	}
+	float facing = ( layer % 2 ) ? -1.0f : 1.0f;
+
+	// Rows are independent
+#pragma omp parallel for
+	for( int y = 0; y < height; ++y )
+	{
+		const float* h = heights + (vr::int64)y * width;
+		float* n = normals + (vr::int64)y * width * 3;
+		for( int x = 0; x < width; ++x, ++h, n+=3 )
+		{
+			if( *h == 0.0f )
+			{
+				n[0] = 1.0f;
+				n[1] = 1.0f;
+				n[2] = 1.0f;
+				continue;
+			}
+
+			// Cross product of the tangents (sx, 0, dx*sz) and (0, sy, dy*sz), divided by sx*sy
+			float dx = heightDifference( h, 1, x > 0, x < width - 1 );
+			float dy = heightDifference( h, width, y > 0, y < height - 1 );
+			vr::vec3f normal( -dx * sz / sx, -dy * sz / sy, 1.0f );
+			normal.normalize();
+			n[0] = normal.x * facing;
+			n[1] = normal.y * facing;
+			n[2] = normal.z * facing;
+		}
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef _LAYERSET_H_
+#define _LAYERSET_H_
+
+#include "LayerFrame.h"
+#include "OrientedBox.h"
+#include <vector>
+#include <string>
+
+/*!
+	In-memory set of layers, laid out exactly as the raw channels of a .shs file:
+	one float per texel for heights and three floats per texel for normals,
+	rows from bottom to top. Empty texels have height 0 and normal (1,1,1).
+ */
+class LayerSet
+{
+public:
+	LayerSet();
+
+	// Discards previous contents and allocates empty layers
+	void resize( int width, int height, int layerCount );
+	void clear();
+
+	// Appends an empty layer and returns its index
+	int addLayer();
+
+	// Appends a layer with the contents of heights and normals (width*height texels),
+	// which are swapped in without a copy and left empty
+	int addLayer( std::vector<float>& heights, std::vector<float>& normals );
+
+	int width() const;
+	int height() const;
+	int layerCount() const;
+
+	float* heights( int layer );
+	const float* heights( int layer ) const;
+
+	float* normals( int layer );
+	const float* normals( int layer ) const;
+
+	// Writes every layer to a .shs file, along with the frame and box they were generated in.
+	// Without normals, readers derive them from heights.
+	bool save( const std::string& filename, const LayerFrame& frame, const OrientedBox& box, bool storeNormals = true ) const;
+
+	// Reads every layer of a .shs file
+	bool load( const std::string& filename );
+
+	// Rebuilds every normal map from its height map, see below
+	void computeNormals( const LayerFrame* frame );
+
+	// Eye space normals of the height field, as stored by the generators. Frame gives the texel
+	// and height scales (unit cube when NULL). Layers alternate between surfaces facing the
+	// viewer (even index) and facing away. Empty texels get (1,1,1).
+	static void computeNormals( const float* heights, int width, int height, const LayerFrame* frame,
+		                        int layer, float* normals );
+
+private:
+	int _width;
+	int _height;
+	std::vector< std::vector<float> > _heights;
+	std::vector< std::vector<float> > _normals;
+};
+
+#endif // _LAYERSET_H_
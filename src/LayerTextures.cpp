@@ -0,0 +1,164 @@
+#include "LayerTextures.h"
+#include <vr/math.h>
+
+LayerTextures::LayerTextures()
+: _layerCount( 0 ), _width( 0 ), _height( 0 ), _heights( 0 ), _normals( 0 ), _bounds( 0 ), _cones( 0 )
+{
+	_heightFormat.internalFormat = GL_LUMINANCE32F_ARB;
+	_heightFormat.format = GL_LUMINANCE;
+	_heightFormat.type = GL_FLOAT;
+	_normalFormat.internalFormat = GL_RGB32F_ARB;
+	_normalFormat.format = GL_RGB;
+	_normalFormat.type = GL_FLOAT;
+}
+
+LayerTextures::~LayerTextures()
+{
+	destroy();
+}
+
+int LayerTextures::maxLayers()
+{
+	GLint maxLayers = 0;
+	glGetIntegerv( GL_MAX_ARRAY_TEXTURE_LAYERS_EXT, &maxLayers );
+	return maxLayers;
+}
+
+void LayerTextures::create( int width, int height, int layerCount, const Format& heights, const Format* normals, ShaderManager& shaderManager )
+{
+	// Texture objects are kept, only the storage is specified again
+	if( ( normals == NULL ) && ( _normals != 0 ) )
+	{
+		glDeleteTextures( 1, &_normals );
+		_normals = 0;
+	}
+	if( _bounds != 0 )
+	{
+		glDeleteTextures( 1, &_bounds );
+		_bounds = 0;
+	}
+	if( _cones != 0 )
+	{
+		glDeleteTextures( 1, &_cones );
+		_cones = 0;
+	}
+
+	_layerCount = layerCount;
+	_width = width;
+	_height = height;
+	_heightFormat = heights;
+	createArray( _heights, HEIGHT_UNIT, heights, width, height );
+	if( normals != NULL )
+	{
+		_normalFormat = *normals;
+		createArray( _normals, NORMAL_UNIT, *normals, width, height );
+	}
+
+	shaderManager.setUniformi( "u_heights", HEIGHT_UNIT );
+	shaderManager.setUniformi( "u_normals", NORMAL_UNIT );
+	shaderManager.setUniformi( "u_layerCount", layerCount );
+	shaderManager.setUniform2f( "u_layerSize", (float)width, (float)height );
+	shaderManager.setUniformi( "u_heightBounds", BOUNDS_UNIT );
+	shaderManager.setUniformi( "u_boundsLevels", 0 );
+	shaderManager.setUniformi( "u_cones", CONE_UNIT );
+	shaderManager.setUniformi( "u_coneMaps", 0 );
+}
+
+void LayerTextures::destroy()
+{
+	if( _heights != 0 )
+		glDeleteTextures( 1, &_heights );
+	if( _normals != 0 )
+		glDeleteTextures( 1, &_normals );
+	if( _bounds != 0 )
+		glDeleteTextures( 1, &_bounds );
+	if( _cones != 0 )
+		glDeleteTextures( 1, &_cones );
+	_heights = 0;
+	_normals = 0;
+	_bounds = 0;
+	_cones = 0;
+	_layerCount = 0;
+	_width = 0;
+	_height = 0;
+}
+
+void LayerTextures::uploadHeights( int layer, int x, int y, int width, int height, const void* data )
+{
+	upload( _heights, HEIGHT_UNIT, _heightFormat, layer, x, y, width, height, data );
+}
+
+void LayerTextures::uploadNormals( int layer, int x, int y, int width, int height, const void* data )
+{
+	upload( _normals, NORMAL_UNIT, _normalFormat, layer, x, y, width, height, data );
+}
+
+void LayerTextures::uploadBounds( const HeightBounds& bounds, ShaderManager& shaderManager )
+{
+	if( ( bounds.levelCount() == 0 ) || ( bounds.layerCount() < _layerCount ) )
+		return;
+
+	Format format = { GL_LUMINANCE_ALPHA32F_ARB, GL_LUMINANCE_ALPHA, GL_FLOAT };
+	createArray( _bounds, BOUNDS_UNIT, format, bounds.atlasWidth(), bounds.atlasHeight() );
+	for( int i = 0; i < _layerCount; ++i )
+		upload( _bounds, BOUNDS_UNIT, format, i, 0, 0, bounds.atlasWidth(), bounds.atlasHeight(), bounds.atlas( i ) );
+
+	shaderManager.setUniformi( "u_boundsLevels", bounds.levelCount() );
+	shaderManager.setUniformf( "u_boundsPaddedWidth", (float)bounds.paddedWidth() );
+	shaderManager.setUniform2f( "u_boundsAtlasSize", (float)bounds.atlasWidth(), (float)bounds.atlasHeight() );
+}
+
+void LayerTextures::uploadConeMap( int layer, const vr::uint8* codes, ShaderManager& shaderManager )
+{
+	Format format = { GL_LUMINANCE8, GL_LUMINANCE, GL_UNSIGNED_BYTE };
+	if( _cones == 0 )
+	{
+		createArray( _cones, CONE_UNIT, format, _width, _height );
+		shaderManager.setUniformi( "u_coneMaps", 1 );
+		shaderManager.setUniformf( "u_coneScale", (float)vr::max( _width, _height ) );
+	}
+	upload( _cones, CONE_UNIT, format, layer, 0, 0, _width, _height, codes );
+}
+
+int LayerTextures::layerCount() const
+{
+	return _layerCount;
+}
+
+bool LayerTextures::hasNormals() const
+{
+	return _normals != 0;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void LayerTextures::createArray( unsigned int& texture, int unit, const Format& format, int width, int height )
+{
+	glActiveTexture( GL_TEXTURE0 + unit );
+	if( texture == 0 )
+		glGenTextures( 1, &texture );
+	glBindTexture( GL_TEXTURE_2D_ARRAY_EXT, texture );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MIN_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_MAG_FILTER, GL_NEAREST );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE );
+	glTexParameteri( GL_TEXTURE_2D_ARRAY_EXT, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE );
+
+	// An array needs at least one layer, the shader never reads past u_layerCount
+	glTexImage3D( GL_TEXTURE_2D_ARRAY_EXT, 0, format.internalFormat, width, height, vr::max( _layerCount, 1 ), 0,
+		          format.format, format.type, NULL );
+}
+
+void LayerTextures::upload( unsigned int texture, int unit, const Format& format, int layer, int x, int y, int width, int height, const void* data )
+{
+	if( ( texture == 0 ) || ( layer >= _layerCount ) )
+		return;
+
+	glActiveTexture( GL_TEXTURE0 + unit );
+	glBindTexture( GL_TEXTURE_2D_ARRAY_EXT, texture );
+	// 16-bit rows are not always a multiple of 4 bytes
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 1 );
+	glTexSubImage3D( GL_TEXTURE_2D_ARRAY_EXT, 0, x, y, layer, width, height, 1, format.format, format.type, data );
+	glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
+}
@@ -0,0 +1,79 @@
+#ifndef _LAYERTEXTURES_H_
+#define _LAYERTEXTURES_H_
+
+#include "ShaderManager.h"
+#include "HeightBounds.h"
+
+/*!
+	Heights and normals of every layer as two texture arrays, one array layer per layer,
+	for the ray casting shader (u_heights and u_normals). All layers share their size and
+	formats, so there is no limit on the layer count other than GL_MAX_ARRAY_TEXTURE_LAYERS.
+	Nearest sampling, clamped to the edges. The min/max pyramids of the heights (see
+	HeightBounds) go to a third array, u_heightBounds, for the casts to skip empty space,
+	and cone maps (see ConeMaps) to a fourth one, u_cones, for them to take longer safe steps.
+ */
+class LayerTextures
+{
+public:
+	// Texture units of the ray casting shader
+	static const int HEIGHT_UNIT = 1;
+	static const int NORMAL_UNIT = 2;
+	static const int PAGE_TABLE_UNIT = 3;
+	static const int BOUNDS_UNIT = 4;
+	static const int CONE_UNIT = 5;
+
+	// As passed to glTexImage
+	struct Format
+	{
+		int internalFormat;
+		unsigned int format;
+		unsigned int type;
+	};
+
+public:
+	LayerTextures();
+	~LayerTextures();
+
+	// Most layers an array holds
+	static int maxLayers();
+
+	// Specifies empty arrays of layerCount layers of width x height, again when already created
+	// (contents are lost). Without normals (NULL), the shader derives them from heights.
+	// Sets the samplers, layer count and layer size of the ray casting shader in shaderManager.
+	// Pyramids and cone maps are dropped until the next uploads, casts step through every texel.
+	void create( int width, int height, int layerCount, const Format& heights, const Format* normals, ShaderManager& shaderManager );
+	void destroy();
+
+	// Texels [x, x+width) x [y, y+height) of layer, in the format given to create.
+	// Rows are tightly packed.
+	void uploadHeights( int layer, int x, int y, int width, int height, const void* data );
+	void uploadNormals( int layer, int x, int y, int width, int height, const void* data );
+
+	// Pyramids of every layer, built from the heights as uploaded. Sets their uniforms in shaderManager.
+	void uploadBounds( const HeightBounds& bounds, ShaderManager& shaderManager );
+
+	// Cone map of layer (width*height codes of the layer size given to create). The shader takes
+	// cone steps once the first map is uploaded, every layer needs one by the next draw.
+	void uploadConeMap( int layer, const vr::uint8* codes, ShaderManager& shaderManager );
+
+	int layerCount() const;
+	bool hasNormals() const;
+
+private:
+	// Generates texture unless it exists, with _layerCount layers of width x height
+	void createArray( unsigned int& texture, int unit, const Format& format, int width, int height );
+	void upload( unsigned int texture, int unit, const Format& format, int layer, int x, int y, int width, int height, const void* data );
+
+private:
+	int _layerCount;
+	int _width;
+	int _height;
+	Format _heightFormat;
+	Format _normalFormat;
+	unsigned int _heights;
+	unsigned int _normals;
+	unsigned int _bounds;
+	unsigned int _cones;
+};
+
+#endif // _LAYERTEXTURES_H_
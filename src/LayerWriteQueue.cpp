@@ -0,0 +1,234 @@
+#include "LayerWriteQueue.h"
+#include <vr/math.h>
+#include <QImage>
+#include <algorithm>
+
+LayerWriteQueue::LayerWriteQueue( int threadCount, int capacity )
+: _threadCount( threadCount ), _capacity( vr::max( capacity, 1 ) ),
+  _quit( false ), _busy( 0 ), _failed( false ), _sequence( 0 )
+{
+	if( _threadCount <= 0 )
+		_threadCount = vr::clampTo( QThread::idealThreadCount() - 1, 1, 4 );
+}
+
+LayerWriteQueue::~LayerWriteQueue()
+{
+	finish();
+
+	_mutex.lock();
+	_quit = true;
+	_jobAdded.wakeAll();
+	_mutex.unlock();
+
+	for( unsigned int i = 0; i < _workers.size(); ++i )
+	{
+		_workers[i]->wait();
+		delete _workers[i];
+	}
+}
+
+void LayerWriteQueue::write( TiledLayerWriter& writer, int layer, int x0, int y0, int width, int height,
+							 std::vector<float>& pixels, const std::string& debugName )
+{
+	Job* job = new Job;
+	job->writer = &writer;
+	job->layers = NULL;
+	job->sequence = 0;
+	job->layer = layer;
+	job->x0 = x0;
+	job->y0 = y0;
+	job->width = width;
+	job->height = height;
+	job->debugName = debugName;
+	push( job, pixels );
+}
+
+void LayerWriteQueue::convert( LayerSet& layers, int width, int height, std::vector<float>& pixels, const std::string& debugName )
+{
+	Job* job = new Job;
+	job->writer = NULL;
+	job->layers = &layers;
+	job->layer = -1;
+	job->x0 = 0;
+	job->y0 = 0;
+	job->width = width;
+	job->height = height;
+	job->debugName = debugName;
+	push( job, pixels );
+}
+
+bool LayerWriteQueue::finish()
+{
+	QMutexLocker locker( &_mutex );
+	while( !_jobs.empty() || ( _busy > 0 ) )
+		_jobDone.wait( &_mutex );
+
+	std::sort( _converted.begin(), _converted.end(), earlierJob );
+	for( unsigned int i = 0; i < _converted.size(); ++i )
+	{
+		Job* job = _converted[i];
+		job->layers->addLayer( job->heights, job->normals );
+		delete job;
+	}
+	_converted.clear();
+	_sequence = 0;
+
+	bool ok = !_failed;
+	_failed = false;
+	return ok;
+}
+
+void LayerWriteQueue::convertPixels( const float* pixels, unsigned int count, int channels, float* heights, float* normals )
+{
+	if( channels == 1 )
+	{
+		for( unsigned int i = 0; i < count; ++i )
+			heights[i] = ( pixels[i] == 0.0f ) ? 0.0f : 1.0f - pixels[i];
+		std::fill( normals, normals + count*3, 0.0f );
+		return;
+	}
+
+	for( unsigned int i = 0, k = 0; i < count; ++i, k+=4 )
+	{
+		// Convert R value to "height"
+		heights[i] = ( pixels[k] == 0.0f ) ? 0.0f : 1.0f - pixels[k];
+
+		// GBA components hold the normal
+		normals[i*3]   = pixels[k+1];
+		normals[i*3+1] = pixels[k+2];
+		normals[i*3+2] = pixels[k+3];
+	}
+}
+
+void LayerWriteQueue::saveDebugImages( const std::string& filename, const float* heights, const float* normals, int width, int height )
+{
+	// Unsigned char images, whole rows at a time.
+	// Note: will be inverted since qt uses different image origin
+	QImage heightImage( width, height, QImage::Format_RGB32 );
+	QImage normalImage( width, height, QImage::Format_RGB32 );
+	for( int y = 0; y < height; ++y )
+	{
+		QRgb* heightRow = (QRgb*)heightImage.scanLine( y );
+		QRgb* normalRow = (QRgb*)normalImage.scanLine( y );
+		const float* h = heights + y * width;
+		const float* n = normals + y * width * 3;
+		for( int x = 0; x < width; ++x, n+=3 )
+		{
+			heightRow[x] = qRgb( (int)( h[x]*255.0f ), 0, 0 );
+			normalRow[x] = qRgb( (int)( vr::abs( n[0]*255.0f ) ), (int)( vr::abs( n[1]*255.0f ) ), (int)( vr::abs( n[2]*255.0f ) ) );
+		}
+	}
+	heightImage.save( ( filename + ".height.bmp" ).c_str() );
+	normalImage.save( ( filename + ".normal.bmp" ).c_str() );
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+bool LayerWriteQueue::earlierJob( const Job* a, const Job* b )
+{
+	return a->sequence < b->sequence;
+}
+
+LayerWriteQueue::Worker::Worker( LayerWriteQueue* queue )
+: _queue( queue )
+{
+}
+
+void LayerWriteQueue::Worker::run()
+{
+	_queue->processJobs();
+}
+
+void LayerWriteQueue::push( Job* job, std::vector<float>& pixels )
+{
+	// Threads start with the first layer
+	if( _workers.empty() )
+	{
+		for( int i = 0; i < _threadCount; ++i )
+		{
+			_workers.push_back( new Worker( this ) );
+			_workers.back()->start();
+		}
+	}
+
+	QMutexLocker locker( &_mutex );
+	while( (int)_jobs.size() >= _capacity )
+		_jobTaken.wait( &_mutex );
+
+	if( job->layers != NULL )
+		job->sequence = _sequence++;
+	job->channels = (int)( pixels.size() / ( (size_t)job->width * job->height ) );
+	job->pixels.swap( pixels );
+	if( !_freeBuffers.empty() )
+	{
+		pixels.swap( _freeBuffers.back() );
+		_freeBuffers.pop_back();
+	}
+	pixels.resize( job->pixels.size() );
+
+	_jobs.push_back( job );
+	_jobAdded.wakeOne();
+}
+
+void LayerWriteQueue::processJobs()
+{
+	while( true )
+	{
+		_mutex.lock();
+		while( !_quit && _jobs.empty() )
+			_jobAdded.wait( &_mutex );
+		if( _jobs.empty() )
+		{
+			_mutex.unlock();
+			return;
+		}
+		Job* job = _jobs.front();
+		_jobs.pop_front();
+		++_busy;
+		_jobTaken.wakeOne();
+		_mutex.unlock();
+
+		bool ok = process( *job );
+
+		QMutexLocker locker( &_mutex );
+		if( !ok )
+			_failed = true;
+
+		// The buffer goes back to the caller with a later layer
+		if( (int)_freeBuffers.size() < _capacity )
+		{
+			_freeBuffers.push_back( std::vector<float>() );
+			_freeBuffers.back().swap( job->pixels );
+		}
+		else
+		{
+			std::vector<float>().swap( job->pixels );
+		}
+		if( job->layers != NULL )
+			_converted.push_back( job );
+		else
+			delete job;
+
+		--_busy;
+		_jobDone.wakeAll();
+	}
+}
+
+bool LayerWriteQueue::process( Job& job )
+{
+	unsigned int count = job.width * job.height;
+	job.heights.resize( count );
+	job.normals.resize( count*3 );
+	convertPixels( &job.pixels[0], count, job.channels, &job.heights[0], &job.normals[0] );
+
+	if( !job.debugName.empty() )
+		saveDebugImages( job.debugName, &job.heights[0], &job.normals[0], job.width, job.height );
+
+	if( job.writer == NULL )
+		return true;
+
+	QMutexLocker locker( &_writeMutex );
+	return job.writer->writeLayer( job.layer, &job.heights[0], &job.normals[0], job.width, job.height, job.x0, job.y0 );
+}
@@ -0,0 +1,110 @@
+#ifndef _LAYERWRITEQUEUE_H_
+#define _LAYERWRITEQUEUE_H_
+
+#include "LayerSet.h"
+#include "TiledLayerWriter.h"
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <vector>
+#include <deque>
+#include <string>
+
+/*!
+	Converts layers read back from depth peeling (floats, see convertPixels) to heights
+	and normals and writes them, on a few writer threads, while the next layer is peeled.
+	At most a given number of layers wait in the queue, adding one more blocks until a thread
+	takes one, so that memory stays bounded however fast layers are read back.
+	Pixel buffers go round between the caller and the threads instead of being reallocated.
+ */
+class LayerWriteQueue
+{
+public:
+	// Writer threads (0 for one less than the cores, at most 4) and layers waiting at most
+	LayerWriteQueue( int threadCount = 0, int capacity = 4 );
+	~LayerWriteQueue();
+
+	// Takes the pixels of a layer of width x height to write into writer, with its lower left
+	// texel at (x0, y0), as RGBA or depth only (4 or 1 floats per texel). Pixels is given a free
+	// buffer of the same size back, to read the next layer into. Writes are serialized, so several writers (and tiles) may be queued at once.
+	// With a debugName, the layer is saved as BMP images as well (see saveDebugImages).
+	void write( TiledLayerWriter& writer, int layer, int x0, int y0, int width, int height,
+		        std::vector<float>& pixels, const std::string& debugName = std::string() );
+
+	// Same for the next layer of layers, which is appended by finish in the order of the calls
+	void convert( LayerSet& layers, int width, int height, std::vector<float>& pixels, const std::string& debugName = std::string() );
+
+	// Waits until every queued layer is written, and appends converted layers to their sets.
+	// False when a write failed since the last finish.
+	bool finish();
+
+	// RGBA read back from peeling to height (1 - depth, 0 where empty) and normal maps.
+	// With a single channel (depth only), normals are zero.
+	static void convertPixels( const float* pixels, unsigned int count, int channels, float* heights, float* normals );
+
+	// Height and normal maps as filename.height.bmp and filename.normal.bmp, upside down
+	static void saveDebugImages( const std::string& filename, const float* heights, const float* normals, int width, int height );
+
+private:
+	struct Job
+	{
+		TiledLayerWriter* writer; // NULL when converted into layers
+		LayerSet* layers;
+		int sequence;             // order of convert calls
+		int layer;
+		int x0;
+		int y0;
+		int width;
+		int height;
+		int channels;
+		std::string debugName;
+		std::vector<float> pixels;
+		std::vector<float> heights;
+		std::vector<float> normals;
+	};
+
+	class Worker : public QThread
+	{
+	public:
+		Worker( LayerWriteQueue* queue );
+
+	protected:
+		virtual void run();
+
+	private:
+		LayerWriteQueue* _queue;
+	};
+
+private:
+	void push( Job* job, std::vector<float>& pixels );
+
+	// Converted layers are appended in the order they were queued
+	static bool earlierJob( const Job* a, const Job* b );
+
+	// Worker thread body, processes jobs until the queue is destroyed
+	void processJobs();
+	bool process( Job& job );
+
+private:
+	int _threadCount;
+	int _capacity;
+	std::vector<Worker*> _workers;
+
+	// Shared with the workers and guarded by _mutex
+	QMutex _mutex;
+	QWaitCondition _jobAdded;
+	QWaitCondition _jobTaken;
+	QWaitCondition _jobDone;
+	bool _quit;
+	std::deque<Job*> _jobs;
+	int _busy;
+	bool _failed;
+	int _sequence;
+	std::vector<Job*> _converted;
+	std::vector< std::vector<float> > _freeBuffers;
+
+	// Only one thread writes files at a time
+	QMutex _writeMutex;
+};
+
+#endif // _LAYERWRITEQUEUE_H_
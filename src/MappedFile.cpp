@@ -0,0 +1,130 @@
+#include "MappedFile.h"
+#include <cstdio>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+MappedFile::MappedFile()
+: _data( NULL ), _size( 0 )
+#ifdef _WIN32
+, _file( INVALID_HANDLE_VALUE ), _mapping( NULL )
+#else
+, _fd( -1 )
+#endif
+{
+	// empty
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+bool MappedFile::open( const std::string& filename )
+{
+	close();
+
+#ifdef _WIN32
+	_file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL );
+	if( _file == INVALID_HANDLE_VALUE )
+		return false;
+
+	LARGE_INTEGER size;
+	if( !GetFileSizeEx( _file, &size ) || ( size.QuadPart == 0 ) )
+	{
+		close();
+		return false;
+	}
+	_size = (vr::uint64)size.QuadPart;
+
+	_mapping = CreateFileMappingA( _file, NULL, PAGE_READONLY, 0, 0, NULL );
+	if( _mapping == NULL )
+	{
+		close();
+		return false;
+	}
+
+	// Fails for files larger than the address space (32-bit builds)
+	_data = (const unsigned char*)MapViewOfFile( _mapping, FILE_MAP_READ, 0, 0, 0 );
+#else
+	_fd = ::open( filename.c_str(), O_RDONLY );
+	if( _fd < 0 )
+		return false;
+
+	struct stat st;
+	if( ( fstat( _fd, &st ) != 0 ) || ( st.st_size == 0 ) )
+	{
+		close();
+		return false;
+	}
+	_size = (vr::uint64)st.st_size;
+
+	void* data = mmap( NULL, (size_t)_size, PROT_READ, MAP_SHARED, _fd, 0 );
+	_data = ( data == MAP_FAILED ) ? NULL : (const unsigned char*)data;
+#endif
+
+	if( _data == NULL )
+	{
+		printf( "Warning: could not map %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if( _data != NULL )
+		UnmapViewOfFile( _data );
+	if( _mapping != NULL )
+		CloseHandle( _mapping );
+	if( _file != INVALID_HANDLE_VALUE )
+		CloseHandle( _file );
+	_mapping = NULL;
+	_file = INVALID_HANDLE_VALUE;
+#else
+	if( _data != NULL )
+		munmap( (void*)_data, (size_t)_size );
+	if( _fd >= 0 )
+		::close( _fd );
+	_fd = -1;
+#endif
+	_data = NULL;
+	_size = 0;
+}
+
+bool MappedFile::isOpen() const
+{
+	return _data != NULL;
+}
+
+const unsigned char* MappedFile::data() const
+{
+	return _data;
+}
+
+vr::uint64 MappedFile::size() const
+{
+	return _size;
+}
+
+void MappedFile::willNeed( vr::uint64 offset, vr::uint64 size ) const
+{
+#ifndef _WIN32
+	if( ( _data == NULL ) || ( offset >= _size ) )
+		return;
+
+	// madvise needs a page aligned start
+	vr::uint64 page = (vr::uint64)sysconf( _SC_PAGESIZE );
+	vr::uint64 start = offset - offset % page;
+	vr::uint64 end = ( offset + size < _size ) ? offset + size : _size;
+	madvise( (void*)( _data + start ), (size_t)( end - start ), MADV_WILLNEED );
+#endif
+}
@@ -0,0 +1,44 @@
+#ifndef _MAPPEDFILE_H_
+#define _MAPPEDFILE_H_
+
+#include <vr/platform.h>
+#include <string>
+
+/*!
+	Read-only memory mapping of a whole file.
+	Pages are loaded by the OS on first access and shared through the page cache
+	with every other process mapping the same file.
+ */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+
+	bool open( const std::string& filename );
+	void close();
+
+	bool isOpen() const;
+	const unsigned char* data() const;
+	vr::uint64 size() const;
+
+	// Asks the OS to start reading a range that will be needed soon (no-op where unsupported)
+	void willNeed( vr::uint64 offset, vr::uint64 size ) const;
+
+private:
+	// Not copyable, the mapping is owned
+	MappedFile( const MappedFile& );
+	MappedFile& operator=( const MappedFile& );
+
+private:
+	const unsigned char* _data;
+	vr::uint64 _size;
+#ifdef _WIN32
+	void* _file;
+	void* _mapping;
+#else
+	int _fd;
+#endif
+};
+
+#endif // _MAPPEDFILE_H_
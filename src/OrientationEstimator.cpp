@@ -0,0 +1,119 @@
+#include "OrientationEstimator.h"
+#include "SoftwareLayerGenerator.h"
+#include <cstdio>
+
+OrientationEstimator::OrientationEstimator()
+: _mesh( NULL ), _resolution( 64 ), _extraDirections( false )
+{
+	// empty
+}
+
+void OrientationEstimator::setMesh( const TriangleMesh* mesh )
+{
+	_mesh = mesh;
+}
+
+void OrientationEstimator::setResolution( int size )
+{
+	_resolution = vr::max( size, 1 );
+}
+
+void OrientationEstimator::setExtraDirections( bool enabled )
+{
+	_extraDirections = enabled;
+}
+
+int OrientationEstimator::estimate( const OrientedBox& box )
+{
+	_candidates.clear();
+
+	if( _mesh == NULL )
+		return -1;
+
+	// Box axes first, -Y leads so that it wins ties as before
+	addCandidate( "-y", LayerFrame::fromBox( box, 1 ) );
+	addCandidate( "-z", LayerFrame::fromBox( box, 2 ) );
+	addCandidate( "-x", LayerFrame::fromBox( box, 0 ) );
+
+	if( _extraDirections )
+	{
+		// Opposite directions give the same layer count, so one per pair is enough
+		static const double dirs[10][3] = {
+			{ 1, 1, 1 }, { 1, 1, -1 }, { 1, -1, 1 }, { -1, 1, 1 },
+			{ 1, 1, 0 }, { 1, -1, 0 }, { 1, 0, 1 }, { 1, 0, -1 }, { 0, 1, 1 }, { 0, 1, -1 } };
+
+		for( int i = 0; i < 10; ++i )
+		{
+			// Directions are given in box axes
+			vr::vec3d dir = box.axis[0] * -dirs[i][0] + box.axis[1] * -dirs[i][1] + box.axis[2] * -dirs[i][2];
+			dir.normalize();
+
+			// Up is the box axis least aligned with the direction
+			int upAxis = 0;
+			for( int k = 1; k < 3; ++k )
+				if( vr::abs( dir.dot( box.axis[k] ) ) < vr::abs( dir.dot( box.axis[upAxis] ) ) )
+					upAxis = k;
+			vr::vec3d up = box.axis[upAxis];
+
+			// Room for three ints of any value, the parentheses and the commas
+			char name[3*11 + 5];
+			sprintf( name, "(%d,%d,%d)", -(int)dirs[i][0], -(int)dirs[i][1], -(int)dirs[i][2] );
+			addCandidate( name, LayerFrame::fromDirection( box, dir, up ) );
+		}
+	}
+
+	// Rasterize each candidate at coarse resolution
+	SoftwareLayerGenerator generator;
+	generator.setMesh( _mesh );
+	generator.setResolution( _resolution, _resolution );
+	generator.setTileSize( 16 );
+
+	std::vector<unsigned int> counts;
+	int best = -1;
+
+	for( int i = 0; i < (int)_candidates.size(); ++i )
+	{
+		Candidate& c = _candidates[i];
+		generator.setFrame( c.frame );
+		c.layerCount = generator.computeDepthComplexity( counts );
+
+		double filled = 0.0;
+		for( unsigned int k = 0; k < counts.size(); ++k )
+			filled += counts[k];
+
+		double total = (double)c.layerCount * counts.size();
+		c.emptyRatio = ( total > 0.0 ) ? (float)( 1.0 - filled / total ) : 1.0f;
+
+		printf( "Estimate %s: %d layers, %.1f%% empty\n", c.name.c_str(), c.layerCount, c.emptyRatio * 100.0f );
+
+		if( ( best < 0 ) || ( c.layerCount < _candidates[best].layerCount ) ||
+			( ( c.layerCount == _candidates[best].layerCount ) && ( c.emptyRatio < _candidates[best].emptyRatio ) ) )
+			best = i;
+	}
+
+	return best;
+}
+
+int OrientationEstimator::candidateCount() const
+{
+	return (int)_candidates.size();
+}
+
+const OrientationEstimator::Candidate& OrientationEstimator::candidate( int i ) const
+{
+	return _candidates[i];
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+void OrientationEstimator::addCandidate( const std::string& name, const LayerFrame& frame )
+{
+	Candidate c;
+	c.name = name;
+	c.frame = frame;
+	c.layerCount = 0;
+	c.emptyRatio = 1.0f;
+	_candidates.push_back( c );
+}
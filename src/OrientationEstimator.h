@@ -0,0 +1,53 @@
+#ifndef _ORIENTATIONESTIMATOR_H_
+#define _ORIENTATIONESTIMATOR_H_
+
+#include "LayerFrame.h"
+#include "TriangleMesh.h"
+#include <vector>
+#include <string>
+
+/*!
+	Cheap search for the viewing direction that needs the fewest layers.
+	Measures depth complexity on a coarse grid with the software rasterizer for the
+	three box axes and, optionally, for the box and face diagonals. Ties on layer
+	count are broken by the fraction of empty texels over all layers.
+ */
+class OrientationEstimator
+{
+public:
+	struct Candidate
+	{
+		std::string name;
+		LayerFrame frame;
+		int layerCount;
+		float emptyRatio; // empty texels / ( layers * texels )
+	};
+
+public:
+	OrientationEstimator();
+
+	void setMesh( const TriangleMesh* mesh );
+
+	// Coarse grid size, 64x64 by default
+	void setResolution( int size );
+
+	// Also try the 4 box diagonals and the 6 face diagonals
+	void setExtraDirections( bool enabled );
+
+	// Evaluates all candidates along the box axes and returns the index of the best one
+	int estimate( const OrientedBox& box );
+
+	int candidateCount() const;
+	const Candidate& candidate( int i ) const;
+
+private:
+	void addCandidate( const std::string& name, const LayerFrame& frame );
+
+private:
+	const TriangleMesh* _mesh;
+	int _resolution;
+	bool _extraDirections;
+	std::vector<Candidate> _candidates;
+};
+
+#endif // _ORIENTATIONESTIMATOR_H_
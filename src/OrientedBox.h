@@ -0,0 +1,50 @@
+#ifndef _ORIENTEDBOX_H_
+#define _ORIENTEDBOX_H_
+
+#include <vr/vec3.h>
+#include "AABB.h"
+
+/*!
+	Box with arbitrary orthonormal axes (right-handed).
+	Long rotated parts fit much tighter than in an AABB.
+ */
+class OrientedBox
+{
+public:
+	static OrientedBox fromAABB( const AABB& box )
+	{
+		OrientedBox obox;
+		obox.center = box.center();
+		obox.axis[0].set( 1, 0, 0 );
+		obox.axis[1].set( 0, 1, 0 );
+		obox.axis[2].set( 0, 0, 1 );
+		obox.halfExtent = ( box.maxV - box.minV ) * 0.5;
+		return obox;
+	}
+
+	// Bit k of i selects the positive side along axis k
+	vr::vec3d corner( int i ) const
+	{
+		vr::vec3d p = center;
+		for( int k = 0; k < 3; ++k )
+			p += axis[k] * ( ( i & ( 1 << k ) ) ? halfExtent[k] : -halfExtent[k] );
+		return p;
+	}
+
+	double extent( int k ) const
+	{
+		return halfExtent[k] * 2.0;
+	}
+
+	double volume() const
+	{
+		return extent( 0 ) * extent( 1 ) * extent( 2 );
+	}
+
+public:
+	vr::vec3d center;
+	vr::vec3d axis[3];
+	vr::vec3d halfExtent;
+};
+
+#endif // _ORIENTEDBOX_H_
@@ -0,0 +1,253 @@
+#include "ProgressiveLayerLoader.h"
+#include <vr/math.h>
+
+ProgressiveLayerLoader::ProgressiveLayerLoader()
+: _layerCount( 0 ), _shaderNormals( false ), _octNormals( false ), _residentLevel( -1 ),
+  _quit( false ), _done( true ), _ready( NULL ), _loader( NULL )
+{
+}
+
+ProgressiveLayerLoader::~ProgressiveLayerLoader()
+{
+	close();
+}
+
+bool ProgressiveLayerLoader::open( const std::string& filename, int maxLayers, bool shaderNormals, ShaderManager& shaderManager )
+{
+	close();
+
+	if( !_file.open( filename ) )
+		return false;
+	if( _file.levelCount() == 0 )
+	{
+		printf( "%s has no pyramid, it cannot be loaded progressively\n", filename.c_str() );
+		_file.close();
+		return false;
+	}
+
+	_timer.restart();
+	_filename = filename;
+	_layerCount = vr::min( _file.layerCount(), maxLayers );
+	if( _file.layerCount() > maxLayers )
+		printf( "Warning: only the first %d of %d layers are loaded\n", maxLayers, _file.layerCount() );
+	_shaderNormals = shaderNormals;
+
+	// Levels share the encodings of the full resolution
+	ShsFile::Encoding normalEncoding = ( _layerCount > 0 ) ? _file.encoding( 0, ShsFile::NORMAL ) : ShsFile::RAW_FLOAT32;
+	_octNormals = !shaderNormals && ( ( normalEncoding == ShsFile::NORMAL_OCT16 ) || ( normalEncoding == ShsFile::NORMAL_OCT8 ) );
+
+	// 16-bit heights go to a 16-bit array, rescaled from the layer range to [0,1].
+	// All layers of an array share its format, a single float layer makes it a float array.
+	bool unitHeights16 = ( _layerCount > 0 );
+	for( int i = 0; i < _layerCount; ++i )
+		unitHeights16 = unitHeights16 && ( _file.layer( i ).channels[ShsFile::HEIGHT].encoding == ShsFile::HEIGHT_UNORM16 );
+	_heightFormat.internalFormat = unitHeights16 ? GL_LUMINANCE16 : GL_LUMINANCE32F_ARB;
+	_heightFormat.format = GL_LUMINANCE;
+	_heightFormat.type = unitHeights16 ? GL_UNSIGNED_SHORT : GL_FLOAT;
+	bool oct16 = ( normalEncoding == ShsFile::NORMAL_OCT16 );
+	_normalFormat.internalFormat = _octNormals ? ( oct16 ? GL_LUMINANCE16_ALPHA16 : GL_LUMINANCE8_ALPHA8 ) : GL_RGB32F_ARB;
+	_normalFormat.format = _octNormals ? GL_LUMINANCE_ALPHA : GL_RGB;
+	_normalFormat.type = _octNormals ? ( oct16 ? GL_UNSIGNED_SHORT : GL_UNSIGNED_BYTE ) : GL_FLOAT;
+
+	// The coarsest level is small, it is read here so that the first frame has something to draw
+	Level coarsest;
+	ShsFile coarsestFile;
+	_quit = false;
+	if( !coarsestFile.open( filename, _file.levelCount() ) || !readLevel( coarsestFile, coarsest ) )
+	{
+		_file.close();
+		return false;
+	}
+
+	shaderManager.addUniformi( "u_octNormals", _octNormals ? 1 : 0 );
+	shaderManager.addUniformf( "u_octScale", ( normalEncoding == ShsFile::NORMAL_OCT8 ) ? 255.0f / 254.0f : 65535.0f / 65534.0f );
+	upload( coarsest, shaderManager );
+
+	_done = false;
+	_loader = new Loader( this );
+	_loader->start( QThread::LowPriority );
+	return true;
+}
+
+void ProgressiveLayerLoader::close()
+{
+	if( _loader != NULL )
+	{
+		_mutex.lock();
+		_quit = true;
+		_mutex.unlock();
+
+		_loader->wait();
+		delete _loader;
+		_loader = NULL;
+	}
+
+	delete _ready;
+	_ready = NULL;
+	_done = true;
+
+	_textures.destroy();
+	_residentLevel = -1;
+	_file.close();
+}
+
+bool ProgressiveLayerLoader::isOpen() const
+{
+	return _loader != NULL;
+}
+
+const ShsFile& ProgressiveLayerLoader::file() const
+{
+	return _file;
+}
+
+int ProgressiveLayerLoader::residentLevel() const
+{
+	return _residentLevel;
+}
+
+bool ProgressiveLayerLoader::update( ShaderManager& shaderManager )
+{
+	_mutex.lock();
+	Level* level = _ready;
+	_ready = NULL;
+	bool done = _done;
+	_mutex.unlock();
+
+	if( level != NULL )
+	{
+		upload( *level, shaderManager );
+		delete level;
+	}
+	return !done;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+ProgressiveLayerLoader::Loader::Loader( ProgressiveLayerLoader* owner )
+: _owner( owner )
+{
+}
+
+void ProgressiveLayerLoader::Loader::run()
+{
+	_owner->loadLevels();
+}
+
+void ProgressiveLayerLoader::loadLevels()
+{
+	for( int l = _file.levelCount() - 1; l >= 0; --l )
+	{
+		// Each level is opened on its own, this thread is the only one reading them
+		Level* level = new Level;
+		ShsFile file;
+		bool ok = file.open( _filename, l ) && readLevel( file, *level );
+
+		QMutexLocker locker( &_mutex );
+		if( !ok || _quit )
+		{
+			// The coarser level stays, failures are reported by ShsFile
+			delete level;
+			_done = true;
+			return;
+		}
+
+		// A level that was never uploaded is overtaken by this one
+		delete _ready;
+		_ready = level;
+		_done = ( l == 0 );
+	}
+}
+
+bool ProgressiveLayerLoader::readLevel( ShsFile& file, Level& level )
+{
+	level.level = file.level();
+	level.width = file.width();
+	level.height = file.height();
+	level.heights.resize( _layerCount );
+	level.bounds.resize( level.width, level.height, _layerCount );
+	level.normals.resize( _shaderNormals ? 0 : _layerCount );
+
+	size_t count = (size_t)file.width() * file.height();
+	for( int i = 0; i < _layerCount; ++i )
+	{
+		if( quitting() )
+			return false;
+
+		std::vector<unsigned char>& heights = level.heights[i];
+		const ShsFile::ChannelEntry& heightEntry = file.layer( i ).channels[ShsFile::HEIGHT];
+		if( _heightFormat.type == GL_UNSIGNED_SHORT )
+		{
+			std::vector<unsigned char> stored( (size_t)file.storedSize( i, ShsFile::HEIGHT ) );
+			if( stored.empty() || !file.readStored( i, ShsFile::HEIGHT, &stored[0] ) )
+				return false;
+			heights.resize( count * sizeof(vr::uint16) );
+			LayerEncoding::unitHeights16( (const vr::uint16*)&stored[0], count, heightEntry.rangeMin, heightEntry.rangeMax,
+				                          (vr::uint16*)&heights[0] );
+			level.bounds.build( i, (const vr::uint16*)&heights[0] );
+		}
+		else
+		{
+			heights.resize( count * sizeof(float) );
+			if( !file.readChannel( i, ShsFile::HEIGHT, (float*)&heights[0] ) )
+				return false;
+			level.bounds.build( i, (const float*)&heights[0] );
+		}
+
+		if( _shaderNormals )
+			continue;
+
+		std::vector<unsigned char>& normals = level.normals[i];
+		if( _octNormals )
+		{
+			if( file.encoding( i, ShsFile::NORMAL ) != file.encoding( 0, ShsFile::NORMAL ) )
+			{
+				printf( "Warning: layers of %s mix normal encodings\n", _filename.c_str() );
+				return false;
+			}
+
+			normals.resize( (size_t)file.storedSize( i, ShsFile::NORMAL ) );
+			if( normals.empty() || !file.readStored( i, ShsFile::NORMAL, &normals[0] ) )
+				return false;
+			continue;
+		}
+
+		// Normals that are not stored are derived from the heights of this level
+		normals.resize( count * 3 * sizeof(float) );
+		if( !file.readChannel( i, ShsFile::NORMAL, (float*)&normals[0] ) )
+			return false;
+	}
+	return true;
+}
+
+bool ProgressiveLayerLoader::quitting()
+{
+	QMutexLocker locker( &_mutex );
+	return _quit;
+}
+
+void ProgressiveLayerLoader::upload( const Level& level, ShaderManager& shaderManager )
+{
+	// Same texture objects, specified again at the size of the new level
+	_textures.create( level.width, level.height, _layerCount, _heightFormat, _shaderNormals ? NULL : &_normalFormat, shaderManager );
+	double textureBytes = 0.0;
+	for( int i = 0; i < _layerCount; ++i )
+	{
+		_textures.uploadHeights( i, 0, 0, level.width, level.height, &level.heights[i][0] );
+		textureBytes += level.heights[i].size();
+		if( _shaderNormals )
+			continue;
+		_textures.uploadNormals( i, 0, 0, level.width, level.height, &level.normals[i][0] );
+		textureBytes += level.normals[i].size();
+	}
+	_textures.uploadBounds( level.bounds, shaderManager );
+
+	// Shader normals sample neighbors one texel of this level away
+	shaderManager.setUniformf( "u_texelSize", 1.0f / vr::min( level.width, level.height ) );
+	_residentLevel = level.level;
+
+	printf( "Level %d of %s: %d layers of %dx%d (%.1f MB of textures) after %.0f ms\n", level.level, _filename.c_str(),
+		    _layerCount, level.width, level.height, textureBytes / ( 1024.0 * 1024.0 ), _timer.elapsed() * 1000.0 );
+}
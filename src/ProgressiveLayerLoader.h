@@ -0,0 +1,100 @@
+#ifndef _PROGRESSIVELAYERLOADER_H_
+#define _PROGRESSIVELAYERLOADER_H_
+
+#include <vr/platform.h>
+#include <vr/timer.h>
+#include "ShsFile.h"
+#include "ShaderManager.h"
+#include "LayerTextures.h"
+#include <QThread>
+#include <QMutex>
+#include <vector>
+
+/*!
+	Loads a layer file with a pyramid (see ShsFile) coarsest level first, so that the layers
+	are drawn right away and sharpen as finer levels come in, up to the full resolution.
+	open() uploads the coarsest level, then a background thread reads the finer ones one
+	after the other and decodes them into textures ready to upload, along with the height
+	pyramids of each level (see HeightBounds). Every frame, update()
+	replaces the textures with the finest level read so far, overtaken levels are skipped.
+	Compact heights and octahedral normals stay compact in texture memory, as with loadLayers.
+ */
+class ProgressiveLayerLoader
+{
+public:
+	ProgressiveLayerLoader();
+	~ProgressiveLayerLoader();
+
+	// Fails unless filename has a pyramid. At most maxLayers layers are loaded into LayerTextures,
+	// without normals with shaderNormals. Uploads the coarsest level and sets the uniforms of the ray casting shader in shaderManager.
+	bool open( const std::string& filename, int maxLayers, bool shaderNormals, ShaderManager& shaderManager );
+	void close();
+
+	bool isOpen() const;
+
+	// Full resolution header, frame and bounding box
+	const ShsFile& file() const;
+
+	// Level in texture memory, 0 once it is the full resolution
+	int residentLevel() const;
+
+	// Uploads the finest level read since the last update, if any. Returns true while
+	// finer levels are still to come, the view should then be drawn again.
+	bool update( ShaderManager& shaderManager );
+
+private:
+	// Texels of each layer, in the formats of _textures
+	struct Level
+	{
+		int level;
+		int width;
+		int height;
+		std::vector< std::vector<unsigned char> > heights;
+		std::vector< std::vector<unsigned char> > normals; // empty with shader normals
+		HeightBounds bounds;
+	};
+
+	class Loader : public QThread
+	{
+	public:
+		Loader( ProgressiveLayerLoader* owner );
+
+	protected:
+		virtual void run();
+
+	private:
+		ProgressiveLayerLoader* _owner;
+	};
+
+private:
+	// Loader thread body, reads the levels below the coarsest one until the full resolution or close
+	void loadLevels();
+
+	// Decodes the layers of file, opened at some level. False when it fails or on close.
+	bool readLevel( ShsFile& file, Level& level );
+	bool quitting();
+
+	void upload( const Level& level, ShaderManager& shaderManager );
+
+private:
+	ShsFile _file;
+	std::string _filename;
+	int _layerCount;
+	bool _shaderNormals;
+	bool _octNormals;
+	int _residentLevel;
+	vr::Timer _timer;
+
+	LayerTextures _textures;
+	LayerTextures::Format _heightFormat; // same for every level
+	LayerTextures::Format _normalFormat;
+
+	// Shared with the loader thread and guarded by _mutex
+	QMutex _mutex;
+	bool _quit;
+	bool _done;    // no finer level will come
+	Level* _ready; // finest level read and not uploaded yet
+	Loader* _loader;
+};
+
+#endif // _PROGRESSIVELAYERLOADER_H_
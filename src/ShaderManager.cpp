@@ -16,8 +16,10 @@ void ShaderManager::reset()
 	_fp.clear();
 	_vp.clear();
 	_gp.clear();
+	_cp.clear();
 	_uniformI.clear();
 	_uniformF.clear();
+	_uniform2F.clear();
 }
 
 void ShaderManager::bindProgram()
@@ -52,6 +54,16 @@ const std::string& ShaderManager::vertexProgram() const
 	return _vp;
 }
 
+void ShaderManager::setComputeProgram( const std::string& filename )
+{
+	_cp = filename;
+}
+
+const std::string& ShaderManager::computeProgram() const
+{
+	return _cp;
+}
+
 void ShaderManager::addUniformi( const char* symbolName, int value )
 {
 	_uniformI.push_back( IntUniform( symbolName, value ) );
@@ -62,6 +74,74 @@ void ShaderManager::addUniformf( const char* symbolName, float value )
 	_uniformF.push_back( FloatUniform( symbolName, value ) );
 }
 
+void ShaderManager::addUniform2f( const char* symbolName, float x, float y )
+{
+	_uniform2F.push_back( Vec2Uniform( symbolName, std::make_pair( x, y ) ) );
+}
+
+void ShaderManager::setUniformi( const char* symbolName, int value )
+{
+	bool found = false;
+	for( int i = 0; i < _uniformI.size(); ++i )
+	{
+		if( _uniformI[i].first == symbolName )
+		{
+			_uniformI[i].second = value;
+			found = true;
+		}
+	}
+	if( !found )
+		addUniformi( symbolName, value );
+
+	if( _programObject == 0 )
+		return;
+	glUseProgram( _programObject );
+	glUniform1i( glGetUniformLocation( _programObject, symbolName ), value );
+	glUseProgram( 0 );
+}
+
+void ShaderManager::setUniformf( const char* symbolName, float value )
+{
+	bool found = false;
+	for( int i = 0; i < _uniformF.size(); ++i )
+	{
+		if( _uniformF[i].first == symbolName )
+		{
+			_uniformF[i].second = value;
+			found = true;
+		}
+	}
+	if( !found )
+		addUniformf( symbolName, value );
+
+	if( _programObject == 0 )
+		return;
+	glUseProgram( _programObject );
+	glUniform1f( glGetUniformLocation( _programObject, symbolName ), value );
+	glUseProgram( 0 );
+}
+
+void ShaderManager::setUniform2f( const char* symbolName, float x, float y )
+{
+	bool found = false;
+	for( int i = 0; i < _uniform2F.size(); ++i )
+	{
+		if( _uniform2F[i].first == symbolName )
+		{
+			_uniform2F[i].second = std::make_pair( x, y );
+			found = true;
+		}
+	}
+	if( !found )
+		addUniform2f( symbolName, x, y );
+
+	if( _programObject == 0 )
+		return;
+	glUseProgram( _programObject );
+	glUniform2f( glGetUniformLocation( _programObject, symbolName ), x, y );
+	glUseProgram( 0 );
+}
+
 void ShaderManager::initShaders()
 {
 	bool ok = reloadShaders();
@@ -104,10 +184,14 @@ bool ShaderManager::reloadShaders()
 		//std::cout << "GS output set to: " << outputVertexCount << "\n";
 	}
 
+	// Compute Shader to be used
+	if( !_cp.empty() )
+		shaderOk &= initShader( _programObject, _cp.c_str(), GL_COMPUTE_SHADER );
+
 	if( !shaderOk )
 		return false;
 
-	if( _fp.empty() && _vp.empty() && _gp.empty() )
+	if( _fp.empty() && _vp.empty() && _gp.empty() && _cp.empty() )
 		return true;
 
 	// Link whole program object
@@ -153,6 +237,10 @@ bool ShaderManager::reloadShaders()
 	{
 		glUniform1f( glGetUniformLocation( _programObject, _uniformF[i].first.c_str() ), _uniformF[i].second );
 	}
+	for( int i = 0; i < _uniform2F.size(); ++i )
+	{
+		glUniform2f( glGetUniformLocation( _programObject, _uniform2F[i].first.c_str() ), _uniform2F[i].second.first, _uniform2F[i].second.second );
+	}
 
 	// Cleanup
 	glUseProgram( 0 );
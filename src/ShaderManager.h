@@ -21,8 +21,18 @@ public:
 	void setVertexProgram( const std::string& filename );
 	const std::string& vertexProgram() const;
 
+	// Compute shaders (OpenGL 4.3) make a program of their own, without the other stages
+	void setComputeProgram( const std::string& filename );
+	const std::string& computeProgram() const;
+
 	void addUniformi( const char* symbolName, int value );
 	void addUniformf( const char* symbolName, float value );
+	void addUniform2f( const char* symbolName, float x, float y );
+
+	// Replaces the value of a uniform, at once when the program is already linked
+	void setUniformi( const char* symbolName, int value );
+	void setUniformf( const char* symbolName, float value );
+	void setUniform2f( const char* symbolName, float x, float y );
 
 	void initShaders();
 	bool reloadShaders();
@@ -32,6 +42,7 @@ public:
 private:
 	typedef std::pair<std::string, int> IntUniform;
 	typedef std::pair<std::string, float> FloatUniform;
+	typedef std::pair<std::string, std::pair<float, float> > Vec2Uniform;
 
 private:
 	bool initShader( GLhandleARB _programObject, const char *filen, GLuint type );
@@ -42,8 +53,10 @@ private:
 	std::string _fp;
 	std::string _vp;
 	std::string _gp;
+	std::string _cp;
 	std::vector<IntUniform>   _uniformI;
 	std::vector<FloatUniform> _uniformF;
+	std::vector<Vec2Uniform>  _uniform2F;
 };
 
 #endif // _SHADERMANAGER_H_
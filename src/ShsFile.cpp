@@ -0,0 +1,1135 @@
+#include "ShsFile.h"
+#include <cstring>
+
+static const char MAGIC[4] = { 'S', 'H', 'S', '\0' };
+
+// Directory entries of older versions are prefixes of the current one
+static const size_t ENTRY_SIZE_V1 = 24;
+static const size_t ENTRY_SIZE_V2 = 32;
+static const size_t ENTRY_SIZE_V3 = 40;
+
+ShsFile::ShsFile()
+: _file( NULL ), _fileSize( 0 ), _level( 0 )
+{
+	initHeader( _header, 0, 0 );
+	memset( &_brickIndex, 0, sizeof(BrickIndex) );
+}
+
+ShsFile::~ShsFile()
+{
+	close();
+}
+
+bool ShsFile::open( const std::string& filename, int level )
+{
+	close();
+
+	// Reading through stdio is the fallback when the file cannot be mapped
+	if( !_mapped.open( filename ) )
+	{
+		_file = fopen( filename.c_str(), "rb" );
+		if( _file == NULL )
+		{
+			printf( "Could not open layer file %s\n", filename.c_str() );
+			return false;
+		}
+	}
+	_filename = filename;
+	_fileSize = _mapped.isOpen() ? _mapped.size() : (vr::uint64)vr::max( fileSize( _file ), (vr::int64)0 );
+
+	if( !read( 0, &_header, sizeof(Header) ) || ( memcmp( _header.magic, MAGIC, 4 ) != 0 ) )
+	{
+		printf( "Invalid layer file %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( ( _header.version < 1 ) || ( _header.version > VERSION ) )
+	{
+		printf( "Unsupported layer file version %u in %s\n", _header.version, filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( _header.directoryOffset == 0 )
+	{
+		printf( "Layer file %s is incomplete\n", filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( ( _header.width <= 0 ) || ( _header.width > MAX_SIZE ) || ( _header.height <= 0 ) || ( _header.height > MAX_SIZE ) ||
+		( _header.layerCount <= 0 ) || ( _header.layerCount > MAX_LAYERS ) )
+	{
+		printf( "Invalid size of %d layers of %dx%d in %s\n", _header.layerCount, _header.width, _header.height, filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( !readDirectory() )
+	{
+		printf( "Could not read directory of %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( isBricked() && !readBrickIndex() )
+	{
+		printf( "Could not read brick index of %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( ( _header.flags & PYRAMID ) && !readPyramidIndex() )
+	{
+		printf( "Could not read pyramid index of %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( ( _header.flags & CONE_MAPS ) && !readConeIndex() )
+	{
+		printf( "Could not read cone index of %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+
+	if( ( level != 0 ) && !openLevel( level ) )
+	{
+		close();
+		return false;
+	}
+
+	const double* f = _header.frame;
+	vr::vec3d* vectors[5] = { &_frame.center, &_frame.eye, &_frame.right, &_frame.up, &_frame.forward };
+	for( int i = 0; i < 5; ++i, f+=3 )
+		vectors[i]->set( f[0], f[1], f[2] );
+	_frame.halfWidth = f[0];
+	_frame.halfHeight = f[1];
+	_frame.zNear = f[2];
+	_frame.zFar = f[3];
+
+	const double* b = _header.box;
+	_box.center.set( b[0], b[1], b[2] );
+	for( int k = 0; k < 3; ++k )
+		_box.axis[k].set( b[3+k*3], b[4+k*3], b[5+k*3] );
+	_box.halfExtent.set( b[12], b[13], b[14] );
+
+	return true;
+}
+
+void ShsFile::close()
+{
+	_mapped.close();
+	if( _file != NULL )
+		fclose( _file );
+	_file = NULL;
+	_layers.clear();
+	_bricks.clear();
+	memset( &_brickIndex, 0, sizeof(BrickIndex) );
+	_levels.clear();
+	_cones.clear();
+	_fileSize = 0;
+	_level = 0;
+}
+
+bool ShsFile::isMapped() const
+{
+	return _mapped.isOpen();
+}
+
+int ShsFile::width() const
+{
+	return _header.width;
+}
+
+int ShsFile::height() const
+{
+	return _header.height;
+}
+
+int ShsFile::layerCount() const
+{
+	return (int)_layers.size();
+}
+
+bool ShsFile::hasFrame() const
+{
+	return ( _header.flags & HAS_FRAME ) != 0;
+}
+
+bool ShsFile::hasBoundingBox() const
+{
+	return ( _header.flags & HAS_BOUNDING_BOX ) != 0;
+}
+
+bool ShsFile::hasNormals() const
+{
+	return ( _header.flags & NO_NORMALS ) == 0;
+}
+
+const LayerFrame& ShsFile::frame() const
+{
+	return _frame;
+}
+
+const OrientedBox& ShsFile::boundingBox() const
+{
+	return _box;
+}
+
+const ShsFile::Header& ShsFile::header() const
+{
+	return _header;
+}
+
+const ShsFile::LayerEntry& ShsFile::layer( int index ) const
+{
+	return _layers[index];
+}
+
+ShsFile::Encoding ShsFile::encoding( int layer, Channel channel ) const
+{
+	return (Encoding)_layers[layer].channels[channel].encoding;
+}
+
+int ShsFile::levelCount() const
+{
+	return (int)_levels.size();
+}
+
+int ShsFile::level() const
+{
+	return _level;
+}
+
+bool ShsFile::hasConeMaps() const
+{
+	return !_cones.empty();
+}
+
+bool ShsFile::readConeMap( int layer, vr::uint8* dst )
+{
+	if( ( layer < 0 ) || ( layer >= (int)_cones.size() ) )
+		return false;
+
+	const ConeEntry& entry = _cones[layer];
+	if( ( entry.size != (vr::uint64)_header.width * _header.height ) || !read( entry.offset, dst, entry.size ) )
+	{
+		printf( "Could not read cone map of layer %d of %s\n", layer + 1, _filename.c_str() );
+		return false;
+	}
+
+	if( checksum( dst, entry.size ) != entry.checksum )
+	{
+		printf( "Checksum mismatch in cone map of layer %d of %s\n", layer + 1, _filename.c_str() );
+		return false;
+	}
+	return true;
+}
+
+bool ShsFile::isBricked() const
+{
+	return ( _header.flags & BRICKED ) != 0;
+}
+
+int ShsFile::brickSize() const
+{
+	return _brickIndex.brickSize;
+}
+
+int ShsFile::bricksX() const
+{
+	return _brickIndex.bricksX;
+}
+
+int ShsFile::bricksY() const
+{
+	return _brickIndex.bricksY;
+}
+
+const ShsFile::BrickEntry& ShsFile::brick( int bx, int by ) const
+{
+	return _bricks[by * _brickIndex.bricksX + bx];
+}
+
+void ShsFile::brickRegion( int bx, int by, int& x0, int& y0, int& width, int& height ) const
+{
+	x0 = bx * _brickIndex.brickSize;
+	y0 = by * _brickIndex.brickSize;
+	width = vr::min( _brickIndex.brickSize, _header.width - x0 );
+	height = vr::min( _brickIndex.brickSize, _header.height - y0 );
+}
+
+bool ShsFile::readBrick( int bx, int by, LayerSet& brick )
+{
+	int x0, y0, width, height;
+	brickRegion( bx, by, x0, y0, width, height );
+	return readRegion( x0, y0, width, height, brick );
+}
+
+bool ShsFile::readRegion( int x0, int y0, int width, int height, LayerSet& region )
+{
+	if( ( x0 < 0 ) || ( y0 < 0 ) || ( width <= 0 ) || ( height <= 0 ) || ( x0 + width > _header.width ) || ( y0 + height > _header.height ) )
+	{
+		printf( "Invalid region %dx%d at (%d, %d) of %s\n", width, height, x0, y0, _filename.c_str() );
+		return false;
+	}
+
+	// Without bricks, the region is cut out of whole layers
+	if( !isBricked() )
+	{
+		LayerSet layers;
+		if( !readLayers( layers ) )
+			return false;
+		region.resize( width, height, layerCount() );
+		for( int i = 0; i < layerCount(); ++i )
+		{
+			for( int y = 0; y < height; ++y )
+			{
+				vr::int64 src = (vr::int64)( y0 + y ) * _header.width + x0;
+				memcpy( region.heights( i ) + (vr::int64)y * width, layers.heights( i ) + src, width * sizeof(float) );
+				memcpy( region.normals( i ) + (vr::int64)y * width * 3, layers.normals( i ) + src * 3, width * 3 * sizeof(float) );
+			}
+		}
+		return true;
+	}
+
+	region.resize( width, height, layerCount() );
+	std::vector<unsigned char> parts;
+	std::vector<vr::uint64> partOffsets;
+	std::vector<float> texels;
+	int size = _brickIndex.brickSize;
+	for( int by = y0 / size; by <= ( y0 + height - 1 ) / size; ++by )
+	{
+		for( int bx = x0 / size; bx <= ( x0 + width - 1 ) / size; ++bx )
+		{
+			if( !readBrickParts( bx, by, parts, partOffsets ) )
+			{
+				region.clear();
+				return false;
+			}
+
+			// Overlap of brick and region, relative to the brick
+			int brickX, brickY, brickWidth, brickHeight;
+			brickRegion( bx, by, brickX, brickY, brickWidth, brickHeight );
+			int left = vr::max( x0, brickX ) - brickX;
+			int bottom = vr::max( y0, brickY ) - brickY;
+			int cols = vr::min( x0 + width, brickX + brickWidth ) - brickX - left;
+			int rows = vr::min( y0 + height, brickY + brickHeight ) - brickY - bottom;
+
+			for( int i = 0; i < layerCount(); ++i )
+			{
+				for( int c = 0; c < CHANNEL_COUNT; ++c )
+				{
+					Channel channel = (Channel)c;
+					if( !storedChannel( i, channel ) )
+						continue;
+
+					int n = components( channel );
+					texels.resize( (size_t)brickWidth * brickHeight * n );
+					decode( _layers[i].channels[c], channel, &parts[(size_t)partOffsets[i*CHANNEL_COUNT + c]],
+						    (size_t)brickWidth * brickHeight, &texels[0] );
+
+					float* dst = ( channel == HEIGHT ) ? region.heights( i ) : region.normals( i );
+					for( int y = 0; y < rows; ++y )
+					{
+						const float* srcRow = &texels[( (size_t)( bottom + y ) * brickWidth + left ) * n];
+						float* dstRow = dst + ( (vr::int64)( brickY + bottom + y - y0 ) * width + ( brickX + left - x0 ) ) * n;
+						memcpy( dstRow, srcRow, cols * n * sizeof(float) );
+					}
+				}
+			}
+		}
+	}
+
+	// Derived normals are computed once the region is complete
+	for( int i = 0; i < layerCount(); ++i )
+	{
+		if( !storedChannel( i, NORMAL ) )
+			LayerSet::computeNormals( region.heights( i ), width, height, hasFrame() ? &_frame : NULL, i, region.normals( i ) );
+	}
+	return true;
+}
+
+const void* ShsFile::storedData( int layer, Channel channel ) const
+{
+	if( !_mapped.isOpen() || isBricked() || !storedChannel( layer, channel ) || !validChannel( layer, channel ) ||
+		( _layers[layer].channels[channel].compression != COMPRESSION_NONE ) )
+		return NULL;
+	return _mapped.data() + _layers[layer].channels[channel].offset;
+}
+
+const float* ShsFile::channelData( int layer, Channel channel ) const
+{
+	if( !storedChannel( layer, channel ) || ( encoding( layer, channel ) != RAW_FLOAT32 ) )
+		return NULL;
+	return (const float*)storedData( layer, channel );
+}
+
+const float* ShsFile::heights( int layer ) const
+{
+	return channelData( layer, HEIGHT );
+}
+
+const float* ShsFile::normals( int layer ) const
+{
+	return channelData( layer, NORMAL );
+}
+
+bool ShsFile::verifyChannel( int layer, Channel channel )
+{
+	// Derived channels have nothing to verify
+	if( !storedChannel( layer, channel ) )
+		return ( layer >= 0 ) && ( layer < layerCount() );
+	if( !validChannel( layer, channel ) )
+		return false;
+
+	// Bricks hold every channel, each with its own checksum
+	if( isBricked() )
+	{
+		std::vector<unsigned char> parts;
+		std::vector<vr::uint64> partOffsets;
+		for( int by = 0; by < _brickIndex.bricksY; ++by )
+		{
+			for( int bx = 0; bx < _brickIndex.bricksX; ++bx )
+			{
+				if( !readBrickParts( bx, by, parts, partOffsets ) )
+					return false;
+			}
+		}
+		return true;
+	}
+
+	const ChannelEntry& entry = _layers[layer].channels[channel];
+	vr::uint32 sum = 1;
+	if( _mapped.isOpen() )
+	{
+		sum = checksum( _mapped.data() + entry.offset, (size_t)entry.size );
+	}
+	else
+	{
+		std::vector<unsigned char> block( 1 << 20 );
+		for( vr::uint64 done = 0; done < entry.size; done += block.size() )
+		{
+			vr::uint64 count = vr::min( entry.size - done, (vr::uint64)block.size() );
+			if( !read( entry.offset + done, &block[0], count ) )
+				return false;
+			sum = checksum( &block[0], (size_t)count, sum );
+		}
+	}
+
+	if( sum != entry.checksum )
+	{
+		printf( "Checksum mismatch in layer %d of %s\n", layer + 1, _filename.c_str() );
+		return false;
+	}
+	return true;
+}
+
+bool ShsFile::readChannel( int layer, Channel channel, float* dst )
+{
+	if( ( layer >= 0 ) && ( layer < layerCount() ) && !storedChannel( layer, channel ) )
+	{
+		if( channel != NORMAL )
+			return false;
+
+		const float* heights = this->heights( layer );
+		std::vector<float> buffer;
+		if( heights == NULL )
+		{
+			buffer.resize( (size_t)_header.width * _header.height );
+			if( !readChannel( layer, HEIGHT, &buffer[0] ) )
+				return false;
+			heights = &buffer[0];
+		}
+		LayerSet::computeNormals( heights, _header.width, _header.height, hasFrame() ? &_frame : NULL, layer, dst );
+		return true;
+	}
+
+	if( !validChannel( layer, channel ) )
+		return false;
+
+	const ChannelEntry& entry = _layers[layer].channels[channel];
+	if( entry.encoding == RAW_FLOAT32 )
+		return readStored( layer, channel, dst );
+
+	// Encoded channels are verified before decoding, straight from the mapping when possible
+	const void* stored = storedData( layer, channel );
+	std::vector<unsigned char> buffer;
+	if( stored != NULL )
+	{
+		if( !verifyChannel( layer, channel ) )
+			return false;
+	}
+	else
+	{
+		buffer.resize( (size_t)storedSize( layer, channel ) );
+		if( !readStored( layer, channel, &buffer[0] ) )
+			return false;
+		stored = &buffer[0];
+	}
+
+	decode( entry, channel, stored, (size_t)_header.width * _header.height, dst );
+	return true;
+}
+
+bool ShsFile::readStored( int layer, Channel channel, void* dst )
+{
+	if( !storedChannel( layer, channel ) || !validChannel( layer, channel ) )
+		return false;
+
+	if( isBricked() )
+	{
+		std::vector<unsigned char> parts;
+		std::vector<vr::uint64> partOffsets;
+		size_t texelBytes = texelSize( encoding( layer, channel ), channel );
+		for( int by = 0; by < _brickIndex.bricksY; ++by )
+		{
+			for( int bx = 0; bx < _brickIndex.bricksX; ++bx )
+			{
+				int x0, y0, width, height;
+				brickRegion( bx, by, x0, y0, width, height );
+				if( !readBrickParts( bx, by, parts, partOffsets, layer*CHANNEL_COUNT + channel ) )
+					return false;
+
+				const unsigned char* part = &parts[(size_t)partOffsets[layer*CHANNEL_COUNT + channel]];
+				for( int y = 0; y < height; ++y )
+				{
+					memcpy( (unsigned char*)dst + ( (vr::uint64)( y0 + y ) * _header.width + x0 ) * texelBytes,
+						    part + (size_t)y * width * texelBytes, width * texelBytes );
+				}
+			}
+		}
+		return true;
+	}
+
+	// Compressed channels are read (or mapped) whole, then decompressed into dst
+	const ChannelEntry& entry = _layers[layer].channels[channel];
+	bool compressed = entry.compression != COMPRESSION_NONE;
+	std::vector<unsigned char> buffer;
+	const unsigned char* stored = (const unsigned char*)dst;
+	if( compressed && _mapped.isOpen() )
+	{
+		stored = _mapped.data() + entry.offset;
+	}
+	else
+	{
+		if( compressed )
+		{
+			buffer.resize( (size_t)entry.size );
+			stored = &buffer[0];
+		}
+		if( !read( entry.offset, (void*)stored, entry.size ) )
+		{
+			printf( "Could not read layer %d of %s\n", layer + 1, _filename.c_str() );
+			return false;
+		}
+	}
+
+	if( checksum( stored, (size_t)entry.size ) != entry.checksum )
+	{
+		printf( "Checksum mismatch in layer %d of %s\n", layer + 1, _filename.c_str() );
+		return false;
+	}
+	return !compressed || decompress( layer, channel, stored, (unsigned char*)dst );
+}
+
+vr::uint64 ShsFile::storedSize( int layer, Channel channel ) const
+{
+	if( !storedChannel( layer, channel ) )
+		return 0;
+	return (vr::uint64)_header.width * _header.height * texelSize( encoding( layer, channel ), channel );
+}
+
+bool ShsFile::readTexels( int layer, Channel channel, vr::uint64 first, vr::uint64 count, float* dst )
+{
+	if( isBricked() || !storedChannel( layer, channel ) || !validChannel( layer, channel ) || ( encoding( layer, channel ) != RAW_FLOAT32 ) ||
+		( _layers[layer].channels[channel].compression != COMPRESSION_NONE ) )
+		return false;
+
+	const ChannelEntry& entry = _layers[layer].channels[channel];
+	vr::uint64 texelBytes = components( channel ) * sizeof(float);
+	if( ( first + count ) * texelBytes > entry.size )
+		return false;
+	return read( entry.offset + first * texelBytes, dst, count * texelBytes );
+}
+
+bool ShsFile::readLayers( LayerSet& layers )
+{
+	// Brick by brick, every brick is read once
+	if( isBricked() )
+		return readRegion( 0, 0, width(), height(), layers );
+
+	layers.resize( width(), height(), layerCount() );
+	for( int i = 0; i < layerCount(); ++i )
+	{
+		bool ok = readChannel( i, HEIGHT, layers.heights( i ) );
+		if( ok && !storedChannel( i, NORMAL ) )
+			LayerSet::computeNormals( layers.heights( i ), width(), height(), hasFrame() ? &_frame : NULL, i, layers.normals( i ) );
+		else if( ok )
+			ok = readChannel( i, NORMAL, layers.normals( i ) );
+
+		if( !ok )
+		{
+			layers.clear();
+			return false;
+		}
+	}
+	return true;
+}
+
+int ShsFile::components( Channel channel )
+{
+	return ( channel == NORMAL ) ? 3 : 1;
+}
+
+int ShsFile::texelSize( Encoding encoding, Channel channel )
+{
+	switch( encoding )
+	{
+	case RAW_FLOAT32:
+		return components( channel ) * (int)sizeof(float);
+	case HEIGHT_UNORM16:
+		return 2;
+	case HEIGHT_QUANTIZED:
+		return 4;
+	case NORMAL_OCT16:
+		return 4;
+	case NORMAL_OCT8:
+		return 2;
+	default:
+		return 0;
+	}
+}
+
+int ShsFile::wordSize( Encoding encoding )
+{
+	switch( encoding )
+	{
+	case RAW_FLOAT32:
+	case HEIGHT_QUANTIZED:
+		return 4;
+	case NORMAL_OCT8:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+bool ShsFile::supports( Encoding encoding, Channel channel )
+{
+	switch( encoding )
+	{
+	case RAW_FLOAT32:
+		return true;
+	case HEIGHT_UNORM16:
+	case HEIGHT_QUANTIZED:
+		return channel == HEIGHT;
+	case NOT_STORED:
+	case NORMAL_OCT16:
+	case NORMAL_OCT8:
+		return channel == NORMAL;
+	default:
+		return false;
+	}
+}
+
+void ShsFile::encode( const ChannelEntry& entry, Channel channel, const float* src, size_t count, void* dst )
+{
+	switch( entry.encoding )
+	{
+	case RAW_FLOAT32:
+		memcpy( dst, src, count * components( channel ) * sizeof(float) );
+		break;
+	case HEIGHT_UNORM16:
+		LayerEncoding::encodeHeights16( src, count, entry.rangeMin, entry.rangeMax, (vr::uint16*)dst );
+		break;
+	case HEIGHT_QUANTIZED:
+		LayerEncoding::quantizeHeights( src, count, entry.rangeMin, entry.step, (vr::uint32*)dst );
+		break;
+	case NORMAL_OCT16:
+		LayerEncoding::encodeOct16( src, count, (vr::uint16*)dst );
+		break;
+	case NORMAL_OCT8:
+		LayerEncoding::encodeOct8( src, count, (vr::uint8*)dst );
+		break;
+	default:
+		break;
+	}
+}
+
+void ShsFile::decode( const ChannelEntry& entry, Channel channel, const void* src, size_t count, float* dst )
+{
+	switch( entry.encoding )
+	{
+	case RAW_FLOAT32:
+		memcpy( dst, src, count * components( channel ) * sizeof(float) );
+		break;
+	case HEIGHT_UNORM16:
+		LayerEncoding::decodeHeights16( (const vr::uint16*)src, count, entry.rangeMin, entry.rangeMax, dst );
+		break;
+	case HEIGHT_QUANTIZED:
+		LayerEncoding::dequantizeHeights( (const vr::uint32*)src, count, entry.rangeMin, entry.step, dst );
+		break;
+	case NORMAL_OCT16:
+		LayerEncoding::decodeOct16( (const vr::uint16*)src, count, dst );
+		break;
+	case NORMAL_OCT8:
+		LayerEncoding::decodeOct8( (const vr::uint8*)src, count, dst );
+		break;
+	default:
+		break;
+	}
+}
+
+void ShsFile::initHeader( Header& header, int width, int height )
+{
+	memset( &header, 0, sizeof(Header) );
+	memcpy( header.magic, MAGIC, 4 );
+	header.version = VERSION;
+	header.width = width;
+	header.height = height;
+}
+
+void ShsFile::packFrame( const LayerFrame& frame, Header& header )
+{
+	double* f = header.frame;
+	const vr::vec3d* vectors[5] = { &frame.center, &frame.eye, &frame.right, &frame.up, &frame.forward };
+	for( int i = 0; i < 5; ++i, f+=3 )
+	{
+		f[0] = vectors[i]->x;
+		f[1] = vectors[i]->y;
+		f[2] = vectors[i]->z;
+	}
+	f[0] = frame.halfWidth;
+	f[1] = frame.halfHeight;
+	f[2] = frame.zNear;
+	f[3] = frame.zFar;
+	header.flags |= HAS_FRAME;
+}
+
+void ShsFile::packBoundingBox( const OrientedBox& box, Header& header )
+{
+	const vr::vec3d* vectors[5] = { &box.center, &box.axis[0], &box.axis[1], &box.axis[2], &box.halfExtent };
+	for( int i = 0; i < 5; ++i )
+	{
+		header.box[i*3]   = vectors[i]->x;
+		header.box[i*3+1] = vectors[i]->y;
+		header.box[i*3+2] = vectors[i]->z;
+	}
+	header.flags |= HAS_BOUNDING_BOX;
+}
+
+int ShsFile::pyramidLevels( int width, int height, int coarsestSize )
+{
+	int levels = 0;
+	while( ( vr::max( width, height ) > vr::max( coarsestSize, 1 ) ) && ( levels < MAX_PYRAMID_LEVELS ) )
+	{
+		width = ( width + 1 ) / 2;
+		height = ( height + 1 ) / 2;
+		++levels;
+	}
+	return levels;
+}
+
+vr::uint64 ShsFile::align( vr::uint64 offset )
+{
+	return ( offset + ALIGNMENT - 1 ) / ALIGNMENT * ALIGNMENT;
+}
+
+vr::uint32 ShsFile::checksum( const void* data, size_t size, vr::uint32 previous )
+{
+	// Adler-32, sums are reduced every 5552 bytes so that they never overflow
+	static const vr::uint32 MOD_ADLER = 65521;
+	const unsigned char* bytes = (const unsigned char*)data;
+	vr::uint32 a = previous & 0xFFFF;
+	vr::uint32 b = previous >> 16;
+
+	while( size > 0 )
+	{
+		size_t block = ( size < 5552 ) ? size : 5552;
+		size -= block;
+		for( size_t i = 0; i < block; ++i )
+		{
+			a += bytes[i];
+			b += a;
+		}
+		bytes += block;
+		a %= MOD_ADLER;
+		b %= MOD_ADLER;
+	}
+	return ( b << 16 ) | a;
+}
+
+bool ShsFile::seek( FILE* file, vr::int64 offset )
+{
+#ifdef _MSC_VER
+	return _fseeki64( file, offset, SEEK_SET ) == 0;
+#else
+	return fseeko( file, (off_t)offset, SEEK_SET ) == 0;
+#endif
+}
+
+vr::int64 ShsFile::fileSize( FILE* file )
+{
+#ifdef _MSC_VER
+	_fseeki64( file, 0, SEEK_END );
+	return _ftelli64( file );
+#else
+	fseeko( file, 0, SEEK_END );
+	return ftello( file );
+#endif
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+bool ShsFile::fits( vr::uint64 offset, vr::uint64 size ) const
+{
+	return ( offset <= _fileSize ) && ( size <= _fileSize - offset );
+}
+
+bool ShsFile::read( vr::uint64 offset, void* dst, vr::uint64 size )
+{
+	if( !fits( offset, size ) )
+		return false;
+
+	if( _mapped.isOpen() )
+	{
+		memcpy( dst, _mapped.data() + offset, (size_t)size );
+		return true;
+	}
+
+	if( ( _file == NULL ) || !seek( _file, (vr::int64)offset ) )
+		return false;
+	return fread( dst, 1, (size_t)size, _file ) == size;
+}
+
+bool ShsFile::readDirectory()
+{
+	_layers.resize( _header.layerCount );
+	if( _layers.empty() )
+		return true;
+
+	if( _header.version >= 4 )
+	{
+		// The whole directory in one read
+		if( !read( _header.directoryOffset, &_layers[0], sizeof(LayerEntry) * _layers.size() ) )
+			return false;
+	}
+	else
+	{
+		size_t entrySize = ( _header.version == 1 ) ? ENTRY_SIZE_V1 : ( ( _header.version == 2 ) ? ENTRY_SIZE_V2 : ENTRY_SIZE_V3 );
+		std::vector<unsigned char> entries( _layers.size() * CHANNEL_COUNT * entrySize );
+		if( !read( _header.directoryOffset, &entries[0], entries.size() ) )
+			return false;
+		for( size_t i = 0; i < _layers.size() * CHANNEL_COUNT; ++i )
+		{
+			ChannelEntry& entry = _layers[i / CHANNEL_COUNT].channels[i % CHANNEL_COUNT];
+			memset( &entry, 0, sizeof(ChannelEntry) );
+			entry.rangeMax = 1.0f;
+			memcpy( &entry, &entries[i * entrySize], entrySize );
+		}
+	}
+
+	// Stored channels must be inside the file before anything is read from them (bricked
+	// files keep their data in bricks, checked as they are read)
+	for( int i = 0; !isBricked() && ( i < layerCount() ); ++i )
+	{
+		for( int c = 0; c < CHANNEL_COUNT; ++c )
+		{
+			const ChannelEntry& entry = _layers[i].channels[c];
+			if( entry.encoding == NOT_STORED )
+				continue;
+			if( !fits( entry.offset, entry.size ) )
+			{
+				printf( "Layer %d of %s is truncated\n", i + 1, _filename.c_str() );
+				return false;
+			}
+
+			// Version 1 was first written without alignment, under the same number
+			if( ( _header.version == 1 ) && ( entry.offset % ALIGNMENT != 0 ) )
+			{
+				printf( "Layer %d of %s has unaligned channels, regenerate the file\n", i + 1, _filename.c_str() );
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+bool ShsFile::readBrickIndex()
+{
+	vr::uint64 offset = _header.directoryOffset + sizeof(LayerEntry) * _layers.size();
+	if( !read( offset, &_brickIndex, sizeof(BrickIndex) ) )
+		return false;
+
+	int size = _brickIndex.brickSize;
+	if( ( size < MIN_BRICK_SIZE ) || ( size > MAX_BRICK_SIZE ) ||
+		( _brickIndex.bricksX != ( _header.width + size - 1 ) / size ) || ( _brickIndex.bricksY != ( _header.height + size - 1 ) / size ) )
+		return false;
+
+	_bricks.resize( (size_t)_brickIndex.bricksX * _brickIndex.bricksY );
+	return _bricks.empty() || read( offset + sizeof(BrickIndex), &_bricks[0], sizeof(BrickEntry) * _bricks.size() );
+}
+
+bool ShsFile::readPyramidIndex()
+{
+	vr::uint64 offset = _header.directoryOffset + sizeof(LayerEntry) * _layers.size();
+	if( isBricked() )
+		offset += sizeof(BrickIndex) + sizeof(BrickEntry) * _bricks.size();
+
+	PyramidIndex index;
+	if( !read( offset, &index, sizeof(PyramidIndex) ) || ( index.levelCount < 1 ) || ( index.levelCount > MAX_PYRAMID_LEVELS ) )
+		return false;
+
+	_levels.resize( index.levelCount );
+	if( !read( offset + sizeof(PyramidIndex), &_levels[0], sizeof(LevelEntry) * _levels.size() ) )
+		return false;
+
+	// Each level halves the previous one
+	int width = _header.width;
+	int height = _header.height;
+	for( unsigned int i = 0; i < _levels.size(); ++i )
+	{
+		width = ( width + 1 ) / 2;
+		height = ( height + 1 ) / 2;
+		if( ( _levels[i].width != width ) || ( _levels[i].height != height ) || ( _levels[i].directoryOffset == 0 ) )
+			return false;
+	}
+	return true;
+}
+
+bool ShsFile::readConeIndex()
+{
+	vr::uint64 offset = _header.directoryOffset + sizeof(LayerEntry) * _layers.size();
+	if( isBricked() )
+		offset += sizeof(BrickIndex) + sizeof(BrickEntry) * _bricks.size();
+	if( _header.flags & PYRAMID )
+		offset += sizeof(PyramidIndex) + sizeof(LevelEntry) * _levels.size();
+
+	ConeIndex index;
+	if( !read( offset, &index, sizeof(ConeIndex) ) || ( index.encoding != CONE_RATIO8 ) )
+		return false;
+
+	_cones.resize( _layers.size() );
+	return _cones.empty() || read( offset + sizeof(ConeIndex), &_cones[0], sizeof(ConeEntry) * _cones.size() );
+}
+
+bool ShsFile::openLevel( int level )
+{
+	if( ( level < 1 ) || ( level > levelCount() ) )
+	{
+		printf( "%s has no level %d\n", _filename.c_str(), level );
+		return false;
+	}
+
+	// Levels are never bricked, everything else reads them like the full resolution
+	const LevelEntry& entry = _levels[level - 1];
+	_header.width = entry.width;
+	_header.height = entry.height;
+	_header.directoryOffset = entry.directoryOffset;
+	_header.flags &= ~( BRICKED | CONE_MAPS );
+	_bricks.clear();
+	_cones.clear();
+	memset( &_brickIndex, 0, sizeof(BrickIndex) );
+	_level = level;
+
+	if( !readDirectory() )
+	{
+		printf( "Could not read directory of level %d of %s\n", level, _filename.c_str() );
+		return false;
+	}
+	return true;
+}
+
+bool ShsFile::readBrickParts( int bx, int by, std::vector<unsigned char>& parts, std::vector<vr::uint64>& partOffsets, int onlyPart )
+{
+	if( ( bx < 0 ) || ( by < 0 ) || ( bx >= _brickIndex.bricksX ) || ( by >= _brickIndex.bricksY ) )
+		return false;
+
+	// One read per brick, or a page range of the mapping
+	const BrickEntry& entry = brick( bx, by );
+	std::vector<unsigned char> buffer;
+	const unsigned char* stored = NULL;
+	if( _mapped.isOpen() )
+	{
+		if( ( entry.offset > _mapped.size() ) || ( entry.size > _mapped.size() - entry.offset ) )
+		{
+			printf( "Brick (%d, %d) of %s is truncated\n", bx, by, _filename.c_str() );
+			return false;
+		}
+		stored = _mapped.data() + entry.offset;
+	}
+	else
+	{
+		buffer.resize( entry.size );
+		if( buffer.empty() || !read( entry.offset, &buffer[0], entry.size ) )
+		{
+			printf( "Could not read brick (%d, %d) of %s\n", bx, by, _filename.c_str() );
+			return false;
+		}
+		stored = &buffer[0];
+	}
+
+	if( checksum( stored, entry.size ) != entry.checksum )
+	{
+		printf( "Checksum mismatch in brick (%d, %d) of %s\n", bx, by, _filename.c_str() );
+		return false;
+	}
+
+	// Parts decoded to their stored encoding, in the order of the table
+	int x0, y0, width, height;
+	brickRegion( bx, by, x0, y0, width, height );
+	int partCount = storedChannelCount();
+	vr::uint64 tableBytes = (vr::uint64)partCount * sizeof(vr::uint32);
+	if( entry.size < tableBytes )
+		return false;
+	std::vector<vr::uint32> ends( partCount );
+	if( partCount > 0 )
+		memcpy( &ends[0], stored, (size_t)tableBytes );
+
+	partOffsets.assign( _layers.size() * CHANNEL_COUNT, 0 );
+	vr::uint64 partsSize = 0;
+	for( int i = 0; i < layerCount(); ++i )
+	{
+		for( int c = 0; c < CHANNEL_COUNT; ++c )
+		{
+			partOffsets[i*CHANNEL_COUNT + c] = partsSize;
+			if( storedChannel( i, (Channel)c ) )
+				partsSize += (vr::uint64)width * height * texelSize( encoding( i, (Channel)c ), (Channel)c );
+		}
+	}
+	parts.resize( (size_t)partsSize );
+
+	int part = 0;
+	vr::uint32 begin = 0;
+	for( int i = 0; i < layerCount(); ++i )
+	{
+		for( int c = 0; c < CHANNEL_COUNT; ++c )
+		{
+			Channel channel = (Channel)c;
+			if( !storedChannel( i, channel ) )
+				continue;
+
+			const ChannelEntry& channelEntry = _layers[i].channels[c];
+			Encoding encoding = (Encoding)channelEntry.encoding;
+			vr::uint32 end = ends[part++];
+			size_t bytes = (size_t)width * height * texelSize( encoding, channel );
+			unsigned char* dst = &parts[(size_t)partOffsets[i*CHANNEL_COUNT + c]];
+			const unsigned char* src = stored + tableBytes + begin;
+			bool ok = ( begin <= end ) && ( end <= entry.size - tableBytes );
+			if( ok && ( onlyPart >= 0 ) && ( onlyPart != i*CHANNEL_COUNT + c ) )
+			{
+				begin = end;
+				continue;
+			}
+			if( ok && ( channelEntry.compression == COMPRESSION_NONE ) )
+			{
+				ok = end - begin == bytes;
+				if( ok )
+					memcpy( dst, src, bytes );
+			}
+			else if( ok )
+			{
+				int words = texelSize( encoding, channel ) / wordSize( encoding );
+				ok = LayerCompression::decompressBlock( src, end - begin, width, height, words, wordSize( encoding ), dst );
+			}
+
+			if( !ok )
+			{
+				printf( "Invalid brick (%d, %d) of %s\n", bx, by, _filename.c_str() );
+				return false;
+			}
+			begin = end;
+		}
+	}
+	return true;
+}
+
+int ShsFile::storedChannelCount() const
+{
+	int count = 0;
+	for( int i = 0; i < layerCount(); ++i )
+	{
+		for( int c = 0; c < CHANNEL_COUNT; ++c )
+			count += storedChannel( i, (Channel)c ) ? 1 : 0;
+	}
+	return count;
+}
+
+bool ShsFile::decompress( int layer, Channel channel, const unsigned char* stored, unsigned char* dst ) const
+{
+	// Block ends (relative to the channel) follow the blocks
+	const ChannelEntry& entry = _layers[layer].channels[channel];
+	int blockCount = ( _header.height + entry.blockRows - 1 ) / entry.blockRows;
+	vr::uint64 tableOffset = entry.size - (vr::uint64)blockCount * sizeof(vr::uint64);
+	std::vector<vr::uint64> ends( blockCount );
+	memcpy( &ends[0], stored + tableOffset, blockCount * sizeof(vr::uint64) );
+
+	Encoding encoding = (Encoding)entry.encoding;
+	int texelBytes = texelSize( encoding, channel );
+	int words = texelBytes / wordSize( encoding );
+	bool ok = true;
+
+#pragma omp parallel for schedule(dynamic)
+	for( int b = 0; b < blockCount; ++b )
+	{
+		vr::uint64 begin = ( b > 0 ) ? ends[b-1] : 0;
+		int y0 = b * entry.blockRows;
+		int rows = vr::min( (int)entry.blockRows, _header.height - y0 );
+		if( ( begin > ends[b] ) || ( ends[b] > tableOffset ) ||
+			!LayerCompression::decompressBlock( stored + begin, (size_t)( ends[b] - begin ), _header.width, rows, words,
+			                                    wordSize( encoding ), dst + (vr::uint64)y0 * _header.width * texelBytes ) )
+			ok = false;
+	}
+
+	if( !ok )
+		printf( "Could not decompress layer %d of %s\n", layer + 1, _filename.c_str() );
+	return ok;
+}
+
+bool ShsFile::storedChannel( int layer, Channel channel ) const
+{
+	if( ( layer < 0 ) || ( layer >= layerCount() ) )
+		return false;
+	return _layers[layer].channels[channel].encoding != NOT_STORED;
+}
+
+bool ShsFile::validChannel( int layer, Channel channel ) const
+{
+	if( ( layer < 0 ) || ( layer >= layerCount() ) )
+		return false;
+
+	const ChannelEntry& entry = _layers[layer].channels[channel];
+	Encoding encoding = (Encoding)entry.encoding;
+	vr::uint64 size = (vr::uint64)_header.width * _header.height * texelSize( encoding, channel );
+	bool validSize = ( entry.compression == COMPRESSION_NONE ) && ( entry.size == size );
+	if( isBricked() )
+	{
+		// Checked brick by brick
+		validSize = ( entry.compression == COMPRESSION_NONE ) || ( entry.compression == COMPRESSION_LZ );
+	}
+	else if( ( entry.compression == COMPRESSION_LZ ) && ( entry.blockRows > 0 ) )
+	{
+		// At least the table of block ends
+		vr::uint64 blockCount = ( _header.height + entry.blockRows - 1 ) / entry.blockRows;
+		validSize = entry.size >= blockCount * sizeof(vr::uint64);
+	}
+
+	if( !supports( encoding, channel ) || ( encoding == NOT_STORED ) || !validSize )
+	{
+		printf( "Unsupported encoding %u for layer %d of %s\n", entry.encoding, layer + 1, _filename.c_str() );
+		return false;
+	}
+
+	// Neither reads nor views into the mapping may run past the end of the file
+	if( !fits( entry.offset, entry.size ) )
+	{
+		printf( "Layer %d of %s is truncated\n", layer + 1, _filename.c_str() );
+		return false;
+	}
+	return true;
+}
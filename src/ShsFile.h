@@ -0,0 +1,340 @@
+#ifndef _SHSFILE_H_
+#define _SHSFILE_H_
+
+#include <vr/platform.h>
+#include "LayerFrame.h"
+#include "OrientedBox.h"
+#include "LayerSet.h"
+#include "MappedFile.h"
+#include "LayerEncoding.h"
+#include "LayerCompression.h"
+#include <cstdio>
+#include <vector>
+#include <string>
+
+/*!
+	Single file container for a layer set (.shs).
+	Layout: header, channel data, then a directory with one entry per layer and channel.
+	The header holds resolution, layer count, frame and bounding box, and points to the
+	directory, so a reader needs one open and two reads before touching any texel.
+	Each channel records its encoding, offset, size and checksum, and heights the range
+	their codes are relative to (see LayerEncoding for the compact encodings).
+	Compressed channels are split into blocks of rows that decompress independently
+	(see LayerCompression), followed by a table with the end offset of every block.
+	Channels start on ALIGNMENT boundaries, so that a memory mapped file hands out
+	views of stored channels without copies. Written by TiledLayerWriter.
+
+	Bricked files (BRICKED) split the layers into square bricks instead, with the texels
+	of every layer and channel of a brick stored together, so that a region of huge layers
+	is read without touching the rest of the file. A brick index after the directory maps
+	each brick to its offset, size and checksum. A brick holds a table with the end of
+	each part (layer by layer, heights then normals, relative to the end of the table),
+	then the parts: texels of the brick region in the channel encoding, each part a
+	single compressed block when the channel is compressed. Channel entries keep their
+	encoding, range and compression, without offset, size or checksum of their own.
+
+	Files with a pyramid (PYRAMID) also hold coarser levels of the layers, each half the
+	size of the previous one (rounded up), so that a viewer shows something long before
+	the full resolution is read. Levels are stored whole with the same encodings, each with
+	a directory of their own, and a pyramid index after the directory (and brick index)
+	points to them. A reader opens one level at a time, as if it were the whole file.
+
+	Files with cone maps (CONE_MAPS) hold one byte per texel and layer of the full
+	resolution (see ConeMaps), stored uncompressed after its channels, so that ray casts
+	take safe steps longer than a texel. A cone index after the pyramid index (or the
+	directory and brick index) points to the map of every layer, with its checksum.
+ */
+class ShsFile
+{
+public:
+	enum Channel
+	{
+		HEIGHT,
+		NORMAL,
+		CHANNEL_COUNT
+	};
+
+	enum Encoding
+	{
+		RAW_FLOAT32,    // floats as in LayerSet, rows from bottom to top
+		NOT_STORED,     // normals only, derived from heights when read
+		HEIGHT_UNORM16, // heights only, 16 bits relative to the channel range
+		NORMAL_OCT16,   // normals only, octahedral 2x16 bits
+		NORMAL_OCT8,    // normals only, octahedral 2x8 bits
+		HEIGHT_QUANTIZED // heights only, 32-bit codes on a grid of the channel step, lossy with a bound
+	};
+
+	enum Compression
+	{
+		COMPRESSION_NONE,
+		COMPRESSION_LZ // predictive delta, byte planes and LZ77, lossless
+	};
+
+	enum Flags
+	{
+		HAS_FRAME = 1,
+		HAS_BOUNDING_BOX = 2,
+		NO_NORMALS = 4, // a quarter of the size, normals are derived from heights
+		BRICKED = 8,
+		PYRAMID = 16,
+		CONE_MAPS = 32
+	};
+
+	// Older versions are still read: 1 has only raw channels, 2 has no compression,
+	// 3 has no quantized heights, 4 has no bricks, 5 has no pyramid, 6 has no cone maps.
+	// Files of version 1 with channels not on ALIGNMENT boundaries predate alignment and
+	// are rejected. The writer only resumes files of this version.
+	static const vr::uint32 VERSION = 7;
+
+	// Largest layer side, so that texel counts of a layer fit an int, and largest layer count
+	static const int MAX_SIZE = 32768;
+	static const int MAX_LAYERS = 65536;
+
+	// Coarser levels a pyramid holds at most
+	static const int MAX_PYRAMID_LEVELS = 24;
+
+	// Range of brick sizes, in texels per side
+	static const int MIN_BRICK_SIZE = 8;
+	static const int MAX_BRICK_SIZE = 1024;
+
+	// Channel data alignment, a multiple of the page size on every platform we target
+	static const vr::uint64 ALIGNMENT = 4096;
+
+	// Every field is naturally aligned, so the struct is written as is (little endian)
+	struct Header
+	{
+		char magic[4];              // "SHS\0"
+		vr::uint32 version;
+		vr::int32 width;
+		vr::int32 height;
+		vr::int32 layerCount;
+		vr::uint32 flags;
+		double frame[19];           // center, eye, right, up, forward, halfWidth, halfHeight, zNear, zFar
+		double box[15];             // center, axis[3], halfExtent
+		vr::uint64 directoryOffset; // 0 while the file is being written
+	};
+
+	struct ChannelEntry
+	{
+		vr::uint32 encoding;
+		vr::uint32 checksum; // Adler-32 of the stored bytes
+		vr::uint64 offset;
+		vr::uint64 size;
+		float rangeMin; // non-empty heights, for HEIGHT_UNORM16 and HEIGHT_QUANTIZED
+		float rangeMax;
+		vr::uint32 compression;
+		vr::uint32 blockRows; // rows per compressed block
+		float step;           // grid of HEIGHT_QUANTIZED, in height units
+		float maxError;       // largest height error measured by the encoder, 0 when lossless
+	};
+
+	struct LayerEntry
+	{
+		ChannelEntry channels[CHANNEL_COUNT];
+	};
+
+	// Follows the directory in bricked files, then one BrickEntry per brick, rows from bottom to top
+	struct BrickIndex
+	{
+		vr::int32 brickSize;
+		vr::int32 bricksX;
+		vr::int32 bricksY;
+		vr::uint32 reserved;
+	};
+
+	struct BrickEntry
+	{
+		vr::uint64 offset;
+		vr::uint32 size;
+		vr::uint32 checksum; // Adler-32 of the whole brick
+	};
+
+	// Follows the directory (and brick index) in files with a pyramid, then one LevelEntry
+	// per coarser level, from the finest one
+	struct PyramidIndex
+	{
+		vr::uint32 levelCount;
+		vr::uint32 reserved;
+	};
+
+	struct LevelEntry
+	{
+		vr::int32 width;
+		vr::int32 height;
+		vr::uint64 directoryOffset; // one LayerEntry per layer, as in the header
+	};
+
+	// Last index in files with cone maps, then one ConeEntry per layer
+	struct ConeIndex
+	{
+		vr::uint32 encoding; // CONE_RATIO8, see ConeMaps
+		vr::uint32 reserved;
+	};
+
+	struct ConeEntry
+	{
+		vr::uint64 offset;
+		vr::uint32 size;
+		vr::uint32 checksum; // Adler-32 of the map
+	};
+
+	enum ConeEncoding
+	{
+		CONE_RATIO8 = 1
+	};
+
+public:
+	ShsFile();
+	~ShsFile();
+
+	// Reads header and directory. The file is memory mapped when possible (not for
+	// files larger than a 32-bit address space), otherwise channels are read on demand.
+	// Level 0 is the full resolution, coarser levels of a pyramid follow from 1.
+	bool open( const std::string& filename, int level = 0 );
+	void close();
+
+	bool isMapped() const;
+
+	int width() const;
+	int height() const;
+	int layerCount() const;
+
+	// False for files written without them
+	bool hasFrame() const;
+	bool hasBoundingBox() const;
+	bool hasNormals() const;
+	const LayerFrame& frame() const;
+	const OrientedBox& boundingBox() const;
+
+	const Header& header() const;
+	const LayerEntry& layer( int index ) const;
+	Encoding encoding( int layer, Channel channel ) const;
+
+	// Coarser levels of the file, 0 without a pyramid, and the level that was opened
+	int levelCount() const;
+	int level() const;
+
+	// Cone maps of the full resolution, false for coarser levels
+	bool hasConeMaps() const;
+
+	// Copies the cone map of a layer (width*height codes) and verifies its checksum
+	bool readConeMap( int layer, vr::uint8* dst );
+
+	// Bricked files, bricks are indexed from the lower left one
+	bool isBricked() const;
+	int brickSize() const;
+	int bricksX() const;
+	int bricksY() const;
+	const BrickEntry& brick( int bx, int by ) const;
+
+	// Texels covered by a brick, smaller than brickSize along the right and top edges
+	void brickRegion( int bx, int by, int& x0, int& y0, int& width, int& height ) const;
+
+	// Decodes every layer of a brick into a LayerSet of the brick region, reading the brick
+	// in one piece (or straight from the mapping) and verifying its checksum.
+	// Normals that are not stored are derived within the brick.
+	bool readBrick( int bx, int by, LayerSet& brick );
+
+	// Every layer of a region, reading only the bricks it overlaps (the whole layers
+	// when the file is not bricked). Normals that are not stored are derived within the region.
+	bool readRegion( int x0, int y0, int width, int height, LayerSet& region );
+
+	// Zero-copy views of stored channels, valid until close. NULL when the file is not mapped,
+	// or the channel is not stored, compressed or bricked.
+	// Pages are read by the OS on first access, and not verified against the checksum.
+	const void* storedData( int layer, Channel channel ) const;
+
+	// Same for RAW_FLOAT32 channels only, NULL for other encodings
+	const float* channelData( int layer, Channel channel ) const;
+	const float* heights( int layer ) const;
+	const float* normals( int layer ) const;
+
+	// Compares a channel against its checksum, reading it in full
+	bool verifyChannel( int layer, Channel channel );
+
+	// Decodes one channel into dst (width*height*components floats), verifying its checksum.
+	// Normals that are not stored are computed from the heights (see LayerSet::computeNormals).
+	bool readChannel( int layer, Channel channel, float* dst );
+
+	// Copies the stored bytes of a channel (storedSize), as they are encoded, verifying its
+	// checksum. Compressed channels are decompressed, one block per thread.
+	// Channels of bricked files are assembled from every brick.
+	bool readStored( int layer, Channel channel, void* dst );
+	vr::uint64 storedSize( int layer, Channel channel ) const;
+
+	// Part of an uncompressed RAW_FLOAT32 channel, count texels from the first one, without verification.
+	// Not for bricked files.
+	bool readTexels( int layer, Channel channel, vr::uint64 first, vr::uint64 count, float* dst );
+
+	// Reads every layer into memory
+	bool readLayers( LayerSet& layers );
+
+	// Floats per texel in given channel
+	static int components( Channel channel );
+
+	// Stored bytes per texel, 0 when not stored
+	static int texelSize( Encoding encoding, Channel channel );
+
+	// Bytes per word of an encoding, texels are texelSize / wordSize words
+	static int wordSize( Encoding encoding );
+
+	// False when given encoding cannot hold given channel
+	static bool supports( Encoding encoding, Channel channel );
+
+	// Converts count texels between floats and the stored encoding of entry (not NOT_STORED).
+	// Heights are encoded relative to entry's range and step, see LayerEncoding.
+	static void encode( const ChannelEntry& entry, Channel channel, const float* src, size_t count, void* dst );
+	static void decode( const ChannelEntry& entry, Channel channel, const void* src, size_t count, float* dst );
+
+	// Header initialized for a new file, without frame or bounding box
+	static void initHeader( Header& header, int width, int height );
+	static void packFrame( const LayerFrame& frame, Header& header );
+	static void packBoundingBox( const OrientedBox& box, Header& header );
+
+	// Coarser levels needed until neither side is above coarsestSize
+	static int pyramidLevels( int width, int height, int coarsestSize = 256 );
+
+	// Rounds up to a multiple of ALIGNMENT
+	static vr::uint64 align( vr::uint64 offset );
+
+	// Incremental Adler-32, start with previous = 1
+	static vr::uint32 checksum( const void* data, size_t size, vr::uint32 previous = 1 );
+
+	// Layers above 2GB need 64-bit offsets
+	static bool seek( FILE* file, vr::int64 offset );
+	static vr::int64 fileSize( FILE* file );
+
+private:
+	// Whether size bytes from offset are inside the file
+	bool fits( vr::uint64 offset, vr::uint64 size ) const;
+	bool read( vr::uint64 offset, void* dst, vr::uint64 size );
+	bool readDirectory();
+	bool readBrickIndex();
+	bool readPyramidIndex();
+	bool readConeIndex();
+	// Replaces size, directory and bricks with those of a coarser level
+	bool openLevel( int level );
+	// Verified brick, decoded to the stored encodings, all parts or only the one of layer*CHANNEL_COUNT + channel
+	bool readBrickParts( int bx, int by, std::vector<unsigned char>& parts, std::vector<vr::uint64>& partOffsets, int onlyPart = -1 );
+	int storedChannelCount() const;
+	bool decompress( int layer, Channel channel, const unsigned char* stored, unsigned char* dst ) const;
+	bool storedChannel( int layer, Channel channel ) const;
+	bool validChannel( int layer, Channel channel ) const;
+
+private:
+	MappedFile _mapped;
+	FILE* _file;
+	std::string _filename;
+	vr::uint64 _fileSize;
+	Header _header;
+	LayerFrame _frame;
+	OrientedBox _box;
+	std::vector<LayerEntry> _layers;
+	BrickIndex _brickIndex;
+	std::vector<BrickEntry> _bricks;
+	std::vector<LevelEntry> _levels;
+	std::vector<ConeEntry> _cones;
+	int _level;
+};
+
+#endif // _SHSFILE_H_
@@ -0,0 +1,393 @@
+#include "SoftwareLayerGenerator.h"
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+SoftwareLayerGenerator::SoftwareLayerGenerator()
+: _mesh( NULL ), _width( 0 ), _height( 0 ), _tileSize( 64 )
+{
+	// empty
+}
+
+void SoftwareLayerGenerator::setMesh( const TriangleMesh* mesh )
+{
+	_mesh = mesh;
+}
+
+void SoftwareLayerGenerator::setFrame( const LayerFrame& frame )
+{
+	_frame = frame;
+}
+
+void SoftwareLayerGenerator::setResolution( int width, int height )
+{
+	_width = width;
+	_height = height;
+}
+
+void SoftwareLayerGenerator::setTileSize( int size )
+{
+	_tileSize = vr::max( size, 1 );
+}
+
+int SoftwareLayerGenerator::generateLayers( LayerSet& layers )
+{
+	layers.clear();
+
+	if( ( _mesh == NULL ) || ( _width <= 0 ) || ( _height <= 0 ) )
+		return 0;
+
+	int layerCount = resolveTiles();
+	printf( "Layers needed: %d\n", layerCount );
+
+	// Emit all layers at once
+	layers.resize( _width, _height, layerCount );
+
+	int tileCount = (int)_tiles.size();
+
+#pragma omp parallel for schedule(dynamic)
+	for( int i = 0; i < tileCount; ++i )
+	{
+		emitTile( _tiles[i], layers, 0, 0 );
+	}
+
+	// Cleanup
+	_projected.clear();
+	_tiles.clear();
+
+	return layerCount;
+}
+
+int SoftwareLayerGenerator::generateLayers( TiledLayerWriter& writer )
+{
+	if( ( _mesh == NULL ) || ( _width <= 0 ) || ( _height <= 0 ) )
+		return 0;
+
+	if( ( writer.width() != _width ) || ( writer.height() != _height ) )
+	{
+		printf( "Warning: layer writer is %dx%d, expected %dx%d\n", writer.width(), writer.height(), _width, _height );
+		return 0;
+	}
+
+	projectTriangles();
+	binTriangles();
+
+	int tileCount = (int)_tiles.size();
+	int layerCount = 0;
+
+#pragma omp parallel for schedule(dynamic)
+	for( int i = 0; i < tileCount; ++i )
+	{
+		Tile& tile = _tiles[i];
+		rasterizeTile( tile, _projected );
+		resolveTile( tile );
+
+		LayerSet layers;
+		layers.resize( tile.x1 - tile.x0, tile.y1 - tile.y0, tile.layerCount );
+		emitTile( tile, layers, tile.x0, tile.y0 );
+
+		// Release tile memory right away
+		std::vector<Fragment>().swap( tile.fragments );
+		std::vector<unsigned int>().swap( tile.offsets );
+		std::vector<unsigned int>().swap( tile.triangles );
+
+#pragma omp critical
+		{
+			writer.writeTile( layers, tile.x0, tile.y0 );
+			layerCount = vr::max( layerCount, tile.layerCount );
+		}
+	}
+
+	printf( "Layers needed: %d\n", layerCount );
+
+	_projected.clear();
+	_tiles.clear();
+
+	return layerCount;
+}
+
+void SoftwareLayerGenerator::projectTriangle( const vr::vec3f* vertices, const vr::vec3f* normals, ProjectedTriangle& tri ) const
+{
+	for( int k = 0; k < 3; ++k )
+	{
+		const vr::vec3f& v = vertices[k];
+		const vr::vec3f& n = normals[k];
+
+		// Pixel centers are at integer + 0.5, as in OpenGL
+		vr::vec3d p = _frame.toTexture( vr::vec3d( v.x, v.y, v.z ) );
+		tri.x[k] = p.x * _width;
+		tri.y[k] = p.y * _height;
+		tri.z[k] = p.z;
+
+		vr::vec3d en = _frame.toEye( vr::vec3d( n.x, n.y, n.z ) );
+		tri.n[k].set( en.x, en.y, en.z );
+	}
+}
+
+bool SoftwareLayerGenerator::coveredTexels( const ProjectedTriangle& tri, int& x0, int& y0, int& x1, int& y1 ) const
+{
+	// Discard triangles entirely outside the depth range
+	if( ( tri.z[0] < 0.0 && tri.z[1] < 0.0 && tri.z[2] < 0.0 ) ||
+		( tri.z[0] > 1.0 && tri.z[1] > 1.0 && tri.z[2] > 1.0 ) )
+		return false;
+
+	// Range of pixel centers covered by the triangle bounds
+	double minX = vr::min( tri.x[0], vr::min( tri.x[1], tri.x[2] ) );
+	double maxX = vr::max( tri.x[0], vr::max( tri.x[1], tri.x[2] ) );
+	double minY = vr::min( tri.y[0], vr::min( tri.y[1], tri.y[2] ) );
+	double maxY = vr::max( tri.y[0], vr::max( tri.y[1], tri.y[2] ) );
+
+	x0 = vr::max( (int)ceil( minX - 0.5 ), 0 );
+	x1 = vr::min( (int)floor( maxX - 0.5 ), _width - 1 );
+	y0 = vr::max( (int)ceil( minY - 0.5 ), 0 );
+	y1 = vr::min( (int)floor( maxY - 0.5 ), _height - 1 );
+
+	return ( x0 <= x1 ) && ( y0 <= y1 );
+}
+
+int SoftwareLayerGenerator::generateTile( const std::vector<ProjectedTriangle>& triangles, int x0, int y0, int x1, int y1, LayerSet& layers ) const
+{
+	Tile tile;
+	tile.x0 = x0;
+	tile.y0 = y0;
+	tile.x1 = x1;
+	tile.y1 = y1;
+	tile.layerCount = 0;
+	tile.triangles.resize( triangles.size() );
+	for( unsigned int i = 0; i < triangles.size(); ++i )
+		tile.triangles[i] = i;
+
+	rasterizeTile( tile, triangles );
+	resolveTile( tile );
+
+	layers.resize( x1 - x0, y1 - y0, tile.layerCount );
+	emitTile( tile, layers, x0, y0 );
+
+	return tile.layerCount;
+}
+
+int SoftwareLayerGenerator::computeDepthComplexity( std::vector<unsigned int>& counts )
+{
+	counts.clear();
+
+	if( ( _mesh == NULL ) || ( _width <= 0 ) || ( _height <= 0 ) )
+		return 0;
+
+	int layerCount = resolveTiles();
+
+	counts.resize( _width*_height );
+	for( unsigned int i = 0; i < _tiles.size(); ++i )
+	{
+		const Tile& tile = _tiles[i];
+		int tileWidth = tile.x1 - tile.x0;
+		for( int y = tile.y0; y < tile.y1; ++y )
+		{
+			for( int x = tile.x0; x < tile.x1; ++x )
+			{
+				unsigned int texel = ( y - tile.y0 )*tileWidth + ( x - tile.x0 );
+				counts[y*_width + x] = tile.offsets[texel+1] - tile.offsets[texel];
+			}
+		}
+	}
+
+	_projected.clear();
+	_tiles.clear();
+
+	return layerCount;
+}
+
+bool SoftwareLayerGenerator::ownsEdge( double dx, double dy )
+{
+	return ( dy < 0.0 ) || ( ( dy == 0.0 ) && ( dx < 0.0 ) );
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+int SoftwareLayerGenerator::resolveTiles()
+{
+	projectTriangles();
+	binTriangles();
+
+	// Rasterize and sort each tile independently
+	int tileCount = (int)_tiles.size();
+
+#pragma omp parallel for schedule(dynamic)
+	for( int i = 0; i < tileCount; ++i )
+	{
+		rasterizeTile( _tiles[i], _projected );
+		resolveTile( _tiles[i] );
+	}
+
+	int layerCount = 0;
+	for( int i = 0; i < tileCount; ++i )
+		layerCount = vr::max( layerCount, _tiles[i].layerCount );
+
+	return layerCount;
+}
+
+void SoftwareLayerGenerator::projectTriangles()
+{
+	int triangleCount = (int)_mesh->triangleCount();
+	_projected.resize( triangleCount );
+
+#pragma omp parallel for
+	for( int t = 0; t < triangleCount; ++t )
+	{
+		projectTriangle( &_mesh->vertices[t*3], &_mesh->normals[t*3], _projected[t] );
+	}
+}
+
+void SoftwareLayerGenerator::binTriangles()
+{
+	int tilesX = ( _width + _tileSize - 1 ) / _tileSize;
+	int tilesY = ( _height + _tileSize - 1 ) / _tileSize;
+
+	_tiles.clear();
+	_tiles.resize( tilesX * tilesY );
+	for( int ty = 0; ty < tilesY; ++ty )
+	{
+		for( int tx = 0; tx < tilesX; ++tx )
+		{
+			Tile& tile = _tiles[ty*tilesX + tx];
+			tile.x0 = tx * _tileSize;
+			tile.y0 = ty * _tileSize;
+			tile.x1 = vr::min( tile.x0 + _tileSize, _width );
+			tile.y1 = vr::min( tile.y0 + _tileSize, _height );
+			tile.layerCount = 0;
+		}
+	}
+
+	for( unsigned int t = 0; t < _projected.size(); ++t )
+	{
+		int x0, y0, x1, y1;
+		if( !coveredTexels( _projected[t], x0, y0, x1, y1 ) )
+			continue;
+
+		for( int ty = y0 / _tileSize; ty <= y1 / _tileSize; ++ty )
+			for( int tx = x0 / _tileSize; tx <= x1 / _tileSize; ++tx )
+				_tiles[ty*tilesX + tx].triangles.push_back( t );
+	}
+}
+
+void SoftwareLayerGenerator::rasterizeTile( Tile& tile, const std::vector<ProjectedTriangle>& projected ) const
+{
+	int tileWidth = tile.x1 - tile.x0;
+
+	for( unsigned int i = 0; i < tile.triangles.size(); ++i )
+	{
+		const ProjectedTriangle& tri = projected[tile.triangles[i]];
+
+		// Orient counter-clockwise
+		int v[3] = { 0, 1, 2 };
+		double area = ( tri.x[1] - tri.x[0] )*( tri.y[2] - tri.y[0] ) - ( tri.x[2] - tri.x[0] )*( tri.y[1] - tri.y[0] );
+		if( area == 0.0 )
+			continue;
+		if( area < 0.0 )
+		{
+			std::swap( v[1], v[2] );
+			area = -area;
+		}
+
+		double minX = vr::min( tri.x[0], vr::min( tri.x[1], tri.x[2] ) );
+		double maxX = vr::max( tri.x[0], vr::max( tri.x[1], tri.x[2] ) );
+		double minY = vr::min( tri.y[0], vr::min( tri.y[1], tri.y[2] ) );
+		double maxY = vr::max( tri.y[0], vr::max( tri.y[1], tri.y[2] ) );
+
+		int x0 = vr::max( (int)ceil( minX - 0.5 ), tile.x0 );
+		int x1 = vr::min( (int)floor( maxX - 0.5 ), tile.x1 - 1 );
+		int y0 = vr::max( (int)ceil( minY - 0.5 ), tile.y0 );
+		int y1 = vr::min( (int)floor( maxY - 0.5 ), tile.y1 - 1 );
+
+		double invArea = 1.0 / area;
+
+		for( int y = y0; y <= y1; ++y )
+		{
+			double py = y + 0.5;
+			for( int x = x0; x <= x1; ++x )
+			{
+				double px = x + 0.5;
+
+				// Edge k goes from v[k] to v[k+1] and weights the opposite vertex v[k+2]
+				double w[3];
+				bool inside = true;
+				for( int k = 0; k < 3 && inside; ++k )
+				{
+					int a = v[k];
+					int b = v[(k+1)%3];
+					double dx = tri.x[b] - tri.x[a];
+					double dy = tri.y[b] - tri.y[a];
+					double e = dx*( py - tri.y[a] ) - dy*( px - tri.x[a] );
+					inside = ( e > 0.0 ) || ( ( e == 0.0 ) && ownsEdge( dx, dy ) );
+					w[v[(k+2)%3]] = e * invArea;
+				}
+
+				if( !inside )
+					continue;
+
+				float depth = (float)( w[0]*tri.z[0] + w[1]*tri.z[1] + w[2]*tri.z[2] );
+				if( ( depth < 0.0f ) || ( depth > 1.0f ) )
+					continue;
+
+				vr::vec3f n = tri.n[0]*(float)w[0] + tri.n[1]*(float)w[1] + tri.n[2]*(float)w[2];
+				n.tryNormalize();
+
+				Fragment f;
+				f.texel = ( y - tile.y0 )*tileWidth + ( x - tile.x0 );
+				f.depth = depth;
+				f.normal[0] = n.x;
+				f.normal[1] = n.y;
+				f.normal[2] = n.z;
+				tile.fragments.push_back( f );
+			}
+		}
+	}
+}
+
+void SoftwareLayerGenerator::resolveTile( Tile& tile ) const
+{
+	unsigned int texelCount = ( tile.x1 - tile.x0 )*( tile.y1 - tile.y0 );
+
+	std::sort( tile.fragments.begin(), tile.fragments.end() );
+
+	// Compact lists, dropping fragments that are not strictly behind the previous one.
+	// Depth peeling discards those as well (gl_FragCoord.z <= prevDepth).
+	tile.offsets.assign( texelCount + 1, 0 );
+	tile.layerCount = 0;
+
+	unsigned int out = 0;
+	unsigned int in = 0;
+	for( unsigned int texel = 0; texel < texelCount; ++texel )
+	{
+		tile.offsets[texel] = out;
+		float prevDepth = -1.0f;
+		for( ; ( in < tile.fragments.size() ) && ( tile.fragments[in].texel == texel ); ++in )
+		{
+			if( tile.fragments[in].depth <= prevDepth )
+				continue;
+			prevDepth = tile.fragments[in].depth;
+			tile.fragments[out++] = tile.fragments[in];
+		}
+		tile.layerCount = vr::max( tile.layerCount, (int)( out - tile.offsets[texel] ) );
+	}
+	tile.offsets[texelCount] = out;
+	tile.fragments.resize( out );
+}
+
+void SoftwareLayerGenerator::emitTile( const Tile& tile, LayerSet& layers, int originX, int originY ) const
+{
+	int tileWidth = tile.x1 - tile.x0;
+
+	for( int y = tile.y0; y < tile.y1; ++y )
+	{
+		for( int x = tile.x0; x < tile.x1; ++x )
+		{
+			unsigned int texel = ( y - tile.y0 )*tileWidth + ( x - tile.x0 );
+			unsigned int idx = ( y - originY )*layers.width() + ( x - originX );
+			unsigned int first = tile.offsets[texel];
+			if( tile.offsets[texel+1] > first )
+				emitTexel( &tile.fragments[first], tile.offsets[texel+1] - first, idx, layers );
+		}
+	}
+}
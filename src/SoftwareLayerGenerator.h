@@ -0,0 +1,123 @@
+#ifndef _SOFTWARELAYERGENERATOR_H_
+#define _SOFTWARELAYERGENERATOR_H_
+
+#include <vector>
+#include "LayerFrame.h"
+#include "LayerSet.h"
+#include "TriangleMesh.h"
+#include "TiledLayerWriter.h"
+
+/*!
+	CPU alternative to depth peeling (software A-buffer).
+	Rasterizes every triangle once into per-texel depth lists, sorts each list and
+	emits all layers together. The image is split into tiles processed in parallel.
+	Produces the same heights and normals as LayerGenerator, without Qt or OpenGL.
+ */
+class SoftwareLayerGenerator
+{
+public:
+	// Triangle in texel units (x, y), window depth (z) and eye space normals
+	struct ProjectedTriangle
+	{
+		double x[3];
+		double y[3];
+		double z[3];
+		vr::vec3f n[3];
+	};
+
+public:
+	SoftwareLayerGenerator();
+
+	void setMesh( const TriangleMesh* mesh );
+	void setFrame( const LayerFrame& frame );
+	void setResolution( int width, int height );
+	void setTileSize( int size );
+
+	// Returns the number of layers generated
+	int generateLayers( LayerSet& layers );
+
+	// Same, but each tile goes to writer as soon as it is resolved, so memory for
+	// fragments and layers is bounded by the tile size. Writer must match the resolution.
+	int generateLayers( TiledLayerWriter& writer );
+
+	// Building blocks for out-of-core generation, only frame and resolution are needed.
+	// Projects one triangle (3 vertices and 3 normals) through the frame.
+	void projectTriangle( const vr::vec3f* vertices, const vr::vec3f* normals, ProjectedTriangle& tri ) const;
+
+	// Range of texel centers touched by tri, false if none (or outside the depth range)
+	bool coveredTexels( const ProjectedTriangle& tri, int& x0, int& y0, int& x1, int& y1 ) const;
+
+	// Resolves texels [x0,x1) x [y0,y1) from the given triangles into tile sized layers.
+	// Returns the number of layers.
+	int generateTile( const std::vector<ProjectedTriangle>& triangles, int x0, int y0, int x1, int y1, LayerSet& layers ) const;
+
+	// Only counts layers per texel (rows from bottom to top), without emitting them.
+	// Returns the maximum count.
+	int computeDepthComplexity( std::vector<unsigned int>& counts );
+
+	// Top-left fill rule for counter-clockwise triangles, so shared edges are rasterized only once.
+	// Otherwise a texel on a shared edge would get two fragments and a spurious layer.
+	// Bvh breaks ray-triangle ties the same way.
+	static bool ownsEdge( double dx, double dy );
+
+	// Writes the count fragments of texel idx, front to back, into layers 0 to count-1,
+	// with the same conversion as LayerWriteQueue::convertPixels. Any fragment type with
+	// a window depth and an eye space normal, as both CPU generators have their own.
+	template<typename Fragment>
+	static void emitTexel( const Fragment* fragments, unsigned int count, unsigned int idx, LayerSet& layers )
+	{
+		for( unsigned int k = 0; k < count; ++k )
+		{
+			const Fragment& frag = fragments[k];
+			layers.heights( k )[idx] = ( frag.depth == 0.0f ) ? 0.0f : 1.0f - frag.depth;
+
+			float* normal = layers.normals( k ) + idx*3;
+			normal[0] = frag.normal[0];
+			normal[1] = frag.normal[1];
+			normal[2] = frag.normal[2];
+		}
+	}
+
+private:
+	struct Fragment
+	{
+		unsigned int texel; // index inside tile
+		float depth;
+		float normal[3];
+
+		bool operator<( const Fragment& other ) const
+		{
+			if( texel != other.texel )
+				return texel < other.texel;
+			return depth < other.depth;
+		}
+	};
+
+	struct Tile
+	{
+		int x0, y0, x1, y1; // texel range [x0,x1) x [y0,y1)
+		std::vector<unsigned int> triangles;
+		std::vector<Fragment> fragments;
+		std::vector<unsigned int> offsets; // per texel, into fragments
+		int layerCount;
+	};
+
+	int resolveTiles();
+	void projectTriangles();
+	void binTriangles();
+	void rasterizeTile( Tile& tile, const std::vector<ProjectedTriangle>& projected ) const;
+	void resolveTile( Tile& tile ) const;
+	// Writes tile into layers, whose lower left texel is (originX, originY)
+	void emitTile( const Tile& tile, LayerSet& layers, int originX, int originY ) const;
+
+private:
+	const TriangleMesh* _mesh;
+	LayerFrame _frame;
+	int _width;
+	int _height;
+	int _tileSize;
+	std::vector<ProjectedTriangle> _projected;
+	std::vector<Tile> _tiles;
+};
+
+#endif // _SOFTWARELAYERGENERATOR_H_
@@ -0,0 +1,323 @@
+#include "StreamingLayerGenerator.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+StreamingLayerGenerator::StreamingLayerGenerator()
+: _stream( NULL ), _hasBox( false ), _width( 0 ), _height( 0 ), _tileSize( 256 ), _tilesX( 0 ), _tilesY( 0 ),
+  _chunkSize( 1 << 20 ), _workDir( "." )
+{
+	// empty
+}
+
+void StreamingLayerGenerator::setStream( TriangleStream* stream )
+{
+	_stream = stream;
+}
+
+void StreamingLayerGenerator::setFrame( const LayerFrame& frame )
+{
+	_frame = frame;
+}
+
+void StreamingLayerGenerator::setBoundingBox( const OrientedBox& box )
+{
+	_box = box;
+	_hasBox = true;
+}
+
+void StreamingLayerGenerator::setResolution( int width, int height )
+{
+	_width = width;
+	_height = height;
+}
+
+void StreamingLayerGenerator::setTileSize( int size )
+{
+	_tileSize = vr::max( size, 1 );
+}
+
+void StreamingLayerGenerator::setChunkSize( unsigned int triangles )
+{
+	_chunkSize = vr::max( triangles, 1u );
+}
+
+void StreamingLayerGenerator::setWorkDirectory( const std::string& dir )
+{
+	_workDir = dir;
+}
+
+int StreamingLayerGenerator::generateLayers( const std::string& filename )
+{
+	if( ( _stream == NULL ) || ( _width <= 0 ) || ( _height <= 0 ) )
+		return -1;
+
+	_generator.setFrame( _frame );
+	_generator.setResolution( _width, _height );
+	_tilesX = ( _width + _tileSize - 1 ) / _tileSize;
+	_tilesY = ( _height + _tileSize - 1 ) / _tileSize;
+	int tileCount = _tilesX * _tilesY;
+
+	// Bins are complete once the job file exists
+	bool resume = canResume();
+	if( !resume )
+	{
+		cleanup();
+		if( !binTriangles() )
+			return -1;
+		saveJob();
+	}
+
+	TiledLayerWriter writer;
+	if( !writer.open( filename, _width, _height, resume ) )
+		return -1;
+	writer.setFrame( _frame );
+	if( _hasBox )
+		writer.setBoundingBox( _box );
+
+	// A list with a torn or invalid line is rewritten with the tiles it holds, otherwise
+	// the next record would be appended to the torn one
+	std::vector<bool> done( tileCount, false );
+	bool rewrite = resume && !readDoneTiles( done );
+
+	FILE* progress = fopen( workFilename( "done" ).c_str(), rewrite ? "w" : "a" );
+	if( progress == NULL )
+	{
+		printf( "Warning: could not record progress in %s\n", _workDir.c_str() );
+		return -1;
+	}
+	if( rewrite )
+	{
+		for( int i = 0; i < tileCount; ++i )
+		{
+			if( done[i] )
+				fprintf( progress, "%d\n", i );
+		}
+		fflush( progress );
+	}
+
+	bool ok = true;
+
+#pragma omp parallel for schedule(dynamic)
+	for( int i = 0; i < tileCount; ++i )
+	{
+		if( done[i] || !ok )
+			continue;
+
+		int x0 = ( i % _tilesX ) * _tileSize;
+		int y0 = ( i / _tilesX ) * _tileSize;
+		int x1 = vr::min( x0 + _tileSize, _width );
+		int y1 = vr::min( y0 + _tileSize, _height );
+
+		std::vector<ProjectedTriangle> triangles;
+		LayerSet layers;
+		bool tileOk = readTile( i, triangles );
+		if( tileOk )
+			_generator.generateTile( triangles, x0, y0, x1, y1, layers );
+
+#pragma omp critical
+		{
+			// Record the tile only once its texels are on disk
+			if( tileOk && writer.writeTile( layers, x0, y0 ) )
+			{
+				writer.flush();
+				fprintf( progress, "%d\n", i );
+				fflush( progress );
+			}
+			else
+			{
+				ok = false;
+			}
+		}
+	}
+
+	fclose( progress );
+
+	int layerCount = writer.layerCount();
+	if( !writer.close() )
+		ok = false;
+
+	if( !ok )
+	{
+		printf( "Warning: streaming generation stopped, run again to resume\n" );
+		return -1;
+	}
+
+	printf( "Layers needed: %d\n", layerCount );
+	cleanup();
+	return layerCount;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+bool StreamingLayerGenerator::canResume()
+{
+	LayerFrame frame;
+	if( !frame.load( workFilename( "frame" ) ) )
+		return false;
+
+	FILE* job = fopen( workFilename( "job" ).c_str(), "r" );
+	if( job == NULL )
+		return false;
+
+	int width = 0;
+	int height = 0;
+	int tileSize = 0;
+	int read = fscanf( job, "%d %d %d", &width, &height, &tileSize );
+	fclose( job );
+
+	// Frames are saved with full precision, so they compare exactly
+	return ( read == 3 ) && ( width == _width ) && ( height == _height ) && ( tileSize == _tileSize ) &&
+		   ( frame.eye == _frame.eye ) && ( frame.right == _frame.right ) && ( frame.up == _frame.up ) &&
+		   ( frame.forward == _frame.forward ) && ( frame.halfWidth == _frame.halfWidth ) &&
+		   ( frame.halfHeight == _frame.halfHeight ) && ( frame.zNear == _frame.zNear ) && ( frame.zFar == _frame.zFar );
+}
+
+void StreamingLayerGenerator::saveJob()
+{
+	_frame.save( workFilename( "frame" ) );
+
+	FILE* job = fopen( workFilename( "job" ).c_str(), "w" );
+	if( job == NULL )
+		return;
+	fprintf( job, "%d %d %d\n", _width, _height, _tileSize );
+	fclose( job );
+}
+
+bool StreamingLayerGenerator::binTriangles()
+{
+	int tileCount = _tilesX * _tilesY;
+	std::vector< std::vector<ProjectedTriangle> > bins( tileCount );
+
+	TriangleMesh chunk;
+	std::vector<ProjectedTriangle> projected;
+	unsigned int total = 0;
+
+	_stream->rewind();
+	while( _stream->readChunk( chunk, _chunkSize ) )
+	{
+		int triangleCount = (int)chunk.triangleCount();
+		projected.resize( triangleCount );
+
+#pragma omp parallel for
+		for( int t = 0; t < triangleCount; ++t )
+		{
+			_generator.projectTriangle( &chunk.vertices[t*3], &chunk.normals[t*3], projected[t] );
+		}
+
+		for( int t = 0; t < triangleCount; ++t )
+		{
+			int x0, y0, x1, y1;
+			if( !_generator.coveredTexels( projected[t], x0, y0, x1, y1 ) )
+				continue;
+
+			for( int ty = y0 / _tileSize; ty <= y1 / _tileSize; ++ty )
+				for( int tx = x0 / _tileSize; tx <= x1 / _tileSize; ++tx )
+					bins[ty*_tilesX + tx].push_back( projected[t] );
+		}
+
+		// Flush bins after every chunk, so that memory does not grow with the mesh
+		for( int i = 0; i < tileCount; ++i )
+		{
+			if( bins[i].empty() )
+				continue;
+
+			FILE* file = fopen( binFilename( i ).c_str(), "ab" );
+			if( ( file == NULL ) || ( fwrite( &bins[i][0], sizeof(ProjectedTriangle), bins[i].size(), file ) != bins[i].size() ) )
+			{
+				printf( "Warning: could not write %s\n", binFilename( i ).c_str() );
+				if( file != NULL )
+					fclose( file );
+				return false;
+			}
+			fclose( file );
+			std::vector<ProjectedTriangle>().swap( bins[i] );
+		}
+
+		total += triangleCount;
+		printf( "Binned %u triangles\n", total );
+	}
+
+	return true;
+}
+
+bool StreamingLayerGenerator::readTile( int tile, std::vector<ProjectedTriangle>& triangles ) const
+{
+	triangles.clear();
+
+	// Tiles without triangles have no bin
+	FILE* file = fopen( binFilename( tile ).c_str(), "rb" );
+	if( file == NULL )
+		return true;
+
+	ProjectedTriangle tri;
+	while( fread( &tri, sizeof(ProjectedTriangle), 1, file ) == 1 )
+		triangles.push_back( tri );
+
+	bool ok = !ferror( file );
+	fclose( file );
+	return ok;
+}
+
+bool StreamingLayerGenerator::readDoneTiles( std::vector<bool>& done ) const
+{
+	FILE* file = fopen( workFilename( "done" ).c_str(), "r" );
+	if( file == NULL )
+		return true;
+
+	// Records are whole lines holding only a tile index. A line cut short by a crash has no
+	// newline, and a line longer than the buffer is no record either.
+	char line[32];
+	bool valid = true;
+	bool partial = false;
+	int count = 0;
+	while( fgets( line, sizeof(line), file ) != NULL )
+	{
+		size_t length = strlen( line );
+		bool complete = ( length > 0 ) && ( line[length - 1] == '\n' );
+		bool rest = partial;
+		partial = !complete;
+
+		char* end = NULL;
+		long tile = strtol( line, &end, 10 );
+		if( rest || !complete || ( end == line ) || ( *end != '\n' ) || ( tile < 0 ) || ( tile >= (long)done.size() ) )
+		{
+			valid = false;
+			continue;
+		}
+		if( !done[tile] )
+		{
+			done[tile] = true;
+			++count;
+		}
+	}
+	fclose( file );
+
+	printf( "Resuming after %d of %d tiles\n", count, (int)done.size() );
+	if( !valid )
+		printf( "Warning: ignored invalid records in %s\n", workFilename( "done" ).c_str() );
+	return valid;
+}
+
+void StreamingLayerGenerator::cleanup()
+{
+	for( int i = 0; i < _tilesX * _tilesY; ++i )
+		remove( binFilename( i ).c_str() );
+	remove( workFilename( "done" ).c_str() );
+	remove( workFilename( "job" ).c_str() );
+	remove( workFilename( "frame" ).c_str() );
+}
+
+std::string StreamingLayerGenerator::binFilename( int tile ) const
+{
+	char name[32];
+	sprintf( name, "/tile%d.bin", tile );
+	return _workDir + name;
+}
+
+std::string StreamingLayerGenerator::workFilename( const char* name ) const
+{
+	return _workDir + "/" + name;
+}
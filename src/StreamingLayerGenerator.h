@@ -0,0 +1,71 @@
+#ifndef _STREAMINGLAYERGENERATOR_H_
+#define _STREAMINGLAYERGENERATOR_H_
+
+#include "SoftwareLayerGenerator.h"
+#include "TriangleStream.h"
+#include "TiledLayerWriter.h"
+#include <vector>
+#include <string>
+
+/*!
+	Out-of-core version of SoftwareLayerGenerator, for meshes larger than memory.
+	Triangles are streamed from disk in chunks, projected and binned into per-tile
+	files. Each tile is then resolved on its own and written straight to the layers.
+	Memory is bounded by the chunk and tile sizes, not by the mesh.
+	Progress is recorded in the work directory, so an interrupted run with the same
+	settings resumes after the last completed tile.
+ */
+class StreamingLayerGenerator
+{
+public:
+	StreamingLayerGenerator();
+
+	void setStream( TriangleStream* stream );
+	void setFrame( const LayerFrame& frame );
+	void setBoundingBox( const OrientedBox& box );
+	void setResolution( int width, int height );
+
+	// Tile edge in texels, 256 by default
+	void setTileSize( int size );
+
+	// Triangles read per chunk, 1M by default
+	void setChunkSize( unsigned int triangles );
+
+	// Existing directory for tile bins and progress, e.g. "../data/out/stream"
+	void setWorkDirectory( const std::string& dir );
+
+	// Writes a .shs file, returns the number of layers or -1 on error
+	int generateLayers( const std::string& filename );
+
+private:
+	typedef SoftwareLayerGenerator::ProjectedTriangle ProjectedTriangle;
+
+	// Returns true when bins and progress from a previous run match the current settings
+	bool canResume();
+	void saveJob();
+
+	bool binTriangles();
+	bool readTile( int tile, std::vector<ProjectedTriangle>& triangles ) const;
+	// Marks the tiles recorded as done, false when some record was torn or invalid
+	bool readDoneTiles( std::vector<bool>& done ) const;
+	void cleanup();
+
+	std::string binFilename( int tile ) const;
+	std::string workFilename( const char* name ) const;
+
+private:
+	TriangleStream* _stream;
+	SoftwareLayerGenerator _generator;
+	LayerFrame _frame;
+	OrientedBox _box;
+	bool _hasBox;
+	int _width;
+	int _height;
+	int _tileSize;
+	int _tilesX;
+	int _tilesY;
+	unsigned int _chunkSize;
+	std::string _workDir;
+};
+
+#endif // _STREAMINGLAYERGENERATOR_H_
@@ -0,0 +1,991 @@
+#include "TiledLayerWriter.h"
+#include "ConeMaps.h"
+#include <vr/timer.h>
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <cfloat>
+#include <cmath>
+
+// Texels encoded at a time by transcode
+static const int ENCODE_BLOCK = 1 << 16;
+
+// Texels per compressed block (rounded to whole rows), and blocks compressed in parallel
+static const int COMPRESSION_BLOCK = 1 << 16;
+static const int COMPRESSION_GROUP = 16;
+
+// Codes of quantized heights stay exact in float
+static const float MAX_QUANTIZED_LEVELS = 16777215.0f;
+
+// Model units per height unit
+static double heightScale( const ShsFile& file )
+{
+	return file.hasFrame() ? file.frame().zFar - file.frame().zNear : 1.0;
+}
+
+TiledLayerWriter::TiledLayerWriter()
+: _file( NULL ), _layerCount( 0 ), _storeNormals( true ),
+  _heightEncoding( ShsFile::RAW_FLOAT32 ), _normalEncoding( ShsFile::RAW_FLOAT32 ), _compression( ShsFile::COMPRESSION_NONE ),
+  _maxHeightError( 0.0f ), _brickSize( 0 ), _pyramidLevels( 0 ), _coneMaps( false )
+{
+	ShsFile::initHeader( _header, 0, 0 );
+}
+
+TiledLayerWriter::~TiledLayerWriter()
+{
+	close();
+}
+
+bool TiledLayerWriter::open( const std::string& filename, int width, int height, bool resume )
+{
+	close();
+
+	if( ( width <= 0 ) || ( height <= 0 ) )
+	{
+		printf( "Warning: invalid layer size %dx%d\n", width, height );
+		return false;
+	}
+
+	ShsFile::initHeader( _header, width, height );
+	if( !_storeNormals )
+		_header.flags |= ShsFile::NO_NORMALS;
+	_filename = filename;
+	_layerCount = 0;
+
+	if( resume )
+	{
+		// Layers cut short while being filled are recreated by addLayer
+		_file = fopen( workFilename().c_str(), "r+b" );
+		ShsFile::Header previous;
+		bool readable = ( _file != NULL ) && ( fread( &previous, sizeof(ShsFile::Header), 1, _file ) == 1 ) &&
+					( memcmp( previous.magic, _header.magic, 4 ) == 0 );
+
+		// Layers of other versions may be laid out differently, they are never resumed
+		if( readable && ( previous.version != _header.version ) )
+			printf( "Warning: %s was written by version %u, not resuming\n", workFilename().c_str(), previous.version );
+
+		if( readable && ( previous.version == _header.version ) &&
+			( previous.width == width ) && ( previous.height == height ) &&
+			( ( previous.flags & ShsFile::NO_NORMALS ) == ( _header.flags & ShsFile::NO_NORMALS ) ) )
+		{
+			// A completed file ends with a directory, which is not a layer
+			vr::int64 end = ( previous.directoryOffset != 0 ) ? (vr::int64)previous.directoryOffset : ShsFile::fileSize( _file );
+			_layerCount = (int)vr::max( ( end - layerOffset( 0 ) ) / ( layerOffset( 1 ) - layerOffset( 0 ) ), (vr::int64)0 );
+		}
+		else if( _file != NULL )
+		{
+			fclose( _file );
+			_file = NULL;
+		}
+		printf( "Resuming with %d existing layers\n", _layerCount );
+	}
+
+	if( _file == NULL )
+		_file = fopen( workFilename().c_str(), "w+b" );
+	if( _file == NULL )
+	{
+		printf( "Warning: could not create %s\n", workFilename().c_str() );
+		return false;
+	}
+
+	// Header without directory marks the file as incomplete until close
+	if( !ShsFile::seek( _file, 0 ) || ( fwrite( &_header, sizeof(ShsFile::Header), 1, _file ) != 1 ) )
+	{
+		printf( "Warning: could not write %s\n", filename.c_str() );
+		fclose( _file );
+		_file = NULL;
+		return false;
+	}
+	return true;
+}
+
+void TiledLayerWriter::setStoreNormals( bool enabled )
+{
+	_storeNormals = enabled;
+}
+
+void TiledLayerWriter::setEncodings( ShsFile::Encoding heights, ShsFile::Encoding normals )
+{
+	_heightEncoding = heights;
+	_normalEncoding = normals;
+}
+
+void TiledLayerWriter::setCompression( ShsFile::Compression compression )
+{
+	_compression = compression;
+}
+
+void TiledLayerWriter::setMaxHeightError( float maxError )
+{
+	_maxHeightError = maxError;
+}
+
+void TiledLayerWriter::setBrickSize( int brickSize )
+{
+	_brickSize = brickSize;
+}
+
+void TiledLayerWriter::setPyramidLevels( int levels )
+{
+	_pyramidLevels = levels;
+}
+
+void TiledLayerWriter::setConeMaps( bool enabled )
+{
+	_coneMaps = enabled;
+}
+
+void TiledLayerWriter::setFrame( const LayerFrame& frame )
+{
+	ShsFile::packFrame( frame, _header );
+}
+
+void TiledLayerWriter::setBoundingBox( const OrientedBox& box )
+{
+	ShsFile::packBoundingBox( box, _header );
+}
+
+bool TiledLayerWriter::close()
+{
+	if( _file == NULL )
+		return false;
+
+	bool ok = writeDirectory();
+	if( fclose( _file ) != 0 )
+		ok = false;
+	_file = NULL;
+
+	if( ok && encoded() )
+	{
+		ok = transcode( workFilename(), _filename, _heightEncoding, _storeNormals ? _normalEncoding : ShsFile::NOT_STORED,
+						 _compression, _maxHeightError, _brickSize, _pyramidLevels, _coneMaps );
+		if( ok )
+			remove( workFilename().c_str() );
+	}
+
+	if( !ok )
+		printf( "Warning: could not complete %s\n", _filename.c_str() );
+	return ok;
+}
+
+void TiledLayerWriter::flush()
+{
+	if( _file != NULL )
+		fflush( _file );
+}
+
+bool TiledLayerWriter::writeTile( const LayerSet& tile, int x0, int y0 )
+{
+	for( int i = 0; i < tile.layerCount(); ++i )
+	{
+		if( !writeLayer( i, tile.heights( i ), tile.normals( i ), tile.width(), tile.height(), x0, y0 ) )
+			return false;
+	}
+	return true;
+}
+
+bool TiledLayerWriter::writeLayer( int layer, const float* heights, const float* normals, int tileWidth, int tileHeight, int x0, int y0 )
+{
+	if( _file == NULL )
+		return false;
+
+	// Clip tile against the full layer
+	int srcX = vr::max( -x0, 0 );
+	int srcY = vr::max( -y0, 0 );
+	int cols = vr::min( x0 + tileWidth, width() ) - ( x0 + srcX );
+	int rows = vr::min( y0 + tileHeight, height() ) - ( y0 + srcY );
+	if( ( cols <= 0 ) || ( rows <= 0 ) )
+		return true;
+
+	while( layerCount() <= layer )
+	{
+		if( !addLayer() )
+			return false;
+	}
+
+	vr::int64 heightOffset = channelOffset( layer, ShsFile::HEIGHT );
+	vr::int64 normalOffset = channelOffset( layer, ShsFile::NORMAL );
+	if( !writeRows( heightOffset, 1, heights, tileWidth, x0 + srcX, y0 + srcY, cols, rows, srcX, srcY ) ||
+		( _storeNormals && !writeRows( normalOffset, 3, normals, tileWidth, x0 + srcX, y0 + srcY, cols, rows, srcX, srcY ) ) )
+	{
+		printf( "Warning: could not write tile (%d, %d) of layer %d\n", x0, y0, layer + 1 );
+		return false;
+	}
+	return true;
+}
+
+int TiledLayerWriter::width() const
+{
+	return _header.width;
+}
+
+int TiledLayerWriter::height() const
+{
+	return _header.height;
+}
+
+int TiledLayerWriter::layerCount() const
+{
+	return _layerCount;
+}
+
+bool TiledLayerWriter::transcode( const std::string& src, const std::string& dst, ShsFile::Encoding heights, ShsFile::Encoding normals,
+								  ShsFile::Compression compression, float maxHeightError, int brickSize, int pyramidLevels, bool coneMaps )
+{
+	if( ( heights == ShsFile::NOT_STORED ) || !ShsFile::supports( heights, ShsFile::HEIGHT ) || !ShsFile::supports( normals, ShsFile::NORMAL ) )
+	{
+		printf( "Warning: invalid layer encodings %d, %d\n", heights, normals );
+		return false;
+	}
+
+	if( ( heights == ShsFile::HEIGHT_QUANTIZED ) && !( maxHeightError > 0.0f ) )
+	{
+		printf( "Warning: quantized heights need an error bound above 0\n" );
+		return false;
+	}
+
+	bool bricked = brickSize > 0;
+	if( bricked && ( ( brickSize < ShsFile::MIN_BRICK_SIZE ) || ( brickSize > ShsFile::MAX_BRICK_SIZE ) ) )
+	{
+		printf( "Warning: brick size must be between %d and %d\n", ShsFile::MIN_BRICK_SIZE, ShsFile::MAX_BRICK_SIZE );
+		return false;
+	}
+
+	if( ( pyramidLevels < 0 ) || ( pyramidLevels > ShsFile::MAX_PYRAMID_LEVELS ) )
+	{
+		printf( "Warning: a pyramid has at most %d levels\n", ShsFile::MAX_PYRAMID_LEVELS );
+		return false;
+	}
+
+	ShsFile in;
+	if( !in.open( src ) )
+		return false;
+
+	FILE* out = fopen( dst.c_str(), "wb" );
+	if( out == NULL )
+	{
+		printf( "Warning: could not create %s\n", dst.c_str() );
+		return false;
+	}
+
+	ShsFile::Header header = in.header();
+	header.version = ShsFile::VERSION;
+	header.directoryOffset = 0;
+	header.flags &= ~( ShsFile::BRICKED | ShsFile::PYRAMID | ShsFile::CONE_MAPS );
+	if( ( normals == ShsFile::NOT_STORED ) || !in.hasNormals() )
+		header.flags |= ShsFile::NO_NORMALS;
+	if( bricked )
+		header.flags |= ShsFile::BRICKED;
+	if( pyramidLevels > 0 )
+		header.flags |= ShsFile::PYRAMID;
+	if( coneMaps )
+		header.flags |= ShsFile::CONE_MAPS;
+	bool ok = fwrite( &header, sizeof(ShsFile::Header), 1, out ) == 1;
+
+	std::vector<ShsFile::LayerEntry> directory;
+	std::vector<ShsFile::BrickEntry> bricks;
+	vr::uint64 offset = ShsFile::align( sizeof(ShsFile::Header) );
+	ok = ok && encodeLayers( in, heights, normals, compression, maxHeightError, brickSize, out, offset, directory, bricks );
+
+	std::vector<ShsFile::ConeEntry> cones;
+	if( ok && coneMaps )
+		ok = writeConeMaps( in, directory, out, offset, cones );
+
+	// Coarser levels after the full resolution, each with its directory after its channels
+	std::vector<ShsFile::LevelEntry> levels;
+	std::string finer = src;
+	for( int k = 1; ok && ( k <= pyramidLevels ); ++k )
+	{
+		char suffix[32];
+		sprintf( suffix, ".level%d", k );
+		std::string coarser = dst + suffix;
+
+		ShsFile finerFile;
+		ShsFile level;
+		std::vector<ShsFile::LayerEntry> levelDirectory;
+		std::vector<ShsFile::BrickEntry> noBricks;
+		ok = finerFile.open( finer ) && writeLevel( finerFile, coarser ) && level.open( coarser ) &&
+			 encodeLayers( level, heights, normals, compression, maxHeightError, 0, out, offset, levelDirectory, noBricks );
+
+		ShsFile::LevelEntry entry;
+		entry.width = level.width();
+		entry.height = level.height();
+		entry.directoryOffset = offset;
+		levels.push_back( entry );
+		ok = ok && ShsFile::seek( out, offset );
+		if( ok && !levelDirectory.empty() )
+			ok = fwrite( &levelDirectory[0], sizeof(ShsFile::LayerEntry), levelDirectory.size(), out ) == levelDirectory.size();
+		offset = ShsFile::align( offset + sizeof(ShsFile::LayerEntry) * levelDirectory.size() );
+
+		// Each level is only needed to build the next one
+		finerFile.close();
+		level.close();
+		if( k > 1 )
+			remove( finer.c_str() );
+		finer = coarser;
+	}
+	if( pyramidLevels > 0 )
+		remove( finer.c_str() );
+
+	// Directory after the last channel, then brick, pyramid and cone indices, and the header pointing to it
+	header.directoryOffset = offset;
+	ok = ok && ShsFile::seek( out, offset );
+	if( ok && !directory.empty() )
+		ok = fwrite( &directory[0], sizeof(ShsFile::LayerEntry), directory.size(), out ) == directory.size();
+	if( ok && bricked )
+	{
+		ShsFile::BrickIndex index;
+		index.brickSize = brickSize;
+		index.bricksX = ( in.width() + brickSize - 1 ) / brickSize;
+		index.bricksY = ( in.height() + brickSize - 1 ) / brickSize;
+		index.reserved = 0;
+		ok = ( fwrite( &index, sizeof(ShsFile::BrickIndex), 1, out ) == 1 ) &&
+			 ( fwrite( &bricks[0], sizeof(ShsFile::BrickEntry), bricks.size(), out ) == bricks.size() );
+	}
+	if( ok && !levels.empty() )
+	{
+		ShsFile::PyramidIndex index;
+		index.levelCount = (vr::uint32)levels.size();
+		index.reserved = 0;
+		ok = ( fwrite( &index, sizeof(ShsFile::PyramidIndex), 1, out ) == 1 ) &&
+			 ( fwrite( &levels[0], sizeof(ShsFile::LevelEntry), levels.size(), out ) == levels.size() );
+	}
+	if( ok && coneMaps )
+	{
+		ShsFile::ConeIndex index;
+		index.encoding = ShsFile::CONE_RATIO8;
+		index.reserved = 0;
+		ok = fwrite( &index, sizeof(ShsFile::ConeIndex), 1, out ) == 1;
+		if( ok && !cones.empty() )
+			ok = fwrite( &cones[0], sizeof(ShsFile::ConeEntry), cones.size(), out ) == cones.size();
+	}
+	ok = ok && ShsFile::seek( out, 0 ) && ( fwrite( &header, sizeof(ShsFile::Header), 1, out ) == 1 );
+	if( fclose( out ) != 0 )
+		ok = false;
+
+	if( !ok )
+		printf( "Warning: could not encode %s into %s\n", src.c_str(), dst.c_str() );
+	return ok;
+}
+
+/************************************************************************/
+/* Private                                                              */
+/************************************************************************/
+
+bool TiledLayerWriter::encodeLayers( ShsFile& in, ShsFile::Encoding heights, ShsFile::Encoding normals, ShsFile::Compression compression,
+									 float maxHeightError, int brickSize, FILE* out, vr::uint64& offset,
+									 std::vector<ShsFile::LayerEntry>& directory, std::vector<ShsFile::BrickEntry>& bricks )
+{
+	// Same layout as written by tiles, each channel aligned after the previous one,
+	// or bricks once every channel is prepared
+	bool bricked = brickSize > 0;
+	bool ok = true;
+	directory.resize( in.layerCount() );
+	std::vector<double> bounds( in.layerCount(), 0.0 );
+	for( int i = 0; ok && ( i < in.layerCount() ); ++i )
+	{
+		for( int c = 0; ok && ( c < ShsFile::CHANNEL_COUNT ); ++c )
+		{
+			ShsFile::Channel channel = (ShsFile::Channel)c;
+			ShsFile::ChannelEntry& entry = directory[i].channels[c];
+			memset( &entry, 0, sizeof(ShsFile::ChannelEntry) );
+			entry.encoding = ( channel == ShsFile::HEIGHT ) ? heights : normals;
+			entry.checksum = 1;
+			entry.rangeMax = 1.0f;
+			entry.compression = compression;
+			if( entry.encoding == ShsFile::HEIGHT_QUANTIZED )
+				entry.step = (float)( 2.0 * maxHeightError / heightScale( in ) );
+
+			if( ( entry.encoding == ShsFile::NOT_STORED ) || ( in.encoding( i, channel ) == ShsFile::NOT_STORED ) )
+			{
+				entry.encoding = ShsFile::NOT_STORED;
+				continue;
+			}
+
+			if( bricked )
+			{
+				double bound = 0.0;
+				ok = in.verifyChannel( i, channel ) && prepareChannel( in, i, channel, entry, bound );
+				if( channel == ShsFile::HEIGHT )
+					bounds[i] = bound;
+				continue;
+			}
+
+			entry.offset = offset;
+			ok = in.verifyChannel( i, channel ) && encodeChannel( in, i, channel, entry, out );
+			offset = ShsFile::align( offset + entry.size );
+		}
+	}
+
+	if( ok && bricked )
+		ok = writeBricks( in, directory, bounds, brickSize, out, offset, bricks );
+	return ok;
+}
+
+bool TiledLayerWriter::writeLevel( ShsFile& finer, const std::string& filename )
+{
+	TiledLayerWriter writer;
+	writer.setStoreNormals( finer.hasNormals() );
+	int width = ( finer.width() + 1 ) / 2;
+	int height = ( finer.height() + 1 ) / 2;
+	if( !writer.open( filename, width, height ) )
+		return false;
+	if( finer.hasFrame() )
+		writer.setFrame( finer.frame() );
+	if( finer.hasBoundingBox() )
+		writer.setBoundingBox( finer.boundingBox() );
+
+	// Two finer rows make one row. Each texel takes every layer from the finer texel of its
+	// 2x2 block with the most surfaces, so that depths along a column stay consistent.
+	int layers = finer.layerCount();
+	int finerWidth = finer.width();
+	std::vector<float> finerHeights( (size_t)layers * 2 * finerWidth );
+	std::vector<float> finerNormals( (size_t)layers * 2 * finerWidth * 3 );
+	std::vector<float> rowHeights( (size_t)layers * width );
+	std::vector<float> rowNormals( (size_t)layers * width * 3, 1.0f );
+	std::vector<int> surfaces( 2 * finerWidth );
+	bool ok = true;
+	for( int y = 0; ok && ( y < height ); ++y )
+	{
+		int rows = vr::min( 2, finer.height() - 2*y );
+		vr::uint64 first = (vr::uint64)2*y * finerWidth;
+		std::fill( surfaces.begin(), surfaces.end(), 0 );
+		for( int l = 0; ok && ( l < layers ); ++l )
+		{
+			float* heights = &finerHeights[(size_t)l * 2 * finerWidth];
+			ok = finer.readTexels( l, ShsFile::HEIGHT, first, (vr::uint64)rows * finerWidth, heights );
+			if( ok && finer.hasNormals() )
+				ok = finer.readTexels( l, ShsFile::NORMAL, first, (vr::uint64)rows * finerWidth, &finerNormals[(size_t)l * 2 * finerWidth * 3] );
+			for( int t = 0; ok && ( t < rows * finerWidth ); ++t )
+			{
+				if( heights[t] != 0.0f )
+					++surfaces[t];
+			}
+		}
+
+		for( int x = 0; ok && ( x < width ); ++x )
+		{
+			int best = 2*x;
+			for( int dy = 0; dy < rows; ++dy )
+			{
+				for( int dx = 0; ( dx < 2 ) && ( 2*x + dx < finerWidth ); ++dx )
+				{
+					int t = dy * finerWidth + 2*x + dx;
+					if( surfaces[t] > surfaces[best] )
+						best = t;
+				}
+			}
+
+			for( int l = 0; l < layers; ++l )
+			{
+				rowHeights[(size_t)l * width + x] = finerHeights[(size_t)l * 2 * finerWidth + best];
+				if( finer.hasNormals() )
+					memcpy( &rowNormals[( (size_t)l * width + x ) * 3], &finerNormals[( (size_t)l * 2 * finerWidth + best ) * 3], sizeof(float)*3 );
+			}
+		}
+
+		for( int l = 0; ok && ( l < layers ); ++l )
+			ok = writer.writeLayer( l, &rowHeights[(size_t)l * width], &rowNormals[(size_t)l * width * 3], width, 1, 0, y );
+	}
+
+	if( !ok )
+		printf( "Warning: could not downsample %s\n", filename.c_str() );
+	return writer.close() && ok;
+}
+
+bool TiledLayerWriter::writeConeMaps( ShsFile& in, const std::vector<ShsFile::LayerEntry>& directory, FILE* out, vr::uint64& offset,
+									 std::vector<ShsFile::ConeEntry>& cones )
+{
+	// Cones are built on the heights the renderer samples, lossy encodings included
+	size_t count = (size_t)in.width() * in.height();
+	std::vector<float> heights( count );
+	std::vector<unsigned char> encoded( count * sizeof(vr::uint32) ); // the largest height encoding
+	std::vector<vr::uint8> codes( count );
+	cones.resize( in.layerCount() );
+	double buildTime = 0.0;
+	vr::Timer timer;
+	bool ok = true;
+	for( int i = 0; ok && ( i < in.layerCount() ); ++i )
+	{
+		const ShsFile::ChannelEntry& entry = directory[i].channels[ShsFile::HEIGHT];
+		if( !in.readChannel( i, ShsFile::HEIGHT, &heights[0] ) )
+			return false;
+		if( entry.encoding != ShsFile::RAW_FLOAT32 )
+		{
+			ShsFile::encode( entry, ShsFile::HEIGHT, &heights[0], count, &encoded[0] );
+			ShsFile::decode( entry, ShsFile::HEIGHT, &encoded[0], count, &heights[0] );
+		}
+
+		// Layers alternate between entering and exiting the solid
+		timer.restart();
+		ConeMaps::build( &heights[0], in.width(), in.height(), ( i % 2 ) == 1, &codes[0] );
+		buildTime += timer.elapsed();
+		ShsFile::ConeEntry& cone = cones[i];
+		cone.offset = offset;
+		cone.size = (vr::uint32)count;
+		cone.checksum = ShsFile::checksum( &codes[0], count );
+		ok = ShsFile::seek( out, (vr::int64)offset ) && ( fwrite( &codes[0], 1, count, out ) == count );
+		offset = ShsFile::align( offset + count );
+	}
+
+	if( ok )
+		printf( "Cone maps of %d layers of %dx%d built in %.2f s\n", in.layerCount(), in.width(), in.height(), buildTime );
+	return ok;
+}
+
+bool TiledLayerWriter::addLayer()
+{
+	// Every texel empty (height 0, normal (1,1,1)), one row at a time
+	std::vector<float> emptyHeights( width(), 0.0f );
+	std::vector<float> emptyNormals( width()*3, 1.0f );
+
+	if( !ShsFile::seek( _file, channelOffset( _layerCount, ShsFile::HEIGHT ) ) )
+		return false;
+	for( int y = 0; y < height(); ++y )
+		fwrite( &emptyHeights[0], sizeof(float), width(), _file );
+
+	if( _storeNormals )
+	{
+		if( !ShsFile::seek( _file, channelOffset( _layerCount, ShsFile::NORMAL ) ) )
+			return false;
+		for( int y = 0; y < height(); ++y )
+			fwrite( &emptyNormals[0], sizeof(float), width()*3, _file );
+	}
+
+	// Padding up to the next layer, so that resume only counts layers written in full
+	ShsFile::Channel last = _storeNormals ? ShsFile::NORMAL : ShsFile::HEIGHT;
+	vr::int64 end = channelOffset( _layerCount, last ) + channelSize( last );
+	if( end < layerOffset( _layerCount + 1 ) )
+	{
+		ShsFile::seek( _file, layerOffset( _layerCount + 1 ) - 1 );
+		fputc( 0, _file );
+	}
+
+	if( ferror( _file ) )
+	{
+		printf( "Warning: could not add layer %d to %s\n", _layerCount + 1, _filename.c_str() );
+		return false;
+	}
+
+	++_layerCount;
+	return true;
+}
+
+bool TiledLayerWriter::writeRows( vr::int64 channelOffset, int components, const float* src, int srcWidth,
+								  int x0, int y0, int cols, int rows, int srcX, int srcY )
+{
+	for( int r = 0; r < rows; ++r )
+	{
+		vr::int64 texel = (vr::int64)( y0 + r ) * width() + x0;
+		if( !ShsFile::seek( _file, channelOffset + texel * components * sizeof(float) ) )
+			return false;
+
+		const float* row = src + ( (vr::int64)( srcY + r ) * srcWidth + srcX ) * components;
+		if( fwrite( row, sizeof(float)*components, cols, _file ) != (size_t)cols )
+			return false;
+	}
+	return true;
+}
+
+bool TiledLayerWriter::writeDirectory()
+{
+	// Tiles land in any order, so checksums are computed once by reading every channel back
+	std::vector<ShsFile::LayerEntry> directory( _layerCount );
+	std::vector<unsigned char> block( 1 << 20 );
+	fflush( _file );
+
+	for( int i = 0; i < _layerCount; ++i )
+	{
+		for( int c = 0; c < ShsFile::CHANNEL_COUNT; ++c )
+		{
+			ShsFile::ChannelEntry& entry = directory[i].channels[c];
+			vr::int64 offset = channelOffset( i, (ShsFile::Channel)c );
+			entry.encoding = ShsFile::RAW_FLOAT32;
+			entry.offset = offset;
+			entry.size = channelSize( (ShsFile::Channel)c );
+			entry.checksum = 1;
+			entry.rangeMin = 0.0f;
+			entry.rangeMax = 1.0f;
+			entry.compression = ShsFile::COMPRESSION_NONE;
+			entry.blockRows = 0;
+			entry.step = 0.0f;
+			entry.maxError = 0.0f;
+
+			if( ( c == ShsFile::NORMAL ) && !_storeNormals )
+			{
+				entry.encoding = ShsFile::NOT_STORED;
+				entry.offset = 0;
+				continue;
+			}
+
+			if( !ShsFile::seek( _file, offset ) )
+				return false;
+			for( vr::int64 left = entry.size; left > 0; )
+			{
+				size_t count = (size_t)vr::min( left, (vr::int64)block.size() );
+				if( fread( &block[0], 1, count, _file ) != count )
+					return false;
+				entry.checksum = ShsFile::checksum( &block[0], count, entry.checksum );
+				left -= count;
+			}
+		}
+	}
+
+	// Directory after the last layer, then the header pointing to it
+	_header.layerCount = _layerCount;
+	_header.directoryOffset = layerOffset( _layerCount );
+	if( !ShsFile::seek( _file, _header.directoryOffset ) )
+		return false;
+	if( !directory.empty() && ( fwrite( &directory[0], sizeof(ShsFile::LayerEntry), directory.size(), _file ) != directory.size() ) )
+		return false;
+	if( !ShsFile::seek( _file, 0 ) || ( fwrite( &_header, sizeof(ShsFile::Header), 1, _file ) != 1 ) )
+		return false;
+	return fflush( _file ) == 0;
+}
+
+vr::int64 TiledLayerWriter::layerOffset( int layer ) const
+{
+	// Header and every channel are padded to the alignment
+	vr::int64 layerSize = ShsFile::align( channelSize( ShsFile::HEIGHT ) ) + ShsFile::align( channelSize( ShsFile::NORMAL ) );
+	return (vr::int64)ShsFile::align( sizeof(ShsFile::Header) ) + layer * layerSize;
+}
+
+vr::int64 TiledLayerWriter::channelOffset( int layer, ShsFile::Channel channel ) const
+{
+	vr::int64 offset = layerOffset( layer );
+	if( channel == ShsFile::NORMAL )
+		offset += ShsFile::align( channelSize( ShsFile::HEIGHT ) );
+	return offset;
+}
+
+vr::int64 TiledLayerWriter::channelSize( ShsFile::Channel channel ) const
+{
+	if( ( channel == ShsFile::NORMAL ) && !_storeNormals )
+		return 0;
+	return (vr::int64)width() * height() * ShsFile::components( channel ) * sizeof(float);
+}
+
+bool TiledLayerWriter::encoded() const
+{
+	return ( _heightEncoding != ShsFile::RAW_FLOAT32 ) || ( _storeNormals && ( _normalEncoding != ShsFile::RAW_FLOAT32 ) ) ||
+		   ( _compression != ShsFile::COMPRESSION_NONE ) || ( _brickSize > 0 ) || ( _pyramidLevels > 0 ) || _coneMaps;
+}
+
+std::string TiledLayerWriter::workFilename() const
+{
+	return encoded() ? _filename + ".part" : _filename;
+}
+
+bool TiledLayerWriter::encodeChannel( ShsFile& src, int layer, ShsFile::Channel channel, ShsFile::ChannelEntry& entry, FILE* dst )
+{
+	double bound = 0.0;
+	if( !prepareChannel( src, layer, channel, entry, bound ) )
+		return false;
+
+	ShsFile::Encoding encoding = (ShsFile::Encoding)entry.encoding;
+	vr::uint64 texels = (vr::uint64)src.width() * src.height();
+	HeightError error = { 0.0, 0.0, 0 };
+	bool ok = true;
+	if( entry.compression != ShsFile::COMPRESSION_NONE )
+	{
+		ok = compressChannel( src, layer, channel, entry, dst, error );
+	}
+	else
+	{
+		std::vector<float> block( ENCODE_BLOCK * ShsFile::components( channel ) );
+		std::vector<unsigned char> encodedBlock( ENCODE_BLOCK * ShsFile::texelSize( encoding, channel ) );
+		ok = ShsFile::seek( dst, entry.offset );
+		for( vr::uint64 first = 0; ok && ( first < texels ); first += ENCODE_BLOCK )
+		{
+			vr::uint64 count = vr::min( texels - first, (vr::uint64)ENCODE_BLOCK );
+			size_t bytes = (size_t)count * ShsFile::texelSize( encoding, channel );
+			ok = src.readTexels( layer, channel, first, count, &block[0] );
+			if( !ok )
+				break;
+
+			encodeTexels( entry, channel, &block[0], (size_t)count, &encodedBlock[0], error );
+			ok = fwrite( &encodedBlock[0], 1, bytes, dst ) == bytes;
+			entry.checksum = ShsFile::checksum( &encodedBlock[0], bytes, entry.checksum );
+		}
+		entry.size = texels * ShsFile::texelSize( encoding, channel );
+	}
+
+	if( ok )
+		reportError( src, layer, entry, error, bound );
+	return ok;
+}
+
+bool TiledLayerWriter::prepareChannel( ShsFile& src, int layer, ShsFile::Channel channel, ShsFile::ChannelEntry& entry, double& bound )
+{
+	if( src.isBricked() || ( src.encoding( layer, channel ) != ShsFile::RAW_FLOAT32 ) ||
+		( src.layer( layer ).channels[channel].compression != ShsFile::COMPRESSION_NONE ) )
+	{
+		printf( "Warning: layer %d is already encoded\n", layer + 1 );
+		return false;
+	}
+
+	// Heights are relative to the range of the whole layer, which takes a first pass
+	ShsFile::Encoding encoding = (ShsFile::Encoding)entry.encoding;
+	if( ( encoding == ShsFile::HEIGHT_UNORM16 ) || ( encoding == ShsFile::HEIGHT_QUANTIZED ) )
+	{
+		vr::uint64 texels = (vr::uint64)src.width() * src.height();
+		std::vector<float> block( ENCODE_BLOCK );
+		entry.rangeMin = FLT_MAX;
+		entry.rangeMax = -FLT_MAX;
+		for( vr::uint64 first = 0; first < texels; first += ENCODE_BLOCK )
+		{
+			vr::uint64 count = vr::min( texels - first, (vr::uint64)ENCODE_BLOCK );
+			float blockMin, blockMax;
+			if( !src.readTexels( layer, channel, first, count, &block[0] ) )
+				return false;
+			if( LayerEncoding::heightRange( &block[0], (size_t)count, blockMin, blockMax ) )
+			{
+				entry.rangeMin = vr::min( entry.rangeMin, blockMin );
+				entry.rangeMax = vr::max( entry.rangeMax, blockMax );
+			}
+		}
+
+		// Empty layer
+		if( entry.rangeMin > entry.rangeMax )
+		{
+			entry.rangeMin = 0.0f;
+			entry.rangeMax = 0.0f;
+		}
+	}
+
+	// Decoded heights round to float, which the step leaves room for. Steps finer than
+	// float heights resolve only make codes longer.
+	bound = entry.step * 0.5;
+	if( encoding == ShsFile::HEIGHT_QUANTIZED )
+	{
+		float rounding = 2.0f * FLT_EPSILON * vr::max( fabsf( entry.rangeMin ), fabsf( entry.rangeMax ) );
+		float minStep = ( entry.rangeMax - entry.rangeMin ) / MAX_QUANTIZED_LEVELS;
+		entry.step -= 2.0f * rounding;
+		if( entry.step < minStep )
+		{
+			printf( "Warning: height error bound of layer %d is below float precision, using %g\n",
+					layer + 1, ( minStep * 0.5 + rounding ) * heightScale( src ) );
+			entry.step = minStep;
+			bound = minStep * 0.5 + rounding;
+		}
+	}
+	return true;
+}
+
+void TiledLayerWriter::reportError( const ShsFile& src, int layer, ShsFile::ChannelEntry& entry, const HeightError& error, double bound )
+{
+	if( error.texels == 0 )
+		return;
+
+	// Real error of lossy heights, in model units
+	double scale = heightScale( src );
+	entry.maxError = (float)error.max;
+	printf( "Layer %d height error: max %g, RMS %g", layer + 1, error.max * scale, sqrt( error.sumSquares / error.texels ) * scale );
+	if( entry.encoding == ShsFile::HEIGHT_QUANTIZED )
+		printf( " (bound %g)", bound * scale );
+	printf( "\n" );
+}
+
+bool TiledLayerWriter::compressChannel( ShsFile& src, int layer, ShsFile::Channel channel, ShsFile::ChannelEntry& entry, FILE* dst,
+										HeightError& error )
+{
+	ShsFile::Encoding encoding = (ShsFile::Encoding)entry.encoding;
+	int width = src.width();
+	int height = src.height();
+	int texelBytes = ShsFile::texelSize( encoding, channel );
+	int words = texelBytes / ShsFile::wordSize( encoding );
+
+	entry.blockRows = vr::max( COMPRESSION_BLOCK / width, 1 );
+	int blockRows = entry.blockRows;
+	int blockCount = ( height + blockRows - 1 ) / blockRows;
+	std::vector<vr::uint64> ends( blockCount );
+	std::vector<float> texels;
+	std::vector<unsigned char> encodedTexels;
+	std::vector< std::vector<unsigned char> > blocks( COMPRESSION_GROUP );
+	vr::uint64 written = 0;
+
+	if( !ShsFile::seek( dst, entry.offset ) )
+		return false;
+
+	// A group of blocks is encoded, compressed in parallel, then written in order
+	for( int first = 0; first < blockCount; first += COMPRESSION_GROUP )
+	{
+		int count = vr::min( COMPRESSION_GROUP, blockCount - first );
+		int y0 = first * blockRows;
+		int rows = vr::min( count * blockRows, height - y0 );
+		vr::uint64 texelCount = (vr::uint64)rows * width;
+
+		texels.resize( (size_t)texelCount * ShsFile::components( channel ) );
+		encodedTexels.resize( (size_t)texelCount * texelBytes );
+		if( !src.readTexels( layer, channel, (vr::uint64)y0 * width, texelCount, &texels[0] ) )
+			return false;
+		encodeTexels( entry, channel, &texels[0], (size_t)texelCount, &encodedTexels[0], error );
+
+#pragma omp parallel for schedule(dynamic)
+		for( int b = 0; b < count; ++b )
+		{
+			int blockY = b * blockRows;
+			blocks[b].clear();
+			LayerCompression::compressBlock( &encodedTexels[(size_t)blockY * width * texelBytes], width,
+				                             vr::min( blockRows, rows - blockY ), words, ShsFile::wordSize( encoding ), blocks[b] );
+		}
+
+		for( int b = 0; b < count; ++b )
+		{
+			if( fwrite( &blocks[b][0], 1, blocks[b].size(), dst ) != blocks[b].size() )
+				return false;
+			entry.checksum = ShsFile::checksum( &blocks[b][0], blocks[b].size(), entry.checksum );
+			written += blocks[b].size();
+			ends[first + b] = written;
+		}
+	}
+
+	// Block ends after the blocks, so that the checksum runs in file order
+	size_t tableBytes = ends.size() * sizeof(vr::uint64);
+	if( fwrite( &ends[0], 1, tableBytes, dst ) != tableBytes )
+		return false;
+	entry.checksum = ShsFile::checksum( &ends[0], tableBytes, entry.checksum );
+	entry.size = written + tableBytes;
+	return true;
+}
+
+bool TiledLayerWriter::writeBricks( ShsFile& src, std::vector<ShsFile::LayerEntry>& directory, const std::vector<double>& bounds,
+									int brickSize, FILE* dst, vr::uint64& offset, std::vector<ShsFile::BrickEntry>& bricks )
+{
+	int bricksX = ( src.width() + brickSize - 1 ) / brickSize;
+	int bricksY = ( src.height() + brickSize - 1 ) / brickSize;
+	bricks.resize( (size_t)bricksX * bricksY );
+
+	// Parts of a brick, in the order of its table
+	std::vector<int> partLayers;
+	std::vector<ShsFile::Channel> partChannels;
+	for( int i = 0; i < src.layerCount(); ++i )
+	{
+		for( int c = 0; c < ShsFile::CHANNEL_COUNT; ++c )
+		{
+			if( directory[i].channels[c].encoding == ShsFile::NOT_STORED )
+				continue;
+			partLayers.push_back( i );
+			partChannels.push_back( (ShsFile::Channel)c );
+		}
+	}
+
+	int partCount = (int)partLayers.size();
+	std::vector< std::vector<float> > texels( partCount );
+	std::vector< std::vector<unsigned char> > encoded( partCount );
+	std::vector< std::vector<unsigned char> > compressed( partCount );
+	std::vector<vr::uint32> ends( partCount );
+	HeightError noError = { 0.0, 0.0, 0 };
+	std::vector<HeightError> errors( partCount, noError );
+
+	if( !ShsFile::seek( dst, offset ) )
+		return false;
+
+	for( int by = 0; by < bricksY; ++by )
+	{
+		for( int bx = 0; bx < bricksX; ++bx )
+		{
+			int x0 = bx * brickSize;
+			int y0 = by * brickSize;
+			int width = vr::min( brickSize, src.width() - x0 );
+			int height = vr::min( brickSize, src.height() - y0 );
+
+			// Rows are gathered first, reads are not thread safe
+			for( int p = 0; p < partCount; ++p )
+			{
+				int components = ShsFile::components( partChannels[p] );
+				texels[p].resize( (size_t)width * height * components );
+				for( int y = 0; y < height; ++y )
+				{
+					if( !src.readTexels( partLayers[p], partChannels[p], (vr::uint64)( y0 + y ) * src.width() + x0, width,
+										 &texels[p][(size_t)y * width * components] ) )
+						return false;
+				}
+			}
+
+			// Parts are encoded and compressed in parallel, a whole brick in one block each
+#pragma omp parallel for schedule(dynamic)
+			for( int p = 0; p < partCount; ++p )
+			{
+				const ShsFile::ChannelEntry& entry = directory[partLayers[p]].channels[partChannels[p]];
+				ShsFile::Encoding encoding = (ShsFile::Encoding)entry.encoding;
+				int texelBytes = ShsFile::texelSize( encoding, partChannels[p] );
+				encoded[p].resize( (size_t)width * height * texelBytes );
+				encodeTexels( entry, partChannels[p], &texels[p][0], (size_t)width * height, &encoded[p][0], errors[p] );
+				if( entry.compression != ShsFile::COMPRESSION_NONE )
+				{
+					compressed[p].clear();
+					LayerCompression::compressBlock( &encoded[p][0], width, height, texelBytes / ShsFile::wordSize( encoding ),
+													 ShsFile::wordSize( encoding ), compressed[p] );
+				}
+			}
+
+			// Table of part ends, then the parts
+			vr::uint64 size = 0;
+			for( int p = 0; p < partCount; ++p )
+			{
+				bool isCompressed = directory[partLayers[p]].channels[partChannels[p]].compression != ShsFile::COMPRESSION_NONE;
+				size += isCompressed ? compressed[p].size() : encoded[p].size();
+				ends[p] = (vr::uint32)size;
+			}
+			size += ends.size() * sizeof(vr::uint32);
+			if( size > 0xFFFFFFFFu )
+			{
+				printf( "Warning: bricks of %d texels are too large for %d layers\n", brickSize, src.layerCount() );
+				return false;
+			}
+
+			ShsFile::BrickEntry& brick = bricks[(size_t)by * bricksX + bx];
+			brick.offset = offset;
+			brick.size = (vr::uint32)size;
+			brick.checksum = 1;
+			if( partCount > 0 )
+			{
+				size_t tableBytes = ends.size() * sizeof(vr::uint32);
+				if( fwrite( &ends[0], 1, tableBytes, dst ) != tableBytes )
+					return false;
+				brick.checksum = ShsFile::checksum( &ends[0], tableBytes, brick.checksum );
+			}
+			for( int p = 0; p < partCount; ++p )
+			{
+				bool isCompressed = directory[partLayers[p]].channels[partChannels[p]].compression != ShsFile::COMPRESSION_NONE;
+				std::vector<unsigned char>& part = isCompressed ? compressed[p] : encoded[p];
+				if( part.empty() )
+					continue;
+				if( fwrite( &part[0], 1, part.size(), dst ) != part.size() )
+					return false;
+				brick.checksum = ShsFile::checksum( &part[0], part.size(), brick.checksum );
+			}
+			offset += size;
+		}
+	}
+	offset = ShsFile::align( offset );
+
+	for( int p = 0; p < partCount; ++p )
+	{
+		if( partChannels[p] == ShsFile::HEIGHT )
+			reportError( src, partLayers[p], directory[partLayers[p]].channels[ShsFile::HEIGHT], errors[p], bounds[partLayers[p]] );
+	}
+	return true;
+}
+
+void TiledLayerWriter::encodeTexels( const ShsFile::ChannelEntry& entry, ShsFile::Channel channel, const float* src, size_t count, void* dst,
+									 HeightError& error )
+{
+	ShsFile::encode( entry, channel, src, count, dst );
+	if( ( channel != ShsFile::HEIGHT ) || ( entry.encoding == ShsFile::RAW_FLOAT32 ) )
+		return;
+
+	// Lossy heights are decoded back, as readers will see them
+	std::vector<float> decoded( count );
+	ShsFile::decode( entry, channel, dst, count, &decoded[0] );
+	for( size_t i = 0; i < count; ++i )
+	{
+		if( src[i] == 0.0f )
+			continue;
+		double e = fabs( (double)decoded[i] - src[i] );
+		error.max = vr::max( error.max, e );
+		error.sumSquares += e * e;
+		++error.texels;
+	}
+}
@@ -0,0 +1,147 @@
+#ifndef _TILEDLAYERWRITER_H_
+#define _TILEDLAYERWRITER_H_
+
+#include <vr/math.h>
+#include "LayerSet.h"
+#include "ShsFile.h"
+#include <cstdio>
+#include <string>
+#include <vector>
+
+/*!
+	Assembles a full size layer file (.shs) from independently generated tiles.
+	Each tile is written in place with seeks, so only one tile needs to be in memory.
+	Room for a layer is added (filled with empty texels) the first time a tile reaches it.
+	Checksums and the directory are written by close(), which also completes the file.
+	With compact encodings, compression or bricks, tiles go to a raw work file (filename + ".part")
+	that close() encodes into filename, since height ranges and compressed sizes are only
+	known once every tile is in.
+ */
+class TiledLayerWriter
+{
+public:
+	TiledLayerWriter();
+	~TiledLayerWriter();
+
+	// With resume, complete layers left in filename by an interrupted run are kept
+	// instead of truncated, so that tiles already written are not lost
+	bool open( const std::string& filename, int width, int height, bool resume = false );
+
+	// Normals take three quarters of a layer, without them readers derive normals from
+	// heights. On by default, takes effect on the next open.
+	void setStoreNormals( bool enabled );
+
+	// Channel encodings of the completed file, RAW_FLOAT32 by default (see ShsFile::Encoding).
+	// Takes effect on the next open.
+	void setEncodings( ShsFile::Encoding heights, ShsFile::Encoding normals );
+
+	// Lossless compression of every channel, none by default. Takes effect on the next open.
+	void setCompression( ShsFile::Compression compression );
+
+	// Error bound of HEIGHT_QUANTIZED heights, in model units (eye space depth when there is a frame)
+	void setMaxHeightError( float maxError );
+
+	// Bricked layout with bricks of brickSize^2 texels (see ShsFile), 0 for whole channels (default)
+	void setBrickSize( int brickSize );
+
+	// Coarser levels stored after the layers (see ShsFile), 0 for none (default)
+	void setPyramidLevels( int levels );
+
+	// Cone maps of every layer stored after the layers (see ConeMaps), off by default
+	void setConeMaps( bool enabled );
+
+	// Stored in the header on close
+	void setFrame( const LayerFrame& frame );
+	void setBoundingBox( const OrientedBox& box );
+
+	// Writes checksums, directory and header. Returns false if the file is not complete.
+	bool close();
+
+	// Pushes written tiles to disk, e.g. before recording them as done
+	void flush();
+
+	// Writes all layers of tile with its lower left texel at (x0, y0).
+	// Parts of the tile outside the full layer are clipped.
+	bool writeTile( const LayerSet& tile, int x0, int y0 );
+
+	// Same for a single layer of a tile, given as tileWidth x tileHeight heights and normals
+	bool writeLayer( int layer, const float* heights, const float* normals, int tileWidth, int tileHeight, int x0, int y0 );
+
+	int width() const;
+	int height() const;
+	int layerCount() const;
+
+	// Writes a complete file with raw channels again with given encodings and compression.
+	// Normals are dropped with NOT_STORED, and stay derived if they were.
+	// HEIGHT_QUANTIZED needs maxHeightError, in model units as above. With a brickSize,
+	// the file is bricked. With pyramidLevels, coarser levels are downsampled and stored as well.
+	// With coneMaps, cone maps are built from the heights as readers decode them.
+	// The real height error of lossy encodings is printed for every layer.
+	static bool transcode( const std::string& src, const std::string& dst, ShsFile::Encoding heights, ShsFile::Encoding normals,
+		                   ShsFile::Compression compression = ShsFile::COMPRESSION_NONE, float maxHeightError = 0.0f,
+		                   int brickSize = 0, int pyramidLevels = 0, bool coneMaps = false );
+
+private:
+	// Height error of surface texels, in height units
+	struct HeightError
+	{
+		double max;
+		double sumSquares;
+		vr::uint64 texels;
+	};
+
+	bool addLayer();
+	bool writeRows( vr::int64 channelOffset, int components, const float* src, int srcWidth,
+		            int x0, int y0, int cols, int rows, int srcX, int srcY );
+	bool writeDirectory();
+
+	bool encoded() const;
+	std::string workFilename() const;
+
+	// Every layer of raw in from offset, which is moved past them, as channels or as bricks with a brickSize
+	static bool encodeLayers( ShsFile& in, ShsFile::Encoding heights, ShsFile::Encoding normals, ShsFile::Compression compression,
+		                      float maxHeightError, int brickSize, FILE* out, vr::uint64& offset,
+		                      std::vector<ShsFile::LayerEntry>& directory, std::vector<ShsFile::BrickEntry>& bricks );
+
+	// Raw file of half the size of raw finer, rounded up
+	static bool writeLevel( ShsFile& finer, const std::string& filename );
+
+	// Cone map of every layer of raw in from offset, which is moved past them, with heights
+	// encoded as in directory (one layer at a time in memory)
+	static bool writeConeMaps( ShsFile& in, const std::vector<ShsFile::LayerEntry>& directory, FILE* out, vr::uint64& offset,
+		                       std::vector<ShsFile::ConeEntry>& cones );
+
+	// Checks that a channel of src is raw, and computes the range and step of its encoding
+	static bool prepareChannel( ShsFile& src, int layer, ShsFile::Channel channel, ShsFile::ChannelEntry& entry, double& bound );
+	static void reportError( const ShsFile& src, int layer, ShsFile::ChannelEntry& entry, const HeightError& error, double bound );
+
+	// Encodes one raw channel of src at entry.offset in dst, filling the rest of entry
+	static bool encodeChannel( ShsFile& src, int layer, ShsFile::Channel channel, ShsFile::ChannelEntry& entry, FILE* dst );
+	static bool compressChannel( ShsFile& src, int layer, ShsFile::Channel channel, ShsFile::ChannelEntry& entry, FILE* dst,
+		                         HeightError& error );
+	// Every prepared channel of src as bricks from offset, which is moved past them
+	static bool writeBricks( ShsFile& src, std::vector<ShsFile::LayerEntry>& directory, const std::vector<double>& bounds,
+		                     int brickSize, FILE* dst, vr::uint64& offset, std::vector<ShsFile::BrickEntry>& bricks );
+	static void encodeTexels( const ShsFile::ChannelEntry& entry, ShsFile::Channel channel, const float* src, size_t count, void* dst,
+		                      HeightError& error );
+
+	vr::int64 layerOffset( int layer ) const;
+	vr::int64 channelOffset( int layer, ShsFile::Channel channel ) const;
+	vr::int64 channelSize( ShsFile::Channel channel ) const;
+
+private:
+	std::string _filename;
+	FILE* _file;
+	ShsFile::Header _header;
+	int _layerCount;
+	bool _storeNormals;
+	ShsFile::Encoding _heightEncoding;
+	ShsFile::Encoding _normalEncoding;
+	ShsFile::Compression _compression;
+	float _maxHeightError;
+	int _brickSize;
+	int _pyramidLevels;
+	bool _coneMaps;
+};
+
+#endif // _TILEDLAYERWRITER_H_
@@ -0,0 +1,432 @@
+#include "TriangleMesh.h"
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#include <osg/NodeVisitor>
+#include <osg/Geometry>
+#include <osg/Transform>
+#include <osg/Geode>
+#include <osg/TriangleFunctor>
+#include <osg/TriangleIndexFunctor>
+
+// Collects triangles from drawables without per-vertex normals, using face normals
+struct CollectTriangles
+{
+	CollectTriangles()
+	: mesh( NULL ), matrix( NULL )
+	{
+	}
+
+	void operator()( const osg::Vec3& v1, const osg::Vec3& v2, const osg::Vec3& v3, bool )
+	{
+		osg::Vec3 p1 = v1 * (*matrix);
+		osg::Vec3 p2 = v2 * (*matrix);
+		osg::Vec3 p3 = v3 * (*matrix);
+		osg::Vec3 n = ( p2 - p1 ) ^ ( p3 - p1 );
+		n.normalize();
+
+		vr::vec3f fn( n.x(), n.y(), n.z() );
+		mesh->addTriangle( vr::vec3f( p1.x(), p1.y(), p1.z() ),
+			               vr::vec3f( p2.x(), p2.y(), p2.z() ),
+			               vr::vec3f( p3.x(), p3.y(), p3.z() ), fn, fn, fn );
+	}
+
+	TriangleMesh* mesh;
+	const osg::Matrix* matrix;
+};
+
+// Collects indexed triangles from geometry with per-vertex normals
+struct CollectIndexedTriangles
+{
+	CollectIndexedTriangles()
+	: mesh( NULL ), matrix( NULL ), normalMatrix( NULL ), vertices( NULL ), normals( NULL )
+	{
+	}
+
+	void operator()( unsigned int i1, unsigned int i2, unsigned int i3 )
+	{
+		osg::Vec3 p1 = (*vertices)[i1] * (*matrix);
+		osg::Vec3 p2 = (*vertices)[i2] * (*matrix);
+		osg::Vec3 p3 = (*vertices)[i3] * (*matrix);
+
+		// Normals go through the inverse transpose
+		osg::Vec3 n1 = osg::Matrix::transform3x3( *normalMatrix, (*normals)[i1] );
+		osg::Vec3 n2 = osg::Matrix::transform3x3( *normalMatrix, (*normals)[i2] );
+		osg::Vec3 n3 = osg::Matrix::transform3x3( *normalMatrix, (*normals)[i3] );
+		n1.normalize();
+		n2.normalize();
+		n3.normalize();
+
+		mesh->addTriangle( vr::vec3f( p1.x(), p1.y(), p1.z() ),
+			               vr::vec3f( p2.x(), p2.y(), p2.z() ),
+			               vr::vec3f( p3.x(), p3.y(), p3.z() ),
+			               vr::vec3f( n1.x(), n1.y(), n1.z() ),
+			               vr::vec3f( n2.x(), n2.y(), n2.z() ),
+			               vr::vec3f( n3.x(), n3.y(), n3.z() ) );
+	}
+
+	TriangleMesh* mesh;
+	const osg::Matrix* matrix;
+	const osg::Matrix* normalMatrix;
+	const osg::Vec3Array* vertices;
+	const osg::Vec3Array* normals;
+};
+
+class CollectTrianglesVisitor : public osg::NodeVisitor
+{
+public:
+	CollectTrianglesVisitor( TriangleMesh& mesh )
+		: osg::NodeVisitor( osg::NodeVisitor::TRAVERSE_ALL_CHILDREN ), _mesh( mesh )
+	{
+		_matrixStack.push_back( osg::Matrix::identity() );
+	}
+
+	virtual void apply( osg::Transform& trans );
+
+	virtual void apply( osg::Geode& geode );
+
+private:
+	TriangleMesh& _mesh;
+	std::vector<osg::Matrix> _matrixStack;
+};
+
+void CollectTrianglesVisitor::apply( osg::Transform& trans )
+{
+	osg::Matrix matrix = _matrixStack.back();
+	trans.computeLocalToWorldMatrix( matrix, NULL );
+	_matrixStack.push_back( matrix );
+
+	for( int i = 0; i < (int)trans.getNumChildren(); i++ )
+		trans.getChild( i )->accept( *this );
+
+	_matrixStack.pop_back();
+}
+
+void CollectTrianglesVisitor::apply( osg::Geode& geode )
+{
+	const osg::Matrix& matrix = _matrixStack.back();
+	osg::Matrix normalMatrix = osg::Matrix::inverse( matrix );
+
+	for( int i = 0; i < (int)geode.getNumDrawables(); i++ )
+	{
+		osg::Drawable* drawable = geode.getDrawable( i );
+		osg::Geometry* geometry = drawable->asGeometry();
+
+		// Use vertex normals whenever they are bound per vertex
+		if( geometry != NULL )
+		{
+			const osg::Vec3Array* vertices = dynamic_cast<const osg::Vec3Array*>( geometry->getVertexArray() );
+			const osg::Vec3Array* normals = dynamic_cast<const osg::Vec3Array*>( geometry->getNormalArray() );
+
+			if( ( vertices != NULL ) && ( normals != NULL ) && 
+				( geometry->getNormalBinding() == osg::Geometry::BIND_PER_VERTEX ) &&
+				( normals->size() == vertices->size() ) )
+			{
+				osg::TriangleIndexFunctor<CollectIndexedTriangles> collector;
+				collector.mesh = &_mesh;
+				collector.matrix = &matrix;
+				collector.normalMatrix = &normalMatrix;
+				collector.vertices = vertices;
+				collector.normals = normals;
+				geometry->accept( collector );
+				continue;
+			}
+		}
+
+		osg::TriangleFunctor<CollectTriangles> collector;
+		collector.mesh = &_mesh;
+		collector.matrix = &matrix;
+		drawable->accept( collector );
+	}
+}
+
+void TriangleMesh::build( osg::Node* node )
+{
+	clear();
+
+	if( node == NULL )
+		return;
+
+	CollectTrianglesVisitor ctv( *this );
+	node->accept( ctv );
+}
+
+void TriangleMesh::clear()
+{
+	vertices.clear();
+	normals.clear();
+}
+
+void TriangleMesh::addTriangle( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2,
+							    const vr::vec3f& n0, const vr::vec3f& n1, const vr::vec3f& n2 )
+{
+	vertices.push_back( v0 );
+	vertices.push_back( v1 );
+	vertices.push_back( v2 );
+	normals.push_back( n0 );
+	normals.push_back( n1 );
+	normals.push_back( n2 );
+}
+
+unsigned int TriangleMesh::triangleCount() const
+{
+	return vertices.size() / 3;
+}
+
+AABB TriangleMesh::computeBoundingBox() const
+{
+	AABB box;
+	box.minV.set( 0, 0, 0 );
+	box.maxV.set( 0, 0, 0 );
+
+	if( vertices.empty() )
+		return box;
+
+	box.minV.set( vertices[0].x, vertices[0].y, vertices[0].z );
+	box.maxV = box.minV;
+
+	for( unsigned int i = 1; i < vertices.size(); ++i )
+	{
+		const vr::vec3f& v = vertices[i];
+		box.minV.set( vr::min<double>( box.minV.x, v.x ), vr::min<double>( box.minV.y, v.y ), vr::min<double>( box.minV.z, v.z ) );
+		box.maxV.set( vr::max<double>( box.maxV.x, v.x ), vr::max<double>( box.maxV.y, v.y ), vr::max<double>( box.maxV.z, v.z ) );
+	}
+
+	return box;
+}
+
+// Eigenvectors of a symmetric 3x3 matrix by cyclic Jacobi rotations, sorted by decreasing eigenvalue
+static void symmetricEigenvectors( double a[3][3], vr::vec3d axes[3] )
+{
+	double v[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+
+	for( int sweep = 0; sweep < 50; ++sweep )
+	{
+		double off = a[0][1]*a[0][1] + a[0][2]*a[0][2] + a[1][2]*a[1][2];
+		if( off < 1e-30 )
+			break;
+
+		for( int p = 0; p < 2; ++p )
+		{
+			for( int q = p + 1; q < 3; ++q )
+			{
+				if( a[p][q] == 0.0 )
+					continue;
+
+				// Rotation that zeroes a[p][q]
+				double theta = ( a[q][q] - a[p][p] ) / ( 2.0 * a[p][q] );
+				double t = ( ( theta >= 0.0 ) ? 1.0 : -1.0 ) / ( vr::abs( theta ) + sqrt( theta*theta + 1.0 ) );
+				double c = 1.0 / sqrt( t*t + 1.0 );
+				double s = t * c;
+
+				for( int k = 0; k < 3; ++k )
+				{
+					double akp = a[k][p];
+					double akq = a[k][q];
+					a[k][p] = c*akp - s*akq;
+					a[k][q] = s*akp + c*akq;
+				}
+				for( int k = 0; k < 3; ++k )
+				{
+					double apk = a[p][k];
+					double aqk = a[q][k];
+					a[p][k] = c*apk - s*aqk;
+					a[q][k] = s*apk + c*aqk;
+				}
+				for( int k = 0; k < 3; ++k )
+				{
+					double vkp = v[k][p];
+					double vkq = v[k][q];
+					v[k][p] = c*vkp - s*vkq;
+					v[k][q] = s*vkp + c*vkq;
+				}
+			}
+		}
+	}
+
+	int order[3] = { 0, 1, 2 };
+	for( int i = 0; i < 3; ++i )
+		for( int j = i + 1; j < 3; ++j )
+			if( a[order[j]][order[j]] > a[order[i]][order[i]] )
+				std::swap( order[i], order[j] );
+
+	for( int i = 0; i < 3; ++i )
+		axes[i].set( v[0][order[i]], v[1][order[i]], v[2][order[i]] );
+}
+
+static inline double cross2( const std::pair<double,double>& o, const std::pair<double,double>& a, const std::pair<double,double>& b )
+{
+	return ( a.first - o.first )*( b.second - o.second ) - ( a.second - o.second )*( b.first - o.first );
+}
+
+// Rotates u and v about their common normal so that the rectangle enclosing
+// all vertices projected on their plane has minimum area.
+// One side of the optimal rectangle is always collinear with a convex hull edge.
+static void minimizeRectangle( const std::vector<vr::vec3f>& vertices, vr::vec3d& u, vr::vec3d& v )
+{
+	std::vector< std::pair<double,double> > points( vertices.size() );
+
+#pragma omp parallel for
+	for( int i = 0; i < (int)vertices.size(); ++i )
+	{
+		vr::vec3d p( vertices[i].x, vertices[i].y, vertices[i].z );
+		points[i] = std::make_pair( p.dot( u ), p.dot( v ) );
+	}
+
+	// Andrew's monotone chain
+	std::sort( points.begin(), points.end() );
+	points.erase( std::unique( points.begin(), points.end() ), points.end() );
+	if( points.size() < 3 )
+		return;
+
+	std::vector< std::pair<double,double> > hull( points.size() * 2 );
+	int k = 0;
+	for( int i = 0; i < (int)points.size(); ++i )
+	{
+		while( ( k >= 2 ) && ( cross2( hull[k-2], hull[k-1], points[i] ) <= 0.0 ) )
+			--k;
+		hull[k++] = points[i];
+	}
+	for( int i = (int)points.size() - 2, lower = k + 1; i >= 0; --i )
+	{
+		while( ( k >= lower ) && ( cross2( hull[k-2], hull[k-1], points[i] ) <= 0.0 ) )
+			--k;
+		hull[k++] = points[i];
+	}
+	hull.resize( k - 1 );
+
+	// Try every hull edge direction, starting with the current axes
+	double bestArea = DBL_MAX;
+	double bestCos = 1.0;
+	double bestSin = 0.0;
+	int hullSize = (int)hull.size();
+
+	for( int e = -1; e < hullSize; ++e )
+	{
+		double c = 1.0;
+		double s = 0.0;
+		if( e >= 0 )
+		{
+			double dx = hull[(e+1)%hullSize].first - hull[e].first;
+			double dy = hull[(e+1)%hullSize].second - hull[e].second;
+			double len = sqrt( dx*dx + dy*dy );
+			if( len == 0.0 )
+				continue;
+			c = dx / len;
+			s = dy / len;
+		}
+
+		double min0 = DBL_MAX, max0 = -DBL_MAX;
+		double min1 = DBL_MAX, max1 = -DBL_MAX;
+		for( int i = 0; i < hullSize; ++i )
+		{
+			double p0 = c*hull[i].first + s*hull[i].second;
+			double p1 = -s*hull[i].first + c*hull[i].second;
+			min0 = vr::min( min0, p0 );
+			max0 = vr::max( max0, p0 );
+			min1 = vr::min( min1, p1 );
+			max1 = vr::max( max1, p1 );
+		}
+
+		// Only switch for a clear gain, keeps principal axes on symmetric shapes
+		double area = ( max0 - min0 )*( max1 - min1 );
+		if( area < bestArea * ( 1.0 - 1e-9 ) )
+		{
+			bestArea = area;
+			bestCos = c;
+			bestSin = s;
+		}
+	}
+
+	vr::vec3d newU = u*bestCos + v*bestSin;
+	vr::vec3d newV = v*bestCos - u*bestSin;
+	u = newU;
+	v = newV;
+}
+
+// Center and half extents of the vertices along the box axes
+static void fitExtents( const std::vector<vr::vec3f>& vertices, OrientedBox& box )
+{
+	vr::vec3d minV( DBL_MAX, DBL_MAX, DBL_MAX );
+	vr::vec3d maxV( -DBL_MAX, -DBL_MAX, -DBL_MAX );
+
+	for( unsigned int i = 0; i < vertices.size(); ++i )
+	{
+		vr::vec3d p( vertices[i].x, vertices[i].y, vertices[i].z );
+		for( int k = 0; k < 3; ++k )
+		{
+			double d = p.dot( box.axis[k] );
+			minV[k] = vr::min( minV[k], d );
+			maxV[k] = vr::max( maxV[k], d );
+		}
+	}
+
+	box.center.set( 0, 0, 0 );
+	for( int k = 0; k < 3; ++k )
+	{
+		box.center += box.axis[k] * ( ( minV[k] + maxV[k] ) * 0.5 );
+		box.halfExtent[k] = ( maxV[k] - minV[k] ) * 0.5;
+	}
+}
+
+OrientedBox TriangleMesh::computeOrientedBox() const
+{
+	OrientedBox aabb = OrientedBox::fromAABB( computeBoundingBox() );
+	if( vertices.size() < 3 )
+		return aabb;
+
+	// Principal axes from the vertex covariance
+	vr::vec3d mean( 0, 0, 0 );
+	for( unsigned int i = 0; i < vertices.size(); ++i )
+		mean += vr::vec3d( vertices[i].x, vertices[i].y, vertices[i].z );
+	mean *= 1.0 / vertices.size();
+
+	double cov[3][3] = { { 0, 0, 0 }, { 0, 0, 0 }, { 0, 0, 0 } };
+	for( unsigned int i = 0; i < vertices.size(); ++i )
+	{
+		vr::vec3d d = vr::vec3d( vertices[i].x, vertices[i].y, vertices[i].z ) - mean;
+		for( int r = 0; r < 3; ++r )
+			for( int c = 0; c < 3; ++c )
+				cov[r][c] += d[r]*d[c];
+	}
+
+	OrientedBox box;
+	symmetricEigenvectors( cov, box.axis );
+	box.axis[0].normalize();
+	box.axis[1] -= box.axis[0] * box.axis[1].dot( box.axis[0] );
+	box.axis[1].normalize();
+	box.axis[2] = box.axis[0].cross( box.axis[1] );
+	fitExtents( vertices, box );
+
+	// PCA is skewed by uneven vertex density, refine by rotating about each axis in turn
+	for( int round = 0; round < 3; ++round )
+	{
+		double prevVolume = box.volume();
+		for( int k = 0; k < 3; ++k )
+			minimizeRectangle( vertices, box.axis[(k+1)%3], box.axis[(k+2)%3] );
+		fitExtents( vertices, box );
+
+		if( box.volume() >= prevVolume * ( 1.0 - 1e-6 ) )
+			break;
+	}
+
+	if( aabb.volume() <= box.volume() )
+		return aabb;
+
+	// Longest axis first, as PCA would give, keeping the box right-handed
+	for( int i = 0; i < 2; ++i )
+	{
+		for( int j = i + 1; j < 3; ++j )
+		{
+			if( box.halfExtent[j] > box.halfExtent[i] )
+			{
+				std::swap( box.axis[i], box.axis[j] );
+				std::swap( box.halfExtent[i], box.halfExtent[j] );
+			}
+		}
+	}
+	box.axis[2] = box.axis[0].cross( box.axis[1] );
+
+	return box;
+}
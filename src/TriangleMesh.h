@@ -0,0 +1,41 @@
+#ifndef _TRIANGLEMESH_H_
+#define _TRIANGLEMESH_H_
+
+#include <vector>
+#include <vr/vec3.h>
+#include "AABB.h"
+#include "OrientedBox.h"
+
+namespace osg {
+	class Node;
+}
+
+/*!
+	Flat world-space triangle soup with per-vertex normals.
+	Every three consecutive vertices (and normals) form one triangle.
+	Used by the CPU layer generators, which need neither Qt nor OpenGL.
+ */
+class TriangleMesh
+{
+public:
+	// Extracts all triangles below node, applying transforms along the way
+	void build( osg::Node* node );
+	void clear();
+
+	void addTriangle( const vr::vec3f& v0, const vr::vec3f& v1, const vr::vec3f& v2,
+		              const vr::vec3f& n0, const vr::vec3f& n1, const vr::vec3f& n2 );
+
+	unsigned int triangleCount() const;
+
+	AABB computeBoundingBox() const;
+
+	// Tight box from principal axes of the vertices, refined with minimum area
+	// rectangles around each axis. Falls back to the AABB when that is smaller.
+	OrientedBox computeOrientedBox() const;
+
+public:
+	std::vector<vr::vec3f> vertices;
+	std::vector<vr::vec3f> normals;
+};
+
+#endif // _TRIANGLEMESH_H_
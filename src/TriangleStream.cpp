@@ -0,0 +1,143 @@
+#include "TriangleStream.h"
+#include <cstring>
+
+static const char STREAM_TAG[4] = { 'G', 'T', 'R', 'I' };
+static const int FLOATS_PER_TRIANGLE = 18;
+
+TriangleStream::TriangleStream()
+: _file( NULL )
+{
+	// empty
+}
+
+TriangleStream::~TriangleStream()
+{
+	close();
+}
+
+bool TriangleStream::create( const std::string& filename )
+{
+	close();
+
+	_file = fopen( filename.c_str(), "wb" );
+	if( _file == NULL )
+	{
+		printf( "Warning: could not create %s\n", filename.c_str() );
+		return false;
+	}
+
+	fwrite( STREAM_TAG, 1, 4, _file );
+	return true;
+}
+
+bool TriangleStream::append( const TriangleMesh& mesh )
+{
+	if( _file == NULL )
+		return false;
+
+	std::vector<float> triangle( FLOATS_PER_TRIANGLE );
+	for( unsigned int t = 0; t < mesh.triangleCount(); ++t )
+	{
+		for( int k = 0; k < 3; ++k )
+		{
+			memcpy( &triangle[k*3], mesh.vertices[t*3+k].ptr(), sizeof(float)*3 );
+			memcpy( &triangle[9+k*3], mesh.normals[t*3+k].ptr(), sizeof(float)*3 );
+		}
+		if( fwrite( &triangle[0], sizeof(float), FLOATS_PER_TRIANGLE, _file ) != FLOATS_PER_TRIANGLE )
+		{
+			printf( "Warning: could not append to triangle stream\n" );
+			return false;
+		}
+	}
+	return true;
+}
+
+bool TriangleStream::open( const std::string& filename )
+{
+	close();
+
+	_file = fopen( filename.c_str(), "rb" );
+	if( _file == NULL )
+	{
+		printf( "Could not open triangle stream %s\n", filename.c_str() );
+		return false;
+	}
+
+	char tag[4];
+	if( ( fread( tag, 1, 4, _file ) != 4 ) || ( memcmp( tag, STREAM_TAG, 4 ) != 0 ) )
+	{
+		printf( "Invalid triangle stream %s\n", filename.c_str() );
+		close();
+		return false;
+	}
+	return true;
+}
+
+void TriangleStream::rewind()
+{
+	if( _file != NULL )
+		fseek( _file, 4, SEEK_SET );
+}
+
+bool TriangleStream::readChunk( TriangleMesh& chunk, unsigned int maxTriangles )
+{
+	chunk.clear();
+
+	if( ( _file == NULL ) || ( maxTriangles == 0 ) )
+		return false;
+
+	_buffer.resize( maxTriangles * FLOATS_PER_TRIANGLE );
+	unsigned int count = (unsigned int)fread( &_buffer[0], sizeof(float)*FLOATS_PER_TRIANGLE, maxTriangles, _file );
+	if( count == 0 )
+		return false;
+
+	chunk.vertices.resize( count*3 );
+	chunk.normals.resize( count*3 );
+	for( unsigned int t = 0; t < count; ++t )
+	{
+		const float* triangle = &_buffer[t*FLOATS_PER_TRIANGLE];
+		for( int k = 0; k < 3; ++k )
+		{
+			chunk.vertices[t*3+k].set( &triangle[k*3] );
+			chunk.normals[t*3+k].set( &triangle[9+k*3] );
+		}
+	}
+	return true;
+}
+
+AABB TriangleStream::computeBoundingBox( unsigned int chunkSize )
+{
+	AABB box;
+	box.minV.set( 0, 0, 0 );
+	box.maxV.set( 0, 0, 0 );
+
+	rewind();
+
+	bool first = true;
+	TriangleMesh chunk;
+	while( readChunk( chunk, chunkSize ) )
+	{
+		AABB chunkBox = chunk.computeBoundingBox();
+		if( first )
+		{
+			box = chunkBox;
+			first = false;
+			continue;
+		}
+		for( int k = 0; k < 3; ++k )
+		{
+			box.minV[k] = vr::min( box.minV[k], chunkBox.minV[k] );
+			box.maxV[k] = vr::max( box.maxV[k], chunkBox.maxV[k] );
+		}
+	}
+
+	rewind();
+	return box;
+}
+
+void TriangleStream::close()
+{
+	if( _file != NULL )
+		fclose( _file );
+	_file = NULL;
+}
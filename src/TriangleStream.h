@@ -0,0 +1,40 @@
+#ifndef _TRIANGLESTREAM_H_
+#define _TRIANGLESTREAM_H_
+
+#include "TriangleMesh.h"
+#include <cstdio>
+#include <string>
+
+/*!
+	Triangle soup on disk, read back in fixed-size chunks, for meshes that do not fit in memory.
+	File layout: "GTRI" tag, then per triangle 3 vertices and 3 normals (18 floats),
+	in the same order as TriangleMesh.
+ */
+class TriangleStream
+{
+public:
+	TriangleStream();
+	~TriangleStream();
+
+	// Writing: creates an empty stream, then appends meshes one at a time
+	bool create( const std::string& filename );
+	bool append( const TriangleMesh& mesh );
+
+	// Reading
+	bool open( const std::string& filename );
+	void rewind();
+
+	// Replaces chunk contents with up to maxTriangles triangles, false when the stream is exhausted
+	bool readChunk( TriangleMesh& chunk, unsigned int maxTriangles );
+
+	// Full pass over the stream, rewinds before and after
+	AABB computeBoundingBox( unsigned int chunkSize );
+
+	void close();
+
+private:
+	FILE* _file;
+	std::vector<float> _buffer;
+};
+
+#endif // _TRIANGLESTREAM_H_
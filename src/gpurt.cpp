@@ -1,11 +1,14 @@
 #include "gpurt.h"
 #include <tecosg/OsgRenderer.h>
 #include <QFileDialog>
+#include <QInputDialog>
 
 #include "AABB.h"
+#include "OrientedBox.h"
 #include <osg/Shape>
 #include <osg/ShapeDrawable>
 #include <osg/Geode>
+#include <osg/Geometry>
 #include <osg/Group>
 #include <osg/PolygonMode>
 #include <osg/Material>
@@ -34,6 +37,9 @@ gpurt::gpurt(QWidget *parent, Qt::WFlags flags)
 	// Disable actions until model is loaded
 	ui.actionComputeBoundingBox->setEnabled( false );
 	ui.actionGenerateLayers->setEnabled( false );
+	ui.actionGenerateLayersOffscreen->setEnabled( false );
+	ui.actionGenerateLayersSoftware->setEnabled( false );
+	ui.actionGenerateLayersRayCasting->setEnabled( false );
 	ui.actionGeometry->setEnabled( false );
 	ui.actionBoundingBox->setEnabled( false );
 	ui.actionHeightmap->setEnabled( false );
@@ -66,6 +72,53 @@ void gpurt::loadModel( const QString& filename )
 	ui.actionGeometry->setChecked( true );
 }
 
+bool gpurt::checkDualPeeling()
+{
+	// Three planes of two coincident quads with different normals. Front to back peeling keeps the
+	// normal of the quad drawn first, the middle plane is left alone in the last dual pass.
+	const float planeZ[3] = { 0.0f, 0.5f, 1.0f };
+	const osg::Vec3 tilts[2] = { osg::Vec3( 0.6f, 0.0f, 0.8f ), osg::Vec3( 0.0f, 0.6f, 0.8f ) };
+	const float corners[6][2] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 0 }, { 1, 1 }, { 0, 1 } };
+
+	osg::Vec3Array* vertices = new osg::Vec3Array;
+	osg::Vec3Array* normals = new osg::Vec3Array;
+	for( int p = 0; p < 3; ++p )
+	{
+		for( int q = 0; q < 2; ++q )
+		{
+			// The near plane draws its quads the other way round
+			const osg::Vec3& normal = tilts[( p == 2 ) ? 1 - q : q];
+			for( int c = 0; c < 6; ++c )
+			{
+				vertices->push_back( osg::Vec3( corners[c][0], corners[c][1], planeZ[p] ) );
+				normals->push_back( normal );
+			}
+		}
+	}
+
+	osg::Geometry* geometry = new osg::Geometry;
+	geometry->setVertexArray( vertices );
+	geometry->setNormalArray( normals );
+	geometry->setNormalBinding( osg::Geometry::BIND_PER_VERTEX );
+	geometry->addPrimitiveSet( new osg::DrawArrays( GL_TRIANGLES, 0, vertices->size() ) );
+
+	osg::Geode* g = new osg::Geode;
+	g->addDrawable( geometry );
+
+	tecosg::OsgModel* planesModel = new tecosg::OsgModel;
+	planesModel->set( g );
+	Canvas::instance()->addGeometryModel( planesModel );
+	_layerGen.setCurrentModel( planesModel );
+
+	Canvas::instance()->setRenderMode( Canvas::BOUNDING_BOX, false );
+	Canvas::instance()->setRenderMode( Canvas::GEOMETRY, true );
+
+	// Makes sure the OpenGL context is initialized
+	Canvas::instance()->updateGL();
+
+	return _layerGen.checkDualPeeling( 256, 256 );
+}
+
 /************************************************************************/
 /* Protected SLOTS                                                      */
 /************************************************************************/
@@ -112,6 +165,79 @@ void gpurt::on_actionPostShading_toggled( bool enabled )
 	Canvas::instance()->setRenderMode( Canvas::POST_SHADING, enabled );
 }
 
+void gpurt::on_actionTexelTraversal_toggled( bool enabled )
+{
+	// Exact intersections texel by texel instead of linear steps
+	_layerGen.setTexelTraversal( enabled );
+}
+
+void gpurt::on_actionStoreNormals_toggled( bool enabled )
+{
+	_layerGen.setStoreNormals( enabled );
+}
+
+void gpurt::on_actionShaderNormals_toggled( bool enabled )
+{
+	// Takes effect on the next load
+	_layerGen.setShaderNormals( enabled );
+}
+
+void gpurt::on_actionCompactLayers_toggled( bool enabled )
+{
+	// 16-bit heights and octahedral 2x16-bit normals, a third of the raw size
+	if( enabled )
+		_layerGen.setEncodings( ShsFile::HEIGHT_UNORM16, ShsFile::NORMAL_OCT16 );
+	else
+		_layerGen.setEncodings( ShsFile::RAW_FLOAT32, ShsFile::RAW_FLOAT32 );
+}
+
+void gpurt::on_actionCompressLayers_toggled( bool enabled )
+{
+	_layerGen.setCompression( enabled ? ShsFile::COMPRESSION_LZ : ShsFile::COMPRESSION_NONE );
+}
+
+void gpurt::on_actionLayerPyramid_toggled( bool enabled )
+{
+	// Coarser levels let large files show up at once when loaded
+	_layerGen.setPyramid( enabled );
+}
+
+void gpurt::on_actionConeMaps_toggled( bool enabled )
+{
+	_layerGen.setConeMaps( enabled );
+}
+
+void gpurt::on_actionDebugImages_toggled( bool enabled )
+{
+	_layerGen.setDebugImages( enabled );
+}
+
+void gpurt::on_actionDualPeeling_toggled( bool enabled )
+{
+	// Nearest and farthest layers in the same pass, same layers in about half the passes
+	if( enabled )
+		ui.actionFragmentLists->setChecked( false );
+	updatePeelingMethod();
+}
+
+void gpurt::on_actionFragmentLists_toggled( bool enabled )
+{
+	// Every layer from a single geometry pass
+	if( enabled )
+		ui.actionDualPeeling->setChecked( false );
+	updatePeelingMethod();
+}
+
+void gpurt::updatePeelingMethod()
+{
+	if( ui.actionDualPeeling->isChecked() )
+		_layerGen.setPeelingMethod( LayerGenerator::DUAL_DEPTH );
+	else if( ui.actionFragmentLists->isChecked() )
+		_layerGen.setPeelingMethod( LayerGenerator::FRAGMENT_LISTS );
+	else
+		_layerGen.setPeelingMethod( LayerGenerator::FRONT_TO_BACK );
+}
+
 void gpurt::on_actionLoad_triggered()
 {
 	QString file = QFileDialog::getOpenFileName(
@@ -129,9 +255,9 @@ void gpurt::on_actionLoad_triggered()
 void gpurt::on_actionLoadLayers_triggered()
 {
 	QStringList files = QFileDialog::getOpenFileNames(
-		this, tr("Choose one or more heightmap files"),
+		this, tr("Choose a layer file or one or more heightmap files"),
 		"../data",
-		tr("Heightmap files (*.height);;All files (*.*)"));
+		tr("Layer files (*.shs);;Heightmap files (*.height);;All files (*.*)"));
 
 	if( files.empty() )
 		return;
@@ -140,7 +266,10 @@ void gpurt::on_actionLoadLayers_triggered()
 
 	for( int i = 0; i < files.size(); ++i )
 	{
-		_layerGen.loadLayerToOpenGL( files[i].toStdString() );
+		if( files[i].endsWith( ".shs", Qt::CaseInsensitive ) )
+			_layerGen.loadLayers( files[i].toStdString() );
+		else
+			_layerGen.loadLayerToOpenGL( files[i].toStdString() );
 	}
 
 	_layerGen.endLayerLoading();
@@ -264,12 +393,18 @@ void gpurt::on_actionComputeBoundingBox_triggered()
 {
 	// Compute bounding box from current model
 	_layerGen.computeBoundingBox();
-	const AABB& box = _layerGen.boundingBox();
+	const OrientedBox& box = _layerGen.orientedBoundingBox();
 
-	// Create bounding box shape
-	const vr::vec3d bc = box.center();
-	osg::Vec3 center( bc.x, bc.y, bc.z );
+	// Create bounding box shape, rotated to the box axes
+	osg::Vec3 center( box.center.x, box.center.y, box.center.z );
 	osg::Box* b = new osg::Box( center, box.extent( 0 ), box.extent( 1 ), box.extent( 2 ) );
+	osg::Matrixd rotation( box.axis[0].x, box.axis[0].y, box.axis[0].z, 0,
+		                   box.axis[1].x, box.axis[1].y, box.axis[1].z, 0,
+						   box.axis[2].x, box.axis[2].y, box.axis[2].z, 0,
+						   0, 0, 0, 1 );
+	osg::Quat q;
+	q.set( rotation );
+	b->setRotation( q );
 
 	// Add shape to shape drawable
 	osg::ShapeDrawable* sd = new osg::ShapeDrawable( b );
@@ -285,6 +420,9 @@ void gpurt::on_actionComputeBoundingBox_triggered()
 
 	// Update actions
 	ui.actionGenerateLayers->setEnabled( true );
+	ui.actionGenerateLayersOffscreen->setEnabled( true );
+	ui.actionGenerateLayersSoftware->setEnabled( true );
+	ui.actionGenerateLayersRayCasting->setEnabled( true );
 	ui.actionBoundingBox->setEnabled( true );
 }
 
@@ -299,3 +437,35 @@ void gpurt::on_actionGenerateLayers_triggered()
 
 	Canvas::instance()->setRenderMode( prevMode );
 }
+
+void gpurt::on_actionGenerateLayersOffscreen_triggered()
+{
+	// Resolution no longer depends on the window size
+	bool ok = false;
+	int width = QInputDialog::getInteger( this, tr("Layer resolution"), tr("Width:"), 4096, 1, 16384, 1, &ok );
+	if( !ok )
+		return;
+	int height = QInputDialog::getInteger( this, tr("Layer resolution"), tr("Height:"), width, 1, 16384, 1, &ok );
+	if( !ok )
+		return;
+
+	Canvas::RenderMode prevMode = Canvas::instance()->renderMode();
+
+	Canvas::instance()->setRenderMode( Canvas::BOUNDING_BOX, false );
+	Canvas::instance()->setRenderMode( Canvas::GEOMETRY, true );
+
+	_layerGen.generateLayers( width, height );
+
+	Canvas::instance()->setRenderMode( prevMode );
+}
+
+void gpurt::on_actionGenerateLayersSoftware_triggered()
+{
+	// Same resolution as the OpenGL path, which uses the viewport size
+	_layerGen.generateLayersSoftware( Canvas::instance()->width(), Canvas::instance()->height() );
+}
+
+void gpurt::on_actionGenerateLayersRayCasting_triggered()
+{
+	_layerGen.generateLayersSoftware( Canvas::instance()->width(), Canvas::instance()->height(), LayerGenerator::RAY_CASTING );
+}
@@ -20,6 +20,9 @@ public:
 
 	void loadModel( const QString& filename );
 
+	// Loads a scene of coincident triangles and compares dual depth peeling against front to back peeling
+	bool checkDualPeeling();
+
 protected slots:
 	virtual void keyPressEvent( QKeyEvent* e );
 	void updateFps( double fps );
@@ -31,6 +34,16 @@ protected slots:
 	void on_actionBoundingBox_toggled( bool enabled );
 	void on_actionHeightmap_toggled( bool enabled );
 	void on_actionPostShading_toggled( bool enabled );
+	void on_actionTexelTraversal_toggled( bool enabled );
+	void on_actionStoreNormals_toggled( bool enabled );
+	void on_actionShaderNormals_toggled( bool enabled );
+	void on_actionCompactLayers_toggled( bool enabled );
+	void on_actionCompressLayers_toggled( bool enabled );
+	void on_actionLayerPyramid_toggled( bool enabled );
+	void on_actionConeMaps_toggled( bool enabled );
+	void on_actionDebugImages_toggled( bool enabled );
+	void on_actionDualPeeling_toggled( bool enabled );
+	void on_actionFragmentLists_toggled( bool enabled );
 
 	void on_actionLoad_triggered();
 	void on_actionLoadLayers_triggered();
@@ -42,6 +55,13 @@ protected slots:
 
 	void on_actionComputeBoundingBox_triggered();
 	void on_actionGenerateLayers_triggered();
+	void on_actionGenerateLayersOffscreen_triggered();
+	void on_actionGenerateLayersSoftware_triggered();
+	void on_actionGenerateLayersRayCasting_triggered();
+
+private:
+	// From the peeling actions, which exclude each other
+	void updatePeelingMethod();
 
 private:
     Ui::gpurtClass ui;
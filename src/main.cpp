@@ -1,9 +1,495 @@
 #include <QtGui/QApplication>
 #include "gpurt.h"
 #include <QGLFormat>
+#include <QDir>
+#include <QImage>
+#include <cstring>
+#include <cstdlib>
+#include "TriangleStream.h"
+#include "StreamingLayerGenerator.h"
+#include "ShsFile.h"
+#include "TiledLayerWriter.h"
+#include "CpuRayCaster.h"
+#include "ConeMaps.h"
+#include "TriangleMesh.h"
+#include "OrientationEstimator.h"
+#include "SoftwareLayerGenerator.h"
+#include "BvhLayerGenerator.h"
+#include <tecosg/OsgModel.h>
+#include <vr/timer.h>
+#include <algorithm>
+#include <cmath>
+
+// Headless layer generation on the CPU, no window or OpenGL context needed: neither
+// LayerGenerator nor Canvas is involved, only the mesh, the frame estimate and the writer.
+// gpurt -generate <model> [width height]
+// gpurt -raycast <model> [width height]
+static int generateHeadless( int argc, char *argv[] )
+{
+	bool rayCasting = ( strcmp( argv[1], "-raycast" ) == 0 );
+
+	tecosg::OsgModel model;
+	model.load( argv[2] );
+	if( !model.valid() )
+	{
+		printf( "Could not load model %s\n", argv[2] );
+		return 1;
+	}
+
+	int width = ( argc > 4 ) ? atoi( argv[3] ) : 512;
+	int height = ( argc > 4 ) ? atoi( argv[4] ) : 512;
+
+	TriangleMesh mesh;
+	mesh.build( model.rawData() );
+	printf( "*** Generating Layers (CPU): %d triangles ***\n", mesh.triangleCount() );
+	if( mesh.triangleCount() == 0 )
+		return 1;
+
+	// Same frame as LayerGenerator: the best candidate around the oriented box
+	OrientedBox box = mesh.computeOrientedBox();
+	OrientationEstimator estimator;
+	estimator.setMesh( &mesh );
+	int best = estimator.estimate( box );
+	LayerFrame frame = ( best < 0 ) ? LayerFrame::fromBox( box, 1 ) : estimator.candidate( best ).frame;
+	if( best >= 0 )
+		printf( "Best orientation: %s (%d layers estimated)\n\n", estimator.candidate( best ).name.c_str(), estimator.candidate( best ).layerCount );
+
+	TiledLayerWriter writer;
+	if( !writer.open( "../data/out/layers.shs", width, height ) )
+		return 1;
+	writer.setFrame( frame );
+	writer.setBoundingBox( box );
+
+	if( rayCasting )
+	{
+		LayerSet layers;
+		BvhLayerGenerator generator;
+		generator.setMesh( &mesh );
+		generator.setFrame( frame );
+		generator.setResolution( width, height );
+		generator.generateLayers( layers );
+		if( !writer.writeTile( layers, 0, 0 ) )
+			return 1;
+	}
+	else
+	{
+		// Tiles are written as they are resolved, full layers are never in memory
+		SoftwareLayerGenerator generator;
+		generator.setMesh( &mesh );
+		generator.setFrame( frame );
+		generator.setResolution( width, height );
+		generator.generateLayers( writer );
+	}
+	return writer.close() ? 0 : 1;
+}
+
+// Appends the triangles of each model to a stream, loading one model at a time:
+// gpurt -convert <stream.tri> <model> [model ...]
+static int convertModels( int argc, char *argv[] )
+{
+	TriangleStream stream;
+	if( !stream.create( argv[2] ) )
+		return 1;
+
+	for( int i = 3; i < argc; ++i )
+	{
+		tecosg::OsgModel model;
+		model.load( argv[i] );
+		if( !model.valid() )
+		{
+			printf( "Could not load model %s\n", argv[i] );
+			return 1;
+		}
+
+		TriangleMesh mesh;
+		mesh.build( model.rawData() );
+		if( !stream.append( mesh ) )
+			return 1;
+		printf( "%s: %d triangles\n", argv[i], mesh.triangleCount() );
+	}
+	return 0;
+}
+
+// Out-of-core generation from a triangle stream, towards -Y of its bounding box.
+// Run the same command again to resume an interrupted run:
+// gpurt -stream <stream.tri> [width height]
+static int generateStreaming( int argc, char *argv[] )
+{
+	TriangleStream stream;
+	if( !stream.open( argv[2] ) )
+		return 1;
+
+	int width = ( argc > 4 ) ? atoi( argv[3] ) : 512;
+	int height = ( argc > 4 ) ? atoi( argv[4] ) : 512;
+
+	AABB box = stream.computeBoundingBox( 1 << 20 );
+	LayerFrame frame = LayerFrame::fromBox( box, 1 );
+
+	std::string workDir = "../data/out/stream";
+	QDir().mkpath( workDir.c_str() );
+
+	StreamingLayerGenerator generator;
+	generator.setStream( &stream );
+	generator.setFrame( frame );
+	generator.setBoundingBox( OrientedBox::fromAABB( box ) );
+	generator.setResolution( width, height );
+	generator.setWorkDirectory( workDir );
+	if( generator.generateLayers( "../data/out/layers.shs" ) < 0 )
+		return 1;
+
+	QDir().rmdir( workDir.c_str() );
+	return 0;
+}
+
+// Memory against quality of normals derived from heights, for a file with stored normals:
+// gpurt -normals <layers.shs>
+static int compareNormals( int argc, char *argv[] )
+{
+	ShsFile file;
+	if( !file.open( argv[2] ) )
+		return 1;
+	if( !file.hasNormals() )
+	{
+		printf( "%s has no stored normals to compare against\n", argv[2] );
+		return 1;
+	}
+
+	unsigned int count = file.width() * file.height();
+	std::vector<float> heights( count );
+	std::vector<float> stored( count*3 );
+	std::vector<float> derived( count*3 );
+	std::vector<float> angles;
+
+	for( int i = 0; i < file.layerCount(); ++i )
+	{
+		if( !file.readChannel( i, ShsFile::HEIGHT, &heights[0] ) || !file.readChannel( i, ShsFile::NORMAL, &stored[0] ) )
+			return 1;
+		LayerSet::computeNormals( &heights[0], file.width(), file.height(), file.hasFrame() ? &file.frame() : NULL, i, &derived[0] );
+
+		for( unsigned int t = 0; t < count; ++t )
+		{
+			if( heights[t] == 0.0f )
+				continue;
+			vr::vec3f a( &stored[t*3] );
+			vr::vec3f b( &derived[t*3] );
+			a.normalize();
+			float cosAngle = vr::max( -1.0f, vr::min( 1.0f, a.dot( b ) ) );
+			angles.push_back( acos( cosAngle ) * 180.0f / 3.14159265f );
+		}
+	}
+
+	if( angles.empty() )
+	{
+		printf( "No surface texels\n" );
+		return 0;
+	}
+
+	double sum = 0.0;
+	for( unsigned int t = 0; t < angles.size(); ++t )
+		sum += angles[t];
+	std::sort( angles.begin(), angles.end() );
+
+	double layerBytes = (double)count * sizeof(float) * file.layerCount();
+	printf( "%d layers of %dx%d, %u surface texels\n", file.layerCount(), file.width(), file.height(), (unsigned int)angles.size() );
+	printf( "Size with normals: %.1f MB, without: %.1f MB\n", layerBytes * 4.0 / ( 1024.0 * 1024.0 ), layerBytes / ( 1024.0 * 1024.0 ) );
+	printf( "Derived normal error: mean %.2f, median %.2f, 95%% %.2f, max %.2f degrees\n", sum / angles.size(),
+		    angles[angles.size() / 2], angles[angles.size() * 95 / 100], angles.back() );
+	return 0;
+}
+
+// Rewrites a layer file with 16-bit heights and octahedral normals, or keeps floats,
+// optionally compressed, reporting size, load time and error. With error=<bound>,
+// heights are quantized within bound (in model units) and compressed. With bricks=<size>,
+// the file is bricked and reading a single brick is timed as well. With pyramid, coarser levels
+// down to 256 texels (or <size>) are stored, and opening the coarsest one is timed. With cones,
+// cone maps are built (and timed) and stored:
+// gpurt -encode <layers.shs> <compact.shs> [oct8|float] [lz] [error=<bound>] [bricks=<size>] [pyramid[=<size>]] [cones]
+static int encodeLayers( int argc, char *argv[] )
+{
+	ShsFile::Encoding heightEncoding = ShsFile::HEIGHT_UNORM16;
+	ShsFile::Encoding normalEncoding = ShsFile::NORMAL_OCT16;
+	ShsFile::Compression compression = ShsFile::COMPRESSION_NONE;
+	float maxHeightError = 0.0f;
+	int brickSize = 0;
+	int coarsestSize = 0;
+	bool coneMaps = false;
+	for( int i = 4; i < argc; ++i )
+	{
+		if( strcmp( argv[i], "oct8" ) == 0 )
+			normalEncoding = ShsFile::NORMAL_OCT8;
+		else if( strcmp( argv[i], "float" ) == 0 )
+			heightEncoding = normalEncoding = ShsFile::RAW_FLOAT32;
+		else if( strcmp( argv[i], "lz" ) == 0 )
+			compression = ShsFile::COMPRESSION_LZ;
+		else if( strncmp( argv[i], "error=", 6 ) == 0 )
+			maxHeightError = (float)atof( argv[i] + 6 );
+		else if( strncmp( argv[i], "bricks=", 7 ) == 0 )
+			brickSize = atoi( argv[i] + 7 );
+		else if( strcmp( argv[i], "pyramid" ) == 0 )
+			coarsestSize = 256;
+		else if( strncmp( argv[i], "pyramid=", 8 ) == 0 )
+			coarsestSize = atoi( argv[i] + 8 );
+		else if( strcmp( argv[i], "cones" ) == 0 )
+			coneMaps = true;
+	}
+
+	// Quantized codes are 32 bits, they only pay off compressed
+	if( maxHeightError > 0.0f )
+	{
+		heightEncoding = ShsFile::HEIGHT_QUANTIZED;
+		compression = ShsFile::COMPRESSION_LZ;
+	}
+
+	ShsFile raw;
+	if( !raw.open( argv[2] ) )
+		return 1;
+	int pyramidLevels = ( coarsestSize > 0 ) ? ShsFile::pyramidLevels( raw.width(), raw.height(), coarsestSize ) : 0;
+	raw.close();
+
+	if( !TiledLayerWriter::transcode( argv[2], argv[3], heightEncoding, normalEncoding, compression, maxHeightError, brickSize, pyramidLevels,
+		                              coneMaps ) )
+		return 1;
+
+	ShsFile compact;
+	if( !raw.open( argv[2] ) || !compact.open( argv[3] ) )
+		return 1;
+
+	unsigned int count = raw.width() * raw.height();
+	std::vector<float> heights( count );
+	std::vector<float> decodedHeights( count );
+	std::vector<float> normals( count*3 );
+	std::vector<float> decodedNormals( count*3 );
+	double heightError = 0.0;
+	double normalError = 0.0;
+	double rawTime = 0.0;
+	double compactTime = 0.0;
+	vr::Timer timer;
+
+	for( int i = 0; i < raw.layerCount(); ++i )
+	{
+		timer.restart();
+		if( !raw.readChannel( i, ShsFile::HEIGHT, &heights[0] ) || !raw.readChannel( i, ShsFile::NORMAL, &normals[0] ) )
+			return 1;
+		rawTime += timer.restart();
+		if( !compact.readChannel( i, ShsFile::HEIGHT, &decodedHeights[0] ) || !compact.readChannel( i, ShsFile::NORMAL, &decodedNormals[0] ) )
+			return 1;
+		compactTime += timer.restart();
+
+		for( unsigned int t = 0; t < count; ++t )
+		{
+			if( heights[t] == 0.0f )
+				continue;
+			heightError = vr::max( heightError, (double)fabs( heights[t] - decodedHeights[t] ) );
+
+			// Small angles from the cross product, acos is too coarse near 1
+			vr::vec3d a( normals[t*3], normals[t*3+1], normals[t*3+2] );
+			vr::vec3d b( decodedNormals[t*3], decodedNormals[t*3+1], decodedNormals[t*3+2] );
+			normalError = vr::max( normalError, atan2( a.cross( b ).length(), a.dot( b ) ) * 180.0 / 3.14159265358979 );
+		}
+	}
+
+	FILE* rawFile = fopen( argv[2], "rb" );
+	FILE* compactFile = fopen( argv[3], "rb" );
+	if( ( rawFile != NULL ) && ( compactFile != NULL ) )
+	{
+		printf( "%d layers of %dx%d: %.1f MB raw, %.1f MB encoded\n", raw.layerCount(), raw.width(), raw.height(),
+			    ShsFile::fileSize( rawFile ) / ( 1024.0 * 1024.0 ), ShsFile::fileSize( compactFile ) / ( 1024.0 * 1024.0 ) );
+		printf( "Read and decode: %.0f ms raw, %.0f ms encoded\n", rawTime * 1000.0, compactTime * 1000.0 );
+	}
+
+	// The brick in the middle, without touching the rest of the file
+	LayerSet brick;
+	if( compact.isBricked() )
+	{
+		timer.restart();
+		if( !compact.readBrick( compact.bricksX() / 2, compact.bricksY() / 2, brick ) )
+			return 1;
+		printf( "%dx%d bricks, one read and decoded in %.2f ms\n", compact.bricksX(), compact.bricksY(), timer.elapsed() * 1000.0 );
+	}
+
+	// What a viewer shows first, from opening the file
+	LayerSet coarsest;
+	if( compact.levelCount() > 0 )
+	{
+		timer.restart();
+		ShsFile level;
+		if( !level.open( argv[3], compact.levelCount() ) || !level.readLayers( coarsest ) )
+			return 1;
+		printf( "%d pyramid levels, the coarsest (%dx%d) opened, read and decoded in %.2f ms\n", compact.levelCount(),
+			    coarsest.width(), coarsest.height(), timer.elapsed() * 1000.0 );
+	}
+	if( rawFile != NULL )
+		fclose( rawFile );
+	if( compactFile != NULL )
+		fclose( compactFile );
+
+	printf( "Max height error %g, max normal error %.4f degrees\n", heightError, normalError );
+	return 0;
+}
+
+// Ray casts a layer file on the CPU, as the shader draws it, seen from above and to the side
+// of the layers. With depth, the view depth of each pixel goes to <image>.depth as raw floats
+// (rows from bottom to top, FLT_MAX where rays miss):
+// With texelTraversal, rays walk the layers texel by texel instead of stepping linearly.
+// Cone maps of the file are used unless noCones is given:
+// gpurt -render <layers.shs> <image> [width height] [shaderNormals] [texelTraversal] [noCones] [depth]
+static int renderHeadless( int argc, char *argv[] )
+{
+	int width = ( ( argc > 5 ) && ( atoi( argv[4] ) > 0 ) ) ? atoi( argv[4] ) : 512;
+	int height = ( ( argc > 5 ) && ( atoi( argv[5] ) > 0 ) ) ? atoi( argv[5] ) : 512;
+	bool shaderNormals = false;
+	bool texelTraversal = false;
+	bool coneMaps = true;
+	bool writeDepth = false;
+	for( int i = 4; i < argc; ++i )
+	{
+		if( strcmp( argv[i], "shaderNormals" ) == 0 )
+			shaderNormals = true;
+		else if( strcmp( argv[i], "texelTraversal" ) == 0 )
+			texelTraversal = true;
+		else if( strcmp( argv[i], "noCones" ) == 0 )
+			coneMaps = false;
+		else if( strcmp( argv[i], "depth" ) == 0 )
+			writeDepth = true;
+	}
+
+	ShsFile file;
+	LayerSet layers;
+	vr::Timer timer;
+	timer.restart();
+	if( !file.open( argv[2] ) || !file.readLayers( layers ) )
+		return 1;
+	printf( "%d layers of %dx%d read in %.0f ms\n", layers.layerCount(), layers.width(), layers.height(), timer.restart() * 1000.0 );
+
+	// Layers are generated looking down their z axis, tilt the view away from it
+	CpuRayCaster caster;
+	caster.setLayers( &layers );
+	caster.setComputeNormals( shaderNormals );
+	caster.setTexelTraversal( texelTraversal );
+	if( coneMaps && file.hasConeMaps() )
+	{
+		std::vector<vr::uint8> codes( (size_t)layers.width() * layers.height() );
+		for( int i = 0; i < layers.layerCount(); ++i )
+		{
+			if( !file.readConeMap( i, &codes[0] ) )
+				return 1;
+			caster.setConeMap( i, &codes[0] );
+		}
+	}
+	if( file.hasFrame() )
+	{
+		const LayerFrame& frame = file.frame();
+		caster.setFrame( &frame );
+		caster.fitCamera( -frame.forward * 2.0 - frame.up + frame.right * 0.5, frame.up );
+	}
+	else
+	{
+		caster.fitCamera( vr::vec3d( 0.5, -1.0, 2.0 ), vr::vec3d( 0, 1, 0 ) );
+	}
+
+	std::vector<unsigned char> rgba;
+	std::vector<float> depth;
+	timer.restart();
+	int hits = caster.render( width, height, rgba, writeDepth ? &depth : NULL );
+	printf( "Rendered %dx%d in %.0f ms, %d rays hit\n", width, height, timer.elapsed() * 1000.0, hits );
+
+	// QImage rows go from top to bottom
+	QImage image( width, height, QImage::Format_ARGB32 );
+	for( int y = 0; y < height; ++y )
+	{
+		QRgb* row = (QRgb*)image.scanLine( height - 1 - y );
+		const unsigned char* pixel = &rgba[(size_t)y * width * 4];
+		for( int x = 0; x < width; ++x, pixel+=4 )
+			row[x] = qRgba( pixel[0], pixel[1], pixel[2], pixel[3] );
+	}
+	if( !image.save( argv[3] ) )
+	{
+		printf( "Could not write image %s\n", argv[3] );
+		return 1;
+	}
+
+	if( writeDepth )
+	{
+		std::string depthName = std::string( argv[3] ) + ".depth";
+		FILE* depthFile = fopen( depthName.c_str(), "wb" );
+		if( depthFile == NULL )
+		{
+			printf( "Could not write depth %s\n", depthName.c_str() );
+			return 1;
+		}
+		size_t written = fwrite( &depth[0], sizeof(float), depth.size(), depthFile );
+		fclose( depthFile );
+		if( written != depth.size() )
+		{
+			printf( "Could not write depth %s\n", depthName.c_str() );
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Checks every stored cone map against its layer by brute force, reporting texel pairs where
+// a cone step would pass a surface (quadratic in the texel count, meant for small files):
+// gpurt -checkCones <layers.shs>
+static int checkConeMaps( int argc, char *argv[] )
+{
+	ShsFile file;
+	LayerSet layers;
+	if( !file.open( argv[2] ) || !file.readLayers( layers ) )
+		return 1;
+	if( !file.hasConeMaps() )
+	{
+		printf( "%s has no cone maps to check\n", argv[2] );
+		return 1;
+	}
+
+	vr::Timer timer;
+	vr::int64 total = 0;
+	std::vector<vr::uint8> codes( (size_t)layers.width() * layers.height() );
+	for( int i = 0; i < layers.layerCount(); ++i )
+	{
+		if( !file.readConeMap( i, &codes[0] ) )
+			return 1;
+		vr::int64 violations = ConeMaps::countViolations( layers.heights( i ), layers.width(), layers.height(), ( i % 2 ) == 1, &codes[0] );
+		if( violations != 0 )
+			printf( "Layer %d: %.0f texel pairs pass a surface\n", i, (double)violations );
+		total += violations;
+	}
+	printf( "%d cone maps of %dx%d checked in %.0f ms, %.0f violations\n", layers.layerCount(), layers.width(), layers.height(),
+			timer.elapsed() * 1000.0, (double)total );
+	return ( total == 0 ) ? 0 : 1;
+}
+
+// Peels coincident triangles front to back and with dual depth peeling, reporting texels
+// where the layers differ. Needs the OpenGL context of the window:
+// gpurt -checkDual
+static int checkDualPeeling( int argc, char *argv[] )
+{
+	QApplication a( argc, argv );
+	gpurt w;
+	w.show();
+	return w.checkDualPeeling() ? 0 : 1;
+}
 
 int main(int argc, char *argv[])
 {
+	if( ( argc > 2 ) && ( ( strcmp( argv[1], "-generate" ) == 0 ) || ( strcmp( argv[1], "-raycast" ) == 0 ) ) )
+		return generateHeadless( argc, argv );
+	if( ( argc > 3 ) && ( strcmp( argv[1], "-convert" ) == 0 ) )
+		return convertModels( argc, argv );
+	if( ( argc > 2 ) && ( strcmp( argv[1], "-stream" ) == 0 ) )
+		return generateStreaming( argc, argv );
+	if( ( argc > 2 ) && ( strcmp( argv[1], "-normals" ) == 0 ) )
+		return compareNormals( argc, argv );
+	if( ( argc > 3 ) && ( strcmp( argv[1], "-encode" ) == 0 ) )
+		return encodeLayers( argc, argv );
+	if( ( argc > 3 ) && ( strcmp( argv[1], "-render" ) == 0 ) )
+		return renderHeadless( argc, argv );
+	if( ( argc > 2 ) && ( strcmp( argv[1], "-checkCones" ) == 0 ) )
+		return checkConeMaps( argc, argv );
+	if( ( argc > 1 ) && ( strcmp( argv[1], "-checkDual" ) == 0 ) )
+		return checkDualPeeling( argc, argv );
+
     QApplication a(argc, argv);
     gpurt w;
     w.show();